@@ -0,0 +1,230 @@
+#pragma once
+
+#include "FileTransfer.h"
+
+#include <ws2tcpip.h>
+
+#include <algorithm>
+#include <string>
+
+/*
+	Block mode (MODE B, RFC 959 section 3.4.2). Every block starts with
+	a descriptor byte and a 16-bit big-endian byte count, the last block
+	of a file carries the EOF flag. Because the end of a file is marked
+	in the stream instead of by closing the connection, one data
+	connection carries file after file for the whole session.
+
+	Files are sent with file structure, which has no records, so the
+	sender never sets EOR. A peer's EOR only ends a record, the block's
+	bytes are data like any other. A restart marker block carries the
+	marker instead of data and is not written to the file.
+*/
+
+// Descriptor flags
+constexpr unsigned char BLOCK_EOR{ 0x80 };		// End of record
+constexpr unsigned char BLOCK_EOF{ 0x40 };		// End of file
+constexpr unsigned char BLOCK_ERRORS{ 0x20 };	// Suspected errors, still data
+constexpr unsigned char BLOCK_RESTART{ 0x10 };	// Restart marker
+
+constexpr int BLOCK_HEADER_SIZE{ 3 };
+constexpr int BLOCK_MAX_DATA{ 0xFFFF };
+
+// Blocks handed to one WSASend call
+constexpr int BLOCK_SEND_BATCH{ 32 };
+
+// Sends data as blocks, the last one flagged EOF if last is set.
+// Headers and data go out together through one gathered send per batch.
+inline int sendBlocks(SOCKET s, const char* data, long long length, bool last)
+{
+	unsigned char headers[BLOCK_SEND_BATCH][BLOCK_HEADER_SIZE];
+	WSABUF wsaBufs[BLOCK_SEND_BATCH * 2];
+
+	long long position{ 0 };
+	do
+	{
+		DWORD bufCount{ 0 };
+		int batchSize{ 0 };
+		for (int i = 0; i < BLOCK_SEND_BATCH; ++i)
+		{
+			int count{ (int)(std::min)(length - position, (long long)BLOCK_MAX_DATA) };
+			bool eof{ last && position + count == length };
+
+			headers[i][0] = eof ? BLOCK_EOF : 0;
+			headers[i][1] = (unsigned char)(count >> 8);
+			headers[i][2] = (unsigned char)(count & 0xFF);
+
+			wsaBufs[bufCount++] = WSABUF{ (ULONG)BLOCK_HEADER_SIZE, reinterpret_cast<char*>(headers[i]) };
+			if (count > 0)
+				wsaBufs[bufCount++] = WSABUF{ (ULONG)count, const_cast<char*>(data + position) };
+
+			position += count;
+			batchSize += BLOCK_HEADER_SIZE + count;
+			if (position == length)
+				break;
+		}
+
+		// A blocking WSASend returns once everything is queued
+		DWORD sent{ 0 };
+		COUNT_SYSCALL();
+		if (WSASend(s, wsaBufs, bufCount, &sent, 0, NULL, NULL) == SOCKET_ERROR || (int)sent != batchSize)
+		{
+			Log{ LOG_LEVEL::ERR } << "WINSOCK: WSASend() failed with error: " << WSAGetLastError();
+			return FAILURE;
+		}
+	} while (position < length);
+
+	return SUCCESS;
+}
+
+// Receives a block's descriptor and byte count
+inline int recvBlockHeader(SOCKET s, unsigned char& descriptor, int& count)
+{
+	unsigned char header[BLOCK_HEADER_SIZE]{};
+	COUNT_SYSCALL();
+	if (recv(s, reinterpret_cast<char*>(header), BLOCK_HEADER_SIZE, MSG_WAITALL) != BLOCK_HEADER_SIZE)
+	{
+		Log{ LOG_LEVEL::ERR } << "WINSOCK: recv() failed with error: " << WSAGetLastError();
+		return FAILURE;
+	}
+
+	descriptor = header[0];
+	count = (header[1] << 8) | header[2];
+	return SUCCESS;
+}
+
+// Sends hFile from offset to its end in block mode
+inline int sendFileBlocks(SOCKET s, HANDLE hFile, long long offset, long long length, TransferBufferPool& pool,
+	ContentHasher* hasher = nullptr)
+{
+	TransferBufferPool::Buffer xferBuf{ pool.acquire() };
+	if (!xferBuf)
+		return FAILURE;
+
+	LARGE_INTEGER position{};
+	position.QuadPart = offset;
+	if (!SetFilePointerEx(hFile, position, NULL, FILE_BEGIN))
+		return FAILURE;
+
+	// An empty file is a single EOF block
+	if (length == 0)
+		return sendBlocks(s, xferBuf.data(), 0, true);
+
+	for (long long remainingData = length; remainingData > 0; )
+	{
+		DWORD bytesRead{ 0 };
+		DWORD toRead{ (DWORD)(std::min)(remainingData, (long long)xferBuf.size()) };
+		COUNT_SYSCALL();
+		if (!ReadFile(hFile, xferBuf.data(), toRead, &bytesRead, NULL) || bytesRead == 0)
+		{
+			Log{ LOG_LEVEL::ERR } << "ReadFile() failed with error: " << GetLastError();
+			return FAILURE;
+		}
+		remainingData -= bytesRead;
+		if (hasher)
+			hasher->update(xferBuf.data(), bytesRead);
+
+		if (sendBlocks(s, xferBuf.data(), bytesRead, remainingData == 0) != SUCCESS)
+			return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+// Receives blocks into hFile starting at offset until the EOF block.
+// Data is collected in a pooled buffer and written a buffer at a time.
+inline int recvFileBlocks(SOCKET s, HANDLE hFile, long long offset, TransferBufferPool& pool, long long& received,
+	ContentHasher* hasher = nullptr)
+{
+	received = 0;
+
+	TransferBufferPool::Buffer xferBuf{ pool.acquire() };
+	if (!xferBuf)
+		return FAILURE;
+
+	LARGE_INTEGER position{};
+	position.QuadPart = offset;
+	if (!SetFilePointerEx(hFile, position, NULL, FILE_BEGIN))
+		return FAILURE;
+
+	std::size_t filled{ 0 };
+	auto flush = [&]() -> bool
+	{
+		DWORD written{ 0 };
+		COUNT_SYSCALL();
+		if (filled > 0 && (!WriteFile(hFile, xferBuf.data(), (DWORD)filled, &written, NULL) || written != (DWORD)filled))
+		{
+			Log{ LOG_LEVEL::ERR } << "WriteFile() failed with error: " << GetLastError();
+			return false;
+		}
+		received += filled;
+		filled = 0;
+		return true;
+	};
+
+	unsigned char descriptor{ 0 };
+	do
+	{
+		int count{ 0 };
+		if (recvBlockHeader(s, descriptor, count) != SUCCESS)
+		{
+			flush();
+			return FAILURE;
+		}
+
+		// Make room for the whole block
+		if (filled + count > xferBuf.size() && !flush())
+			return FAILURE;
+
+		COUNT_SYSCALL();
+		if (count > 0 && recv(s, xferBuf.data() + filled, count, MSG_WAITALL) != count)
+		{
+			Log{ LOG_LEVEL::ERR } << "WINSOCK: recv() failed with error: " << WSAGetLastError();
+			flush();
+			return FAILURE;
+		}
+
+		// A marker is received over and not kept
+		if (descriptor & BLOCK_RESTART)
+			continue;
+
+		if (hasher)
+			hasher->update(xferBuf.data() + filled, count);
+		filled += count;
+	} while (!(descriptor & BLOCK_EOF));
+
+	if (!flush())
+		return FAILURE;
+
+	// Drop whatever was left behind by an earlier, longer file
+	return SetEndOfFile(hFile) ? SUCCESS : FAILURE;
+}
+
+// Receives blocks into memory until the EOF block, for transfers
+// small enough to hold like directory listings
+inline int recvBlocks(SOCKET s, std::string& data)
+{
+	data.clear();
+
+	unsigned char descriptor{ 0 };
+	do
+	{
+		int count{ 0 };
+		if (recvBlockHeader(s, descriptor, count) != SUCCESS)
+			return FAILURE;
+
+		std::size_t filled{ data.size() };
+		data.resize(filled + count);
+
+		COUNT_SYSCALL();
+		if (count > 0 && recv(s, &data[filled], count, MSG_WAITALL) != count)
+		{
+			Log{ LOG_LEVEL::ERR } << "WINSOCK: recv() failed with error: " << WSAGetLastError();
+			return FAILURE;
+		}
+
+		if (descriptor & BLOCK_RESTART)
+			data.resize(filled);
+	} while (!(descriptor & BLOCK_EOF));
+
+	return SUCCESS;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <ws2tcpip.h>
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+// Transfer chunk size limits
+constexpr std::size_t MIN_TRANSFER_CHUNK{ 64 * 1024 };
+constexpr std::size_t MAX_TRANSFER_CHUNK{ 8 * 1024 * 1024 };
+constexpr std::size_t DEFAULT_TRANSFER_CHUNK{ 256 * 1024 };
+
+/*
+	Page-aligned transfer buffers that are reused across transfers.
+	A transfer leases one buffer and gives it back when the lease
+	goes out of scope, so after warm-up the copy path allocates
+	nothing. The pool only grows to the number of transfers that
+	ran at the same time.
+*/
+class TransferBufferPool
+{
+public:
+	// Lease on one buffer, returns it to the pool when destroyed
+	class Buffer
+	{
+	private:
+		TransferBufferPool* m_pool;
+		char* m_data;
+
+	public:
+		Buffer(TransferBufferPool* pool, char* data) : m_pool{ pool }, m_data{ data } {}
+		~Buffer() { if (m_data) m_pool->release(m_data); }
+
+		Buffer(Buffer&& other) noexcept : m_pool{ other.m_pool }, m_data{ other.m_data } { other.m_data = nullptr; }
+		Buffer(const Buffer&) = delete;
+		Buffer& operator=(const Buffer&) = delete;
+		Buffer& operator=(Buffer&&) = delete;
+
+		char* data() const { return m_data; }
+		std::size_t size() const { return m_pool->chunkSize(); }
+		explicit operator bool() const { return m_data != nullptr; }
+	};
+
+private: // Variables
+	std::size_t m_chunkSize;
+
+	std::mutex m_mutex;
+	std::vector<char*> m_free;
+	std::atomic<std::size_t> m_allocated;
+
+private: // Functions
+	void release(char* data)
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		m_free.push_back(data);
+	}
+
+public:
+	explicit TransferBufferPool(std::size_t chunkSize = DEFAULT_TRANSFER_CHUNK) :
+		m_chunkSize{ (std::min)((std::max)(chunkSize, MIN_TRANSFER_CHUNK), MAX_TRANSFER_CHUNK) },
+		m_allocated{ 0 }
+	{
+		// Whole pages only
+		SYSTEM_INFO systemInfo{};
+		GetSystemInfo(&systemInfo);
+		std::size_t pageSize{ systemInfo.dwPageSize };
+		m_chunkSize = (m_chunkSize + pageSize - 1) / pageSize * pageSize;
+	}
+
+	virtual ~TransferBufferPool()
+	{
+		// Leases must not outlive the pool
+		for (char* data : m_free)
+			VirtualFree(data, 0, MEM_RELEASE);
+	}
+
+	TransferBufferPool(const TransferBufferPool&) = delete;
+	TransferBufferPool& operator=(const TransferBufferPool&) = delete;
+
+	// An empty Buffer means the system is out of memory
+	Buffer acquire()
+	{
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			if (!m_free.empty())
+			{
+				char* data{ m_free.back() };
+				m_free.pop_back();
+				return Buffer{ this, data };
+			}
+			++m_allocated;
+		}
+
+		// VirtualAlloc hands out whole, page-aligned pages
+		char* data = (char*)VirtualAlloc(NULL, m_chunkSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (data == nullptr)
+			--m_allocated;
+
+		return Buffer{ this, data };
+	}
+
+	std::size_t chunkSize() const { return m_chunkSize; }
+	std::size_t allocated() const { return m_allocated; }
+};
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+
+/*
+	Command decoding without allocations. A command line is split into
+	string_views, and the verb is looked up in a table that is built at
+	compile time: every verb gets its own slot through a perfect hash,
+	so a lookup is one multiply, one shift and one compare.
+
+	The table is shared code, the verbs and the COMMAND enum stay with
+	each program. The enums start with INVALID, which is what a value
+	initialised command is.
+*/
+
+// FTP verbs have three or four letters
+constexpr std::size_t MAX_VERB_LENGTH{ 4 };
+
+// A verb folded to upper case and packed into 32 bits, 0 if it can not be a verb
+constexpr std::uint32_t verbKey(std::string_view verb)
+{
+	if (verb.empty() || verb.size() > MAX_VERB_LENGTH)
+		return 0;
+
+	std::uint32_t key{ 0 };
+	for (char c : verb)
+	{
+		if (c >= 'a' && c <= 'z')
+			c = (char)(c - 'a' + 'A');
+		else if (c < 'A' || c > 'Z')
+			return 0;
+		key = (key << 8) | (unsigned char)c;
+	}
+	return key;
+}
+
+template <typename Command>
+struct CommandName
+{
+	std::string_view verb;
+	Command command;
+};
+
+template <typename Command, unsigned int SlotBits = 6>
+class CommandTable
+{
+private: // Variables
+	static constexpr std::size_t SLOTS{ std::size_t{ 1 } << SlotBits };
+
+	struct Slot
+	{
+		std::uint32_t key;
+		Command command;
+	};
+
+	std::array<Slot, SLOTS> m_slots;
+	std::uint32_t m_multiplier;
+
+private: // Functions
+	static constexpr std::size_t slotOf(std::uint32_t key, std::uint32_t multiplier)
+	{
+		return (std::uint32_t)(key * multiplier) >> (32 - SlotBits);
+	}
+
+	// Multipliers tried before giving up on a set of verbs
+	static constexpr std::uint32_t MAX_ATTEMPTS{ 1u << 16 };
+
+public:
+	// Searches for a multiplier that puts every verb in a slot of its own.
+	// A verb that is not a verb or a set with no such multiplier throws,
+	// which stops the compilation of a constexpr table.
+	template <std::size_t N>
+	constexpr CommandTable(const CommandName<Command>(&names)[N]) :
+		m_slots{},
+		m_multiplier{ 0 }
+	{
+		static_assert(N < SLOTS, "Too many verbs for the table");
+
+		for (std::uint32_t attempt = 0; attempt < MAX_ATTEMPTS; ++attempt)
+		{
+			std::uint32_t multiplier{ 0x9E3779B1u + 2 * attempt };
+
+			std::array<bool, SLOTS> taken{};
+			bool collision{ false };
+			for (std::size_t i = 0; i < N && !collision; ++i)
+			{
+				std::uint32_t key{ verbKey(names[i].verb) };
+				if (key == 0)
+					throw std::logic_error("Not a verb");
+
+				std::size_t slot{ slotOf(key, multiplier) };
+				collision = taken[slot];
+				taken[slot] = true;
+			}
+			if (collision)
+				continue;
+
+			m_multiplier = multiplier;
+			for (std::size_t i = 0; i < N; ++i)
+			{
+				std::uint32_t key{ verbKey(names[i].verb) };
+				m_slots[slotOf(key, multiplier)] = Slot{ key, names[i].command };
+			}
+			return;
+		}
+
+		throw std::logic_error("No perfect hash for these verbs");
+	}
+
+	// Case-insensitive, Command{} if the verb is unknown
+	constexpr Command find(std::string_view verb) const
+	{
+		std::uint32_t key{ verbKey(verb) };
+		if (key == 0)
+			return Command{};
+
+		const Slot& slot{ m_slots[slotOf(key, m_multiplier)] };
+		return (slot.key == key) ? slot.command : Command{};
+	}
+
+	constexpr bool contains(std::string_view verb) const { return find(verb) != Command{}; }
+};
+
+// A command line split into views of the line it came from
+struct CommandLine
+{
+	std::string_view verb;
+	std::string_view argument;	// First word after the verb
+	std::string_view rest;		// Everything after the verb
+};
+
+constexpr bool isBlank(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+
+constexpr std::string_view trimBlanks(std::string_view text)
+{
+	while (!text.empty() && isBlank(text.front())) text.remove_prefix(1);
+	while (!text.empty() && isBlank(text.back())) text.remove_suffix(1);
+	return text;
+}
+
+// Splits off the first word, what is left is trimmed
+constexpr std::string_view splitWord(std::string_view& text)
+{
+	text = trimBlanks(text);
+
+	std::size_t end{ 0 };
+	while (end < text.size() && !isBlank(text[end]))
+		++end;
+
+	std::string_view word{ text.substr(0, end) };
+	text = trimBlanks(text.substr(end));
+	return word;
+}
+
+constexpr CommandLine splitCommand(std::string_view line)
+{
+	CommandLine command{};
+	command.verb = splitWord(line);
+	command.rest = line;
+	command.argument = splitWord(line);
+	return command;
+}
+
+// A whole word as a number, false if the word is anything else
+template <typename T>
+bool parseNumber(std::string_view word, T& value)
+{
+	const char* last{ word.data() + word.size() };
+	auto [end, ec] = std::from_chars(word.data(), last, value);
+	return ec == std::errc{} && end == last;
+}
@@ -0,0 +1,388 @@
+#pragma once
+
+#include "FileTransfer.h"
+
+#include <ws2tcpip.h>
+#include <compressapi.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <cstring>
+
+// Need to tell the compiler to link Cabinet.lib
+#pragma comment(lib, "Cabinet.lib")
+
+/*
+	Compressed mode (MODE Z). The file goes out as in stream mode, a
+	size header and then the data, but the data is cut into chunks and
+	each chunk is compressed on its own with the Windows Compression
+	API. Every chunk starts with a descriptor byte, the level it was
+	compressed with or 0 if it is stored as is, followed by its raw and
+	its payload length.
+
+	The sender stores a chunk as is when compressing it does not pay:
+	data that is already compressed barely shrinks, and on a link that
+	moves bytes faster than the compressor makes them, compressing only
+	slows the transfer down. After such a chunk it sends a run of chunks
+	without trying, then measures again.
+*/
+
+// Levels, from fastest to smallest
+constexpr int COMPRESS_LEVEL_MIN{ 1 };	// XPRESS
+constexpr int COMPRESS_LEVEL_MAX{ 4 };	// LZMS
+constexpr int COMPRESS_LEVEL_DEFAULT{ 1 };
+
+// Raw bytes in one chunk, both ends have to agree on it
+constexpr DWORD COMPRESS_CHUNK_SIZE{ 256 * 1024 };
+
+constexpr unsigned char CHUNK_STORED{ 0 };
+constexpr int CHUNK_HEADER_SIZE{ 9 };	// Descriptor, raw length, payload length
+
+// A chunk has to shrink by this much to be sent compressed
+constexpr double COMPRESS_MIN_SAVING{ 0.1 };
+
+// Chunks stored without trying after compression did not pay
+constexpr unsigned int COMPRESS_BACKOFF_CHUNKS{ 16 };
+
+// Weight of the newest sample in the measured rates
+constexpr double COMPRESS_RATE_WEIGHT{ 0.25 };
+
+// Bytes sent per sample of the link rate, a single send says little
+constexpr long long COMPRESS_RATE_WINDOW{ 4LL * COMPRESS_CHUNK_SIZE };
+
+inline DWORD compressionAlgorithm(int level)
+{
+	switch (level)
+	{
+	case 1: return COMPRESS_ALGORITHM_XPRESS;
+	case 2: return COMPRESS_ALGORITHM_XPRESS_HUFF;
+	case 3: return COMPRESS_ALGORITHM_MSZIP;
+	default: return COMPRESS_ALGORITHM_LZMS;
+	}
+}
+
+// Room a compressed chunk may take, the API adds its own header and
+// incompressible data grows a little
+constexpr SIZE_T COMPRESS_BOUND{ COMPRESS_CHUNK_SIZE + COMPRESS_CHUNK_SIZE / 8 + 4096 };
+
+// Sending side of one transfer
+class ChunkCompressor
+{
+private: // Variables
+	COMPRESSOR_HANDLE m_hCompressor;
+	int m_level;
+
+	std::vector<char> m_input;		// Chunk read from the file
+	std::vector<char> m_output;		// Header followed by the compressed chunk
+
+	unsigned int m_skip;			// Chunks left to store without trying
+	double m_compressRate;			// Raw bytes compressed per second, 0 until measured
+	double m_linkRate;				// Bytes sent per second, 0 until measured
+
+	long long m_backlog;			// Bytes the socket takes before a send waits, -1 until asked
+	long long m_windowBytes;		// Sent since the last link rate sample
+	double m_windowSeconds;			// Spent in send for them
+
+public:
+	// Totals of the transfer, for reporting
+	long long rawBytes;
+	long long sentBytes;
+	double compressSeconds;
+
+private: // Functions
+	static double blend(double rate, double sample)
+	{
+		return (rate == 0) ? sample : rate + COMPRESS_RATE_WEIGHT * (sample - rate);
+	}
+
+	// Compressing pays when the time it takes is less than the sending time it saves
+	bool pays(double ratio) const
+	{
+		if (m_compressRate == 0 || m_linkRate == 0)
+			return true;
+		return 1.0 / m_compressRate < (1.0 - ratio) / m_linkRate;
+	}
+
+	// What autotuning aims the send backlog at, or the fixed buffer size
+	static long long sendBacklog(SOCKET s)
+	{
+		ULONG backlog{ 0 };
+		DWORD returned{ 0 };
+		if (WSAIoctl(s, SIO_IDEAL_SEND_BACKLOG_QUERY, NULL, 0, &backlog, sizeof(backlog), &returned, NULL, NULL) != SOCKET_ERROR)
+			return (long long)backlog;
+
+		int size{ 0 };
+		int sizeLength{ sizeof(size) };
+		if (getsockopt(s, SOL_SOCKET, SO_SNDBUF, (char*)&size, &sizeLength) != SOCKET_ERROR)
+			return (long long)size;
+		return 0;
+	}
+
+	int sendTimed(SOCKET s, const char* data, int length)
+	{
+		if (m_backlog < 0)
+			m_backlog = sendBacklog(s);
+
+		auto start{ std::chrono::steady_clock::now() };
+		if (sendAll(s, data, length) != SUCCESS)
+		{
+			Log{ LOG_LEVEL::ERR } << "WINSOCK: send() failed with error: " << WSAGetLastError();
+			return FAILURE;
+		}
+		std::chrono::duration<double> elapsed{ std::chrono::steady_clock::now() - start };
+		sentBytes += length;
+
+		// Until the socket's buffer is full a send only copies and returns at
+		// once, after that it waits for the link to drain what came before.
+		// Only those sends are measured, summed over several chunks.
+		if (sentBytes <= m_backlog)
+			return SUCCESS;
+
+		m_windowBytes += length;
+		m_windowSeconds += elapsed.count();
+		if (m_windowBytes >= COMPRESS_RATE_WINDOW)
+		{
+			if (m_windowSeconds > 0)
+				m_linkRate = blend(m_linkRate, m_windowBytes / m_windowSeconds);
+			m_windowBytes = 0;
+			m_windowSeconds = 0;
+		}
+
+		return SUCCESS;
+	}
+
+public:
+	ChunkCompressor(int level) :
+		m_hCompressor{ NULL },
+		m_level{ (std::min)((std::max)(level, COMPRESS_LEVEL_MIN), COMPRESS_LEVEL_MAX) },
+		m_input(COMPRESS_CHUNK_SIZE),
+		m_output(CHUNK_HEADER_SIZE + COMPRESS_BOUND),
+		m_skip{ 0 },
+		m_compressRate{ 0 },
+		m_linkRate{ 0 },
+		m_backlog{ -1 },
+		m_windowBytes{ 0 },
+		m_windowSeconds{ 0 },
+		rawBytes{ 0 },
+		sentBytes{ 0 },
+		compressSeconds{ 0 }
+	{
+		// Without a compressor every chunk is stored
+		if (!CreateCompressor(compressionAlgorithm(m_level), NULL, &m_hCompressor))
+		{
+			Log{ LOG_LEVEL::ERR } << "CreateCompressor() failed with error: " << GetLastError();
+			m_hCompressor = NULL;
+		}
+	}
+
+	~ChunkCompressor()
+	{
+		if (m_hCompressor != NULL)
+			CloseCompressor(m_hCompressor);
+	}
+
+	ChunkCompressor(const ChunkCompressor&) = delete;
+	ChunkCompressor& operator=(const ChunkCompressor&) = delete;
+
+	char* input() { return m_input.data(); }
+
+	// Sends one chunk of at most COMPRESS_CHUNK_SIZE bytes
+	int send(SOCKET s, const char* data, DWORD length)
+	{
+		unsigned char descriptor{ CHUNK_STORED };
+		SIZE_T compressedSize{ 0 };
+
+		if (m_hCompressor != NULL && m_skip == 0 && length > 0)
+		{
+			auto start{ std::chrono::steady_clock::now() };
+			BOOL compressed{ Compress(m_hCompressor, data, length, m_output.data() + CHUNK_HEADER_SIZE,
+				COMPRESS_BOUND, &compressedSize) };
+			std::chrono::duration<double> elapsed{ std::chrono::steady_clock::now() - start };
+
+			compressSeconds += elapsed.count();
+			if (elapsed.count() > 0)
+				m_compressRate = blend(m_compressRate, length / elapsed.count());
+
+			// The work is done, so a chunk that shrank goes out compressed
+			// either way, the decision only holds for the chunks after it
+			double ratio{ compressed ? (double)compressedSize / length : 1.0 };
+			if (compressed && ratio <= 1.0 - COMPRESS_MIN_SAVING)
+				descriptor = (unsigned char)m_level;
+			if (descriptor == CHUNK_STORED || !pays(ratio))
+				m_skip = COMPRESS_BACKOFF_CHUNKS;
+		}
+		else if (m_skip > 0)
+			--m_skip;
+
+		DWORD payload{ (descriptor == CHUNK_STORED) ? length : (DWORD)compressedSize };
+		m_output[0] = (char)descriptor;
+		memcpy(m_output.data() + 1, &length, sizeof(length));
+		memcpy(m_output.data() + 5, &payload, sizeof(payload));
+		rawBytes += length;
+
+		// A compressed chunk already sits behind its header
+		if (descriptor != CHUNK_STORED)
+			return sendTimed(s, m_output.data(), CHUNK_HEADER_SIZE + (int)payload);
+
+		if (sendTimed(s, m_output.data(), CHUNK_HEADER_SIZE) != SUCCESS)
+			return FAILURE;
+		return (length > 0) ? sendTimed(s, data, (int)length) : SUCCESS;
+	}
+};
+
+// Receiving side of one transfer, any level can arrive
+class ChunkDecompressor
+{
+private: // Variables
+	DECOMPRESSOR_HANDLE m_hDecompressors[COMPRESS_LEVEL_MAX];
+	std::vector<char> m_input;
+	std::vector<char> m_output;
+
+public:
+	ChunkDecompressor() :
+		m_hDecompressors{},
+		m_input(COMPRESS_BOUND),
+		m_output(COMPRESS_CHUNK_SIZE)
+	{
+	}
+
+	~ChunkDecompressor()
+	{
+		for (DECOMPRESSOR_HANDLE hDecompressor : m_hDecompressors)
+			if (hDecompressor != NULL)
+				CloseDecompressor(hDecompressor);
+	}
+
+	ChunkDecompressor(const ChunkDecompressor&) = delete;
+	ChunkDecompressor& operator=(const ChunkDecompressor&) = delete;
+
+	// Receives one chunk of at most limit raw bytes, data points at its raw bytes
+	int receive(SOCKET s, long long limit, const char*& data, DWORD& length)
+	{
+		char header[CHUNK_HEADER_SIZE]{};
+		COUNT_SYSCALL();
+		if (recv(s, header, CHUNK_HEADER_SIZE, MSG_WAITALL) != CHUNK_HEADER_SIZE)
+		{
+			Log{ LOG_LEVEL::ERR } << "WINSOCK: recv() failed with error: " << WSAGetLastError();
+			return FAILURE;
+		}
+
+		unsigned char descriptor{ (unsigned char)header[0] };
+		DWORD payload{ 0 };
+		memcpy(&length, header + 1, sizeof(length));
+		memcpy(&payload, header + 5, sizeof(payload));
+
+		if (descriptor > COMPRESS_LEVEL_MAX || length == 0 || length > COMPRESS_CHUNK_SIZE || length > limit ||
+			payload > COMPRESS_BOUND || (descriptor == CHUNK_STORED && payload != length))
+		{
+			Log{ LOG_LEVEL::ERR } << "Malformed compressed chunk.";
+			return FAILURE;
+		}
+
+		char* target{ (descriptor == CHUNK_STORED) ? m_output.data() : m_input.data() };
+		COUNT_SYSCALL();
+		if (payload > 0 && recv(s, target, (int)payload, MSG_WAITALL) != (int)payload)
+		{
+			Log{ LOG_LEVEL::ERR } << "WINSOCK: recv() failed with error: " << WSAGetLastError();
+			return FAILURE;
+		}
+		data = m_output.data();
+		if (descriptor == CHUNK_STORED)
+			return SUCCESS;
+
+		// One decompressor per level, made when the first chunk needs it
+		DECOMPRESSOR_HANDLE& hDecompressor{ m_hDecompressors[descriptor - 1] };
+		if (hDecompressor == NULL && !CreateDecompressor(compressionAlgorithm(descriptor), NULL, &hDecompressor))
+		{
+			Log{ LOG_LEVEL::ERR } << "CreateDecompressor() failed with error: " << GetLastError();
+			hDecompressor = NULL;
+			return FAILURE;
+		}
+
+		SIZE_T decompressedSize{ 0 };
+		if (!Decompress(hDecompressor, m_input.data(), payload, m_output.data(), length, &decompressedSize) ||
+			decompressedSize != length)
+		{
+			Log{ LOG_LEVEL::ERR } << "Decompress() failed with error: " << GetLastError();
+			return FAILURE;
+		}
+
+		return SUCCESS;
+	}
+};
+
+// Sends length bytes from memory in compressed mode
+inline int sendCompressed(SOCKET s, const char* data, long long length, ChunkCompressor& compressor)
+{
+	for (long long position = 0; position < length; )
+	{
+		DWORD chunk{ (DWORD)(std::min)(length - position, (long long)COMPRESS_CHUNK_SIZE) };
+		if (compressor.send(s, data + position, chunk) != SUCCESS)
+			return FAILURE;
+		position += chunk;
+	}
+
+	return SUCCESS;
+}
+
+// Sends hFile from offset in compressed mode
+inline int sendFileCompressed(SOCKET s, HANDLE hFile, long long offset, long long length, ChunkCompressor& compressor,
+	ContentHasher* hasher = nullptr)
+{
+	for (long long position = 0; position < length; )
+	{
+		DWORD toRead{ (DWORD)(std::min)(length - position, (long long)COMPRESS_CHUNK_SIZE) };
+
+		OVERLAPPED overlapped{};
+		overlapped.Offset = (DWORD)((offset + position) & 0xFFFFFFFF);
+		overlapped.OffsetHigh = (DWORD)((offset + position) >> 32);
+
+		DWORD bytesRead{ 0 };
+		COUNT_SYSCALL();
+		if (!ReadFile(hFile, compressor.input(), toRead, &bytesRead, &overlapped) || bytesRead != toRead)
+		{
+			Log{ LOG_LEVEL::ERR } << "ReadFile() failed with error: " << GetLastError();
+			return FAILURE;
+		}
+
+		if (hasher)
+			hasher->update(compressor.input(), bytesRead);
+		if (compressor.send(s, compressor.input(), bytesRead) != SUCCESS)
+			return FAILURE;
+		position += bytesRead;
+	}
+
+	return SUCCESS;
+}
+
+// Receives length raw bytes in compressed mode into hFile at offset.
+// On failure the file holds every chunk that arrived whole.
+inline int recvFileCompressed(SOCKET s, HANDLE hFile, long long offset, long long length, ChunkDecompressor& decompressor,
+	ContentHasher* hasher = nullptr)
+{
+	for (long long position = 0; position < length; )
+	{
+		const char* data{ nullptr };
+		DWORD chunk{ 0 };
+		if (decompressor.receive(s, length - position, data, chunk) != SUCCESS)
+			return FAILURE;
+
+		OVERLAPPED overlapped{};
+		overlapped.Offset = (DWORD)((offset + position) & 0xFFFFFFFF);
+		overlapped.OffsetHigh = (DWORD)((offset + position) >> 32);
+
+		DWORD written{ 0 };
+		COUNT_SYSCALL();
+		if (chunk > 0 && (!WriteFile(hFile, data, chunk, &written, &overlapped) || written != chunk))
+		{
+			Log{ LOG_LEVEL::ERR } << "WriteFile() failed with error: " << GetLastError();
+			return FAILURE;
+		}
+		if (hasher)
+			hasher->update(data, chunk);
+		position += chunk;
+	}
+
+	return SUCCESS;
+}
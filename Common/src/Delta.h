@@ -0,0 +1,716 @@
+#pragma once
+
+#include "FTP_Common.h"
+#include "FileTransfer.h"
+#include "Hash.h"
+#include "Logger.h"
+#include "SyscallCount.h"
+
+#include <ws2tcpip.h>
+
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+/*
+	Delta transfers (XDLT and XDGT), the rsync algorithm. The side that
+	holds an old copy of the file cuts it into blocks and sends the
+	signature of every block: a weak checksum that can be rolled along
+	the data a byte at a time, and XXH64 as the strong hash. The side
+	with the new file rolls the weak checksum over every offset, looks
+	it up among the signatures and confirms a hit with the strong hash.
+	It answers with instructions, copy these blocks of the old copy or
+	insert these literal bytes, and the old copy's side builds the new
+	file from the two. The XXH64 of the whole new file comes last and
+	the rebuilt file has to match it.
+
+	Reading and hashing the old copy is most of the work of a transfer
+	that changed little, so the signature is computed by several threads,
+	each over its own range of blocks in its own mapped views.
+
+	Signatures and instructions frame themselves, a delta transfer is
+	the same in every transfer mode.
+*/
+
+// Block sizes, about the square root of the file so the signature stays small
+constexpr std::uint32_t DELTA_MIN_BLOCK{ 2048 };
+constexpr std::uint32_t DELTA_MAX_BLOCK{ 128 * 1024 };
+
+// A larger copy is signed as empty and the file is sent whole,
+// its signature would not fit in memory
+constexpr std::uint64_t DELTA_MAX_BLOCKS{ 1ULL << 24 };
+
+// Literal bytes in one instruction
+constexpr std::uint32_t DELTA_MAX_LITERAL{ 256 * 1024 };
+
+// The new file is read through a window of this size, many blocks long
+constexpr std::size_t DELTA_WINDOW_SIZE{ 8 * 1024 * 1024 };
+
+// Instructions and signatures go out this many bytes at a time
+constexpr std::size_t DELTA_SEND_SIZE{ 256 * 1024 };
+
+// Part of the old copy one signature thread maps at a time
+constexpr long long DELTA_VIEW_SIZE{ 64LL * 1024 * 1024 };
+
+// Signature threads, each gets at least this many blocks
+constexpr unsigned int DELTA_MAX_THREADS{ 16 };
+constexpr std::size_t DELTA_BLOCKS_PER_THREAD{ 256 };
+
+// Instructions, each a tag byte and its fields
+constexpr char DELTA_COPY{ 'C' };		// First block and block count, 4 bytes each
+constexpr char DELTA_LITERAL{ 'L' };	// Length, 4 bytes, then the bytes
+constexpr char DELTA_END{ 'E' };		// Size and XXH64 of the new file, 8 bytes each
+
+constexpr int SIGNATURE_HEADER_SIZE{ 20 };	// Block size, file size, block count
+constexpr int BLOCK_SIGNATURE_SIZE{ 12 };	// Weak checksum, strong hash
+
+constexpr std::uint32_t NO_BLOCK{ 0xFFFFFFFF };
+
+// Block size for an old copy of fileSize bytes
+inline std::uint32_t deltaBlockSize(long long fileSize)
+{
+	double root{ (std::min)(std::sqrt((double)(std::max)(fileSize, 0LL)), (double)DELTA_MAX_BLOCK) };
+	std::uint32_t size{ (std::uint32_t)root & ~1023u };
+	return (std::max)(size, DELTA_MIN_BLOCK);
+}
+
+// The checksum rsync rolls, two 16-bit sums of the bytes in the window
+class RollingChecksum
+{
+private:
+	std::uint32_t m_a{ 0 };
+	std::uint32_t m_b{ 0 };
+	std::uint32_t m_length{ 0 };
+
+public:
+	void reset(const char* data, std::uint32_t length)
+	{
+		const unsigned char* p{ reinterpret_cast<const unsigned char*>(data) };
+		m_a = m_b = 0;
+		m_length = length;
+		for (std::uint32_t i = 0; i < length; ++i)
+		{
+			m_a += p[i];
+			m_b += m_a;
+		}
+	}
+
+	// Moves the window on by one byte
+	void roll(unsigned char out, unsigned char in)
+	{
+		m_a += in - out;
+		m_b += m_a - m_length * out;
+	}
+
+	std::uint32_t value() const { return (m_a & 0xFFFF) | (m_b << 16); }
+};
+
+inline std::uint64_t strongHash(const char* data, std::size_t length)
+{
+	Xxh64 hash{};
+	hash.update(data, length);
+	return hash.value();
+}
+
+struct BlockSignature
+{
+	std::uint32_t weak{ 0 };
+	std::uint64_t strong{ 0 };
+};
+
+struct Signature
+{
+	std::uint32_t blockSize{ DELTA_MIN_BLOCK };
+	long long fileSize{ 0 };
+	std::vector<BlockSignature> blocks{};
+
+	// Bytes in block i, the last one may be short
+	std::uint32_t length(std::size_t i) const
+	{
+		return (std::uint32_t)(std::min)((long long)blockSize, fileSize - (long long)i * blockSize);
+	}
+};
+
+// What a delta transfer moved, for reporting
+struct DeltaStats
+{
+	long long matched{ 0 };	// Bytes taken from the old copy
+	long long literal{ 0 };	// Bytes sent as they are
+	long long sent{ 0 };	// Bytes of instructions on the connection
+};
+
+/***********************************************
+	Signature
+***********************************************/
+
+// Signs blocks [first, last) of the mapped old copy
+inline bool signBlocks(HANDLE hMapping, Signature& signature, std::size_t first, std::size_t last, long long granularity)
+{
+	long long position{ (long long)first * signature.blockSize };
+	long long end{ (std::min)((long long)last * signature.blockSize, signature.fileSize) };
+	std::size_t block{ first };
+
+	while (position < end)
+	{
+		// Views start on the allocation granularity and end on a block boundary
+		long long viewStart{ position - (position % granularity) };
+		long long viewEnd{ (std::min)(viewStart + DELTA_VIEW_SIZE, end) };
+		if (viewEnd < end)
+			viewEnd = position + (viewEnd - position) / signature.blockSize * signature.blockSize;
+
+		const char* view = (const char*)MapViewOfFile(hMapping, FILE_MAP_READ, (DWORD)(viewStart >> 32),
+			(DWORD)(viewStart & 0xFFFFFFFF), (SIZE_T)(viewEnd - viewStart));
+		if (view == NULL)
+		{
+			Log{ LOG_LEVEL::ERR } << "MapViewOfFile() failed with error: " << GetLastError();
+			return false;
+		}
+
+		for (; position < viewEnd; ++block)
+		{
+			const char* data{ view + (position - viewStart) };
+			std::uint32_t length{ signature.length(block) };
+
+			RollingChecksum weak{};
+			weak.reset(data, length);
+			signature.blocks[block] = BlockSignature{ weak.value(), strongHash(data, length) };
+			position += length;
+		}
+
+		UnmapViewOfFile(view);
+	}
+
+	return true;
+}
+
+// Signs the whole file behind hFile, spread over up to threads threads
+inline int computeSignature(HANDLE hFile, Signature& signature, unsigned int threads)
+{
+	LARGE_INTEGER fileSize{};
+	if (!GetFileSizeEx(hFile, &fileSize))
+	{
+		Log{ LOG_LEVEL::ERR } << "GetFileSizeEx() failed with error: " << GetLastError();
+		return FAILURE;
+	}
+
+	signature.fileSize = fileSize.QuadPart;
+	signature.blockSize = deltaBlockSize(signature.fileSize);
+	std::uint64_t count{ ((std::uint64_t)signature.fileSize + signature.blockSize - 1) / signature.blockSize };
+	if (count > DELTA_MAX_BLOCKS)
+	{
+		Log{ LOG_LEVEL::INFO } << "File of " << signature.fileSize << " bytes is too large to sign, it is sent whole.";
+		signature.fileSize = 0;
+		signature.blockSize = deltaBlockSize(0);
+		count = 0;
+	}
+	signature.blocks.assign((std::size_t)count, BlockSignature{});
+
+	// An empty file has nothing to sign, and can not be mapped
+	if (count == 0)
+		return SUCCESS;
+
+	HANDLE hMapping = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (hMapping == NULL)
+	{
+		Log{ LOG_LEVEL::ERR } << "CreateFileMappingW() failed with error: " << GetLastError();
+		return FAILURE;
+	}
+
+	SYSTEM_INFO systemInfo{};
+	GetSystemInfo(&systemInfo);
+	long long granularity{ (long long)systemInfo.dwAllocationGranularity };
+
+	// Small files are not worth a thread
+	std::size_t workers{ (std::min)({ (std::size_t)(std::max)(threads, 1u), (std::size_t)DELTA_MAX_THREADS,
+		((std::size_t)count + DELTA_BLOCKS_PER_THREAD - 1) / DELTA_BLOCKS_PER_THREAD }) };
+	std::size_t perWorker{ ((std::size_t)count + workers - 1) / workers };
+
+	// The calling thread signs the first range itself
+	std::atomic<bool> failed{ false };
+	std::vector<std::thread> pool{};
+	for (std::size_t first = perWorker; first < (std::size_t)count; first += perWorker)
+	{
+		std::size_t last{ (std::min)(first + perWorker, (std::size_t)count) };
+		pool.emplace_back([&, first, last]()
+			{
+				if (!signBlocks(hMapping, signature, first, last, granularity))
+					failed = true;
+			});
+	}
+	if (!signBlocks(hMapping, signature, 0, (std::min)(perWorker, (std::size_t)count), granularity))
+		failed = true;
+
+	for (std::thread& thread : pool)
+		thread.join();
+	CloseHandle(hMapping);
+
+	return failed ? FAILURE : SUCCESS;
+}
+
+// Receives exactly length bytes
+inline int recvDeltaBytes(SOCKET s, char* data, std::size_t length)
+{
+	for (std::size_t received = 0; received < length; )
+	{
+		int chunk{ (int)(std::min)(length - received, DELTA_SEND_SIZE) };
+		COUNT_SYSCALL();
+		int iResult = recv(s, data + received, chunk, MSG_WAITALL);
+		if (iResult <= 0)
+		{
+			if (iResult == SOCKET_ERROR)
+				Log{ LOG_LEVEL::ERR } << "WINSOCK: recv() failed with error: " << WSAGetLastError();
+			else
+				Log{ LOG_LEVEL::ERR } << "WINSOCK: Connection closed " << length - received << " bytes early.";
+			return FAILURE;
+		}
+		received += iResult;
+	}
+
+	return SUCCESS;
+}
+
+inline int sendSignature(SOCKET s, const Signature& signature)
+{
+	std::uint64_t count{ signature.blocks.size() };
+	std::vector<char> message(SIGNATURE_HEADER_SIZE + signature.blocks.size() * BLOCK_SIGNATURE_SIZE);
+	memcpy(message.data(), &signature.blockSize, sizeof(signature.blockSize));
+	memcpy(message.data() + 4, &signature.fileSize, sizeof(signature.fileSize));
+	memcpy(message.data() + 12, &count, sizeof(count));
+
+	char* p{ message.data() + SIGNATURE_HEADER_SIZE };
+	for (const BlockSignature& block : signature.blocks)
+	{
+		memcpy(p, &block.weak, sizeof(block.weak));
+		memcpy(p + 4, &block.strong, sizeof(block.strong));
+		p += BLOCK_SIGNATURE_SIZE;
+	}
+
+	for (std::size_t sent = 0; sent < message.size(); )
+	{
+		int chunk{ (int)(std::min)(message.size() - sent, DELTA_SEND_SIZE) };
+		if (sendAll(s, message.data() + sent, chunk) != SUCCESS)
+		{
+			Log{ LOG_LEVEL::ERR } << "WINSOCK: send() failed with error: " << WSAGetLastError();
+			return FAILURE;
+		}
+		sent += chunk;
+	}
+
+	return SUCCESS;
+}
+
+inline int recvSignature(SOCKET s, Signature& signature)
+{
+	char header[SIGNATURE_HEADER_SIZE]{};
+	if (recvDeltaBytes(s, header, sizeof(header)) != SUCCESS)
+		return FAILURE;
+
+	std::uint64_t count{ 0 };
+	memcpy(&signature.blockSize, header, sizeof(signature.blockSize));
+	memcpy(&signature.fileSize, header + 4, sizeof(signature.fileSize));
+	memcpy(&count, header + 12, sizeof(count));
+
+	// The blocks have to cover exactly the file
+	if (signature.blockSize < DELTA_MIN_BLOCK || signature.blockSize > DELTA_MAX_BLOCK || signature.fileSize < 0 ||
+		count > DELTA_MAX_BLOCKS || count != ((std::uint64_t)signature.fileSize + signature.blockSize - 1) / signature.blockSize)
+	{
+		Log{ LOG_LEVEL::ERR } << "Malformed delta signature.";
+		return FAILURE;
+	}
+
+	// Grown as the entries arrive, a header alone can not make the other side allocate
+	signature.blocks.clear();
+	std::vector<char> entries((std::min)((std::size_t)count * BLOCK_SIGNATURE_SIZE, DELTA_SEND_SIZE / BLOCK_SIGNATURE_SIZE * BLOCK_SIGNATURE_SIZE));
+	for (std::size_t block = 0; block < (std::size_t)count; )
+	{
+		std::size_t batch{ (std::min)((std::size_t)count - block, entries.size() / BLOCK_SIGNATURE_SIZE) };
+		if (recvDeltaBytes(s, entries.data(), batch * BLOCK_SIGNATURE_SIZE) != SUCCESS)
+			return FAILURE;
+
+		signature.blocks.resize(block + batch);
+		for (std::size_t i = 0; i < batch; ++i, ++block)
+		{
+			memcpy(&signature.blocks[block].weak, entries.data() + i * BLOCK_SIGNATURE_SIZE, sizeof(std::uint32_t));
+			memcpy(&signature.blocks[block].strong, entries.data() + i * BLOCK_SIGNATURE_SIZE + 4, sizeof(std::uint64_t));
+		}
+	}
+
+	return SUCCESS;
+}
+
+/***********************************************
+	Instructions
+***********************************************/
+
+// Collects the instructions of the sending side, a run of blocks that
+// follow each other in the old copy goes out as one copy
+class DeltaEncoder
+{
+private: // Variables
+	SOCKET m_socket;
+	DeltaStats& m_stats;
+	std::vector<char> m_output;
+
+	std::uint32_t m_copyFirst;
+	std::uint32_t m_copyCount;
+
+private: // Functions
+	void put(const void* data, std::size_t length)
+	{
+		const char* bytes{ static_cast<const char*>(data) };
+		m_output.insert(m_output.end(), bytes, bytes + length);
+	}
+
+	int flushCopy()
+	{
+		if (m_copyCount == 0)
+			return SUCCESS;
+
+		m_output.push_back(DELTA_COPY);
+		put(&m_copyFirst, sizeof(m_copyFirst));
+		put(&m_copyCount, sizeof(m_copyCount));
+		m_copyCount = 0;
+		return (m_output.size() >= DELTA_SEND_SIZE) ? flush() : SUCCESS;
+	}
+
+public:
+	DeltaEncoder(SOCKET s, DeltaStats& stats) :
+		m_socket{ s },
+		m_stats{ stats },
+		m_output{},
+		m_copyFirst{ 0 },
+		m_copyCount{ 0 }
+	{
+		m_output.reserve(DELTA_SEND_SIZE + DELTA_MAX_LITERAL + 16);
+	}
+
+	DeltaEncoder(const DeltaEncoder&) = delete;
+	DeltaEncoder& operator=(const DeltaEncoder&) = delete;
+
+	int copy(std::uint32_t block, std::uint32_t length)
+	{
+		m_stats.matched += length;
+		if (m_copyCount > 0 && block == m_copyFirst + m_copyCount)
+		{
+			++m_copyCount;
+			return SUCCESS;
+		}
+
+		if (flushCopy() != SUCCESS)
+			return FAILURE;
+		m_copyFirst = block;
+		m_copyCount = 1;
+		return SUCCESS;
+	}
+
+	int literal(const char* data, std::size_t length)
+	{
+		if (length > 0 && flushCopy() != SUCCESS)
+			return FAILURE;
+
+		for (std::size_t position = 0; position < length; )
+		{
+			std::uint32_t piece{ (std::uint32_t)(std::min)(length - position, (std::size_t)DELTA_MAX_LITERAL) };
+			m_output.push_back(DELTA_LITERAL);
+			put(&piece, sizeof(piece));
+			put(data + position, piece);
+			m_stats.literal += piece;
+			position += piece;
+
+			if (m_output.size() >= DELTA_SEND_SIZE && flush() != SUCCESS)
+				return FAILURE;
+		}
+
+		return SUCCESS;
+	}
+
+	int end(long long size, std::uint64_t digest)
+	{
+		if (flushCopy() != SUCCESS)
+			return FAILURE;
+
+		m_output.push_back(DELTA_END);
+		put(&size, sizeof(size));
+		put(&digest, sizeof(digest));
+		return flush();
+	}
+
+	int flush()
+	{
+		if (m_output.empty())
+			return SUCCESS;
+
+		if (sendAll(m_socket, m_output.data(), (int)m_output.size()) != SUCCESS)
+		{
+			Log{ LOG_LEVEL::ERR } << "WINSOCK: send() failed with error: " << WSAGetLastError();
+			return FAILURE;
+		}
+		m_stats.sent += (long long)m_output.size();
+		m_output.clear();
+		return SUCCESS;
+	}
+};
+
+// Sends hFile as instructions against the old copy the signature describes.
+// A hasher, if one is given, sees the whole file in order.
+inline int sendDelta(SOCKET s, HANDLE hFile, const Signature& basis, DeltaStats& stats, ContentHasher* hasher = nullptr)
+{
+	LARGE_INTEGER fileSize{}, start{};
+	if (!GetFileSizeEx(hFile, &fileSize) || !SetFilePointerEx(hFile, start, NULL, FILE_BEGIN))
+	{
+		Log{ LOG_LEVEL::ERR } << "GetFileSizeEx() failed with error: " << GetLastError();
+		return FAILURE;
+	}
+
+	// Whole blocks by weak checksum, blocks sharing one are chained through next.
+	// The filter rules out most offsets before the table is asked.
+	const std::uint32_t blockSize{ basis.blockSize };
+	std::unordered_map<std::uint32_t, std::uint32_t> first{};
+	std::vector<std::uint32_t> next(basis.blocks.size(), NO_BLOCK);
+	std::vector<bool> filter(1 << 20, false);
+	first.reserve(basis.blocks.size());
+	for (std::size_t i = basis.blocks.size(); i-- > 0; )
+	{
+		if (basis.length(i) != blockSize)
+			continue;	// The short last block can only match the end of the file
+
+		std::uint32_t weak{ basis.blocks[i].weak };
+		auto [it, inserted] = first.try_emplace(weak, (std::uint32_t)i);
+		if (!inserted)
+		{
+			next[i] = it->second;
+			it->second = (std::uint32_t)i;
+		}
+		filter[(weak * 2654435761u) >> 12] = true;
+	}
+
+	DeltaEncoder encoder{ s, stats };
+	Xxh64 whole{};
+	RollingChecksum weak{};
+	bool rolling{ false };
+	std::uint32_t expected{ NO_BLOCK };	// The block after the last match, tried first
+
+	std::vector<char> window(DELTA_WINDOW_SIZE);
+	std::size_t filled{ 0 }, position{ 0 }, literalStart{ 0 };
+	long long remaining{ fileSize.QuadPart };
+
+	while (true)
+	{
+		// Keep a whole block ahead of the position in the window
+		if (filled - position < blockSize && remaining > 0)
+		{
+			// Pending literal bytes go out before they are moved away
+			if (encoder.literal(window.data() + literalStart, position - literalStart) != SUCCESS)
+				return FAILURE;
+			memmove(window.data(), window.data() + position, filled - position);
+			filled -= position;
+			position = literalStart = 0;
+
+			DWORD toRead{ (DWORD)(std::min)((long long)(window.size() - filled), remaining) }, bytesRead{ 0 };
+			COUNT_SYSCALL();
+			if (!ReadFile(hFile, window.data() + filled, toRead, &bytesRead, NULL) || bytesRead != toRead)
+			{
+				Log{ LOG_LEVEL::ERR } << "ReadFile() failed with error: " << GetLastError();
+				return FAILURE;
+			}
+			whole.update(window.data() + filled, bytesRead);
+			if (hasher)
+				hasher->update(window.data() + filled, bytesRead);
+			filled += bytesRead;
+			remaining -= bytesRead;
+			continue;
+		}
+
+		// What is left is shorter than a block
+		if (filled - position < blockSize)
+			break;
+
+		// Nothing to match, the file goes out as literals
+		if (first.empty())
+		{
+			position = filled;
+			continue;
+		}
+
+		if (!rolling)
+		{
+			weak.reset(window.data() + position, blockSize);
+			rolling = true;
+		}
+
+		std::uint32_t block{ NO_BLOCK };
+		std::uint32_t checksum{ weak.value() };
+		if (filter[(checksum * 2654435761u) >> 12])
+		{
+			auto it{ first.find(checksum) };
+			if (it != first.end())
+			{
+				// The block after the last match first, so runs of blocks become one copy
+				std::uint64_t strong{ strongHash(window.data() + position, blockSize) };
+				if (expected < basis.blocks.size() && basis.length(expected) == blockSize &&
+					basis.blocks[expected].weak == checksum && basis.blocks[expected].strong == strong)
+					block = expected;
+				for (std::uint32_t i = it->second; block == NO_BLOCK && i != NO_BLOCK; i = next[i])
+				{
+					if (basis.blocks[i].strong == strong)
+						block = i;
+				}
+			}
+		}
+
+		if (block != NO_BLOCK)
+		{
+			if (encoder.literal(window.data() + literalStart, position - literalStart) != SUCCESS ||
+				encoder.copy(block, blockSize) != SUCCESS)
+				return FAILURE;
+			position += blockSize;
+			literalStart = position;
+			expected = block + 1;
+			rolling = false;
+			continue;
+		}
+
+		// No match, the window moves on by one byte. The byte after it may
+		// still have to be read, then the checksum starts over after the refill.
+		if (filled - position > blockSize)
+			weak.roll((unsigned char)window[position], (unsigned char)window[position + blockSize]);
+		else
+			rolling = false;
+		++position;
+	}
+
+	// The end of the file can still be the old copy's short last block
+	std::size_t tail{ filled - position };
+	std::size_t last{ basis.blocks.size() - 1 };
+	if (tail > 0 && !basis.blocks.empty() && basis.length(last) == tail)
+	{
+		weak.reset(window.data() + position, (std::uint32_t)tail);
+		if (basis.blocks[last].weak == weak.value() && basis.blocks[last].strong == strongHash(window.data() + position, tail))
+		{
+			if (encoder.literal(window.data() + literalStart, position - literalStart) != SUCCESS ||
+				encoder.copy((std::uint32_t)last, (std::uint32_t)tail) != SUCCESS)
+				return FAILURE;
+			literalStart = filled;
+		}
+	}
+
+	if (encoder.literal(window.data() + literalStart, filled - literalStart) != SUCCESS)
+		return FAILURE;
+
+	return encoder.end(fileSize.QuadPart, whole.value());
+}
+
+// Builds the new file in hTarget from the instructions and the old copy
+// in hBasis, which the signature describes. Fails if the result is not
+// the file the sender has. A hasher, if one is given, sees the new file.
+inline int recvDelta(SOCKET s, HANDLE hBasis, const Signature& basis, HANDLE hTarget, DeltaStats& stats,
+	ContentHasher* hasher = nullptr)
+{
+	std::vector<char> buffer((std::max)((std::size_t)DELTA_MAX_LITERAL, (std::size_t)DELTA_MAX_BLOCK));
+	Xxh64 whole{};
+	long long written{ 0 };
+
+	auto write = [&](const char* data, DWORD length)
+	{
+		DWORD bytesWritten{ 0 };
+		COUNT_SYSCALL();
+		if (!WriteFile(hTarget, data, length, &bytesWritten, NULL) || bytesWritten != length)
+		{
+			Log{ LOG_LEVEL::ERR } << "WriteFile() failed with error: " << GetLastError();
+			return false;
+		}
+		whole.update(data, length);
+		if (hasher)
+			hasher->update(data, length);
+		written += length;
+		return true;
+	};
+
+	while (true)
+	{
+		char tag{ 0 };
+		if (recvDeltaBytes(s, &tag, 1) != SUCCESS)
+			return FAILURE;
+
+		if (tag == DELTA_COPY)
+		{
+			std::uint32_t fields[2]{};
+			if (recvDeltaBytes(s, reinterpret_cast<char*>(fields), sizeof(fields)) != SUCCESS)
+				return FAILURE;
+			stats.sent += 1 + sizeof(fields);
+
+			std::uint64_t firstBlock{ fields[0] }, count{ fields[1] };
+			if (count == 0 || firstBlock + count > basis.blocks.size())
+			{
+				Log{ LOG_LEVEL::ERR } << "Malformed delta instruction.";
+				return FAILURE;
+			}
+
+			// Positional reads, the old copy is read where the blocks are
+			long long offset{ (long long)firstBlock * basis.blockSize };
+			long long end{ (std::min)((long long)(firstBlock + count) * basis.blockSize, basis.fileSize) };
+			stats.matched += end - offset;
+			while (offset < end)
+			{
+				OVERLAPPED overlapped{};
+				overlapped.Offset = (DWORD)(offset & 0xFFFFFFFF);
+				overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+				DWORD toRead{ (DWORD)(std::min)(end - offset, (long long)buffer.size()) }, bytesRead{ 0 };
+				COUNT_SYSCALL();
+				if (!ReadFile(hBasis, buffer.data(), toRead, &bytesRead, &overlapped) || bytesRead != toRead)
+				{
+					Log{ LOG_LEVEL::ERR } << "ReadFile() failed with error: " << GetLastError();
+					return FAILURE;
+				}
+				if (!write(buffer.data(), bytesRead))
+					return FAILURE;
+				offset += bytesRead;
+			}
+		}
+		else if (tag == DELTA_LITERAL)
+		{
+			std::uint32_t length{ 0 };
+			if (recvDeltaBytes(s, reinterpret_cast<char*>(&length), sizeof(length)) != SUCCESS)
+				return FAILURE;
+			if (length == 0 || length > DELTA_MAX_LITERAL)
+			{
+				Log{ LOG_LEVEL::ERR } << "Malformed delta instruction.";
+				return FAILURE;
+			}
+
+			if (recvDeltaBytes(s, buffer.data(), length) != SUCCESS || !write(buffer.data(), length))
+				return FAILURE;
+			stats.literal += length;
+			stats.sent += 1 + sizeof(length) + length;
+		}
+		else if (tag == DELTA_END)
+		{
+			long long size{ 0 };
+			std::uint64_t digest{ 0 };
+			char fields[sizeof(size) + sizeof(digest)]{};
+			if (recvDeltaBytes(s, fields, sizeof(fields)) != SUCCESS)
+				return FAILURE;
+			memcpy(&size, fields, sizeof(size));
+			memcpy(&digest, fields + sizeof(size), sizeof(digest));
+			stats.sent += 1 + sizeof(fields);
+
+			if (size != written || digest != whole.value())
+			{
+				Log{ LOG_LEVEL::ERR } << "Delta result does not match the sent file.";
+				return FAILURE;
+			}
+			return SUCCESS;
+		}
+		else
+		{
+			Log{ LOG_LEVEL::ERR } << "Malformed delta instruction.";
+			return FAILURE;
+		}
+	}
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+// Shared by the FTP client and server
+
+// Return constants
+constexpr int SUCCESS{ 0 };
+constexpr int FAILURE{ 1 };
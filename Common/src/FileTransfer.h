@@ -0,0 +1,204 @@
+#pragma once
+
+#include "FTP_Common.h"
+#include "BufferPool.h"
+#include "Logger.h"
+#include "SyscallCount.h"
+#include "Hash.h"
+
+#include <ws2tcpip.h>
+
+#include <algorithm>
+
+/*
+	Receive path shared by the server's STOR and the client's RETR.
+	The destination file is preallocated and mapped, and recv() writes
+	straight into the mapped view, so the data lands in the file cache
+	without passing through an intermediate buffer. When the file can
+	not be mapped the data is copied through a pooled buffer instead.
+	A hasher, if one is given, sees every byte in order as it arrives.
+*/
+
+// How long a send may wait for room in a full non-blocking socket
+constexpr int SEND_TIMEOUT_MS{ 5000 };
+
+// Part of the file mapped at a time while receiving
+constexpr long long RECV_VIEW_SIZE{ 64LL * 1024 * 1024 };
+
+// Largest single recv() into a mapped view
+constexpr int RECV_CHUNK_SIZE{ 1024 * 1024 };
+
+// Sends the whole buffer, also on non-blocking sockets
+inline int sendAll(SOCKET s, const char* buf, int bufLen)
+{
+	for (int sent = 0; sent < bufLen; )
+	{
+		COUNT_SYSCALL();
+		int iSendResult = send(s, buf + sent, bufLen - sent, 0);
+		if (iSendResult == SOCKET_ERROR)
+		{
+			if (WSAGetLastError() != WSAEWOULDBLOCK)
+				return FAILURE;
+
+			// Wait for room in the send buffer
+			WSAPOLLFD pollFd{ s, POLLWRNORM, 0 };
+			if (WSAPoll(&pollFd, 1, SEND_TIMEOUT_MS) <= 0)
+				return FAILURE;
+			continue;
+		}
+		sent += iSendResult;
+	}
+
+	return SUCCESS;
+}
+
+// Moves the end of hFile to size
+inline bool setFileSize(HANDLE hFile, long long size)
+{
+	LARGE_INTEGER position{};
+	position.QuadPart = size;
+	return SetFilePointerEx(hFile, position, NULL, FILE_BEGIN) && SetEndOfFile(hFile);
+}
+
+// Receives into mapped views of the file. Stops early without failing
+// if a view can not be mapped, received tells how far it got.
+inline int recvMapped(SOCKET s, HANDLE hFile, long long offset, long long length, long long& received,
+	ContentHasher* hasher = nullptr)
+{
+	received = 0;
+
+	long long end{ offset + length };
+	HANDLE hMapping = CreateFileMappingW(hFile, NULL, PAGE_READWRITE, (DWORD)(end >> 32), (DWORD)(end & 0xFFFFFFFF), NULL);
+	if (hMapping == NULL)
+		return SUCCESS;
+
+	// Views have to start on the allocation granularity
+	SYSTEM_INFO systemInfo{};
+	GetSystemInfo(&systemInfo);
+	long long granularity{ (long long)systemInfo.dwAllocationGranularity };
+
+	long long position{ offset };
+	while (position < end)
+	{
+		long long viewStart{ position - (position % granularity) };
+		SIZE_T viewSize{ (SIZE_T)(std::min)(RECV_VIEW_SIZE, end - viewStart) };
+
+		char* view = (char*)MapViewOfFile(hMapping, FILE_MAP_WRITE, (DWORD)(viewStart >> 32), (DWORD)(viewStart & 0xFFFFFFFF), viewSize);
+		if (view == NULL)
+			break; // The caller copies the rest
+
+		// Fill the view, recv() may return any amount up to what was asked
+		long long viewEnd{ viewStart + (long long)viewSize };
+		while (position < viewEnd)
+		{
+			int chunk{ (int)(std::min)((long long)RECV_CHUNK_SIZE, viewEnd - position) };
+			COUNT_SYSCALL();
+			int iResult = recv(s, view + (position - viewStart), chunk, 0);
+			if (iResult <= 0)
+			{
+				if (iResult == SOCKET_ERROR)
+					Log{ LOG_LEVEL::ERR } << "WINSOCK: recv() failed with error: " << WSAGetLastError();
+				else
+					Log{ LOG_LEVEL::ERR } << "WINSOCK: Connection closed " << end - position << " bytes early.";
+
+				UnmapViewOfFile(view);
+				CloseHandle(hMapping);
+				received = position - offset;
+				return FAILURE;
+			}
+			if (hasher)
+				hasher->update(view + (position - viewStart), (std::size_t)iResult);
+			position += iResult;
+		}
+
+		UnmapViewOfFile(view);
+	}
+
+	CloseHandle(hMapping);
+	received = position - offset;
+
+	return SUCCESS;
+}
+
+// Receives through a buffer, writing exactly the bytes that arrived
+// so a short recv() can never put garbage in the file.
+inline int recvCopy(SOCKET s, HANDLE hFile, long long offset, long long length, long long& received, TransferBufferPool& pool,
+	ContentHasher* hasher = nullptr)
+{
+	received = 0;
+
+	// Lease a transfer buffer
+	TransferBufferPool::Buffer xferBuf{ pool.acquire() };
+	if (!xferBuf)
+		return FAILURE;
+
+	// Loop while there's still data to receive
+	while (received < length)
+	{
+		COUNT_SYSCALL();
+		int iResult = recv(s, xferBuf.data(), (int)(std::min)(length - received, (long long)xferBuf.size()), 0);
+		if (iResult <= 0)
+		{
+			if (iResult == SOCKET_ERROR)
+				Log{ LOG_LEVEL::ERR } << "WINSOCK: recv() failed with error: " << WSAGetLastError();
+			else
+				Log{ LOG_LEVEL::ERR } << "WINSOCK: Connection closed " << length - received << " bytes early.";
+			return FAILURE;
+		}
+
+		// Positional write, other ranges of the same file may be written at the same time
+		OVERLAPPED position{};
+		position.Offset = (DWORD)((offset + received) & 0xFFFFFFFF);
+		position.OffsetHigh = (DWORD)((offset + received) >> 32);
+
+		DWORD written{ 0 };
+		COUNT_SYSCALL();
+		if (!WriteFile(hFile, xferBuf.data(), (DWORD)iResult, &written, &position) || written != (DWORD)iResult)
+		{
+			Log{ LOG_LEVEL::ERR } << "WriteFile() failed with error: " << GetLastError();
+			return FAILURE;
+		}
+		if (hasher)
+			hasher->update(xferBuf.data(), (std::size_t)iResult);
+		received += iResult;
+	}
+
+	return SUCCESS;
+}
+
+// Receives exactly length bytes from s into hFile starting at offset.
+// hFile needs read and write access so it can be mapped. If the file had
+// to grow and the transfer fails, it is cut back to the last byte that
+// actually arrived.
+inline int recvToFile(SOCKET s, HANDLE hFile, long long offset, long long length, TransferBufferPool& pool,
+	ContentHasher* hasher = nullptr)
+{
+	LARGE_INTEGER currentSize{};
+	if (!GetFileSizeEx(hFile, &currentSize))
+		return FAILURE;
+
+	// Reserve the whole range up front so it can be mapped
+	bool grown{ (long long)currentSize.QuadPart < offset + length };
+	if (grown && !setFileSize(hFile, offset + length))
+		return FAILURE;
+
+	if (length <= 0)
+		return SUCCESS;
+
+	long long received{ 0 };
+	int iResult = recvMapped(s, hFile, offset, length, received, hasher);
+
+	// Copy whatever could not be mapped
+	if (iResult == SUCCESS && received < length)
+	{
+		long long copied{ 0 };
+		iResult = recvCopy(s, hFile, offset + received, length - received, copied, pool, hasher);
+		received += copied;
+	}
+
+	// Do not leave preallocated zeros behind a failed transfer
+	if (iResult != SUCCESS && grown)
+		setFileSize(hFile, (std::max)((long long)currentSize.QuadPart, offset + received));
+
+	return iResult;
+}
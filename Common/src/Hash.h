@@ -0,0 +1,449 @@
+#pragma once
+
+#include "FTP_Common.h"
+#include "BufferPool.h"
+#include "Logger.h"
+#include "SyscallCount.h"
+
+#include <ws2tcpip.h>
+#include <bcrypt.h>
+
+#if defined(_M_X64)
+#include <intrin.h>
+#include <nmmintrin.h>
+#endif
+
+#include <array>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <cctype>
+
+// Need to tell the compiler to link Bcrypt.lib
+#pragma comment(lib, "Bcrypt.lib")
+
+/*
+	Content hashes for HASH and XCRC. CRC-32C uses the SSE 4.2 crc32
+	instruction where the CPU has it, XXH64 is plain 64-bit arithmetic
+	that runs at memory speed, and SHA-256 goes through CNG, which picks
+	the SHA extensions or AVX2 on its own. All of them take the data a
+	piece at a time, so a transfer can hash the bytes as they go by
+	instead of reading the file again afterwards.
+*/
+
+enum class HASH_ALGORITHM
+{
+	CRC32C, XXH64, SHA256
+};
+
+constexpr int HASH_ALGORITHMS{ 3 };
+
+constexpr unsigned int hashBit(HASH_ALGORITHM algorithm)
+{
+	return 1u << (int)algorithm;
+}
+
+// Names as used by HASH and OPTS HASH
+constexpr const char* hashName(HASH_ALGORITHM algorithm)
+{
+	switch (algorithm)
+	{
+	case HASH_ALGORITHM::CRC32C: return "CRC32C";
+	case HASH_ALGORITHM::XXH64: return "XXH64";
+	default: return "SHA-256";
+	}
+}
+
+// Case-insensitive, false if the name is unknown
+inline bool parseHashName(std::string_view name, HASH_ALGORITHM& algorithm)
+{
+	for (int i = 0; i < HASH_ALGORITHMS; ++i)
+	{
+		std::string_view candidate{ hashName((HASH_ALGORITHM)i) };
+		if (candidate.size() == name.size() && std::equal(candidate.begin(), candidate.end(), name.begin(),
+			[](char a, char b) { return a == (char)std::toupper((unsigned char)b); }))
+		{
+			algorithm = (HASH_ALGORITHM)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+/***********************************************
+	CRC-32C
+***********************************************/
+// Castagnoli polynomial, reflected
+constexpr std::uint32_t CRC32C_POLYNOMIAL{ 0x82F63B78 };
+
+constexpr std::array<std::uint32_t, 256> crc32cTable()
+{
+	std::array<std::uint32_t, 256> table{};
+	for (std::uint32_t i = 0; i < 256; ++i)
+	{
+		std::uint32_t crc{ i };
+		for (int bit = 0; bit < 8; ++bit)
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+		table[i] = crc;
+	}
+	return table;
+}
+
+inline constexpr std::array<std::uint32_t, 256> CRC32C_TABLE{ crc32cTable() };
+
+class Crc32c
+{
+private:
+	std::uint32_t m_crc{ 0xFFFFFFFF };
+
+	static bool hardware()
+	{
+#if defined(_M_X64)
+		// CPUID leaf 1, ECX bit 20 is SSE 4.2
+		static const bool sse42{ []
+		{
+			int info[4]{};
+			__cpuid(info, 1);
+			return (info[2] & (1 << 20)) != 0;
+		}() };
+		return sse42;
+#else
+		return false;
+#endif
+	}
+
+public:
+	void update(const char* data, std::size_t length)
+	{
+		const unsigned char* p{ reinterpret_cast<const unsigned char*>(data) };
+		std::uint32_t crc{ m_crc };
+
+#if defined(_M_X64)
+		if (hardware())
+		{
+			// Eight bytes per instruction, the unaligned head and tail a byte at a time
+			unsigned long long crc64{ crc };
+			for (; length >= 8; p += 8, length -= 8)
+			{
+				unsigned long long word{};
+				std::memcpy(&word, p, sizeof(word));
+				crc64 = _mm_crc32_u64(crc64, word);
+			}
+			crc = (std::uint32_t)crc64;
+			for (; length > 0; ++p, --length)
+				crc = _mm_crc32_u8(crc, *p);
+
+			m_crc = crc;
+			return;
+		}
+#endif
+
+		for (; length > 0; ++p, --length)
+			crc = CRC32C_TABLE[(crc ^ *p) & 0xFF] ^ (crc >> 8);
+		m_crc = crc;
+	}
+
+	std::uint32_t value() const { return m_crc ^ 0xFFFFFFFF; }
+};
+
+/***********************************************
+	XXH64
+***********************************************/
+class Xxh64
+{
+private:
+	static constexpr std::uint64_t P1{ 11400714785074694791ULL };
+	static constexpr std::uint64_t P2{ 14029467366897019727ULL };
+	static constexpr std::uint64_t P3{ 1609587929392839161ULL };
+	static constexpr std::uint64_t P4{ 9650029242287828579ULL };
+	static constexpr std::uint64_t P5{ 2870177450012600261ULL };
+
+	static constexpr int STRIPE{ 32 };
+
+	std::uint64_t m_acc[4]{ P1 + P2, P2, 0, 0 - P1 };	// Seed 0
+	std::uint64_t m_total{ 0 };
+	unsigned char m_stripe[STRIPE]{};	// Bytes that do not fill a stripe yet
+	std::size_t m_filled{ 0 };
+
+	static std::uint64_t rotl(std::uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+	static std::uint64_t read64(const unsigned char* p)
+	{
+		std::uint64_t v{};
+		std::memcpy(&v, p, sizeof(v));
+		return v;
+	}
+
+	static std::uint32_t read32(const unsigned char* p)
+	{
+		std::uint32_t v{};
+		std::memcpy(&v, p, sizeof(v));
+		return v;
+	}
+
+	static std::uint64_t round(std::uint64_t acc, std::uint64_t input)
+	{
+		acc += input * P2;
+		return rotl(acc, 31) * P1;
+	}
+
+	static std::uint64_t merge(std::uint64_t h, std::uint64_t acc)
+	{
+		h ^= round(0, acc);
+		return h * P1 + P4;
+	}
+
+	void consume(const unsigned char* p)
+	{
+		for (int lane = 0; lane < 4; ++lane)
+			m_acc[lane] = round(m_acc[lane], read64(p + lane * 8));
+	}
+
+public:
+	void update(const char* data, std::size_t length)
+	{
+		const unsigned char* p{ reinterpret_cast<const unsigned char*>(data) };
+		m_total += length;
+
+		// Finish a stripe left over from the last call
+		if (m_filled > 0)
+		{
+			std::size_t take{ (std::min)(length, STRIPE - m_filled) };
+			std::memcpy(m_stripe + m_filled, p, take);
+			m_filled += take;
+			p += take;
+			length -= take;
+			if (m_filled < STRIPE)
+				return;
+			consume(m_stripe);
+			m_filled = 0;
+		}
+
+		for (; length >= STRIPE; p += STRIPE, length -= STRIPE)
+			consume(p);
+
+		std::memcpy(m_stripe, p, length);
+		m_filled = length;
+	}
+
+	std::uint64_t value() const
+	{
+		std::uint64_t h{};
+		if (m_total >= STRIPE)
+		{
+			h = rotl(m_acc[0], 1) + rotl(m_acc[1], 7) + rotl(m_acc[2], 12) + rotl(m_acc[3], 18);
+			for (std::uint64_t acc : m_acc)
+				h = merge(h, acc);
+		}
+		else
+			h = P5;	// Seed 0
+		h += m_total;
+
+		const unsigned char* p{ m_stripe };
+		std::size_t length{ m_filled };
+		for (; length >= 8; p += 8, length -= 8)
+			h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+		if (length >= 4)
+		{
+			h = rotl(h ^ (read32(p) * P1), 23) * P2 + P3;
+			p += 4;
+			length -= 4;
+		}
+		for (; length > 0; ++p, --length)
+			h = rotl(h ^ (*p * P5), 11) * P1;
+
+		// Avalanche
+		h ^= h >> 33;
+		h *= P2;
+		h ^= h >> 29;
+		h *= P3;
+		h ^= h >> 32;
+		return h;
+	}
+};
+
+/***********************************************
+	SHA-256
+***********************************************/
+constexpr ULONG SHA256_LENGTH{ 32 };
+
+class Sha256
+{
+private:
+	BCRYPT_HASH_HANDLE m_hHash{ NULL };
+
+	// Opened once for the process, a provider can be shared by any number of hashes
+	static BCRYPT_ALG_HANDLE provider()
+	{
+		static const BCRYPT_ALG_HANDLE hAlgorithm{ []
+		{
+			BCRYPT_ALG_HANDLE hAlg{ NULL };
+			NTSTATUS status = BCryptOpenAlgorithmProvider(&hAlg, BCRYPT_SHA256_ALGORITHM, NULL, 0);
+			if (!BCRYPT_SUCCESS(status))
+			{
+				Log{ LOG_LEVEL::ERR } << "BCryptOpenAlgorithmProvider() failed with status: " << status;
+				return (BCRYPT_ALG_HANDLE)NULL;
+			}
+			return hAlg;
+		}() };
+		return hAlgorithm;
+	}
+
+public:
+	Sha256()
+	{
+		// The hash object's memory is allocated by CNG
+		if (provider() == NULL || !BCRYPT_SUCCESS(BCryptCreateHash(provider(), &m_hHash, NULL, 0, NULL, 0, 0)))
+			m_hHash = NULL;
+	}
+
+	~Sha256()
+	{
+		if (m_hHash != NULL)
+			BCryptDestroyHash(m_hHash);
+	}
+
+	Sha256(const Sha256&) = delete;
+	Sha256& operator=(const Sha256&) = delete;
+
+	bool valid() const { return m_hHash != NULL; }
+
+	void update(const char* data, std::size_t length)
+	{
+		// BCryptHashData takes a ULONG length
+		while (m_hHash != NULL && length > 0)
+		{
+			ULONG part{ (ULONG)(std::min)(length, (std::size_t)1 << 30) };
+			if (!BCRYPT_SUCCESS(BCryptHashData(m_hHash, (PUCHAR)data, part, 0)))
+			{
+				BCryptDestroyHash(m_hHash);
+				m_hHash = NULL;
+				return;
+			}
+			data += part;
+			length -= part;
+		}
+	}
+
+	// Finishing consumes the hash, it is called once
+	bool finish(unsigned char (&digest)[SHA256_LENGTH])
+	{
+		return m_hHash != NULL && BCRYPT_SUCCESS(BCryptFinishHash(m_hHash, digest, SHA256_LENGTH, 0));
+	}
+};
+
+/***********************************************
+	Content Hasher
+***********************************************/
+/*
+	Runs any set of the algorithms over the same bytes. A transfer that
+	wants its file hashed hands one of these to the copy loop, which
+	calls update() with every piece of data it moves.
+*/
+class ContentHasher
+{
+private:
+	const unsigned int m_algorithms;
+	unsigned long long m_hashed{ 0 };
+
+	Crc32c m_crc{};
+	Xxh64 m_xxh{};
+	std::unique_ptr<Sha256> m_sha;	// Only created if asked for, it holds a CNG object
+	std::string m_shaDigest;		// CNG finishes a hash once, the result is kept
+
+	static std::string hex(const unsigned char* bytes, std::size_t length)
+	{
+		static const char digits[]{ "0123456789abcdef" };
+		std::string text(length * 2, '0');
+		for (std::size_t i = 0; i < length; ++i)
+		{
+			text[i * 2] = digits[bytes[i] >> 4];
+			text[i * 2 + 1] = digits[bytes[i] & 0xF];
+		}
+		return text;
+	}
+
+public:
+	explicit ContentHasher(unsigned int algorithms) :
+		m_algorithms{ algorithms },
+		m_sha{ has(HASH_ALGORITHM::SHA256) ? std::make_unique<Sha256>() : nullptr }
+	{
+	}
+
+	ContentHasher(const ContentHasher&) = delete;
+	ContentHasher& operator=(const ContentHasher&) = delete;
+
+	bool has(HASH_ALGORITHM algorithm) const { return (m_algorithms & hashBit(algorithm)) != 0; }
+	unsigned int algorithms() const { return m_algorithms; }
+
+	// Bytes seen so far, a transfer that skipped the hasher sees fewer than the file has
+	unsigned long long hashed() const { return m_hashed; }
+
+	void update(const char* data, std::size_t length)
+	{
+		m_hashed += length;
+		if (has(HASH_ALGORITHM::CRC32C)) m_crc.update(data, length);
+		if (has(HASH_ALGORITHM::XXH64)) m_xxh.update(data, length);
+		if (m_sha) m_sha->update(data, length);
+	}
+
+	// Lower-case hex, big-endian like the usual tools print them.
+	// No more data may be added after a digest was taken. Empty if CNG failed.
+	std::string digest(HASH_ALGORITHM algorithm)
+	{
+		switch (algorithm)
+		{
+		case HASH_ALGORITHM::CRC32C:
+		{
+			std::uint32_t crc{ m_crc.value() };
+			unsigned char bytes[4]{ (unsigned char)(crc >> 24), (unsigned char)(crc >> 16), (unsigned char)(crc >> 8), (unsigned char)crc };
+			return hex(bytes, sizeof(bytes));
+		}
+		case HASH_ALGORITHM::XXH64:
+		{
+			std::uint64_t h{ m_xxh.value() };
+			unsigned char bytes[8]{};
+			for (int i = 0; i < 8; ++i)
+				bytes[i] = (unsigned char)(h >> (56 - i * 8));
+			return hex(bytes, sizeof(bytes));
+		}
+		default:
+		{
+			unsigned char bytes[SHA256_LENGTH]{};
+			if (m_shaDigest.empty() && m_sha && m_sha->finish(bytes))
+				m_shaDigest = hex(bytes, sizeof(bytes));
+			return m_shaDigest;
+		}
+		}
+	}
+};
+
+// Hashes hFile from its start through a pooled buffer
+inline int hashFile(HANDLE hFile, ContentHasher& hasher, TransferBufferPool& pool)
+{
+	TransferBufferPool::Buffer xferBuf{ pool.acquire() };
+	if (!xferBuf)
+		return FAILURE;
+
+	LARGE_INTEGER position{};
+	if (!SetFilePointerEx(hFile, position, NULL, FILE_BEGIN))
+		return FAILURE;
+
+	while (true)
+	{
+		DWORD bytesRead{ 0 };
+		COUNT_SYSCALL();
+		if (!ReadFile(hFile, xferBuf.data(), (DWORD)xferBuf.size(), &bytesRead, NULL))
+		{
+			Log{ LOG_LEVEL::ERR } << "ReadFile() failed with error: " << GetLastError();
+			return FAILURE;
+		}
+		if (bytesRead == 0)
+			return SUCCESS;
+
+		hasher.update(xferBuf.data(), bytesRead);
+	}
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "FTP_Common.h"
+
+#include <ws2tcpip.h>
+
+#include <string>
+
+// Longest control line that is waited for, a peer that never sends
+// a line end must not grow the buffer without bound
+constexpr std::size_t MAX_LINE_LENGTH{ 8192 };
+
+// Every command and every reply line ends with it
+constexpr const char* CRLF{ "\r\n" };
+
+// Bytes taken from the socket per recv()
+constexpr int LINE_RECV_SIZE{ 4096 };
+
+/*
+	Buffered reader for the control connection. Whatever recv() returns
+	is appended, and complete lines are taken out in the order they
+	arrived. Lines end in CRLF, a bare LF is accepted too. Several
+	commands that arrive in one packet are kept apart, a command split
+	over several packets is put back together.
+*/
+class LineBuffer
+{
+private: // Variables
+	std::string m_data;
+	std::size_t m_start;	// First byte not taken yet
+
+public:
+	LineBuffer() : m_data{}, m_start{ 0 } {}
+
+	void append(const char* data, std::size_t length)
+	{
+		// Drop the lines already taken before the buffer grows
+		if (m_start > 0)
+		{
+			m_data.erase(0, m_start);
+			m_start = 0;
+		}
+		m_data.append(data, length);
+	}
+
+	// Receives once and appends, returns what recv() returned
+	int receive(SOCKET s)
+	{
+		char recvBuf[LINE_RECV_SIZE];
+		int iResult = recv(s, recvBuf, sizeof(recvBuf), 0);
+		if (iResult > 0)
+			append(recvBuf, (std::size_t)iResult);
+		return iResult;
+	}
+
+	// Takes the next complete line, without its line end
+	bool nextLine(std::string& line)
+	{
+		std::size_t end{ m_data.find('\n', m_start) };
+		if (end == std::string::npos)
+			return false;
+
+		std::size_t length{ end - m_start };
+		if (length > 0 && m_data[end - 1] == '\r')
+			--length;
+		line.assign(m_data, m_start, length);
+
+		m_start = end + 1;
+		if (m_start == m_data.size())
+			clear();
+		return true;
+	}
+
+	bool hasLine() const { return m_data.find('\n', m_start) != std::string::npos; }
+
+	// The unfinished line is already longer than any line may be
+	bool overflow() const { return m_data.size() - m_start > MAX_LINE_LENGTH && !hasLine(); }
+
+	void clear()
+	{
+		m_data.clear();
+		m_start = 0;
+	}
+};
@@ -0,0 +1,322 @@
+#pragma once
+
+#include <ws2tcpip.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/*
+	Asynchronous log. Every thread writes its records into a ring of
+	its own, with one producer and one consumer no lock is needed, and
+	a background writer drains all rings in batches to a file or the
+	console. A thread that logs never waits for console or disk I/O:
+	when its ring is full the record is dropped and counted, and the
+	writer reports the count.
+
+	Until start() is called, and after stop(), records are written
+	straight through, so code shared with the client logs the same way.
+*/
+
+// ERROR is a macro in the Windows headers
+enum class LOG_LEVEL
+{
+	DEBUG, INFO, WARN, ERR
+};
+
+constexpr std::size_t LOG_RECORD_SIZE{ 240 };	// Longer messages are cut
+constexpr std::size_t LOG_RING_RECORDS{ 512 };	// Per thread
+constexpr int LOG_FLUSH_INTERVAL_MS{ 20 };
+
+constexpr const char* logLevelName(LOG_LEVEL level)
+{
+	switch (level)
+	{
+	case LOG_LEVEL::DEBUG: return "DEBUG";
+	case LOG_LEVEL::INFO: return "INFO ";
+	case LOG_LEVEL::WARN: return "WARN ";
+	default: return "ERROR";
+	}
+}
+
+class Logger
+{
+public:
+	struct Record
+	{
+		LOG_LEVEL level;
+		unsigned short length;
+		long long time;			// Microseconds since the logger was created
+		char text[LOG_RECORD_SIZE];
+	};
+
+private: // Variables
+	// Written by one thread, drained by the writer
+	struct Ring
+	{
+		std::array<Record, LOG_RING_RECORDS> records;
+		std::atomic<std::size_t> head{ 0 };	// Next record the thread writes
+		std::atomic<std::size_t> tail{ 0 };	// Next record the writer takes
+		std::atomic<unsigned long long> dropped{ 0 };
+		DWORD threadId{ 0 };
+	};
+
+	// Registration happens once per thread, only it takes the lock
+	std::mutex m_ringsMutex;
+	std::vector<std::unique_ptr<Ring>> m_rings;
+
+	std::atomic<LOG_LEVEL> m_level;
+	std::atomic<bool> m_running;
+	std::thread m_writer;
+
+	std::ofstream m_file;
+	std::ostream* m_output;
+
+	const std::chrono::steady_clock::time_point m_epoch;
+
+private: // Functions
+	Logger() :
+		m_level{ LOG_LEVEL::INFO },
+		m_running{ false },
+		m_output{ &std::cout },
+		m_epoch{ std::chrono::steady_clock::now() }
+	{
+	}
+
+	Ring& threadRing()
+	{
+		thread_local Ring* ring{ nullptr };
+		if (ring == nullptr)
+		{
+			auto created{ std::make_unique<Ring>() };
+			created->threadId = GetCurrentThreadId();
+
+			std::lock_guard<std::mutex> lock{ m_ringsMutex };
+			ring = created.get();
+			m_rings.push_back(std::move(created));
+		}
+		return *ring;
+	}
+
+	static void format(std::string& batch, const Record& record, DWORD threadId)
+	{
+		char prefix[64];
+		int length = std::snprintf(prefix, sizeof(prefix), "%10.6f %s [%5lu] ",
+			record.time / 1e6, logLevelName(record.level), (unsigned long)threadId);
+		batch.append(prefix, (std::size_t)(std::max)(length, 0));
+		batch.append(record.text, record.length);
+		batch += '\n';
+	}
+
+	// Takes everything the rings hold, in time order
+	void drain()
+	{
+		std::vector<std::pair<const Record*, Ring*>> taken{};
+		std::vector<std::pair<Ring*, std::size_t>> ends{};
+		std::string batch{};
+
+		{
+			std::lock_guard<std::mutex> lock{ m_ringsMutex };
+			for (auto& ring : m_rings)
+			{
+				std::size_t tail{ ring->tail.load(std::memory_order_relaxed) };
+				std::size_t head{ ring->head.load(std::memory_order_acquire) };
+				for (std::size_t i = tail; i != head; ++i)
+					taken.emplace_back(&ring->records[i % LOG_RING_RECORDS], ring.get());
+				ends.emplace_back(ring.get(), head);
+
+				unsigned long long dropped{ ring->dropped.exchange(0, std::memory_order_relaxed) };
+				if (dropped > 0)
+					batch += "LOG: Thread " + std::to_string(ring->threadId) + " dropped " + std::to_string(dropped) + " records.\n";
+			}
+		}
+
+		std::stable_sort(taken.begin(), taken.end(), [](const auto& a, const auto& b)
+			{
+				return a.first->time < b.first->time;
+			});
+		for (const auto& [record, ring] : taken)
+			format(batch, *record, ring->threadId);
+
+		// The records are copied out, their slots can be reused
+		for (const auto& [ring, head] : ends)
+			ring->tail.store(head, std::memory_order_release);
+
+		if (!batch.empty())
+		{
+			m_output->write(batch.data(), (std::streamsize)batch.size());
+			m_output->flush();
+		}
+	}
+
+	void run()
+	{
+		while (m_running.load(std::memory_order_acquire))
+		{
+			drain();
+			std::this_thread::sleep_for(std::chrono::milliseconds{ LOG_FLUSH_INTERVAL_MS });
+		}
+		drain();
+	}
+
+public:
+	static Logger& get()
+	{
+		static Logger logger{};
+		return logger;
+	}
+
+	~Logger() { stop(); }
+
+	Logger(const Logger&) = delete;
+	Logger& operator=(const Logger&) = delete;
+
+	// Starts the writer, an empty path logs to the console
+	bool start(const std::string& path, LOG_LEVEL level)
+	{
+		if (m_running.load())
+			return true;
+
+		m_level.store(level);
+		if (!path.empty())
+		{
+			m_file.open(path, std::ios_base::app);
+			if (!m_file)
+				return false;
+			m_output = &m_file;
+		}
+
+		m_running.store(true, std::memory_order_release);
+		m_writer = std::thread{ &Logger::run, this };
+		return true;
+	}
+
+	// Writes what is left and goes back to writing straight through
+	void stop()
+	{
+		if (!m_running.exchange(false))
+			return;
+
+		if (m_writer.joinable())
+			m_writer.join();
+		if (m_file.is_open())
+			m_file.close();
+		m_output = &std::cout;
+	}
+
+	bool enabled(LOG_LEVEL level) const { return level >= m_level.load(std::memory_order_relaxed); }
+
+	long long now() const
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_epoch).count();
+	}
+
+	void write(const Record& record)
+	{
+		if (!m_running.load(std::memory_order_acquire))
+		{
+			std::ostream& out{ (record.level >= LOG_LEVEL::WARN) ? std::cerr : std::cout };
+			out.write(record.text, record.length);
+			out << '\n';
+			return;
+		}
+
+		Ring& ring{ threadRing() };
+		std::size_t head{ ring.head.load(std::memory_order_relaxed) };
+		if (head - ring.tail.load(std::memory_order_acquire) >= LOG_RING_RECORDS)
+		{
+			ring.dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		ring.records[head % LOG_RING_RECORDS] = record;
+		ring.head.store(head + 1, std::memory_order_release);
+	}
+};
+
+/*
+	One log line, built on the stack and handed to the logger when it
+	goes out of scope:
+		Log{ LOG_LEVEL::ERR } << "WINSOCK: recv() failed with error: " << WSAGetLastError();
+*/
+class Log
+{
+private: // Variables
+	Logger::Record m_record;
+	bool m_enabled;
+
+private: // Functions
+	void append(const char* text, std::size_t length)
+	{
+		length = (std::min)(length, LOG_RECORD_SIZE - m_record.length);
+		std::memcpy(m_record.text + m_record.length, text, length);
+		m_record.length = (unsigned short)(m_record.length + length);
+	}
+
+public:
+	explicit Log(LOG_LEVEL level) :
+		m_record{},
+		m_enabled{ Logger::get().enabled(level) }
+	{
+		m_record.level = level;
+		if (m_enabled)
+			m_record.time = Logger::get().now();
+	}
+
+	~Log()
+	{
+		// A line ends with the record, a trailing newline is not repeated
+		while (m_record.length > 0 && m_record.text[m_record.length - 1] == '\n')
+			--m_record.length;
+		if (m_enabled)
+			Logger::get().write(m_record);
+	}
+
+	Log(const Log&) = delete;
+	Log& operator=(const Log&) = delete;
+
+	Log& operator<<(std::string_view text)
+	{
+		if (m_enabled) append(text.data(), text.size());
+		return *this;
+	}
+
+	Log& operator<<(const char* text) { return *this << std::string_view{ text }; }
+	Log& operator<<(const std::string& text) { return *this << std::string_view{ text }; }
+
+	Log& operator<<(char c)
+	{
+		if (m_enabled) append(&c, 1);
+		return *this;
+	}
+
+	template <typename T, typename = std::enable_if_t<std::is_arithmetic_v<T>>>
+	Log& operator<<(T value)
+	{
+		if (!m_enabled)
+			return *this;
+
+		char number[32];
+		int length{ 0 };
+		if constexpr (std::is_floating_point_v<T>)
+			length = std::snprintf(number, sizeof(number), "%g", (double)value);
+		else if constexpr (std::is_signed_v<T>)
+			length = std::snprintf(number, sizeof(number), "%lld", (long long)value);
+		else
+			length = std::snprintf(number, sizeof(number), "%llu", (unsigned long long)value);
+		append(number, (std::size_t)(std::max)(length, 0));
+		return *this;
+	}
+};
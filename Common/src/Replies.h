@@ -0,0 +1,130 @@
+#pragma once
+
+#include "FTP_Common.h"
+#include "LineBuffer.h"
+#include "Logger.h"
+
+#include <ws2tcpip.h>
+
+#include <charconv>
+#include <sstream>
+#include <string>
+
+/*
+	The user side of the control connection: reading replies and
+	sending a command and waiting for its reply. Shared by the client
+	and the load generator.
+*/
+
+// Receives one whole reply. A multi-line reply, from "214-" up to the
+// line starting with "214 ", comes back as one string.
+inline int receiveReply(SOCKET s, LineBuffer& buffer, std::string& reply)
+{
+	reply.clear();
+	std::string line{}, last{};
+	while (true)
+	{
+		while (!buffer.nextLine(line))
+		{
+			if (buffer.overflow() || buffer.receive(s) <= 0)
+			{
+				Log{ LOG_LEVEL::ERR } << "WINSOCK: recv() failed with error: " << WSAGetLastError();
+				return FAILURE;
+			}
+		}
+
+		if (!reply.empty())
+			reply += '\n';
+		reply += line;
+
+		if (last.empty())
+		{
+			// A single line reply
+			if (line.length() < 4 || line[3] != '-')
+				return SUCCESS;
+			last = line.substr(0, 3) + ' ';
+		}
+		else if (line.compare(0, last.length(), last) == 0)
+			return SUCCESS;
+	}
+}
+
+// Receives one reply, SUCCESS if it has the expected code
+inline int readReply(SOCKET s, LineBuffer& buffer, int expectedCode, std::string& reply)
+{
+	if (receiveReply(s, buffer, reply) != SUCCESS)
+		return FAILURE;
+
+	std::istringstream iss{ reply };
+	int replyCode{ 0 };
+	iss >> replyCode;
+
+	return (replyCode == expectedCode) ? SUCCESS : FAILURE;
+}
+
+// Sends a command and receives its reply
+inline int exchange(SOCKET s, LineBuffer& buffer, const std::string& request, int expectedCode, std::string& reply)
+{
+	std::string line{ request + CRLF };
+	if (send(s, line.c_str(), (int)line.length(), 0) == SOCKET_ERROR)
+	{
+		Log{ LOG_LEVEL::ERR } << "WINSOCK: send() failed with error: " << WSAGetLastError();
+		reply.clear();
+		return FAILURE;
+	}
+
+	return readReply(s, buffer, expectedCode, reply);
+}
+
+// Port from "229 Entering Extended Passive Mode (|||port|)"
+inline int parsePassivePort(const std::string& reply, unsigned short& port)
+{
+	std::size_t start{ reply.find("(|||") };
+	if (start == std::string::npos)
+		return FAILURE;
+
+	const char* first{ reply.data() + start + 4 };
+	const char* last{ reply.data() + reply.length() };
+	unsigned int value{ 0 };
+	auto [end, ec] = std::from_chars(first, last, value);
+	if (ec != std::errc{} || value == 0 || value > 65535 || last - end < 2 || end[0] != '|' || end[1] != ')')
+		return FAILURE;
+
+	port = (unsigned short)value;
+	return SUCCESS;
+}
+
+// Size from "213 <size>"
+inline int parseFileSize(const std::string& reply, long long& size)
+{
+	if (reply.length() < 5)
+		return FAILURE;
+
+	const char* last{ reply.data() + reply.length() };
+	auto [end, ec] = std::from_chars(reply.data() + 4, last, size);
+	if (ec != std::errc{} || size < 0 || (end != last && *end != '\r' && *end != ' '))
+		return FAILURE;
+
+	return SUCCESS;
+}
+
+// Directory from '257 "C:\dir" is the current working directory.',
+// a quote inside the name is doubled
+inline int parsePathname(const std::string& reply, std::string& pathname)
+{
+	std::size_t start{ reply.find('"') };
+	if (start == std::string::npos)
+		return FAILURE;
+
+	pathname.clear();
+	for (std::size_t i = start + 1; i < reply.length(); ++i)
+	{
+		if (reply[i] != '"')
+			pathname += reply[i];
+		else if (i + 1 < reply.length() && reply[i + 1] == '"')
+			pathname += reply[++i];
+		else
+			return SUCCESS;
+	}
+	return FAILURE;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <atomic>
+
+/*
+	Counts the socket and file calls made by the transfer code. Only a
+	program built with FTP_COUNT_SYSCALLS counts, the benchmarks use it
+	to report calls per megabyte; everywhere else COUNT_SYSCALL() is
+	nothing and costs nothing.
+*/
+#ifdef FTP_COUNT_SYSCALLS
+
+inline std::atomic<unsigned long long> syscallCount{ 0 };
+
+#define COUNT_SYSCALL() syscallCount.fetch_add(1, std::memory_order_relaxed)
+
+inline unsigned long long syscallsMade() { return syscallCount.load(std::memory_order_relaxed); }
+
+#else
+
+#define COUNT_SYSCALL() ((void)0)
+
+inline unsigned long long syscallsMade() { return 0; }
+
+#endif
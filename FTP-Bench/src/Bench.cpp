@@ -0,0 +1,1155 @@
+#include "Bench.h"
+
+#include <iostream>
+#include <fstream>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+
+/***********************************************
+// Helper Functions
+***********************************************/
+
+// Seconds on a monotonic clock
+double now()
+{
+	return std::chrono::duration<double>{ std::chrono::steady_clock::now().time_since_epoch() }.count();
+}
+
+double filetimeSeconds(const FILETIME& kernel, const FILETIME& user)
+{
+	unsigned long long k{ ((unsigned long long)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime };
+	unsigned long long u{ ((unsigned long long)user.dwHighDateTime << 32) | user.dwLowDateTime };
+	return (k + u) / 1e7;
+}
+
+// Kernel and user time of every thread of this process
+double processSeconds()
+{
+	FILETIME creation{}, exit{}, kernel{}, user{};
+	if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+		return 0.0;
+	return filetimeSeconds(kernel, user);
+}
+
+// Kernel and user time of the calling thread
+double threadSeconds()
+{
+	FILETIME creation{}, exit{}, kernel{}, user{};
+	if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+		return 0.0;
+	return filetimeSeconds(kernel, user);
+}
+
+unsigned long long splitMix(unsigned long long x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+// Bytes that do not compress
+void fillRandom(char* data, std::size_t length, unsigned long long seed)
+{
+	for (std::size_t i = 0; i < length; ++i)
+		data[i] = (char)(splitMix(seed + i / 8) >> (i % 8 * 8));
+}
+
+// Words in random order, about as compressible as a log file
+void fillText(char* data, std::size_t length, unsigned long long seed)
+{
+	static const char* words[]{ "the ", "server ", "sent ", "file ", "data ", "to ", "a ", "client ",
+		"in ", "block ", "mode ", "and ", "closed ", "connection ", "226 ", "transfer\r\n" };
+
+	for (std::size_t i = 0, n = 0; i < length; ++n)
+	{
+		const char* word{ words[splitMix(seed + n) % (sizeof(words) / sizeof(words[0]))] };
+		for (; *word && i < length; ++word, ++i)
+			data[i] = *word;
+	}
+}
+
+// Sends the whole buffer without counting the calls
+int sendRaw(SOCKET s, const char* buf, long long length)
+{
+	for (long long sent = 0; sent < length; )
+	{
+		int iResult = send(s, buf + sent, (int)(std::min)(length - sent, (long long)INT_MAX), 0);
+		if (iResult == SOCKET_ERROR)
+			return FAILURE;
+		sent += iResult;
+	}
+	return SUCCESS;
+}
+
+// Frames data as blocks, the last one flagged EOF if last is set
+void frameBlocks(std::vector<char>& frame, const char* data, long long length, bool last)
+{
+	frame.clear();
+	for (long long position = 0; position < length || (last && length == 0); )
+	{
+		int count{ (int)(std::min)(length - position, (long long)BLOCK_MAX_DATA) };
+		bool eof{ last && position + count == length };
+
+		frame.push_back((char)(eof ? BLOCK_EOF : 0));
+		frame.push_back((char)(count >> 8));
+		frame.push_back((char)(count & 0xFF));
+		frame.insert(frame.end(), data + position, data + position + count);
+
+		position += count;
+		if (eof)
+			break;
+	}
+}
+
+// Writes data to a temporary file, it stays in the file cache
+int writeFile(const std::string& path, const char* data, std::size_t length)
+{
+	HANDLE hFile = CreateFileA(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		std::cerr << "CreateFileA() failed with error: " << GetLastError() << '\n';
+		return FAILURE;
+	}
+
+	for (std::size_t written = 0; written < length; )
+	{
+		DWORD chunk{ (DWORD)(std::min)(length - written, (std::size_t)PATTERN_SIZE) }, bytesWritten{ 0 };
+		if (!WriteFile(hFile, data + written, chunk, &bytesWritten, NULL) || bytesWritten != chunk)
+		{
+			std::cerr << "WriteFile() failed with error: " << GetLastError() << '\n';
+			CloseHandle(hFile);
+			return FAILURE;
+		}
+		written += chunk;
+	}
+
+	CloseHandle(hFile);
+	return SUCCESS;
+}
+
+std::string sizeText(long long size)
+{
+	if (size >= 1024LL * 1024 * 1024 && size % (1024LL * 1024 * 1024) == 0)
+		return std::to_string(size / (1024LL * 1024 * 1024)) + " GiB";
+	if (size >= 1024 * 1024 && size % (1024 * 1024) == 0)
+		return std::to_string(size / (1024 * 1024)) + " MiB";
+	if (size >= 1024 && size % 1024 == 0)
+		return std::to_string(size / 1024) + " KiB";
+	return std::to_string(size) + " B";
+}
+
+std::string jsonString(const std::string& text)
+{
+	std::string quoted{ "\"" };
+	for (char c : text)
+	{
+		if (c == '"' || c == '\\')
+			quoted += '\\';
+		if ((unsigned char)c >= 0x20)
+			quoted += c;
+	}
+	return quoted + '"';
+}
+
+/***********************************************
+	Constructor
+***********************************************/
+Bench::Bench(const BenchConfig& config) :
+	m_config{ config },
+	wsaData{ NULL },
+	m_directory{},
+	m_pattern(PATTERN_SIZE)
+{
+	fillRandom(m_pattern.data(), m_pattern.size(), 1);
+}
+
+/***********************************************
+	Destructor
+***********************************************/
+Bench::~Bench()
+{
+	for (const std::string& path : m_files)
+		DeleteFileA(path.c_str());
+	WSACleanup();
+}
+
+/***********************************************
+	Setup
+***********************************************/
+int Bench::init()
+{
+	if (InitializeWinsock() != SUCCESS) return FAILURE;
+
+	m_directory = m_config.directory;
+	if (m_directory.empty())
+	{
+		char tempPath[MAX_PATH + 1]{};
+		if (GetTempPathA(sizeof(tempPath), tempPath) == 0)
+		{
+			std::cerr << "GetTempPathA() failed with error: " << GetLastError() << '\n';
+			return FAILURE;
+		}
+		m_directory = tempPath;
+	}
+	if (m_directory.back() != '\\' && m_directory.back() != '/')
+		m_directory += '\\';
+
+	return SUCCESS;
+}
+
+int Bench::InitializeWinsock()
+{
+	int iResult = WSAStartup(WINSOCK_VER, &wsaData);
+	if (iResult != SUCCESS)
+	{
+		std::cerr << "WINSOCK: WSAStartup() failed with error: " << iResult << '\n';
+		return FAILURE;
+	}
+	return SUCCESS;
+}
+
+// Two connected sockets over loopback, Winsock has no socketpair()
+int Bench::socketPair(SOCKET& sender, SOCKET& receiver)
+{
+	sender = receiver = INVALID_SOCKET;
+
+	SOCKET ListenSocket = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (ListenSocket == INVALID_SOCKET)
+	{
+		std::cerr << "WINSOCK: socket() failed with error: " << WSAGetLastError() << '\n';
+		return FAILURE;
+	}
+
+	sockaddr_in address{};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0;
+	int addressLength{ sizeof(address) };
+
+	if (bind(ListenSocket, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR ||
+		listen(ListenSocket, 1) == SOCKET_ERROR ||
+		getsockname(ListenSocket, (sockaddr*)&address, &addressLength) == SOCKET_ERROR)
+	{
+		std::cerr << "WINSOCK: listen() failed with error: " << WSAGetLastError() << '\n';
+		closesocket(ListenSocket);
+		return FAILURE;
+	}
+
+	sender = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sender == INVALID_SOCKET || connect(sender, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR)
+	{
+		std::cerr << "WINSOCK: connect() failed with error: " << WSAGetLastError() << '\n';
+		if (sender != INVALID_SOCKET)
+			closesocket(sender);
+		closesocket(ListenSocket);
+		sender = INVALID_SOCKET;
+		return FAILURE;
+	}
+
+	receiver = accept(ListenSocket, NULL, NULL);
+	closesocket(ListenSocket);
+	if (receiver == INVALID_SOCKET)
+	{
+		std::cerr << "WINSOCK: accept() failed with error: " << WSAGetLastError() << '\n';
+		closesocket(sender);
+		sender = INVALID_SOCKET;
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+// Writes a source file once per size, as a temporary file it stays in the file cache
+std::string Bench::sourceFile(long long size)
+{
+	std::string path{ m_directory + "ftp-bench-" + std::to_string(size) + ".dat" };
+	if (std::find(m_files.begin(), m_files.end(), path) != m_files.end())
+		return path;
+
+	HANDLE hFile = CreateFileA(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		std::cerr << "CreateFileA() failed with error: " << GetLastError() << '\n';
+		return {};
+	}
+	m_files.push_back(path);
+
+	for (long long written = 0; written < size; )
+	{
+		DWORD chunk{ (DWORD)(std::min)(size - written, (long long)m_pattern.size()) }, bytesWritten{ 0 };
+		if (!WriteFile(hFile, m_pattern.data(), chunk, &bytesWritten, NULL) || bytesWritten != chunk)
+		{
+			std::cerr << "WriteFile() failed with error: " << GetLastError() << '\n';
+			CloseHandle(hFile);
+			return {};
+		}
+		written += chunk;
+	}
+
+	CloseHandle(hFile);
+	return path;
+}
+
+/***********************************************
+	Strategies
+***********************************************/
+int Bench::sendWith(STRATEGY strategy, SOCKET s, HANDLE hFile, long long size, TransferBufferPool& pool, IocpTransfer& iocp)
+{
+	switch (strategy)
+	{
+	case STRATEGY::LOOP8:
+	{
+		LARGE_INTEGER position{};
+		if (!SetFilePointerEx(hFile, position, NULL, FILE_BEGIN))
+			return FAILURE;
+
+		char buf[LOOP8_SIZE];
+		for (long long sent = 0; sent < size; )
+		{
+			DWORD bytesRead{ 0 };
+			COUNT_SYSCALL();
+			if (!ReadFile(hFile, buf, LOOP8_SIZE, &bytesRead, NULL) || bytesRead == 0)
+				return FAILURE;
+			if (sendAll(s, buf, (int)bytesRead) != SUCCESS)
+				return FAILURE;
+			sent += bytesRead;
+		}
+		return SUCCESS;
+	}
+	case STRATEGY::COPY:
+	{
+		TransferBufferPool::Buffer xferBuf{ pool.acquire() };
+		if (!xferBuf)
+			return FAILURE;
+
+		for (long long sent = 0; sent < size; )
+		{
+			OVERLAPPED position{};
+			position.Offset = (DWORD)(sent & 0xFFFFFFFF);
+			position.OffsetHigh = (DWORD)(sent >> 32);
+
+			DWORD bytesRead{ 0 };
+			DWORD toRead{ (DWORD)(std::min)(size - sent, (long long)xferBuf.size()) };
+			COUNT_SYSCALL();
+			if (!ReadFile(hFile, xferBuf.data(), toRead, &bytesRead, &position) || bytesRead == 0)
+				return FAILURE;
+			if (sendAll(s, xferBuf.data(), (int)bytesRead) != SUCCESS)
+				return FAILURE;
+			sent += bytesRead;
+		}
+		return SUCCESS;
+	}
+	case STRATEGY::MAPPED:
+	{
+		HANDLE hMapping = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (hMapping == NULL)
+			return FAILURE;
+
+		int iResult{ SUCCESS };
+		for (long long offset = 0; offset < size && iResult == SUCCESS; offset += RECV_VIEW_SIZE)
+		{
+			long long length{ (std::min)(RECV_VIEW_SIZE, size - offset) };
+			COUNT_SYSCALL();
+			const char* view = static_cast<const char*>(MapViewOfFile(hMapping, FILE_MAP_READ,
+				(DWORD)(offset >> 32), (DWORD)(offset & 0xFFFFFFFF), (SIZE_T)length));
+			if (view == NULL)
+			{
+				iResult = FAILURE;
+				break;
+			}
+			iResult = sendAll(s, view, (int)length);
+			UnmapViewOfFile(view);
+		}
+
+		CloseHandle(hMapping);
+		return iResult;
+	}
+	case STRATEGY::TRANSMIT:
+	{
+		OVERLAPPED overlapped{};
+		overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+		if (overlapped.hEvent == NULL)
+			return FAILURE;
+
+		int iResult{ SUCCESS };
+		for (long long offset = 0; offset < size; )
+		{
+			DWORD chunk{ (DWORD)(std::min)(size - offset, TRANSMIT_CHUNK_SIZE) };
+			overlapped.Offset = (DWORD)(offset & 0xFFFFFFFF);
+			overlapped.OffsetHigh = (DWORD)(offset >> 32);
+			ResetEvent(overlapped.hEvent);
+
+			DWORD sent{ 0 }, flags{ 0 };
+			COUNT_SYSCALL();
+			if ((!TransmitFile(s, hFile, chunk, 0, &overlapped, NULL, 0) && WSAGetLastError() != WSA_IO_PENDING) ||
+				!WSAGetOverlappedResult(s, &overlapped, &sent, TRUE, &flags))
+			{
+				std::cerr << "WINSOCK: TransmitFile() failed with error: " << WSAGetLastError() << '\n';
+				iResult = FAILURE;
+				break;
+			}
+			offset += sent;
+		}
+
+		CloseHandle(overlapped.hEvent);
+		return iResult;
+	}
+	case STRATEGY::IOCP:
+	{
+		bool started{ false };
+		int iResult = iocp.sendFile(s, hFile, 0, size, started);
+		return started ? iResult : FAILURE;
+	}
+	case STRATEGY::BLOCKS:
+		return sendFileBlocks(s, hFile, 0, size, pool);
+	default:
+		return FAILURE;
+	}
+}
+
+int Bench::recvWith(STRATEGY strategy, SOCKET s, HANDLE hFile, long long size, TransferBufferPool& pool, IocpTransfer& iocp)
+{
+	long long received{ 0 };
+
+	switch (strategy)
+	{
+	case STRATEGY::LOOP8:
+	{
+		LARGE_INTEGER position{};
+		if (!SetFilePointerEx(hFile, position, NULL, FILE_BEGIN))
+			return FAILURE;
+
+		char buf[LOOP8_SIZE];
+		while (received < size)
+		{
+			COUNT_SYSCALL();
+			int iResult = recv(s, buf, (int)(std::min)(size - received, (long long)LOOP8_SIZE), 0);
+			if (iResult <= 0)
+				return FAILURE;
+
+			DWORD written{ 0 };
+			COUNT_SYSCALL();
+			if (!WriteFile(hFile, buf, (DWORD)iResult, &written, NULL) || written != (DWORD)iResult)
+				return FAILURE;
+			received += iResult;
+		}
+		return SUCCESS;
+	}
+	case STRATEGY::COPY:
+		return recvCopy(s, hFile, 0, size, received, pool);
+	case STRATEGY::MAPPED:
+	{
+		if (!setFileSize(hFile, size))
+			return FAILURE;
+		int iResult = recvMapped(s, hFile, 0, size, received);
+		return (iResult == SUCCESS && received == size) ? SUCCESS : FAILURE;
+	}
+	case STRATEGY::AUTO:
+		return recvToFile(s, hFile, 0, size, pool);
+	case STRATEGY::IOCP:
+	{
+		bool started{ false };
+		int iResult = iocp.recvFile(s, hFile, 0, size, started);
+		return started ? iResult : FAILURE;
+	}
+	case STRATEGY::BLOCKS:
+	{
+		int iResult = recvFileBlocks(s, hFile, 0, pool, received);
+		return (iResult == SUCCESS && received == size) ? SUCCESS : FAILURE;
+	}
+	default:
+		return FAILURE;
+	}
+}
+
+// Receives and throws away up to expected bytes, returns how many came
+long long Bench::drain(SOCKET s, long long expected)
+{
+	std::vector<char> buf(DRAIN_BUFLEN);
+	long long received{ 0 };
+	while (received < expected)
+	{
+		int iResult = recv(s, buf.data(), (int)(std::min)(expected - received, (long long)buf.size()), 0);
+		if (iResult <= 0)
+			break;
+		received += iResult;
+	}
+	return received;
+}
+
+// Sends files of the pattern, as blocks that end in EOF if blocks is set
+int Bench::feed(SOCKET s, bool blocks, long long size, unsigned int files)
+{
+	if (!blocks)
+	{
+		for (long long remaining = size * files; remaining > 0; )
+		{
+			long long chunk{ (std::min)(remaining, (long long)m_pattern.size()) };
+			if (sendRaw(s, m_pattern.data(), chunk) != SUCCESS)
+				return FAILURE;
+			remaining -= chunk;
+		}
+		return SUCCESS;
+	}
+
+	// Whole pattern buffers are framed once, the tail of each file on its own
+	std::vector<char> body{}, tail{};
+	frameBlocks(body, m_pattern.data(), (long long)m_pattern.size(), false);
+	frameBlocks(tail, m_pattern.data(), size % (long long)m_pattern.size(), true);
+
+	for (unsigned int f = 0; f < files; ++f)
+	{
+		for (long long i = 0; i < size / (long long)m_pattern.size(); ++i)
+		{
+			if (sendRaw(s, body.data(), (long long)body.size()) != SUCCESS)
+				return FAILURE;
+		}
+		if (sendRaw(s, tail.data(), (long long)tail.size()) != SUCCESS)
+			return FAILURE;
+	}
+	return SUCCESS;
+}
+
+/***********************************************
+	Measurements
+***********************************************/
+int Bench::sendStream(STRATEGY strategy, const std::string& path, long long size, unsigned int iterations,
+	TransferBufferPool& pool, IocpTransfer& iocp)
+{
+	HANDLE hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		std::cerr << "CreateFileA() failed with error: " << GetLastError() << '\n';
+		return FAILURE;
+	}
+
+	// A socket joins a completion port for good, so IOCP gets a new
+	// connection per file like a server data connection does. The others
+	// reuse one, small files then measure the copy and not the connect.
+	unsigned int filesPerConnection{ (strategy == STRATEGY::IOCP) ? 1 : iterations };
+
+	int iResult{ SUCCESS };
+	for (unsigned int done = 0; done < iterations && iResult == SUCCESS; done += filesPerConnection)
+	{
+		SOCKET sender{ INVALID_SOCKET }, receiver{ INVALID_SOCKET };
+		if (socketPair(sender, receiver) != SUCCESS)
+		{
+			iResult = FAILURE;
+			break;
+		}
+
+		long long expected{ size * filesPerConnection }, drained{ 0 };
+		std::thread drainer{ [this, receiver, expected, &drained] { drained = drain(receiver, expected); } };
+
+		for (unsigned int f = 0; f < filesPerConnection && iResult == SUCCESS; ++f)
+			iResult = sendWith(strategy, sender, hFile, size, pool, iocp);
+
+		// The drainer stops at the end of the stream if the send failed
+		shutdown(sender, SD_SEND);
+		drainer.join();
+		closesocket(sender);
+		closesocket(receiver);
+
+		if (drained != expected)
+			iResult = FAILURE;
+	}
+
+	CloseHandle(hFile);
+	return iResult;
+}
+
+int Bench::recvStream(STRATEGY strategy, long long size, unsigned int iterations, TransferBufferPool& pool, IocpTransfer& iocp)
+{
+	// Every stream writes a file of its own, IOCP reopens it so it has to be shared
+	std::string path{ m_directory + "ftp-bench-recv-" + std::to_string(GetCurrentThreadId()) + ".dat" };
+	HANDLE hFile = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		std::cerr << "CreateFileA() failed with error: " << GetLastError() << '\n';
+		return FAILURE;
+	}
+
+	unsigned int filesPerConnection{ (strategy == STRATEGY::IOCP) ? 1 : iterations };
+
+	int iResult{ SUCCESS };
+	for (unsigned int done = 0; done < iterations && iResult == SUCCESS; done += filesPerConnection)
+	{
+		SOCKET sender{ INVALID_SOCKET }, receiver{ INVALID_SOCKET };
+		if (socketPair(sender, receiver) != SUCCESS)
+		{
+			iResult = FAILURE;
+			break;
+		}
+
+		std::thread feeder{ [this, sender, strategy, size, filesPerConnection]
+			{
+				feed(sender, strategy == STRATEGY::BLOCKS, size, filesPerConnection);
+				shutdown(sender, SD_SEND);
+			} };
+
+		for (unsigned int f = 0; f < filesPerConnection && iResult == SUCCESS; ++f)
+			iResult = recvWith(strategy, receiver, hFile, size, pool, iocp);
+
+		// Closing first fails a feeder that is still sending
+		closesocket(receiver);
+		feeder.join();
+		closesocket(sender);
+	}
+
+	CloseHandle(hFile);
+	DeleteFileA(path.c_str());
+	return iResult;
+}
+
+Sample Bench::measure(DIRECTION direction, STRATEGY strategy, const std::string& path, long long size,
+	std::size_t chunk, unsigned int streams)
+{
+	Sample sample{};
+
+	TransferBufferPool pool{ chunk };
+	IocpTransfer iocp{ pool };
+	if (strategy == STRATEGY::IOCP && iocp.start() != SUCCESS)
+	{
+		std::cerr << "BENCH: I/O completion ports unavailable.\n";
+		return sample;
+	}
+
+	// Small files are moved repeatedly so that a sample takes long enough to time
+	long long target{ (strategy == STRATEGY::LOOP8) ? LOOP8_MAX_SIZE : MIN_SAMPLE_BYTES };
+	long long files{ target / (std::max)(size, 1LL) / streams };
+	unsigned int iterations{ (unsigned int)(std::min)((long long)MAX_ITERATIONS, (std::max)(1LL, files)) };
+
+	std::vector<int> results(streams, FAILURE);
+	auto runStream = [&](unsigned int i)
+	{
+		results[i] = (direction == DIRECTION::SEND) ?
+			sendStream(strategy, path, size, iterations, pool, iocp) :
+			recvStream(strategy, size, iterations, pool, iocp);
+	};
+
+	unsigned long long calls{ syscallsMade() };
+	double cpuSeconds{ processSeconds() };
+	double started{ now() };
+
+	// The calling thread runs the first stream
+	std::vector<std::thread> threads{};
+	for (unsigned int i = 1; i < streams; ++i)
+		threads.emplace_back(runStream, i);
+	runStream(0);
+	for (auto& thread : threads)
+		thread.join();
+
+	sample.seconds = now() - started;
+	sample.cpuSeconds = processSeconds() - cpuSeconds;
+	sample.calls = syscallsMade() - calls;
+	sample.bytes = size * iterations * streams;
+	sample.ok = std::all_of(results.begin(), results.end(), [](int iResult) { return iResult == SUCCESS; });
+
+	iocp.stop();
+	return sample;
+}
+
+// Takes the median of the repeated samples, a failed sample fails the measurement
+void Bench::measureTransfer(const char* suite, DIRECTION direction, STRATEGY strategy, const std::string& path,
+	long long size, std::size_t chunk, unsigned int streams)
+{
+	std::string name{ std::string{ (direction == DIRECTION::SEND) ? "send " : "recv " } + strategyName(strategy) };
+
+	std::vector<Sample> samples{};
+	for (unsigned int i = 0; i < (std::max)(m_config.repeat, 1u); ++i)
+	{
+		Sample sample{ measure(direction, strategy, path, size, chunk, streams) };
+		if (!sample.ok)
+		{
+			std::cerr << "BENCH: " << name << ' ' << sizeText(size) << " failed.\n";
+			return;
+		}
+		samples.push_back(sample);
+	}
+	std::sort(samples.begin(), samples.end(), [](const Sample& a, const Sample& b) { return a.seconds < b.seconds; });
+	const Sample& median{ samples[samples.size() / 2] };
+
+	BenchResult result{};
+	result.suite = suite;
+	result.name = name;
+	result.size = size;
+	result.chunk = usesChunk(strategy) ? TransferBufferPool{ chunk }.chunkSize() : 0;
+	result.streams = streams;
+	result.mbPerSecond = median.bytes / 1e6 / median.seconds;
+	result.cpuPerGB = median.cpuSeconds / (median.bytes / 1e9);
+	result.callsPerMB = median.calls / (median.bytes / 1e6);
+	record(result);
+}
+
+/***********************************************
+	Suites
+***********************************************/
+// Every strategy at every file size, the buffered ones at every chunk size
+void Bench::runTransfer()
+{
+	std::cout << "\nTransfer strategies, one connection\n";
+
+	for (long long size : m_config.sizes)
+	{
+		std::string path{ sourceFile(size) };
+		if (path.empty())
+			return;
+
+		for (DIRECTION direction : { DIRECTION::SEND, DIRECTION::RECV })
+		{
+			for (STRATEGY strategy : (direction == DIRECTION::SEND) ? m_config.send : m_config.recv)
+			{
+				if (strategy == STRATEGY::LOOP8 && size > LOOP8_MAX_SIZE)
+					continue;
+
+				if (!usesChunk(strategy))
+				{
+					measureTransfer("transfer", direction, strategy, path, size, DEFAULT_TRANSFER_CHUNK, 1);
+					continue;
+				}
+				for (std::size_t chunk : m_config.chunks)
+					measureTransfer("transfer", direction, strategy, path, size, chunk, 1);
+			}
+		}
+	}
+}
+
+// Blocking transfers, one thread each, against the shared completion port
+void Bench::runConcurrent()
+{
+	std::cout << "\nConcurrent transfers of " << sizeText(m_config.streamSize) << '\n';
+
+	std::string path{ sourceFile(m_config.streamSize) };
+	if (path.empty())
+		return;
+
+	for (unsigned int streams : m_config.concurrency)
+	{
+		measureTransfer("concurrency", DIRECTION::SEND, STRATEGY::TRANSMIT, path, m_config.streamSize, DEFAULT_TRANSFER_CHUNK, streams);
+		measureTransfer("concurrency", DIRECTION::SEND, STRATEGY::IOCP, path, m_config.streamSize, DEFAULT_TRANSFER_CHUNK, streams);
+		measureTransfer("concurrency", DIRECTION::RECV, STRATEGY::AUTO, path, m_config.streamSize, DEFAULT_TRANSFER_CHUNK, streams);
+		measureTransfer("concurrency", DIRECTION::RECV, STRATEGY::IOCP, path, m_config.streamSize, DEFAULT_TRANSFER_CHUNK, streams);
+	}
+}
+
+// CPU cost of every MODE Z level, the Compression API called directly so
+// the adaptive choice of the transfer code does not store the chunks
+void Bench::runCompress()
+{
+	std::cout << "\nCompression levels, " << sizeText(COMPRESS_SAMPLE_SIZE) << " in " << sizeText(COMPRESS_CHUNK_SIZE) << " chunks\n";
+
+	static const char* algorithms[]{ "", "xpress", "xpress-huff", "mszip", "lzms" };
+
+	std::vector<char> raw(COMPRESS_SAMPLE_SIZE);
+	std::vector<char> output(COMPRESS_CHUNK_SIZE);
+	std::vector<std::vector<char>> compressed(COMPRESS_SAMPLE_SIZE / COMPRESS_CHUNK_SIZE, std::vector<char>(COMPRESS_BOUND));
+	std::vector<SIZE_T> compressedSizes(compressed.size());
+
+	for (const char* kind : { "text", "random" })
+	{
+		if (std::strcmp(kind, "text") == 0)
+			fillText(raw.data(), raw.size(), 7);
+		else
+			fillRandom(raw.data(), raw.size(), 7);
+
+		for (int level = COMPRESS_LEVEL_MIN; level <= COMPRESS_LEVEL_MAX; ++level)
+		{
+			COMPRESSOR_HANDLE hCompressor{ NULL };
+			DECOMPRESSOR_HANDLE hDecompressor{ NULL };
+			if (!CreateCompressor(compressionAlgorithm(level), NULL, &hCompressor) ||
+				!CreateDecompressor(compressionAlgorithm(level), NULL, &hDecompressor))
+			{
+				std::cerr << "CreateCompressor() failed with error: " << GetLastError() << '\n';
+				if (hCompressor != NULL)
+					CloseCompressor(hCompressor);
+				continue;
+			}
+
+			bool ok{ true };
+			SIZE_T totalCompressed{ 0 };
+			double cpuSeconds{ threadSeconds() }, started{ now() };
+			for (std::size_t i = 0; i < compressed.size() && ok; ++i)
+			{
+				ok = Compress(hCompressor, raw.data() + i * COMPRESS_CHUNK_SIZE, COMPRESS_CHUNK_SIZE,
+					compressed[i].data(), compressed[i].size(), &compressedSizes[i]) != FALSE;
+				totalCompressed += compressedSizes[i];
+			}
+			double compressSeconds{ now() - started }, compressCpu{ threadSeconds() - cpuSeconds };
+
+			cpuSeconds = threadSeconds();
+			started = now();
+			for (std::size_t i = 0; i < compressed.size() && ok; ++i)
+			{
+				SIZE_T decompressedSize{ 0 };
+				ok = Decompress(hDecompressor, compressed[i].data(), compressedSizes[i], output.data(), output.size(),
+					&decompressedSize) && decompressedSize == COMPRESS_CHUNK_SIZE;
+			}
+			double decompressSeconds{ now() - started }, decompressCpu{ threadSeconds() - cpuSeconds };
+
+			CloseCompressor(hCompressor);
+			CloseDecompressor(hDecompressor);
+
+			if (!ok)
+			{
+				std::cerr << "BENCH: Level " << level << " failed with error: " << GetLastError() << '\n';
+				continue;
+			}
+
+			BenchResult result{};
+			result.suite = "compress";
+			result.size = COMPRESS_SAMPLE_SIZE;
+			result.chunk = COMPRESS_CHUNK_SIZE;
+			result.ratio = (double)totalCompressed / COMPRESS_SAMPLE_SIZE;
+
+			result.name = std::string{ "compress " } + algorithms[level] + ' ' + kind;
+			result.mbPerSecond = COMPRESS_SAMPLE_SIZE / 1e6 / compressSeconds;
+			result.cpuPerGB = compressCpu / (COMPRESS_SAMPLE_SIZE / 1e9);
+			record(result);
+
+			result.name = std::string{ "decompress " } + algorithms[level] + ' ' + kind;
+			result.mbPerSecond = COMPRESS_SAMPLE_SIZE / 1e6 / decompressSeconds;
+			result.cpuPerGB = decompressCpu / (COMPRESS_SAMPLE_SIZE / 1e9);
+			record(result);
+		}
+	}
+}
+
+// Control connection costs: decoding a command and framing pipelined lines
+void Bench::runParse()
+{
+	std::cout << "\nCommand parsing, " << PARSE_ITERATIONS << " commands\n";
+
+	static const char* lines[]{ "RETR pub/release-2.1.tar.gz", "STOR upload.bin", "CWD /pub/mirrors", "LIST",
+		"EPSV", "SIZE image.iso", "REST 1048576", "RANG 0 65535", "MODE B", "SITE STATS", "NOOP", "quit" };
+	constexpr std::size_t lineCount{ sizeof(lines) / sizeof(lines[0]) };
+
+	std::vector<std::string_view> views(lines, lines + lineCount);
+	std::size_t known{ 0 };
+	double started{ now() };
+	for (unsigned int i = 0; i < PARSE_ITERATIONS; ++i)
+	{
+		CommandLine command{ splitCommand(views[i % lineCount]) };
+		if (commandTable.find(command.verb) != COMMAND::INVALID)
+			known += command.argument.size() + 1;
+	}
+	double seconds{ now() - started };
+
+	BenchResult result{};
+	result.suite = "parse";
+	result.name = "decode";
+	result.nsPerOp = seconds * 1e9 / PARSE_ITERATIONS;
+	record(result);
+
+	// The lines arrive pipelined, as much as one recv() takes at a time
+	std::string stream{};
+	for (std::size_t i = 0; i < 1000; ++i)
+		stream += std::string{ lines[i % lineCount] } + CRLF;
+
+	LineBuffer input{};
+	std::string line{};
+	std::size_t framed{ 0 };
+	started = now();
+	for (unsigned int round = 0; round < PARSE_ITERATIONS / 1000; ++round)
+	{
+		for (std::size_t position = 0; position < stream.size(); position += LINE_RECV_SIZE)
+		{
+			input.append(stream.data() + position, (std::min)(stream.size() - position, (std::size_t)LINE_RECV_SIZE));
+			while (input.nextLine(line))
+				++framed;
+		}
+	}
+	seconds = now() - started;
+
+	result.name = "frame";
+	result.nsPerOp = seconds * 1e9 / (std::max)(framed, std::size_t{ 1 });
+	record(result);
+
+	// Keeps the loops from being optimized away
+	if (known == 0 || framed == 0)
+		std::cerr << "BENCH: Nothing was parsed.\n";
+}
+
+void Bench::runHash()
+{
+	std::cout << "\nHashing, " << sizeText(HASH_SAMPLE_SIZE) << " in " << sizeText(HASH_PIECE_SIZE) << " pieces\n";
+
+	std::vector<char> data(HASH_PIECE_SIZE);
+	fillRandom(data.data(), data.size(), 11);
+
+	// Each algorithm alone, then the pair a transfer computes by default
+	const unsigned int sets[]{ hashBit(HASH_ALGORITHM::CRC32C), hashBit(HASH_ALGORITHM::XXH64), hashBit(HASH_ALGORITHM::SHA256),
+		hashBit(HASH_ALGORITHM::CRC32C) | hashBit(HASH_ALGORITHM::SHA256) };
+
+	for (unsigned int algorithms : sets)
+	{
+		std::string name{};
+		for (int i = 0; i < HASH_ALGORITHMS; ++i)
+		{
+			if (algorithms & hashBit((HASH_ALGORITHM)i))
+				name += (name.empty() ? "" : "+") + std::string{ hashName((HASH_ALGORITHM)i) };
+		}
+
+		std::vector<double> seconds{};
+		std::vector<double> cpuSeconds{};
+		std::string digest{};
+		for (unsigned int sample = 0; sample < (std::max)(m_config.repeat, 1u); ++sample)
+		{
+			ContentHasher hasher{ algorithms };
+			double cpuStarted{ threadSeconds() }, started{ now() };
+			for (long long hashed = 0; hashed < HASH_SAMPLE_SIZE; hashed += HASH_PIECE_SIZE)
+				hasher.update(data.data(), data.size());
+
+			// The digest is part of the cost, it also keeps the loop from being optimized away
+			for (int i = 0; i < HASH_ALGORITHMS; ++i)
+			{
+				if (algorithms & hashBit((HASH_ALGORITHM)i))
+					digest += hasher.digest((HASH_ALGORITHM)i);
+			}
+			seconds.push_back(now() - started);
+			cpuSeconds.push_back(threadSeconds() - cpuStarted);
+		}
+
+		if (digest.empty())
+		{
+			std::cerr << "BENCH: " << name << " produced no digest.\n";
+			continue;
+		}
+
+		std::sort(seconds.begin(), seconds.end());
+		std::sort(cpuSeconds.begin(), cpuSeconds.end());
+
+		BenchResult result{};
+		result.suite = "hash";
+		result.name = name;
+		result.size = HASH_SAMPLE_SIZE;
+		result.chunk = HASH_PIECE_SIZE;
+		result.mbPerSecond = HASH_SAMPLE_SIZE / 1e6 / seconds[seconds.size() / 2];
+		result.cpuPerGB = cpuSeconds[cpuSeconds.size() / 2] / (HASH_SAMPLE_SIZE / 1e9);
+		record(result);
+	}
+}
+
+// Signing an old copy on one core and on all of them, then delta
+// transfers of versions changed by more and more over loopback. The
+// signature is made once per old copy, so the transfers start from it.
+void Bench::runDelta()
+{
+	unsigned int cores{ (std::max)(std::thread::hardware_concurrency(), 1u) };
+	std::cout << "\nDelta transfers, " << sizeText(DELTA_SAMPLE_SIZE) << " old copy, " << cores << " cores\n";
+
+	std::string oldPath{ m_directory + "ftp-bench-delta-old.dat" };
+	std::string newPath{ m_directory + "ftp-bench-delta-new.dat" };
+	std::string outPath{ m_directory + "ftp-bench-delta-out.dat" };
+	m_files.insert(m_files.end(), { oldPath, newPath, outPath });
+
+	std::vector<char> data(DELTA_SAMPLE_SIZE);
+	fillRandom(data.data(), data.size(), 13);
+	if (writeFile(oldPath, data.data(), data.size()) != SUCCESS)
+		return;
+
+	HANDLE hOld = CreateFileA(oldPath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if (hOld == INVALID_HANDLE_VALUE)
+	{
+		std::cerr << "CreateFileA() failed with error: " << GetLastError() << '\n';
+		return;
+	}
+
+	Signature basis{};
+	std::vector<unsigned int> threadCounts{ 1 };
+	if (cores > 1)
+		threadCounts.push_back(cores);
+	for (unsigned int threads : threadCounts)
+	{
+		std::vector<double> seconds{};
+		std::vector<double> cpuSeconds{};
+		for (unsigned int sample = 0; sample < (std::max)(m_config.repeat, 1u); ++sample)
+		{
+			double cpuStarted{ processSeconds() }, started{ now() };
+			if (computeSignature(hOld, basis, threads) != SUCCESS)
+			{
+				std::cerr << "BENCH: Signing failed.\n";
+				CloseHandle(hOld);
+				return;
+			}
+			seconds.push_back(now() - started);
+			cpuSeconds.push_back(processSeconds() - cpuStarted);
+		}
+		std::sort(seconds.begin(), seconds.end());
+		std::sort(cpuSeconds.begin(), cpuSeconds.end());
+
+		BenchResult result{};
+		result.suite = "delta";
+		result.name = "signature x" + std::to_string(threads);
+		result.size = DELTA_SAMPLE_SIZE;
+		result.streams = threads;
+		result.mbPerSecond = DELTA_SAMPLE_SIZE / 1e6 / seconds[seconds.size() / 2];
+		result.cpuPerGB = cpuSeconds[cpuSeconds.size() / 2] / (DELTA_SAMPLE_SIZE / 1e9);
+		result.ratio = (double)basis.blocks.size() * BLOCK_SIGNATURE_SIZE / DELTA_SAMPLE_SIZE;
+		record(result);
+	}
+
+	for (double changeRatio : DELTA_CHANGE_RATIOS)
+	{
+		// Edits spread evenly, each somewhere in its own slot of the file
+		std::vector<char> changed{ data };
+		std::size_t edits{ (std::size_t)(changeRatio * changed.size() / DELTA_EDIT_SIZE) };
+		if (changeRatio > 0 && edits == 0)
+			edits = 1;
+		std::size_t slot{ edits ? changed.size() / edits : 0 };
+		for (std::size_t i = 0; i < edits; ++i)
+		{
+			std::size_t offset{ i * slot + (std::size_t)(splitMix(17 + i) % (slot - DELTA_EDIT_SIZE + 1)) };
+			fillRandom(changed.data() + offset, DELTA_EDIT_SIZE, 1000 + i);
+		}
+		if (changeRatio > 0)
+		{
+			std::vector<char> inserted(DELTA_INSERT_SIZE);
+			fillRandom(inserted.data(), inserted.size(), 99);
+			changed.insert(changed.begin() + changed.size() / 2, inserted.begin(), inserted.end());
+		}
+		if (writeFile(newPath, changed.data(), changed.size()) != SUCCESS)
+			break;
+
+		HANDLE hNew = CreateFileA(newPath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (hNew == INVALID_HANDLE_VALUE)
+		{
+			std::cerr << "CreateFileA() failed with error: " << GetLastError() << '\n';
+			break;
+		}
+
+		bool ok{ true };
+		DeltaStats stats{};
+		std::vector<double> seconds{};
+		std::vector<double> cpuSeconds{};
+		for (unsigned int sample = 0; sample < (std::max)(m_config.repeat, 1u) && ok; ++sample)
+		{
+			SOCKET sender{ INVALID_SOCKET }, receiver{ INVALID_SOCKET };
+			HANDLE hOut = CreateFileA(outPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, NULL);
+			if (hOut == INVALID_HANDLE_VALUE || socketPair(sender, receiver) != SUCCESS)
+			{
+				if (hOut != INVALID_HANDLE_VALUE)
+					CloseHandle(hOut);
+				ok = false;
+				break;
+			}
+
+			// The sender ends its side either way, so a failed send can not leave the receiver waiting
+			DeltaStats sent{};
+			stats = DeltaStats{};
+			int sendResult{ FAILURE };
+			double cpuStarted{ processSeconds() }, started{ now() };
+			std::thread senderThread{ [&]()
+				{
+					sendResult = sendDelta(sender, hNew, basis, sent);
+					shutdown(sender, SD_SEND);
+				} };
+			int recvResult = recvDelta(receiver, hOld, basis, hOut, stats);
+			senderThread.join();
+			seconds.push_back(now() - started);
+			cpuSeconds.push_back(processSeconds() - cpuStarted);
+
+			closesocket(sender);
+			closesocket(receiver);
+			CloseHandle(hOut);
+			ok = sendResult == SUCCESS && recvResult == SUCCESS;
+		}
+		CloseHandle(hNew);
+
+		char name[64];
+		std::snprintf(name, sizeof(name), "delta %g%% changed", changeRatio * 100);
+		if (!ok)
+		{
+			std::cerr << "BENCH: " << name << " failed.\n";
+			continue;
+		}
+		std::sort(seconds.begin(), seconds.end());
+		std::sort(cpuSeconds.begin(), cpuSeconds.end());
+
+		BenchResult result{};
+		result.suite = "delta";
+		result.name = name;
+		result.size = (long long)changed.size();
+		result.mbPerSecond = changed.size() / 1e6 / seconds[seconds.size() / 2];
+		result.cpuPerGB = cpuSeconds[cpuSeconds.size() / 2] / (changed.size() / 1e9);
+		result.ratio = (double)stats.sent / changed.size();
+		record(result);
+	}
+
+	CloseHandle(hOld);
+}
+
+int Bench::run()
+{
+	std::cout << "Files in " << m_directory << ", " << m_config.repeat << " samples per measurement.\n";
+
+	if (m_config.transfer) runTransfer();
+	if (m_config.concurrent) runConcurrent();
+	if (m_config.compress) runCompress();
+	if (m_config.parse) runParse();
+	if (m_config.hash) runHash();
+	if (m_config.delta) runDelta();
+
+	if (!m_config.jsonPath.empty())
+		return writeJson();
+
+	return SUCCESS;
+}
+
+/***********************************************
+	Results
+***********************************************/
+void Bench::record(const BenchResult& result)
+{
+	m_results.push_back(result);
+
+	char line[200];
+	if (result.suite == "parse")
+		std::snprintf(line, sizeof(line), "%-28s %10.1f ns\n", result.name.c_str(), result.nsPerOp);
+	else if (result.suite == "hash")
+		std::snprintf(line, sizeof(line), "%-28s %10.2f GB/s %8.2f s CPU/GB\n",
+			result.name.c_str(), result.mbPerSecond / 1000, result.cpuPerGB);
+	else if (result.suite == "delta")
+		std::snprintf(line, sizeof(line), "%-28s %10.1f MB/s %8.2f s CPU/GB %9.5f sent\n",
+			result.name.c_str(), result.mbPerSecond, result.cpuPerGB, result.ratio);
+	else if (result.suite == "compress")
+		std::snprintf(line, sizeof(line), "%-28s %10.1f MB/s %8.2f s CPU/GB %7.3f ratio\n",
+			result.name.c_str(), result.mbPerSecond, result.cpuPerGB, result.ratio);
+	else
+		std::snprintf(line, sizeof(line), "%-16s %9s %9s x%-4u %10.1f MB/s %8.2f s CPU/GB %10.2f calls/MB\n",
+			result.name.c_str(), sizeText(result.size).c_str(), result.chunk ? sizeText((long long)result.chunk).c_str() : "-",
+			result.streams, result.mbPerSecond, result.cpuPerGB, result.callsPerMB);
+	std::cout << line;
+}
+
+int Bench::writeJson()
+{
+	std::ofstream ofs{ m_config.jsonPath, std::ios_base::trunc };
+	if (!ofs)
+	{
+		std::cerr << "BENCH: Unable to write " << m_config.jsonPath << '\n';
+		return FAILURE;
+	}
+
+	ofs << "{\n  \"label\": " << jsonString(m_config.label)
+		<< ",\n  \"repeat\": " << m_config.repeat
+		<< ",\n  \"results\": [";
+
+	for (std::size_t i = 0; i < m_results.size(); ++i)
+	{
+		const BenchResult& result{ m_results[i] };
+		ofs << (i ? "," : "") << "\n    { \"suite\": " << jsonString(result.suite) << ", \"name\": " << jsonString(result.name)
+			<< ", \"size\": " << result.size << ", \"chunk\": " << result.chunk << ", \"streams\": " << result.streams
+			<< ", \"mb_per_s\": " << result.mbPerSecond << ", \"cpu_s_per_gb\": " << result.cpuPerGB
+			<< ", \"calls_per_mb\": " << result.callsPerMB << ", \"ratio\": " << result.ratio
+			<< ", \"ns_per_op\": " << result.nsPerOp << " }";
+	}
+	ofs << "\n  ]\n}\n";
+
+	return ofs ? SUCCESS : FAILURE;
+}
@@ -0,0 +1,215 @@
+#pragma once
+
+// The calls are counted inside the shared transfer code, so every file
+// of the program has to see the same setting
+#ifndef FTP_COUNT_SYSCALLS
+#error FTP-Bench has to be built with FTP_COUNT_SYSCALLS defined
+#endif
+
+#include "../../Common/src/FTP_Common.h"
+#include "../../Common/src/FileTransfer.h"
+#include "../../Common/src/BufferPool.h"
+#include "../../Common/src/BlockMode.h"
+#include "../../Common/src/Compression.h"
+#include "../../Common/src/Hash.h"
+#include "../../Common/src/Delta.h"
+#include "../../Common/src/LineBuffer.h"
+#include "../../FTP-Server/src/FTP_Server.h"
+
+#include <ws2tcpip.h>
+#include <mswsock.h>
+
+#include <string>
+#include <vector>
+
+// Each sample moves at least this much, small files are sent repeatedly
+constexpr long long MIN_SAMPLE_BYTES{ 64LL * 1024 * 1024 };
+constexpr unsigned int MAX_ITERATIONS{ 4096 };
+
+// The 8-byte loop makes two calls per 8 bytes, larger files take minutes
+constexpr int LOOP8_SIZE{ 8 };
+constexpr long long LOOP8_MAX_SIZE{ 16LL * 1024 * 1024 };
+
+// Receive buffer of the side that only drains the socket
+constexpr int DRAIN_BUFLEN{ 1024 * 1024 };
+
+// Contents of the source files, repeated
+constexpr std::size_t PATTERN_SIZE{ 4 * 1024 * 1024 };
+
+// Data compressed per level by the compression suite
+constexpr long long COMPRESS_SAMPLE_SIZE{ 32LL * 1024 * 1024 };
+
+// Data hashed per sample by the hash suite, in pieces like a transfer hands them over
+constexpr long long HASH_SAMPLE_SIZE{ 256LL * 1024 * 1024 };
+constexpr std::size_t HASH_PIECE_SIZE{ 1024 * 1024 };
+
+// Old copy of the delta suite, and how much of it each new version changed.
+// The changes are scattered edits, and every changed version also has
+// bytes inserted in the middle so matches have to be found off the block boundaries.
+constexpr long long DELTA_SAMPLE_SIZE{ 256LL * 1024 * 1024 };
+constexpr double DELTA_CHANGE_RATIOS[]{ 0.0, 0.0001, 0.001, 0.01, 0.1, 1.0 };
+constexpr std::size_t DELTA_EDIT_SIZE{ 4096 };
+constexpr std::size_t DELTA_INSERT_SIZE{ 100 };
+
+// Commands decoded by the parse suite
+constexpr unsigned int PARSE_ITERATIONS{ 1000000 };
+
+// How a file gets between the disk and the socket
+enum class STRATEGY
+{
+	LOOP8,		// 8 bytes per read and per send, the original transfer loop
+	COPY,		// ReadFile/recv through one pooled buffer
+	MAPPED,		// send from or recv into a mapped view of the file
+	TRANSMIT,	// TransmitFile, the kernel sends from the file cache
+	AUTO,		// recvToFile, mapped with the copy loop as fallback
+	IOCP,		// Overlapped buffers on a completion port
+	BLOCKS		// MODE B framing
+};
+
+enum class DIRECTION
+{
+	SEND, RECV
+};
+
+constexpr const char* strategyName(STRATEGY strategy)
+{
+	switch (strategy)
+	{
+	case STRATEGY::LOOP8: return "loop8";
+	case STRATEGY::COPY: return "copy";
+	case STRATEGY::MAPPED: return "mapped";
+	case STRATEGY::TRANSMIT: return "transmit";
+	case STRATEGY::AUTO: return "auto";
+	case STRATEGY::IOCP: return "iocp";
+	default: return "blocks";
+	}
+}
+
+// Whether the size of the transfer buffer changes what the strategy does
+constexpr bool usesChunk(STRATEGY strategy)
+{
+	return strategy == STRATEGY::COPY || strategy == STRATEGY::IOCP || strategy == STRATEGY::BLOCKS;
+}
+
+struct BenchConfig
+{
+	// 1 KB to 1 GB by default, 4 GB has to be asked for
+	std::vector<long long> sizes{ 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024, 256 * 1024 * 1024, 1024LL * 1024 * 1024 };
+	std::vector<std::size_t> chunks{ 64 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024 };
+
+	std::vector<STRATEGY> send{ STRATEGY::LOOP8, STRATEGY::COPY, STRATEGY::MAPPED, STRATEGY::TRANSMIT, STRATEGY::IOCP, STRATEGY::BLOCKS };
+	std::vector<STRATEGY> recv{ STRATEGY::LOOP8, STRATEGY::COPY, STRATEGY::MAPPED, STRATEGY::AUTO, STRATEGY::IOCP, STRATEGY::BLOCKS };
+
+	// Blocking against completion port transfers running at the same time
+	std::vector<unsigned int> concurrency{ 1, 16, 256 };
+	long long streamSize{ 16 * 1024 * 1024 };
+
+	unsigned int repeat{ 3 };	// Samples per measurement, the median is reported
+	std::string directory{};	// Where the files go, the temporary directory if empty
+
+	// Suites to run
+	bool transfer{ true };
+	bool concurrent{ true };
+	bool compress{ true };
+	bool parse{ true };
+	bool hash{ true };
+	bool delta{ true };
+
+	std::string jsonPath{};		// Machine-readable results, empty if not wanted
+	std::string label{};		// Names the build in the results
+};
+
+// One line of the report, fields that do not apply stay 0
+struct BenchResult
+{
+	std::string suite;
+	std::string name;
+	long long size{ 0 };		// Bytes per file
+	std::size_t chunk{ 0 };		// Transfer buffer
+	unsigned int streams{ 0 };	// Transfers at the same time
+	double mbPerSecond{ 0 };
+	double cpuPerGB{ 0 };		// CPU seconds per GB moved
+	double callsPerMB{ 0 };		// Socket and file calls per MB moved
+	double ratio{ 0 };			// Compressed size over raw size, or sent bytes over file size
+	double nsPerOp{ 0 };
+};
+
+// One run of a measurement
+struct Sample
+{
+	bool ok{ false };
+	double seconds{ 0 };
+	double cpuSeconds{ 0 };		// Of the whole process, both ends of the connection
+	unsigned long long calls{ 0 };
+	long long bytes{ 0 };
+};
+
+/*
+	Microbenchmarks of the ways a file can move over a data connection.
+	Both ends run in this process over loopback connections, the files
+	are temporary files that stay in the file cache, so what is measured
+	is the cost of the copy strategy and not of the disk or the network.
+	The strategies call the same transfer functions as the server and
+	the client.
+*/
+class Bench
+{
+private: // Variables
+	const BenchConfig m_config;
+
+	/*The WSADATA structure contains information
+	about the Windows Sockets implementation.*/
+	WSADATA wsaData;
+
+	std::string m_directory;
+	std::vector<char> m_pattern;
+	std::vector<std::string> m_files;	// Created here, deleted at the end
+
+	std::vector<BenchResult> m_results;
+
+private: // Functions
+	// Setup
+	int InitializeWinsock();
+	int socketPair(SOCKET& sender, SOCKET& receiver);
+	std::string sourceFile(long long size);
+
+	// One file over one connection
+	int sendWith(STRATEGY strategy, SOCKET s, HANDLE hFile, long long size, TransferBufferPool& pool, IocpTransfer& iocp);
+	int recvWith(STRATEGY strategy, SOCKET s, HANDLE hFile, long long size, TransferBufferPool& pool, IocpTransfer& iocp);
+
+	// The other end of the connection, not counted
+	long long drain(SOCKET s, long long expected);
+	int feed(SOCKET s, bool blocks, long long size, unsigned int files);
+
+	// Files sent or received by one thread
+	int sendStream(STRATEGY strategy, const std::string& path, long long size, unsigned int iterations,
+		TransferBufferPool& pool, IocpTransfer& iocp);
+	int recvStream(STRATEGY strategy, long long size, unsigned int iterations, TransferBufferPool& pool, IocpTransfer& iocp);
+
+	Sample measure(DIRECTION direction, STRATEGY strategy, const std::string& path, long long size,
+		std::size_t chunk, unsigned int streams);
+	void measureTransfer(const char* suite, DIRECTION direction, STRATEGY strategy, const std::string& path,
+		long long size, std::size_t chunk, unsigned int streams);
+
+	// Suites
+	void runTransfer();
+	void runConcurrent();
+	void runCompress();
+	void runParse();
+	void runHash();
+	void runDelta();
+
+	// Results
+	void record(const BenchResult& result);
+	int writeJson();
+
+public:
+	explicit Bench(const BenchConfig& config);
+	virtual ~Bench();
+
+	Bench(const Bench&) = delete;
+	Bench& operator=(const Bench&) = delete;
+
+	int init();
+	int run();
+};
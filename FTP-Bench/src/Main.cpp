@@ -0,0 +1,163 @@
+// FTP transfer microbenchmark driver program
+
+#include "Bench.h"
+
+#include <iostream>
+#include <sstream>
+#include <string>
+
+// Bytes with an optional K, M or G suffix
+long long parseSize(const std::string& value)
+{
+	std::size_t end{ 0 };
+	long long size{ std::stoll(value, &end) };
+	std::string suffix{ value.substr(end) };
+	if (suffix == "K" || suffix == "k") size *= 1024;
+	else if (suffix == "M" || suffix == "m") size *= 1024 * 1024;
+	else if (suffix == "G" || suffix == "g") size *= 1024 * 1024 * 1024;
+	else if (!suffix.empty())
+		throw std::runtime_error("Unknown size suffix in " + value);
+
+	if (size <= 0)
+		throw std::runtime_error("Size must be positive: " + value);
+	return size;
+}
+
+std::vector<std::string> split(const std::string& text, char separator)
+{
+	std::vector<std::string> parts{};
+	std::stringstream ss{ text };
+	for (std::string part{}; std::getline(ss, part, separator); )
+	{
+		if (!part.empty())
+			parts.push_back(part);
+	}
+	return parts;
+}
+
+std::vector<STRATEGY> parseStrategies(const std::string& value, DIRECTION direction)
+{
+	std::vector<STRATEGY> strategies{};
+	for (const std::string& name : split(value, ','))
+	{
+		int strategy{ (int)STRATEGY::LOOP8 };
+		while (strategy <= (int)STRATEGY::BLOCKS && name != strategyName((STRATEGY)strategy))
+			++strategy;
+
+		// TransmitFile only sends, the mapped-or-copy choice only receives
+		bool valid{ strategy <= (int)STRATEGY::BLOCKS &&
+			!(direction == DIRECTION::SEND && (STRATEGY)strategy == STRATEGY::AUTO) &&
+			!(direction == DIRECTION::RECV && (STRATEGY)strategy == STRATEGY::TRANSMIT) };
+		if (!valid)
+			throw std::runtime_error("Unknown strategy " + name);
+
+		strategies.push_back((STRATEGY)strategy);
+	}
+	return strategies;
+}
+
+// Reads the command line settings:
+//	--sizes <size,...>			file sizes, take K, M or G
+//	--chunks <size,...>			transfer buffer sizes tried by copy, iocp and blocks
+//	--send <strategy,...>		loop8, copy, mapped, transmit, iocp, blocks
+//	--recv <strategy,...>		loop8, copy, mapped, auto, iocp, blocks
+//	--concurrency <n,...>		transfers at the same time in the concurrency suite
+//	--stream-size <size>		file size of the concurrency suite
+//	--repeat <count>			samples per measurement, the median is reported
+//	--dir <path>				where the files go, the temporary directory by default
+//	--suites <name,...>			transfer, concurrency, compress, parse, hash, delta
+//	--json <file>				machine-readable results
+//	--label <name>				names the build in the results
+BenchConfig parseArguments(int argc, char** argv)
+{
+	BenchConfig config{};
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string option{ argv[i] };
+		if (i + 1 >= argc)
+			throw std::runtime_error("Missing value for " + option);
+
+		std::string value{ argv[++i] };
+		if (option == "--sizes")
+		{
+			config.sizes.clear();
+			for (const std::string& size : split(value, ','))
+				config.sizes.push_back(parseSize(size));
+		}
+		else if (option == "--chunks")
+		{
+			config.chunks.clear();
+			for (const std::string& chunk : split(value, ','))
+				config.chunks.push_back((std::size_t)parseSize(chunk));
+		}
+		else if (option == "--send")
+			config.send = parseStrategies(value, DIRECTION::SEND);
+		else if (option == "--recv")
+			config.recv = parseStrategies(value, DIRECTION::RECV);
+		else if (option == "--concurrency")
+		{
+			config.concurrency.clear();
+			for (const std::string& count : split(value, ','))
+				config.concurrency.push_back((unsigned int)std::stoul(count));
+		}
+		else if (option == "--stream-size")
+			config.streamSize = parseSize(value);
+		else if (option == "--repeat")
+			config.repeat = (unsigned int)std::stoul(value);
+		else if (option == "--dir")
+			config.directory = value;
+		else if (option == "--suites")
+		{
+			config.transfer = config.concurrent = config.compress = config.parse = config.hash = config.delta = false;
+			for (const std::string& suite : split(value, ','))
+			{
+				if (suite == "transfer") config.transfer = true;
+				else if (suite == "concurrency") config.concurrent = true;
+				else if (suite == "compress") config.compress = true;
+				else if (suite == "parse") config.parse = true;
+				else if (suite == "hash") config.hash = true;
+				else if (suite == "delta") config.delta = true;
+				else
+					throw std::runtime_error("Unknown suite " + suite);
+			}
+		}
+		else if (option == "--json")
+			config.jsonPath = value;
+		else if (option == "--label")
+			config.label = value;
+		else
+			throw std::runtime_error("Unknown option " + option);
+	}
+
+	for (unsigned int streams : config.concurrency)
+	{
+		if (streams == 0)
+			throw std::runtime_error("Concurrency must be at least 1");
+	}
+	if (config.chunks.empty())
+		throw std::runtime_error("No chunk sizes");
+
+	return config;
+}
+
+int main(int argc, char** argv)
+try
+{
+	Bench bench{ parseArguments(argc, argv) };
+
+	if (bench.init() != SUCCESS)
+		return FAILURE;
+
+	return bench.run();
+}
+catch (std::exception& e)
+{
+	std::cerr << "ERROR: " << e.what() << '\n';
+	return FAILURE;
+}
+catch (...)
+{
+	std::cerr << "Unknown error.\n";
+	return FAILURE + 1;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+#include <fstream>
+#include <filesystem>
+#include <system_error>
+
+// Bytes received between two checkpoint updates of a download
+constexpr long long CHECKPOINT_INTERVAL{ 64LL * 1024 * 1024 };
+
+constexpr const char* CHECKPOINT_SUFFIX{ ".ftp-checkpoint" };
+
+/*
+	Progress of an interrupted transfer, kept in a sidecar file next
+	to the local file. A download records how many bytes are safely on
+	disk, an upload only records that it was started, the server's SIZE
+	tells how far it got. A rerun of the same command continues from
+	there with REST instead of starting over from byte zero.
+*/
+struct Checkpoint
+{
+	long long size{ -1 };		// Whole file, -1 if not known
+	long long confirmed{ 0 };	// Bytes that do not have to be sent again
+};
+
+inline std::filesystem::path checkpointPath(const std::string& filename)
+{
+	return std::filesystem::path{ filename + CHECKPOINT_SUFFIX };
+}
+
+inline bool loadCheckpoint(const std::string& filename, Checkpoint& checkpoint)
+{
+	std::ifstream ifs{ checkpointPath(filename) };
+	Checkpoint loaded{};
+	if (!(ifs >> loaded.size >> loaded.confirmed) || loaded.confirmed < 0)
+		return false;
+
+	checkpoint = loaded;
+	return true;
+}
+
+// Written to a temporary file first, a crash never leaves half a checkpoint
+inline bool saveCheckpoint(const std::string& filename, const Checkpoint& checkpoint)
+{
+	std::filesystem::path path{ checkpointPath(filename) };
+	std::filesystem::path temporary{ path.string() + ".tmp" };
+	{
+		std::ofstream ofs{ temporary, std::ios_base::trunc };
+		if (!(ofs << checkpoint.size << ' ' << checkpoint.confirmed << '\n') || !ofs.flush())
+			return false;
+	}
+
+	std::error_code ec{};
+	std::filesystem::rename(temporary, path, ec);
+	return !ec;
+}
+
+inline void removeCheckpoint(const std::string& filename)
+{
+	std::error_code ec{};
+	std::filesystem::remove(checkpointPath(filename), ec);
+}
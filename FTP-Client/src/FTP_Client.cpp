@@ -4,6 +4,11 @@
 #include <sstream>
 #include <fstream>
 #include <filesystem>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <climits>
 
 /***********************************************
 // Helper Functions
@@ -34,10 +39,17 @@ FTP_Client::FTP_Client() :
 	ControlSocket{ INVALID_SOCKET },
 	DataListenSocket{ INVALID_SOCKET },
 	DataTransferSocket{ INVALID_SOCKET },
+	m_passive{ true },
+	m_passivePort{ 0 },
+	m_blockMode{ false },
+	m_compression{ 0 },
+	m_dedup{ true },
+	m_dedupAsked{ false },
 	serverAddr{ NULL },
 	serverAddrSize{ sizeof(serverAddr) },
 	sCommand{ "" },
-	sArgument{ "" }
+	sArgument{ "" },
+	m_bufferPool{}
 {
 }
 
@@ -68,7 +80,7 @@ int FTP_Client::init()
 		ZeroMemory(msgBuf, msgBufLen);
 
 		// Receive welcome message
-		m_iResult = recv(ControlSocket, msgBuf, msgBufLen, 0);
+		m_iResult = recvReply(msgBuf, msgBufLen);
 		if (m_iResult == SOCKET_ERROR)
 		{
 			std::cerr << "WINSOCK: recv() failed with error: " << WSAGetLastError() << '\n';
@@ -199,6 +211,9 @@ int FTP_Client::ControlProcess()
 	iss >> sCommand;
 	iss >> sArgument;
 
+	// The server frames commands on CRLF
+	client_input += CRLF;
+
 	COMMAND command = getCommand(sCommand);
 	switch (command)
 	{
@@ -207,6 +222,9 @@ int FTP_Client::ControlProcess()
 		// Open data transfer listening socket
 		if (EstablishDataConnection() == SUCCESS)
 		{
+			// An interrupted download continues where its checkpoint says
+			long long restart{ sArgument.empty() ? 0 : resumeRetr() };
+
 			// Send RETR message
 			m_iResult = send(ControlSocket, client_input.c_str(), client_input.length(), 0);
 			if (m_iResult == SOCKET_ERROR)
@@ -220,7 +238,7 @@ int FTP_Client::ControlProcess()
 			if (!sArgument.empty())
 			{
 				// Receive OK or not OK to continue
-				recv(ControlSocket, msgBuf, msgBufLen, 0);
+				recvReply(msgBuf, msgBufLen);
 
 				// Check message
 				std::cout << "SERVER: " << msgBuf << '\n';
@@ -230,38 +248,43 @@ int FTP_Client::ControlProcess()
 				if (replyCode == FILE_OKAY)
 				{
 					// Attempt to accept the server's data connection
-					if (AcceptDataConnection() == SUCCESS)
+					if (OpenDataConnection(msgBuf, msgBufLen) == SUCCESS)
 					{
-						// Connection established message
-						ZeroMemory(msgBuf, msgBufLen);
-						recv(ControlSocket, msgBuf, msgBufLen, 0);
-						std::cout << "SERVER: " << msgBuf;
-
 						// Receive file
-						retrFile();
+						m_iResult = retrFile(restart);
 
 						// Recv sucess or no success
 						ZeroMemory(msgBuf, msgBufLen);
-						recv(ControlSocket, msgBuf, msgBufLen, 0);
+						recvReply(msgBuf, msgBufLen);
 						std::cout << "SERVER: " << msgBuf << '\n';
 						
-						closesocket(DataTransferSocket);
+						endTransfer(msgBuf, m_iResult);
 					}
 				}
 			}
 			else
 			{
-				recv(ControlSocket, msgBuf, msgBufLen, 0);
+				recvReply(msgBuf, msgBufLen);
 				std::cout << "SERVER: " << msgBuf << '\n';
 			}
-			closesocket(DataListenSocket);
+			CloseDataListener();
 		}
 	} break;
 	case COMMAND::STOR:
 	{
+		// Content the server already stores is not sent again
+		if (dedupStor())
+		{
+			removeCheckpoint(sArgument);
+			break;
+		}
+
 		// Open data transfer listening socket
 		if (EstablishDataConnection() == SUCCESS)
 		{
+			// An interrupted upload continues from what the server already has
+			long long restart{ (sArgument.empty() || !std::filesystem::exists(sArgument)) ? 0 : resumeStor() };
+
 			// Send STOR message
 			m_iResult = send(ControlSocket, client_input.c_str(), client_input.length(), 0);
 			if (m_iResult == SOCKET_ERROR)
@@ -284,34 +307,95 @@ int FTP_Client::ControlProcess()
 				else
 				{
 					// Attempt to accept the server's data connection
-					recv(ControlSocket, msgBuf, msgBufLen, 0);
+					recvReply(msgBuf, msgBufLen);
 					std::cout << "SERVER: " << msgBuf << '\n';
-					if (AcceptDataConnection() == SUCCESS)
-					{
-						// Connection established message
-						ZeroMemory(msgBuf, msgBufLen);
-						recv(ControlSocket, msgBuf, msgBufLen, 0);
-						std::cout << "SERVER: " << msgBuf;
 
+					// The server may refuse the path
+					std::istringstream iss{ msgBuf };
+					int replyCode{ 0 };
+					iss >> replyCode;
+					if (replyCode == FILE_OKAY && OpenDataConnection(msgBuf, msgBufLen) == SUCCESS)
+					{
 						// Send file
-						storFile(ifs);
+						m_iResult = storFile(ifs, restart);
 						
 						// Recv sucess or no success
 						ZeroMemory(msgBuf, msgBufLen);
-						recv(ControlSocket, msgBuf, msgBufLen, 0);
+						recvReply(msgBuf, msgBufLen);
 						std::cout << "SERVER: " << msgBuf << '\n';
 
-						// Data connection not needed anymore
-						closesocket(DataTransferSocket);
+						// Keep the checkpoint until the server confirms the whole file
+						std::istringstream iss{ msgBuf };
+						int replyCode{ 0 };
+						iss >> replyCode;
+						if (m_iResult == SUCCESS && (replyCode == CLOSING_DATA_CONNECTION || replyCode == FILE_ACTION_OKAY))
+							removeCheckpoint(sArgument);
+
+						endTransfer(msgBuf, m_iResult);
 					}
 				}
 			}				
 			else // Receive invalid argument message from server
 			{
-				recv(ControlSocket, msgBuf, msgBufLen, 0);
+				recvReply(msgBuf, msgBufLen);
 				std::cout << "SERVER: " << msgBuf << '\n';
 			}
-			closesocket(DataListenSocket);
+			CloseDataListener();
+		}
+	} break;
+	case COMMAND::PGET:
+	{
+		// PGET <file-name> [connections], a segmented RETR
+		unsigned int streams{ DEFAULT_SEGMENTS };
+		iss >> streams;
+
+		if (sArgument.empty())
+			std::cout << "CLIENT: Use PGET <file-name> [connections].\n";
+		else
+			parallelRetr(streams);
+	} break;
+	case COMMAND::PASV:
+	{
+		// Client setting only, the server is asked with EPSV before a transfer
+		m_passive = !m_passive;
+		m_passivePort = 0;
+		std::cout << "CLIENT: Passive mode " << (m_passive ? "on" : "off") << ".\n";
+	} break;
+	case COMMAND::MODE:
+	{
+		// Send Command to Server
+		m_iResult = send(ControlSocket, client_input.c_str(), client_input.length(), 0);
+		if (m_iResult == SOCKET_ERROR)
+		{
+			std::cerr << "WINSOCK: send() failed with error: " << WSAGetLastError() << '\n';
+			return FAILURE;
+		}
+
+		// Receive response from Server
+		recvReply(msgBuf, msgBufLen);
+		std::cout << "SERVER: " << msgBuf << '\n';
+
+		// The server starts over with a fresh data connection too
+		std::istringstream iss{ msgBuf };
+		int replyCode{ 0 };
+		iss >> replyCode;
+		if (replyCode == COMMAND_OKAY)
+		{
+			m_blockMode = (sArgument == "B" || sArgument == "b");
+
+			// MODE Z [level]
+			m_compression = 0;
+			if (sArgument == "Z" || sArgument == "z")
+			{
+				std::istringstream args{ client_input };
+				std::string command{}, mode{};
+				if (!(args >> command >> mode >> m_compression))
+					m_compression = COMPRESS_LEVEL_DEFAULT;
+			}
+
+			if (DataTransferSocket != INVALID_SOCKET)
+				closesocket(DataTransferSocket);
+			DataTransferSocket = INVALID_SOCKET;
 		}
 	} break;
 	case COMMAND::HELP:
@@ -325,8 +409,10 @@ int FTP_Client::ControlProcess()
 		}
 		
 		// Receive response from Server
-		recv(ControlSocket, msgBuf, msgBufLen, 0);
-		std::cout << "SERVER: " << msgBuf << '\n';
+		// Multi-line reply, it may not fit in msgBuf
+		std::string reply{};
+		receiveReply(ControlSocket, m_controlBuffer, reply);
+		std::cout << "SERVER: " << reply << '\n';
 	} break;
 	case COMMAND::MKD:
 	{
@@ -339,7 +425,7 @@ int FTP_Client::ControlProcess()
 		}
 
 		// Receive response
-		recv(ControlSocket, msgBuf, msgBufLen, 0);
+		recvReply(msgBuf, msgBufLen);
 		std::cout << "SERVER: " << msgBuf << '\n';
 	} break;
 	case COMMAND::CWD:
@@ -353,7 +439,7 @@ int FTP_Client::ControlProcess()
 		}
 
 		// Receive response from Server
-		recv(ControlSocket, msgBuf, msgBufLen, 0);
+		recvReply(msgBuf, msgBufLen);
 		std::cout << "SERVER: " << msgBuf << '\n';
 
 		// check message
@@ -379,7 +465,7 @@ int FTP_Client::ControlProcess()
 		}
 
 		// Receive response from Server
-		recv(ControlSocket, msgBuf, msgBufLen, 0);
+		recvReply(msgBuf, msgBufLen);
 		std::cout << "SERVER: " << msgBuf << '\n';
 	} break;
 	case COMMAND::QUIT:
@@ -393,25 +479,27 @@ int FTP_Client::ControlProcess()
 		}
 
 		// Receive response from Server
-		recv(ControlSocket, msgBuf, msgBufLen, 0);
+		recvReply(msgBuf, msgBufLen);
 		std::cout << "SERVER: " << msgBuf << '\n';
 
 		Disconnect();
 		return FAILURE;
 	} break;
 	case COMMAND::LIST:
+	case COMMAND::NLST:
+	case COMMAND::MLSD:
 	{
-		// Send Command to Server
-		send(ControlSocket, client_input.c_str(), client_input.length(), 0);
-		if (m_iResult == SOCKET_ERROR)
-		{
-			std::cerr << "WINSOCK: send() failed with error: " << WSAGetLastError() << '\n';
+		if (listDirectory(client_input) != SUCCESS)
+			return FAILURE;
+	} break;
+	case COMMAND::XDLT:
+	case COMMAND::XDGT:
+	{
+		// XDLT uploads and XDGT downloads only the blocks that changed
+		if (sArgument.empty())
+			std::cout << "CLIENT: Use " << sCommand << " <file-name>.\n";
+		else if (deltaTransfer(client_input, command == COMMAND::XDLT) != SUCCESS)
 			return FAILURE;
-		}
-
-		// Receive response from Server
-		recv(ControlSocket, msgBuf, msgBufLen, 0);
-		std::cout << "SERVER: " << msgBuf << '\n';
 	} break;
 	case COMMAND::INVALID:
 	{
@@ -424,7 +512,7 @@ int FTP_Client::ControlProcess()
 		}
 
 		// Receive response from Server
-		recv(ControlSocket, msgBuf, msgBufLen, 0);
+		recvReply(msgBuf, msgBufLen);
 		std::cout << "SERVER: " << msgBuf << '\n';
 	} break;
 	default:
@@ -438,6 +526,19 @@ int FTP_Client::ControlProcess()
 	return SUCCESS;
 }
 
+// Receives one whole reply into msgBuf like recv(), a reply longer than msgBuf is cut
+int FTP_Client::recvReply(char* msgBuf, int msgBufLen)
+{
+	std::string reply{};
+	if (receiveReply(ControlSocket, m_controlBuffer, reply) != SUCCESS)
+		return SOCKET_ERROR;
+
+	int length{ (std::min)((int)reply.length(), msgBufLen - 1) };
+	memcpy(msgBuf, reply.c_str(), length);
+	msgBuf[length] = '\0';
+	return length;
+}
+
 void FTP_Client::Disconnect()
 {
 	// Close all sockets
@@ -455,6 +556,14 @@ void FTP_Client::Disconnect()
 
 int FTP_Client::EstablishDataConnection()
 {
+	// Block mode is still connected from the previous transfer
+	if (DataTransferSocket != INVALID_SOCKET)
+		return SUCCESS;
+
+	// Passive mode only needs to know the server's port
+	if (m_passive)
+		return RequestPassivePort();
+
 	ZeroMemory(&hints, sizeof(hints));	// ZeroMemory fills the values with zeros
 	hints.ai_family = AF_INET;			// AF_NET for IPv4. AF_NET6 for IPv6. AF_UNSPEC for either (might cause error).
 	hints.ai_socktype = SOCK_STREAM;	// Used to specify a stream socket.
@@ -507,8 +616,69 @@ int FTP_Client::EstablishDataConnection()
 	return SUCCESS;
 }
 
+// Connects the data connection after a 150 and reads what follows,
+// 125 if the server has it too and 425 if it gave up waiting
+int FTP_Client::OpenDataConnection(char* msgBuf, int msgBufLen)
+{
+	bool connected{ AcceptDataConnection() == SUCCESS };
+
+	// Connection established message
+	ZeroMemory(msgBuf, msgBufLen);
+	recvReply(msgBuf, msgBufLen);
+	std::cout << "SERVER: " << msgBuf << '\n';
+
+	std::istringstream iss{ msgBuf };
+	int replyCode{ 0 };
+	iss >> replyCode;
+	if (connected && replyCode == CONNECTION_OPEN)
+		return SUCCESS;
+
+	// Nothing will come over a connection the server does not use
+	if (DataTransferSocket != INVALID_SOCKET)
+		closesocket(DataTransferSocket);
+	DataTransferSocket = INVALID_SOCKET;
+	return FAILURE;
+}
+
 int FTP_Client::AcceptDataConnection()
 {
+	// Block mode is still connected from the previous transfer
+	if (DataTransferSocket != INVALID_SOCKET)
+		return SUCCESS;
+
+	// Passive mode, connect to the port the server is listening on
+	if (m_passive)
+	{
+		sockaddr_in dataAddr{};
+		int dataAddrSize{ sizeof(dataAddr) };
+		if (getpeername(ControlSocket, (sockaddr*)&dataAddr, &dataAddrSize) == SOCKET_ERROR)
+		{
+			std::cerr << "WINSOCK: getpeername() failed with error: " << WSAGetLastError() << '\n';
+			return FAILURE;
+		}
+		dataAddr.sin_port = htons(m_passivePort);
+
+		DataTransferSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (DataTransferSocket == INVALID_SOCKET)
+		{
+			std::cerr << "WINSOCK: socket() failed with error: " << WSAGetLastError() << '\n';
+			return FAILURE;
+		}
+
+		if (connect(DataTransferSocket, (sockaddr*)&dataAddr, sizeof(dataAddr)) == SOCKET_ERROR)
+		{
+			std::cerr << "WINSOCK: connect() failed with error: " << WSAGetLastError() << '\n';
+			closesocket(DataTransferSocket);
+			DataTransferSocket = INVALID_SOCKET;
+
+			// Ask for a fresh port next time
+			m_passivePort = 0;
+			return FAILURE;
+		}
+
+		return SUCCESS;
+	}
+
 	// Accept server's data transfer request
 	DataTransferSocket = accept(DataListenSocket, (sockaddr*)&serverAddr, &serverAddrSize);
 	if (DataTransferSocket == INVALID_SOCKET)
@@ -522,61 +692,671 @@ int FTP_Client::AcceptDataConnection()
 	return SUCCESS;
 }
 
-int FTP_Client::retrFile()
+// The server keeps its passive port for the whole session,
+// so EPSV is only sent before the first transfer
+int FTP_Client::RequestPassivePort()
 {
-	// Prepare transfer buffer
-	char xferBuf[TRANSFER_BYTE_SYZE];
-	int xferBufLen{ sizeof(xferBuf) };
-	ZeroMemory(xferBuf, xferBufLen);
-
-	// Receive file size
-	long file_size{ 0 };
-	m_iResult = recv(DataTransferSocket, reinterpret_cast<char*>(&file_size), sizeof(file_size), 0);
-	std::cout << " (" << file_size << " bytes)\n";
+	if (m_passivePort != 0)
+		return SUCCESS;
 
-	// Create file in binary mode
-	std::ofstream ofs{ sArgument, std::ios_base::binary };
-	if (!ofs) std::cout << "CLIENT: Error opening file: " << sArgument << "\n";
+	std::string reply{};
+	if (exchange(ControlSocket, m_controlBuffer, "EPSV", EXTENDED_PASSIVE_MODE, reply) != SUCCESS ||
+		parsePassivePort(reply, m_passivePort) != SUCCESS)
+	{
+		std::cout << "SERVER: " << reply << '\n';
+		m_passivePort = 0;
+		return FAILURE;
+	}
 
-	// Receive file
-	// Loop while there's still data to receive
-	for (int remainingData = file_size; remainingData > 0; remainingData -= m_iResult)
+	return SUCCESS;
+}
+
+// Block mode keeps the data connection after a successful transfer,
+// anything else leaves it in an unknown state and closes it
+void FTP_Client::endTransfer(const char* reply, int result)
+{
+	std::istringstream iss{ reply };
+	int replyCode{ 0 };
+	iss >> replyCode;
+
+	if (m_blockMode && result == SUCCESS && replyCode == FILE_ACTION_OKAY)
+		return;
+
+	closesocket(DataTransferSocket);
+	DataTransferSocket = INVALID_SOCKET;
+}
+
+void FTP_Client::CloseDataListener()
+{
+	// Only active mode listens
+	if (DataListenSocket != INVALID_SOCKET)
+		closesocket(DataListenSocket);
+	DataListenSocket = INVALID_SOCKET;
+}
+
+int FTP_Client::retrFile(long long offset)
+{
+	// Receive file size, block mode has none and marks the end in the stream.
+	// After REST the size holds only the bytes from the offset on.
+	long long file_size{ 0 };
+	if (!m_blockMode)
 	{
-		m_iResult = recv(DataTransferSocket, xferBuf, xferBufLen, 0);
-		if (m_iResult == SOCKET_ERROR)
+		m_iResult = recv(DataTransferSocket, reinterpret_cast<char*>(&file_size), sizeof(file_size), MSG_WAITALL);
+		if (m_iResult != sizeof(file_size))
 		{
 			std::cerr << "WINSOCK: recv() failed with error: " << WSAGetLastError() << '\n';
 			return FAILURE;
 		}
-		ofs.write(xferBuf, xferBufLen);
+		std::cout << " (" << file_size << " bytes)\n";
 	}
 
-	ofs.close();
+	// Create file, it is opened for reading too so it can be mapped.
+	// A resumed download keeps what it already has.
+	HANDLE hFile = CreateFileW(std::filesystem::path{ sArgument }.wstring().c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+		(offset > 0) ? OPEN_EXISTING : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		std::cout << "CLIENT: Error opening file: " << sArgument << "\n";
+		return FAILURE;
+	}
+
+	// Receive file
+	Checkpoint checkpoint{ m_blockMode ? -1 : offset + file_size, offset };
+	if (m_blockMode)
+	{
+		long long received{ 0 };
+		m_iResult = recvFileBlocks(DataTransferSocket, hFile, offset, m_bufferPool, received);
+		std::cout << " (" << received << " bytes)\n";
+
+		// Everything that arrived before the failure was written
+		if (m_iResult != SUCCESS && received > 0 && FlushFileBuffers(hFile))
+		{
+			checkpoint.confirmed = offset + received;
+			saveCheckpoint(sArgument, checkpoint);
+		}
+	}
+	else
+	{
+		// A slice at a time, each one flushed and recorded before the next.
+		// Slices end on chunk boundaries, so compressed chunks never span two.
+		static_assert(CHECKPOINT_INTERVAL % COMPRESS_CHUNK_SIZE == 0, "A checkpoint would split a compressed chunk");
+		ChunkDecompressor decompressor{};
+		m_iResult = SUCCESS;
+		for (long long done = 0; m_iResult == SUCCESS && done < file_size; )
+		{
+			long long slice{ (std::min)(file_size - done, CHECKPOINT_INTERVAL) };
+			if (m_compression > 0)
+				m_iResult = recvFileCompressed(DataTransferSocket, hFile, offset + done, slice, decompressor);
+			else
+				m_iResult = recvToFile(DataTransferSocket, hFile, offset + done, slice, m_bufferPool);
+			if (m_iResult != SUCCESS)
+				break;
+			done += slice;
+
+			if (done < file_size && FlushFileBuffers(hFile))
+			{
+				checkpoint.confirmed = offset + done;
+				saveCheckpoint(sArgument, checkpoint);
+			}
+		}
+
+		// Drop whatever an earlier, longer download left after the new end
+		if (m_iResult == SUCCESS && offset > 0 && !setFileSize(hFile, offset + file_size))
+			m_iResult = FAILURE;
+	}
+	CloseHandle(hFile);
+
+	if (m_iResult == SUCCESS)
+		removeCheckpoint(sArgument);
+	else if (loadCheckpoint(sArgument, checkpoint))
+		std::cout << "CLIENT: " << checkpoint.confirmed << " bytes kept, RETR " << sArgument << " again to resume.\n";
 	
+	return m_iResult;
+}
+
+// Sends LIST, NLST or MLSD and prints the listing that comes back
+// over the data connection. Fails only if the control connection does.
+int FTP_Client::listDirectory(const std::string& request)
+{
+	char msgBuf[DEFAULT_BUFLEN]{};
+	int msgBufLen{ sizeof(msgBuf) };
+
+	// Open data transfer listening socket
+	if (EstablishDataConnection() != SUCCESS)
+		return SUCCESS;
+
+	m_iResult = send(ControlSocket, request.c_str(), (int)request.length(), 0);
+	if (m_iResult == SOCKET_ERROR)
+	{
+		std::cerr << "WINSOCK: send() failed with error: " << WSAGetLastError() << '\n';
+		CloseDataListener();
+		return FAILURE;
+	}
+
+	// Receive OK or not OK to continue
+	recvReply(msgBuf, msgBufLen);
+	std::cout << "SERVER: " << msgBuf << '\n';
+	std::istringstream iss{ msgBuf };
+	int replyCode{ 0 };
+	iss >> replyCode;
+	if (replyCode == FILE_OKAY && OpenDataConnection(msgBuf, msgBufLen) == SUCCESS)
+	{
+		std::string listing{};
+		m_iResult = retrListing(listing);
+		if (m_iResult == SUCCESS)
+			std::cout << listing;
+
+		// Recv sucess or no success
+		ZeroMemory(msgBuf, msgBufLen);
+		recvReply(msgBuf, msgBufLen);
+		std::cout << "SERVER: " << msgBuf << '\n';
+
+		endTransfer(msgBuf, m_iResult);
+	}
+	CloseDataListener();
+
+	return SUCCESS;
+}
+
+// Moves only what changed of a file both sides have a copy of. XDLT sends
+// the local file against the signature of the server's copy, XDGT sends
+// the signature of the local copy and rebuilds it from the instructions.
+int FTP_Client::deltaTransfer(const std::string& request, bool upload)
+{
+	char msgBuf[DEFAULT_BUFLEN]{};
+	int msgBufLen{ sizeof(msgBuf) };
+	std::filesystem::path filename{ sArgument };
+
+	// An upload needs the local file, a download builds on it if there is one
+	HANDLE hFile = CreateFileW(filename.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (upload && hFile == INVALID_HANDLE_VALUE)
+	{
+		std::cout << "CLIENT: 550 Requested action not taken. File not found.\n";
+		return SUCCESS;
+	}
+
+	// Signed before the server is asked, it waits for the signature on the data connection
+	Signature basis{};
+	if (!upload && hFile != INVALID_HANDLE_VALUE && computeSignature(hFile, basis, std::thread::hardware_concurrency()) != SUCCESS)
+	{
+		std::cout << "CLIENT: Unable to read " << sArgument << ".\n";
+		CloseHandle(hFile);
+		return SUCCESS;
+	}
+
+	// Open data transfer listening socket
+	if (EstablishDataConnection() != SUCCESS)
+	{
+		if (hFile != INVALID_HANDLE_VALUE)
+			CloseHandle(hFile);
+		return SUCCESS;
+	}
+
+	m_iResult = send(ControlSocket, request.c_str(), (int)request.length(), 0);
+	if (m_iResult == SOCKET_ERROR)
+	{
+		std::cerr << "WINSOCK: send() failed with error: " << WSAGetLastError() << '\n';
+		CloseDataListener();
+		if (hFile != INVALID_HANDLE_VALUE)
+			CloseHandle(hFile);
+		return FAILURE;
+	}
+
+	// Receive OK or not OK to continue
+	recvReply(msgBuf, msgBufLen);
+	std::cout << "SERVER: " << msgBuf << '\n';
+	std::istringstream iss{ msgBuf };
+	int replyCode{ 0 };
+	iss >> replyCode;
+	if (upload && replyCode != FILE_OKAY)
+		std::cout << "CLIENT: Without a copy on the server, send the file with STOR.\n";
+
+	if (replyCode == FILE_OKAY && OpenDataConnection(msgBuf, msgBufLen) == SUCCESS)
+	{
+		// The download is built beside the local copy and replaces it once it is whole
+		std::filesystem::path rebuilt{ sArgument + ".delta" };
+		DeltaStats stats{};
+		if (upload)
+		{
+			m_iResult = recvSignature(DataTransferSocket, basis);
+			if (m_iResult == SUCCESS)
+				m_iResult = sendDelta(DataTransferSocket, hFile, basis, stats);
+		}
+		else
+		{
+			HANDLE hTarget = CreateFileW(rebuilt.wstring().c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+				FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+			m_iResult = FAILURE;
+			if (hTarget != INVALID_HANDLE_VALUE && sendSignature(DataTransferSocket, basis) == SUCCESS)
+				m_iResult = recvDelta(DataTransferSocket, hFile, basis, hTarget, stats);
+			if (hTarget != INVALID_HANDLE_VALUE)
+				CloseHandle(hTarget);
+		}
+		if (hFile != INVALID_HANDLE_VALUE)
+			CloseHandle(hFile);
+		hFile = INVALID_HANDLE_VALUE;
+
+		// The server may be waiting for data that will not come
+		if (m_iResult != SUCCESS)
+		{
+			closesocket(DataTransferSocket);
+			DataTransferSocket = INVALID_SOCKET;
+		}
+
+		// Recv sucess or no success
+		ZeroMemory(msgBuf, msgBufLen);
+		recvReply(msgBuf, msgBufLen);
+		std::cout << "SERVER: " << msgBuf << '\n';
+
+		std::istringstream iss{ msgBuf };
+		iss >> replyCode;
+		bool done{ m_iResult == SUCCESS && (replyCode == CLOSING_DATA_CONNECTION || replyCode == FILE_ACTION_OKAY) };
+		if (!upload)
+		{
+			if (done && !MoveFileExW(rebuilt.wstring().c_str(), filename.wstring().c_str(), MOVEFILE_REPLACE_EXISTING))
+			{
+				std::cerr << "MoveFileExW() failed with error: " << GetLastError() << '\n';
+				done = false;
+			}
+			if (!done)
+				DeleteFileW(rebuilt.wstring().c_str());
+		}
+		if (done)
+			std::cout << "CLIENT: " << stats.matched << " bytes matched, " << stats.literal << " bytes sent as they are, "
+				<< stats.sent << " bytes on the connection.\n";
+
+		endTransfer(msgBuf, m_iResult);
+	}
+	CloseDataListener();
+	if (hFile != INVALID_HANDLE_VALUE)
+		CloseHandle(hFile);
+
+	return SUCCESS;
+}
+
+// Receives a listing into memory, framed like a file in the current mode
+int FTP_Client::retrListing(std::string& listing)
+{
+	if (m_blockMode)
+		return recvBlocks(DataTransferSocket, listing);
+
+	long long size{ 0 };
+	m_iResult = recv(DataTransferSocket, reinterpret_cast<char*>(&size), sizeof(size), MSG_WAITALL);
+	if (m_iResult != sizeof(size) || size < 0)
+	{
+		std::cerr << "WINSOCK: recv() failed with error: " << WSAGetLastError() << '\n';
+		return FAILURE;
+	}
+
+	if (m_compression > 0)
+	{
+		ChunkDecompressor decompressor{};
+		listing.clear();
+		while ((long long)listing.size() < size)
+		{
+			const char* data{ nullptr };
+			DWORD chunk{ 0 };
+			if (decompressor.receive(DataTransferSocket, size - (long long)listing.size(), data, chunk) != SUCCESS)
+				return FAILURE;
+			listing.append(data, chunk);
+		}
+		return SUCCESS;
+	}
+
+	listing.resize((std::size_t)size);
+	for (long long received = 0; received < size; )
+	{
+		int chunk{ (int)(std::min)(size - received, (long long)INT_MAX) };
+		if (recv(DataTransferSocket, &listing[(std::size_t)received], chunk, MSG_WAITALL) != chunk)
+		{
+			std::cerr << "WINSOCK: recv() failed with error: " << WSAGetLastError() << '\n';
+			return FAILURE;
+		}
+		received += chunk;
+	}
+
+	return SUCCESS;
+}
+
+// Sends SIZE and REST for a download with a checkpoint. Returns the
+// offset the server will start at, 0 to download the whole file.
+long long FTP_Client::resumeRetr()
+{
+	Checkpoint checkpoint{};
+	if (!loadCheckpoint(sArgument, checkpoint))
+		return 0;
+
+	// The local file must still hold the confirmed bytes
+	std::error_code ec{};
+	long long localSize{ (long long)std::filesystem::file_size(sArgument, ec) };
+
+	// A remote file that changed size is not the one the checkpoint was for
+	std::string reply{};
+	long long remoteSize{ 0 };
+	if (!ec && checkpoint.confirmed > 0 && localSize >= checkpoint.confirmed &&
+		exchange(ControlSocket, m_controlBuffer, "SIZE " + sArgument, FILE_STATUS, reply) == SUCCESS &&
+		parseFileSize(reply, remoteSize) == SUCCESS)
+	{
+		if ((checkpoint.size < 0) ? remoteSize >= checkpoint.confirmed : remoteSize == checkpoint.size)
+		{
+			std::string restart{ "REST " + std::to_string(checkpoint.confirmed) };
+			if (exchange(ControlSocket, m_controlBuffer, restart, PENDING_FURTHER_INFORMATION, reply) == SUCCESS)
+			{
+				std::cout << "CLIENT: Resuming " << sArgument << " at byte " << checkpoint.confirmed << ".\n";
+				return checkpoint.confirmed;
+			}
+		}
+	}
+
+	removeCheckpoint(sArgument);
+	return 0;
+}
+
+// Sends SIZE and REST for an upload with a checkpoint. Returns the
+// offset to send from, 0 to upload the whole file.
+long long FTP_Client::resumeStor()
+{
+	std::error_code ec{};
+	long long localSize{ (long long)std::filesystem::file_size(sArgument, ec) };
+	if (ec)
+		return 0;
+
+	// A local file that changed size starts over, so does a new upload.
+	// The checkpoint is written before anything is sent.
+	Checkpoint checkpoint{};
+	if (!loadCheckpoint(sArgument, checkpoint) || checkpoint.size != localSize)
+	{
+		saveCheckpoint(sArgument, Checkpoint{ localSize, 0 });
+		return 0;
+	}
+
+	// The server's SIZE counts only the bytes that arrived, also after it crashed
+	// with the file grown ahead of the data
+	std::string reply{};
+	long long remoteSize{ 0 };
+	if (exchange(ControlSocket, m_controlBuffer, "SIZE " + sArgument, FILE_STATUS, reply) != SUCCESS ||
+		parseFileSize(reply, remoteSize) != SUCCESS)
+		return 0;
+	long long offset{ (std::min)(remoteSize, localSize) };
+
+	std::string restart{ "REST " + std::to_string(offset) };
+	if (offset == 0 || exchange(ControlSocket, m_controlBuffer, restart, PENDING_FURTHER_INFORMATION, reply) != SUCCESS)
+		return 0;
+
+	std::cout << "CLIENT: Resuming " << sArgument << " at byte " << offset << ".\n";
+	return offset;
+}
+
+// Offers the file's SHA-256 before an upload. True if the server
+// created the file from content it already had, false if it must be sent.
+bool FTP_Client::dedupStor()
+{
+	std::error_code ec{};
+	if (sArgument.empty() || !std::filesystem::is_regular_file(sArgument, ec))
+		return false;
+	long long localSize{ (long long)std::filesystem::file_size(sArgument, ec) };
+	if (ec || localSize < DEDUP_MIN_SIZE)
+		return false;
+
+	// A resumed upload only sends what the server lacks, hashing all of it would cost more
+	Checkpoint checkpoint{};
+	if (loadCheckpoint(sArgument, checkpoint) && checkpoint.size == localSize)
+		return false;
+
+	// Whether the server has a content store is asked once, before any file is read:
+	// XDUP without arguments gets a 502 if it has none and a 501 if it has one
+	std::string reply{};
+	if (!m_dedupAsked)
+	{
+		m_dedup = exchange(ControlSocket, m_controlBuffer, "XDUP", COMMAND_NOT_IMPLEMENTED, reply) != SUCCESS;
+		m_dedupAsked = true;
+	}
+	if (!m_dedup)
+		return false;
+
+	HANDLE hFile = CreateFileW(std::filesystem::path{ sArgument }.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ,
+		NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	ContentHasher hasher{ hashBit(HASH_ALGORITHM::SHA256) };
+	int iResult{ hashFile(hFile, hasher, m_bufferPool) };
+	CloseHandle(hFile);
+	if (iResult != SUCCESS || hasher.hashed() != (unsigned long long)localSize)
+		return false;
+
+	// A 350 leaves the digest with the server for the STOR that follows
+	std::string request{ "XDUP " + hasher.digest(HASH_ALGORITHM::SHA256) + ' ' + std::to_string(localSize) + ' ' + sArgument };
+	bool linked{ exchange(ControlSocket, m_controlBuffer, request, FILE_ACTION_OKAY, reply) == SUCCESS };
+	std::cout << "SERVER: " << reply << '\n';
+	return linked;
+}
+
+// Splits a download into byte ranges fetched over parallel connections,
+// each range is written straight to its place in the preallocated file
+int FTP_Client::parallelRetr(unsigned int streams)
+{
+	// Ask for the size first, on the main control connection
+	std::string reply{};
+	long long file_size{ 0 };
+	if (exchange(ControlSocket, m_controlBuffer, "SIZE " + sArgument, FILE_STATUS, reply) != SUCCESS ||
+		parseFileSize(reply, file_size) != SUCCESS)
+	{
+		std::cout << "SERVER: " << reply << '\n';
+		return FAILURE;
+	}
+
+	// The ranges have control connections of their own, which start at the top
+	// of the server's tree. They change to this session's directory first.
+	std::string directory{};
+	if (exchange(ControlSocket, m_controlBuffer, "PWD", PATHNAME_CREATED, reply) != SUCCESS ||
+		parsePathname(reply, directory) != SUCCESS)
+	{
+		std::cout << "SERVER: " << reply << '\n';
+		return FAILURE;
+	}
+
+	// Small files get fewer connections
+	long long usefulStreams{ (std::max)(1LL, (file_size + MIN_SEGMENT_SIZE - 1) / MIN_SEGMENT_SIZE) };
+	streams = (unsigned int)(std::min)((long long)(std::min)((std::max)(streams, 1u), MAX_SEGMENTS), usefulStreams);
+
+	// Preallocate, so the ranges never have to grow the file
+	HANDLE hFile = CreateFileW(std::filesystem::path{ sArgument }.wstring().c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		std::cout << "CLIENT: Error opening file: " << sArgument << "\n";
+		return FAILURE;
+	}
+	if (!setFileSize(hFile, file_size))
+	{
+		std::cerr << "CLIENT: Unable to allocate " << file_size << " bytes.\n";
+		CloseHandle(hFile);
+		return FAILURE;
+	}
+	if (file_size == 0)
+	{
+		CloseHandle(hFile);
+		return SUCCESS;
+	}
+
+	std::cout << "CLIENT: Downloading " << file_size << " bytes over " << streams << " connections.\n";
+	auto startTime{ std::chrono::steady_clock::now() };
+
+	std::vector<int> results(streams, FAILURE);
+	std::vector<std::thread> threads{};
+	long long segment{ file_size / streams };
+	for (unsigned int i = 0; i < streams; ++i)
+	{
+		long long offset{ segment * i };
+		long long length{ (i == streams - 1) ? file_size - offset : segment };
+		threads.emplace_back([this, hFile, &directory, offset, length, &results, i]
+			{
+				results[i] = fetchRange(hFile, directory, offset, length);
+			});
+	}
+	for (auto& thread : threads)
+		thread.join();
+
+	std::chrono::duration<double> elapsed{ std::chrono::steady_clock::now() - startTime };
+	CloseHandle(hFile);
+
+	if (std::count(results.begin(), results.end(), FAILURE) > 0)
+	{
+		std::cerr << "CLIENT: " << std::count(results.begin(), results.end(), FAILURE) << " of " << streams << " ranges failed.\n";
+		return FAILURE;
+	}
+
+	std::cout << "CLIENT: Received " << file_size << " bytes in " << elapsed.count() << " s ("
+			  << file_size / (std::max)(elapsed.count(), 1e-9) / (1024 * 1024) << " MiB/s).\n";
+
 	return SUCCESS;
 }
 
-int FTP_Client::storFile(std::ifstream& ifs)
+// Fetches one range with its own control and passive data connection
+int FTP_Client::fetchRange(HANDLE hFile, const std::string& directory, long long offset, long long length)
 {
-	// Prepare transfer buffer
-	char xferBuf[TRANSFER_BYTE_SYZE];
-	int xferBufLen{ sizeof(xferBuf) };
-	ZeroMemory(xferBuf, xferBufLen);
+	// Same server as the main control connection
+	sockaddr_in controlAddr{};
+	int controlAddrSize{ sizeof(controlAddr) };
+	if (getpeername(ControlSocket, (sockaddr*)&controlAddr, &controlAddrSize) == SOCKET_ERROR)
+		return FAILURE;
+
+	SOCKET controlSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (controlSocket == INVALID_SOCKET)
+		return FAILURE;
+	if (connect(controlSocket, (sockaddr*)&controlAddr, sizeof(controlAddr)) == SOCKET_ERROR)
+	{
+		std::cerr << "WINSOCK: connect() failed with error: " << WSAGetLastError() << '\n';
+		closesocket(controlSocket);
+		return FAILURE;
+	}
+
+	// The four commands go out in one write, the server answers them
+	// in order without a round trip for each
+	std::string commands{ "CWD " + directory + CRLF +
+		"RANG " + std::to_string(offset) + ' ' + std::to_string(offset + length - 1) + CRLF +
+		"EPSV" + CRLF + "RETR " + sArgument + CRLF };
+
+	int iResult{ FAILURE };
+	LineBuffer controlBuffer{};
+	std::string reply{};
+	unsigned short dataPort{ 0 };
+	if (readReply(controlSocket, controlBuffer, SERVICE_READY, reply) == SUCCESS &&
+		send(controlSocket, commands.c_str(), (int)commands.length(), 0) != SOCKET_ERROR &&
+		readReply(controlSocket, controlBuffer, COMMAND_OKAY, reply) == SUCCESS &&
+		readReply(controlSocket, controlBuffer, PENDING_FURTHER_INFORMATION, reply) == SUCCESS &&
+		readReply(controlSocket, controlBuffer, EXTENDED_PASSIVE_MODE, reply) == SUCCESS &&
+		parsePassivePort(reply, dataPort) == SUCCESS &&
+		readReply(controlSocket, controlBuffer, FILE_OKAY, reply) == SUCCESS)
+	{
+		sockaddr_in dataAddr{ controlAddr };
+		dataAddr.sin_port = htons(dataPort);
 
-	// Get file size
-	long file_size = (long)std::filesystem::file_size(sArgument);
+		SOCKET dataSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (dataSocket != INVALID_SOCKET &&
+			connect(dataSocket, (sockaddr*)&dataAddr, sizeof(dataAddr)) != SOCKET_ERROR &&
+			readReply(controlSocket, controlBuffer, CONNECTION_OPEN, reply) == SUCCESS)
+		{
+			// The size header holds the length of the range
+			long long rangeSize{ 0 };
+			if (recv(dataSocket, reinterpret_cast<char*>(&rangeSize), sizeof(rangeSize), MSG_WAITALL) == sizeof(rangeSize) &&
+				rangeSize == length)
+				iResult = recvToFile(dataSocket, hFile, offset, length, m_bufferPool);
+		}
+		if (dataSocket != INVALID_SOCKET)
+			closesocket(dataSocket);
+
+		if (iResult == SUCCESS && readReply(controlSocket, controlBuffer, CLOSING_DATA_CONNECTION, reply) != SUCCESS)
+			iResult = FAILURE;
+	}
+
+	if (iResult != SUCCESS && !reply.empty())
+		std::cout << "SERVER: " << reply << '\n';
+
+	// No need to wait for the goodbye
+	send(controlSocket, "QUIT\r\n", 6, 0);
+	closesocket(controlSocket);
+
+	return iResult;
+}
+
+int FTP_Client::storFile(std::ifstream& ifs, long long offset)
+{
+	// Lease a transfer buffer
+	TransferBufferPool::Buffer xferBuf{ m_bufferPool.acquire() };
+	if (!xferBuf)
+	{
+		std::cerr << "CLIENT: Out of transfer buffers.\n";
+		return FAILURE;
+	}
+
+	// Get file size, after REST only the part from the offset on is sent
+	long long file_size = (long long)std::filesystem::file_size(sArgument) - offset;
 	std::cout << " (" << file_size << " bytes)\n";
+	ifs.seekg(offset);
 
-	// Send file size
-	m_iSendResult = send(DataTransferSocket, reinterpret_cast<char*>(&file_size), sizeof(file_size), 0);
+	// Send file size, block mode marks the end of the file in the stream instead
+	if (m_blockMode)
+	{
+		// An empty file is a single EOF block
+		if (file_size == 0)
+			return sendBlocks(DataTransferSocket, xferBuf.data(), 0, true);
+	}
+	else if (sendAll(DataTransferSocket, reinterpret_cast<char*>(&file_size), sizeof(file_size)) != SUCCESS)
+	{
+		std::cerr << "WINSOCK: send() failed with error: " << WSAGetLastError() << '\n';
+		return FAILURE;
+	}
+
+	// Compressed mode reads into the compressor's own buffer
+	if (m_compression > 0)
+	{
+		ChunkCompressor compressor{ m_compression };
+		for (long long remainingData = file_size; remainingData > 0; )
+		{
+			ifs.read(compressor.input(), (std::streamsize)(std::min)(remainingData, (long long)COMPRESS_CHUNK_SIZE));
+			DWORD readLen{ (DWORD)ifs.gcount() };
+			if (readLen == 0)
+			{
+				std::cerr << "CLIENT: File ended " << remainingData << " bytes early.\n";
+				return FAILURE;
+			}
+
+			remainingData -= readLen;
+			if (compressor.send(DataTransferSocket, compressor.input(), readLen) != SUCCESS)
+				return FAILURE;
+		}
+
+		if (compressor.rawBytes > 0)
+			std::cout << "CLIENT: Compressed " << compressor.rawBytes << " bytes to " << compressor.sentBytes << " ("
+				<< 100.0 * compressor.sentBytes / compressor.rawBytes << "%).\n";
+		ifs.close();
+
+		return SUCCESS;
+	}
 
 	// Send file
 	// Loop while there's still data to send
-	for (int remainingData = file_size; remainingData > 0; remainingData -= m_iSendResult)
+	for (long long remainingData = file_size; remainingData > 0; )
 	{
-		ifs.read(xferBuf, xferBufLen);
-		m_iSendResult = send(DataTransferSocket, xferBuf, xferBufLen, 0);
-		if (m_iSendResult == SOCKET_ERROR)
+		ifs.read(xferBuf.data(), (std::streamsize)(std::min)(remainingData, (long long)xferBuf.size()));
+		int readLen{ (int)ifs.gcount() };
+		if (readLen <= 0)
+		{
+			std::cerr << "CLIENT: File ended " << remainingData << " bytes early.\n";
+			return FAILURE;
+		}
+
+		remainingData -= readLen;
+
+		if (m_blockMode)
+		{
+			if (sendBlocks(DataTransferSocket, xferBuf.data(), readLen, remainingData == 0) != SUCCESS)
+				return FAILURE;
+		}
+		else if (sendAll(DataTransferSocket, xferBuf.data(), readLen) != SUCCESS)
 		{
 			std::cerr << "WINSOCK: send() failed with error: " << WSAGetLastError() << '\n';
 			return FAILURE;
@@ -592,16 +1372,8 @@ int FTP_Client::storFile(std::ifstream& ifs)
 	COMMANDS
 ***********************************************/
 
-COMMAND FTP_Client::getCommand(std::string& sCommand)
+COMMAND FTP_Client::getCommand(std::string_view command)
 {
-	// Make all characters uppercase
-	for (auto& c : sCommand)
-		c = std::toupper(c);
-
-	// Search hash table for command
-	auto x = stringToCommand.find(sCommand);
-	if (x != std::end(stringToCommand))
-		return x->second;
-	else
-		return COMMAND::INVALID;
+	// Case-insensitive, no copy of the verb is made
+	return commandTable.find(command);
 }
\ No newline at end of file
@@ -1,19 +1,23 @@
 #pragma once
 
+#include "../../Common/src/FTP_Common.h"
+#include "../../Common/src/Commands.h"
+#include "../../Common/src/FileTransfer.h"
+#include "../../Common/src/BlockMode.h"
+#include "../../Common/src/Compression.h"
+#include "../../Common/src/Delta.h"
+#include "../../Common/src/LineBuffer.h"
+#include "../../Common/src/Replies.h"
+#include "Checkpoint.h"
+
 #include <ws2tcpip.h>
 
 #include <string>
-#include <map>
 
 // Need to tell the compiler to link Ws2_32.lib
 #pragma comment(lib, "Ws2_32.lib")
 
-// Return constants
-constexpr int SUCCESS{ 0 };
-constexpr int FAILURE{ 1 };
-
 // Buffer constants
-constexpr int TRANSFER_BYTE_SYZE{ 8 };
 constexpr int DEFAULT_BUFLEN{ 512 };
 
 // IP Address and Port constants
@@ -21,25 +25,41 @@ constexpr const char* IP_ADDRESS{ "192.168.0.2" };
 constexpr const char* DATA_PORT{ "20" };
 constexpr const char* CONTROL_PORT{ "21" };
 
+// Segmented download limits
+constexpr unsigned int DEFAULT_SEGMENTS{ 4 };
+constexpr unsigned int MAX_SEGMENTS{ 16 };
+constexpr long long MIN_SEGMENT_SIZE{ 1024 * 1024 };	// Smaller ranges are not worth a connection
+
+// Uploads at least this large are offered to the server's content store first
+constexpr long long DEDUP_MIN_SIZE{ 1024 * 1024 };
+
 // Use Winsock version 2.2
 constexpr WORD WINSOCK_VER{ MAKEWORD(2, 2) };
 
 enum class COMMAND
 {
-	INVALID, RETR, STOR, HELP, QUIT, MKD, PWD, CWD, LIST
+	INVALID, RETR, STOR, HELP, QUIT, MKD, PWD, CWD, LIST, PASV, MODE, PGET, NLST, MLSD, XDLT, XDGT
 };
 
-static std::map<std::string, COMMAND> stringToCommand
-{
-		{"RETR", COMMAND::RETR },
-		{"STOR", COMMAND::STOR },
-		{"HELP", COMMAND::HELP },
-		{"QUIT", COMMAND::QUIT },
-		{"MKD", COMMAND::MKD },
-		{"PWD", COMMAND::PWD },
-		{"CWD", COMMAND::CWD },
-		{"LIST", COMMAND::LIST }
-};
+// Verbs, looked up through a perfect hash built at compile time
+inline constexpr CommandTable<COMMAND> commandTable
+{ {
+		{ "RETR", COMMAND::RETR },
+		{ "STOR", COMMAND::STOR },
+		{ "HELP", COMMAND::HELP },
+		{ "QUIT", COMMAND::QUIT },
+		{ "MKD", COMMAND::MKD },
+		{ "PWD", COMMAND::PWD },
+		{ "CWD", COMMAND::CWD },
+		{ "LIST", COMMAND::LIST },
+		{ "PASV", COMMAND::PASV },
+		{ "MODE", COMMAND::MODE },
+		{ "PGET", COMMAND::PGET },
+		{ "NLST", COMMAND::NLST },
+		{ "MLSD", COMMAND::MLSD },
+		{ "XDLT", COMMAND::XDLT },
+		{ "XDGT", COMMAND::XDGT }
+} };
 
 class FTP_Client
 {
@@ -55,6 +75,20 @@ private: // Variables
 	SOCKET DataListenSocket;	// SOCKET for Client to listen for Server data connections
 	SOCKET DataTransferSocket;	// SOCKET for the data transfer connection
 
+	// Passive mode, the client connects to a port the server listens on
+	bool m_passive;
+	unsigned short m_passivePort;	// Port from the last EPSV reply, 0 if none
+
+	// Block mode, the data connection stays open between files
+	bool m_blockMode;
+
+	// Compressed mode level, 0 if off
+	int m_compression;
+
+	// XDUP is offered until the server says it has no content store
+	bool m_dedup;
+	bool m_dedupAsked;
+
 	// Used for DNS Lookup
 	sockaddr_in serverAddr;		// Server's socket address
 	int serverAddrSize;
@@ -68,6 +102,12 @@ private: // Variables
 	// Command stuff
 	std::string sCommand, sArgument;
 
+	// Reply lines received but not read yet
+	LineBuffer m_controlBuffer;
+
+	// Buffer for the copy paths
+	TransferBufferPool m_bufferPool;
+
 private: // Functions
 	// Winsock and User-PI
 	int InitializeWinsock();
@@ -76,17 +116,30 @@ private: // Functions
 
 	// Main loop
 	int ControlProcess();
+	int recvReply(char* msgBuf, int msgBufLen);
 
 	// User-DTP
 	int EstablishDataConnection(); // TCP Connection
 	int AcceptDataConnection();
+	int OpenDataConnection(char* msgBuf, int msgBufLen);
+	int RequestPassivePort();
+	void CloseDataListener();
+	void endTransfer(const char* reply, int result);
 
 	// FTP Commands
-	int retrFile();
-	int storFile(std::ifstream& ifs);
+	int retrFile(long long offset);
+	int storFile(std::ifstream& ifs, long long offset);
+	long long resumeRetr();
+	long long resumeStor();
+	bool dedupStor();
+	int parallelRetr(unsigned int streams);
+	int fetchRange(HANDLE hFile, const std::string& directory, long long offset, long long length);
+	int listDirectory(const std::string& request);
+	int retrListing(std::string& listing);
+	int deltaTransfer(const std::string& request, bool upload);
 
 	// Commands and input
-	COMMAND getCommand(std::string& command);
+	COMMAND getCommand(std::string_view command);
 
 public:
 	FTP_Client();
@@ -97,5 +150,14 @@ public:
 };
 
 // Reply codes
+constexpr int CONNECTION_OPEN{ 125 };
 constexpr int FILE_OKAY{ 150 };
-constexpr int COMMAND_OKAY{ 200 };
\ No newline at end of file
+constexpr int COMMAND_OKAY{ 200 };
+constexpr int FILE_STATUS{ 213 };
+constexpr int SERVICE_READY{ 220 };
+constexpr int CLOSING_DATA_CONNECTION{ 226 };
+constexpr int EXTENDED_PASSIVE_MODE{ 229 };
+constexpr int FILE_ACTION_OKAY{ 250 };
+constexpr int PATHNAME_CREATED{ 257 };
+constexpr int PENDING_FURTHER_INFORMATION{ 350 };
+constexpr int COMMAND_NOT_IMPLEMENTED{ 502 };
\ No newline at end of file
@@ -0,0 +1,871 @@
+#include "LoadGen.h"
+
+#include <psapi.h>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <algorithm>
+
+/***********************************************
+// Helper Functions
+***********************************************/
+
+// Microseconds on a monotonic clock
+long long now()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+unsigned long long splitMix(unsigned long long x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+// Every 8 bytes come from one hash of the file id and the position
+void fillPattern(char* data, std::size_t length, unsigned int id, long long offset)
+{
+	unsigned long long seed{ (unsigned long long)id << 40 };
+	for (std::size_t i = 0; i < length; )
+	{
+		long long position{ offset + (long long)i };
+		unsigned long long word{ splitMix(seed ^ (unsigned long long)(position >> 3)) };
+		for (int b = (int)(position & 7); b < 8 && i < length; ++b, ++i)
+			data[i] = (char)(word >> (b * 8));
+	}
+}
+
+bool checkPattern(const char* data, std::size_t length, unsigned int id, long long offset)
+{
+	unsigned long long seed{ (unsigned long long)id << 40 };
+	for (std::size_t i = 0; i < length; )
+	{
+		long long position{ offset + (long long)i };
+		unsigned long long word{ splitMix(seed ^ (unsigned long long)(position >> 3)) };
+		for (int b = (int)(position & 7); b < 8 && i < length; ++b, ++i)
+		{
+			if (data[i] != (char)(word >> (b * 8)))
+				return false;
+		}
+	}
+	return true;
+}
+
+// Latency at quantile q of sorted samples, in milliseconds
+double percentileMs(const std::vector<long long>& sorted, double q)
+{
+	if (sorted.empty())
+		return 0.0;
+
+	std::size_t rank{ (std::size_t)(q * sorted.size()) };
+	return sorted[(std::min)(rank, sorted.size() - 1)] / 1e3;
+}
+
+std::string jsonString(const std::string& text)
+{
+	std::string quoted{ "\"" };
+	for (char c : text)
+	{
+		if (c == '"' || c == '\\')
+			quoted += '\\';
+		if ((unsigned char)c >= 0x20)
+			quoted += c;
+	}
+	return quoted + '"';
+}
+
+/***********************************************
+	Connection
+***********************************************/
+Connection::Connection(Relay* relay) :
+	ControlSocket{ INVALID_SOCKET },
+	m_controlBuffer{},
+	m_serverAddr{},
+	m_dataPort{ 0 },
+	m_reply{},
+	m_relay{ relay }
+{
+}
+
+Connection::~Connection()
+{
+	close();
+}
+
+int Connection::open(const sockaddr_in& serverAddr)
+{
+	m_serverAddr = serverAddr;
+
+	ControlSocket = connectTo(m_serverAddr);
+	if (ControlSocket == INVALID_SOCKET)
+		return FAILURE;
+
+	// Commands are small, they must not wait for the previous one's ack
+	BOOL noDelay{ TRUE };
+	setsockopt(ControlSocket, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+
+	return expect(SERVICE_READY);
+}
+
+void Connection::close()
+{
+	if (ControlSocket == INVALID_SOCKET)
+		return;
+
+	// No need to wait for the goodbye
+	send(ControlSocket, "QUIT\r\n", 6, 0);
+	closesocket(ControlSocket);
+
+	ControlSocket = INVALID_SOCKET;
+	m_controlBuffer.clear();
+	m_dataPort = 0;
+}
+
+int Connection::command(const std::string& request, int expectedCode)
+{
+	return exchange(ControlSocket, m_controlBuffer, request, expectedCode, m_reply);
+}
+
+int Connection::expect(int expectedCode)
+{
+	return readReply(ControlSocket, m_controlBuffer, expectedCode, m_reply);
+}
+
+int Connection::receive()
+{
+	return receiveReply(ControlSocket, m_controlBuffer, m_reply);
+}
+
+int Connection::openData(SOCKET& dataSocket)
+{
+	if (m_dataPort == 0 &&
+		(command("EPSV", EXTENDED_PASSIVE_MODE) != SUCCESS || parsePassivePort(m_reply, m_dataPort) != SUCCESS))
+		return FAILURE;
+
+	// Same address as the control connection
+	sockaddr_in dataAddr{ m_serverAddr };
+	dataAddr.sin_port = htons(m_dataPort);
+
+	dataSocket = connectTo(dataAddr);
+	return (dataSocket != INVALID_SOCKET) ? SUCCESS : FAILURE;
+}
+
+SOCKET Connection::connectTo(const sockaddr_in& addr)
+{
+	if (m_relay)
+		return m_relay->open(addr);
+
+	SOCKET s = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (s == INVALID_SOCKET)
+	{
+		std::cerr << "WINSOCK: socket() failed with error: " << WSAGetLastError() << '\n';
+		return INVALID_SOCKET;
+	}
+
+	if (connect(s, (const sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR)
+	{
+		std::cerr << "WINSOCK: connect() failed with error: " << WSAGetLastError() << '\n';
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+
+	return s;
+}
+
+/***********************************************
+	Constructor
+***********************************************/
+LoadGen::LoadGen(const LoadConfig& config) :
+	m_config{ config },
+	wsaData{ NULL },
+	serverAddr{},
+	m_totalWeight{ 0 },
+	m_stop{ false },
+	m_idleAcceptRate{ 0.0 }
+{
+}
+
+/***********************************************
+	Destructor
+***********************************************/
+LoadGen::~LoadGen()
+{
+	m_idle.clear();
+	m_relay.reset();
+	WSACleanup();
+}
+
+/***********************************************
+	Setup
+***********************************************/
+int LoadGen::init()
+{
+	if (InitializeWinsock() != SUCCESS) return FAILURE;
+	if (ResolveServer() != SUCCESS) return FAILURE;
+
+	// Lay out the file set, every file gets its own pattern
+	for (const FileClass& fileClass : m_config.files)
+	{
+		m_classFirst.push_back(m_files.size());
+		m_totalWeight += fileClass.weight;
+		for (unsigned int i = 0; i < fileClass.count; ++i)
+		{
+			unsigned int id{ (unsigned int)m_files.size() + 1 };
+			m_files.push_back({ std::string{ LOADGEN_DIRECTORY } + '/' + fileClass.name + '-' + std::to_string(i), id, fileClass.size });
+		}
+	}
+	if (m_files.empty() || m_totalWeight == 0)
+	{
+		std::cerr << "LOADGEN: The file set is empty.\n";
+		return FAILURE;
+	}
+
+	if (PrepareFiles() != SUCCESS) return FAILURE;
+	if (OpenIdleConnections() != SUCCESS) return FAILURE;
+
+	// Only the runs go through the relay, setup and idle connections do not
+	if (m_config.delay > 0)
+	{
+		m_relay = std::make_unique<Relay>(m_config.delay);
+		if (m_relay->init() != SUCCESS) return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
+int LoadGen::InitializeWinsock()
+{
+	int iResult = WSAStartup(WINSOCK_VER, &wsaData);
+	if (iResult != SUCCESS)
+	{
+		std::cerr << "WINSOCK: WSAStartup() failed with error: " << iResult << '\n';
+		return FAILURE;
+	}
+	return SUCCESS;
+}
+
+int LoadGen::ResolveServer()
+{
+	addrinfo hints{}, * result{ NULL };
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	int iResult = getaddrinfo(m_config.host.c_str(), m_config.port.c_str(), &hints, &result);
+	if (iResult != SUCCESS)
+	{
+		std::cerr << "WINSOCK: getaddrinfo() failed with error: " << iResult << '\n';
+		return FAILURE;
+	}
+
+	serverAddr = *reinterpret_cast<sockaddr_in*>(result->ai_addr);
+	freeaddrinfo(result);
+	return SUCCESS;
+}
+
+// Uploads the files the server does not have yet, a file of the
+// right size is assumed to be from an earlier run
+int LoadGen::PrepareFiles()
+{
+	Connection connection{};
+	if (connection.open(serverAddr) != SUCCESS)
+	{
+		std::cerr << "LOADGEN: Unable to connect to " << m_config.host << ':' << m_config.port << '\n';
+		return FAILURE;
+	}
+
+	// Already existing is fine
+	connection.command(std::string{ "MKD " } + LOADGEN_DIRECTORY, PATHNAME_CREATED);
+	connection.command(std::string{ "MKD " } + LOADGEN_SUBDIRECTORY, PATHNAME_CREATED);
+
+	std::vector<char> buffer(LOADGEN_BUFLEN);
+	unsigned long long uploaded{ 0 };
+	std::size_t files{ 0 };
+	for (const FileRef& file : m_files)
+	{
+		long long size{ 0 };
+		if (connection.command("SIZE " + file.path, FILE_STATUS) == SUCCESS &&
+			parseFileSize(connection.reply(), size) == SUCCESS && size == file.size)
+			continue;
+
+		if (stor(connection, file, buffer, uploaded) != SUCCESS)
+		{
+			std::cerr << "LOADGEN: Unable to upload " << file.path << ": " << connection.reply() << '\n';
+			return FAILURE;
+		}
+		++files;
+	}
+
+	std::cout << "LOADGEN: " << m_files.size() << " files in the set, uploaded " << files
+		<< " (" << uploaded << " bytes).\n";
+	return SUCCESS;
+}
+
+// Holds connections that never send a command, like a server full of idle clients
+int LoadGen::OpenIdleConnections()
+{
+	if (m_config.idle == 0)
+		return SUCCESS;
+
+	long long started{ now() };
+	for (unsigned int i = 0; i < m_config.idle; ++i)
+	{
+		auto connection{ std::make_unique<Connection>() };
+		if (connection->open(serverAddr) != SUCCESS)
+		{
+			std::cerr << "LOADGEN: The server accepted " << i << " of " << m_config.idle << " idle connections.\n";
+			break;
+		}
+		m_idle.push_back(std::move(connection));
+	}
+
+	double seconds{ (now() - started) / 1e6 };
+	m_idleAcceptRate = (seconds > 0) ? m_idle.size() / seconds : 0.0;
+
+	std::cout << "LOADGEN: Holding " << m_idle.size() << " idle connections, accepted at "
+		<< (long long)m_idleAcceptRate << " per second.\n";
+	return SUCCESS;
+}
+
+/***********************************************
+	Runs
+***********************************************/
+int LoadGen::runAll()
+{
+	// Stream counts only matter with PGET in the mix
+	std::vector<unsigned int> streams{ 0 };
+	if (m_config.mix[(std::size_t)OP::PGET] > 0)
+		streams = m_config.streams;
+
+	for (unsigned int clients : m_config.clients)
+	{
+		for (unsigned int count : streams)
+		{
+			m_runs.push_back(run(clients, count));
+			printRun(m_runs.back());
+		}
+	}
+
+	if (!m_config.jsonPath.empty())
+		return writeJson();
+
+	return SUCCESS;
+}
+
+RunResults LoadGen::run(unsigned int clients, unsigned int streams)
+{
+	RunResults results{};
+	results.clients = clients;
+	results.streams = streams;
+
+	std::vector<ClientResults> clientResults(clients);
+	m_stop = false;
+
+	// The server is sampled for as long as the clients run
+	std::atomic<bool> sampling{ true };
+	std::thread sampler{ [this, &results, &sampling]
+		{
+			results.server = sampleServer(sampling);
+		} };
+
+	long long started{ now() };
+	std::vector<std::thread> threads{};
+	for (unsigned int i = 0; i < clients; ++i)
+		threads.emplace_back(&LoadGen::runClient, this, i, streams, std::ref(clientResults[i]));
+
+	std::this_thread::sleep_for(std::chrono::duration<double>{ m_config.duration });
+	m_stop = true;
+
+	// Operations still running are finished and counted
+	for (auto& thread : threads)
+		thread.join();
+	results.seconds = (now() - started) / 1e6;
+
+	sampling = false;
+	sampler.join();
+
+	for (const ClientResults& client : clientResults)
+	{
+		for (std::size_t op = 0; op < OP_COUNT; ++op)
+		{
+			OpResults& total{ results.ops[op] };
+			total.latencies.insert(total.latencies.end(), client[op].latencies.begin(), client[op].latencies.end());
+			total.errors += client[op].errors;
+			total.bytes += client[op].bytes;
+		}
+	}
+	for (OpResults& op : results.ops)
+		std::sort(op.latencies.begin(), op.latencies.end());
+
+	return results;
+}
+
+int LoadGen::openSession(Connection& connection)
+{
+	if (connection.open(serverAddr) != SUCCESS ||
+		connection.command(std::string{ "CWD " } + LOADGEN_DIRECTORY, COMMAND_OKAY) != SUCCESS)
+	{
+		connection.close();
+		return FAILURE;
+	}
+	return SUCCESS;
+}
+
+void LoadGen::runClient(unsigned int id, unsigned int streams, ClientResults& results)
+{
+	std::mt19937 rng{ m_config.seed * 7919u + id };
+	std::vector<char> buffer(LOADGEN_BUFLEN);
+	Connection connection{ m_relay.get() };
+	bool inSubdirectory{ false };
+
+	// Uploads overwrite one file per client, sized like the smallest class
+	long long uploadSize{ m_config.files.front().size };
+	for (const FileClass& fileClass : m_config.files)
+		uploadSize = (std::min)(uploadSize, fileClass.size);
+	FileRef upload{ std::string{ LOADGEN_DIRECTORY } + "/stor-" + std::to_string(id), 1000000 + id, uploadSize };
+
+	while (!m_stop)
+	{
+		OP op{ pickOp(rng) };
+		unsigned long long bytes{ 0 };
+		int iResult{ FAILURE };
+
+		long long started{ now() };
+		if (connection.isOpen() || openSession(connection) == SUCCESS)
+		{
+			switch (op)
+			{
+			case OP::RETR:
+			{
+				const FileRef& file{ pickFile(rng) };
+				iResult = retr(connection, file, 0, file.size, -1, m_config.verify, buffer, bytes);
+			} break;
+			case OP::STOR:
+				iResult = stor(connection, upload, buffer, bytes);
+				break;
+			case OP::LIST:
+				iResult = list(connection, buffer, bytes);
+				break;
+			case OP::CWD:
+			{
+				inSubdirectory = !inSubdirectory;
+				iResult = connection.command(std::string{ "CWD " } + (inSubdirectory ? LOADGEN_SUBDIRECTORY : LOADGEN_DIRECTORY), COMMAND_OKAY);
+			} break;
+			case OP::RANG:
+				iResult = rang(connection, pickLargest(rng), rng, buffer, bytes);
+				break;
+			case OP::RESUME:
+				iResult = resume(connection, pickLargest(rng), rng, buffer, bytes);
+				break;
+			case OP::PGET:
+				iResult = pget(connection, pickLargest(rng), streams, buffer, bytes);
+				break;
+			default:
+				break;
+			}
+		}
+		else
+			std::this_thread::sleep_for(std::chrono::milliseconds{ 100 }); // Server refused, back off
+
+		OpResults& result{ results[(std::size_t)op] };
+		if (iResult == SUCCESS)
+		{
+			result.latencies.push_back(now() - started);
+			result.bytes += bytes;
+		}
+		else
+		{
+			// The conversation may be out of step, start a new session
+			++result.errors;
+			connection.close();
+			inSubdirectory = false;
+		}
+	}
+}
+
+OP LoadGen::pickOp(std::mt19937& rng)
+{
+	unsigned int total{ 0 };
+	for (unsigned int weight : m_config.mix)
+		total += weight;
+
+	unsigned int draw{ std::uniform_int_distribution<unsigned int>{ 0, total - 1 }(rng) };
+	for (std::size_t op = 0; op < OP_COUNT; ++op)
+	{
+		if (draw < m_config.mix[op])
+			return (OP)op;
+		draw -= m_config.mix[op];
+	}
+	return OP::RETR;
+}
+
+// A class by its weight, then any file of it
+const FileRef& LoadGen::pickFile(std::mt19937& rng)
+{
+	unsigned int draw{ std::uniform_int_distribution<unsigned int>{ 0, m_totalWeight - 1 }(rng) };
+	std::size_t fileClass{ 0 };
+	while (draw >= m_config.files[fileClass].weight)
+		draw -= m_config.files[fileClass++].weight;
+
+	unsigned int count{ m_config.files[fileClass].count };
+	return m_files[m_classFirst[fileClass] + std::uniform_int_distribution<unsigned int>{ 0, count - 1 }(rng)];
+}
+
+// Range and resume tests want a file big enough to cut
+const FileRef& LoadGen::pickLargest(std::mt19937& rng)
+{
+	std::size_t largest{ 0 };
+	for (std::size_t i = 1; i < m_config.files.size(); ++i)
+	{
+		if (m_config.files[i].size > m_config.files[largest].size)
+			largest = i;
+	}
+
+	unsigned int count{ m_config.files[largest].count };
+	return m_files[m_classFirst[largest] + std::uniform_int_distribution<unsigned int>{ 0, count - 1 }(rng)];
+}
+
+/***********************************************
+	Operations
+***********************************************/
+// Downloads bytes offset to end of the file. With cutAfter set the data
+// connection is reset once that many bytes arrived, like a dropped link.
+int LoadGen::retr(Connection& connection, const FileRef& file, long long offset, long long end,
+	long long cutAfter, bool verify, std::vector<char>& buffer, unsigned long long& bytes)
+{
+	// Part of a file needs RANG, the rest of one REST
+	if (end < file.size)
+	{
+		if (connection.command("RANG " + std::to_string(offset) + ' ' + std::to_string(end - 1), PENDING_FURTHER_INFORMATION) != SUCCESS)
+			return FAILURE;
+	}
+	else if (offset > 0 && connection.command("REST " + std::to_string(offset), PENDING_FURTHER_INFORMATION) != SUCCESS)
+		return FAILURE;
+
+	SOCKET dataSocket{ INVALID_SOCKET };
+	if (connection.command("RETR " + file.path, FILE_OKAY) != SUCCESS ||
+		connection.openData(dataSocket) != SUCCESS)
+		return FAILURE;
+
+	int iResult{ FAILURE };
+	long long size{ 0 }, received{ 0 };
+	bool cut{ false };
+	if (connection.expect(CONNECTION_OPEN) == SUCCESS &&
+		recv(dataSocket, reinterpret_cast<char*>(&size), sizeof(size), MSG_WAITALL) == sizeof(size) &&
+		size == end - offset)
+	{
+		iResult = SUCCESS;
+		while (received < size && iResult == SUCCESS)
+		{
+			if (cutAfter >= 0 && received >= cutAfter)
+			{
+				// Reset instead of a graceful close, the server sees a broken connection
+				linger abort{ 1, 0 };
+				setsockopt(dataSocket, SOL_SOCKET, SO_LINGER, (const char*)&abort, sizeof(abort));
+				cut = true;
+				break;
+			}
+
+			long long wanted{ (std::min)((long long)buffer.size(), size - received) };
+			if (cutAfter >= 0)
+				wanted = (std::min)(wanted, cutAfter - received);
+
+			int iRecv = recv(dataSocket, buffer.data(), (int)wanted, 0);
+			if (iRecv <= 0)
+				iResult = FAILURE;
+			else
+			{
+				if (verify && !checkPattern(buffer.data(), (std::size_t)iRecv, file.id, offset + received))
+				{
+					std::cerr << "LOADGEN: " << file.path << " differs at byte " << offset + received << '\n';
+					iResult = FAILURE;
+				}
+				received += iRecv;
+			}
+		}
+	}
+	closesocket(dataSocket);
+	bytes += (unsigned long long)received;
+
+	// A cut transfer ends with a failure reply, or 226 if the server was already done
+	if (cut)
+		return connection.receive();
+	if (iResult == SUCCESS)
+		iResult = connection.expect(CLOSING_DATA_CONNECTION);
+
+	return iResult;
+}
+
+// The listing comes over the data connection, framed like a file
+int LoadGen::list(Connection& connection, std::vector<char>& buffer, unsigned long long& bytes)
+{
+	SOCKET dataSocket{ INVALID_SOCKET };
+	if (connection.command("LIST", FILE_OKAY) != SUCCESS ||
+		connection.openData(dataSocket) != SUCCESS)
+		return FAILURE;
+
+	int iResult{ FAILURE };
+	long long size{ 0 }, received{ 0 };
+	if (connection.expect(CONNECTION_OPEN) == SUCCESS &&
+		recv(dataSocket, reinterpret_cast<char*>(&size), sizeof(size), MSG_WAITALL) == sizeof(size))
+	{
+		iResult = SUCCESS;
+		while (received < size && iResult == SUCCESS)
+		{
+			int iRecv = recv(dataSocket, buffer.data(), (int)(std::min)((long long)buffer.size(), size - received), 0);
+			if (iRecv <= 0)
+				iResult = FAILURE;
+			else
+				received += iRecv;
+		}
+	}
+	closesocket(dataSocket);
+	bytes += (unsigned long long)received;
+
+	if (iResult == SUCCESS)
+		iResult = connection.expect(CLOSING_DATA_CONNECTION);
+
+	return iResult;
+}
+
+int LoadGen::stor(Connection& connection, const FileRef& file, std::vector<char>& buffer, unsigned long long& bytes)
+{
+	SOCKET dataSocket{ INVALID_SOCKET };
+	if (connection.command("STOR " + file.path, FILE_OKAY) != SUCCESS ||
+		connection.openData(dataSocket) != SUCCESS)
+		return FAILURE;
+
+	int iResult{ FAILURE };
+	long long size{ file.size };
+	if (connection.expect(CONNECTION_OPEN) == SUCCESS &&
+		sendAll(dataSocket, reinterpret_cast<char*>(&size), sizeof(size)) == SUCCESS)
+	{
+		iResult = SUCCESS;
+		for (long long sent = 0; sent < size && iResult == SUCCESS; )
+		{
+			int chunk{ (int)(std::min)((long long)buffer.size(), size - sent) };
+			fillPattern(buffer.data(), (std::size_t)chunk, file.id, sent);
+			iResult = sendAll(dataSocket, buffer.data(), chunk);
+			sent += chunk;
+		}
+	}
+
+	// The server replies once it has every byte
+	if (iResult == SUCCESS)
+	{
+		iResult = connection.expect(CLOSING_DATA_CONNECTION);
+		bytes += (unsigned long long)size;
+	}
+	closesocket(dataSocket);
+
+	return iResult;
+}
+
+// One segment of a segmented download
+int LoadGen::rang(Connection& connection, const FileRef& file, std::mt19937& rng, std::vector<char>& buffer, unsigned long long& bytes)
+{
+	long long length{ (std::min)(file.size, std::uniform_int_distribution<long long>{ MIN_RANGE_SIZE, MAX_RANGE_SIZE }(rng)) };
+	long long offset{ std::uniform_int_distribution<long long>{ 0, file.size - length }(rng) };
+
+	return retr(connection, file, offset, offset + length, -1, m_config.verify, buffer, bytes);
+}
+
+// Fault injection: the download is cut at a random byte and finished
+// with REST, both parts are checked so the result is the file byte for byte
+int LoadGen::resume(Connection& connection, const FileRef& file, std::mt19937& rng, std::vector<char>& buffer, unsigned long long& bytes)
+{
+	if (file.size < 2)
+		return retr(connection, file, 0, file.size, -1, true, buffer, bytes);
+
+	long long cutAfter{ std::uniform_int_distribution<long long>{ 1, file.size - 1 }(rng) };
+	unsigned long long firstPart{ 0 };
+	if (retr(connection, file, 0, file.size, cutAfter, true, buffer, firstPart) != SUCCESS ||
+		firstPart != (unsigned long long)cutAfter)
+		return FAILURE;
+
+	bytes += firstPart;
+	return retr(connection, file, cutAfter, file.size, -1, true, buffer, bytes);
+}
+
+// One file split into as many ranges as streams, each fetched over its
+// own session at the same time like the client's PGET. The first range
+// uses the client's connection, the others connect for the download.
+int LoadGen::pget(Connection& connection, const FileRef& file, unsigned int streams, std::vector<char>& buffer, unsigned long long& bytes)
+{
+	std::size_t ranges{ (std::size_t)(std::max)(1LL, (std::min)((long long)streams, file.size)) };
+	std::vector<int> results(ranges, FAILURE);
+	std::vector<unsigned long long> received(ranges, 0);
+
+	std::vector<std::thread> threads{};
+	for (std::size_t i = 1; i < ranges; ++i)
+	{
+		threads.emplace_back([this, &file, &results, &received, ranges, i]
+			{
+				Connection range{ m_relay.get() };
+				std::vector<char> rangeBuffer(LOADGEN_BUFLEN);
+				if (openSession(range) == SUCCESS)
+					results[i] = retr(range, file, file.size * (long long)i / (long long)ranges,
+						file.size * (long long)(i + 1) / (long long)ranges, -1, m_config.verify, rangeBuffer, received[i]);
+			});
+	}
+	results[0] = retr(connection, file, 0, file.size / (long long)ranges, -1, m_config.verify, buffer, received[0]);
+
+	for (auto& thread : threads)
+		thread.join();
+
+	int iResult{ SUCCESS };
+	for (std::size_t i = 0; i < ranges; ++i)
+	{
+		bytes += received[i];
+		if (results[i] != SUCCESS)
+			iResult = FAILURE;
+	}
+	return iResult;
+}
+
+/***********************************************
+	Server Process
+***********************************************/
+ServerUsage LoadGen::sampleServer(const std::atomic<bool>& running)
+{
+	ServerUsage usage{};
+	if (m_config.serverPid == 0)
+		return usage;
+
+	HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION | PROCESS_VM_READ, FALSE, m_config.serverPid);
+	if (hProcess == NULL)
+	{
+		std::cerr << "LOADGEN: OpenProcess() failed with error: " << GetLastError() << '\n';
+		return usage;
+	}
+
+	// Kernel and user time together, in seconds
+	auto cpuSeconds = [hProcess]()
+	{
+		FILETIME creation{}, exit{}, kernel{}, user{};
+		if (!GetProcessTimes(hProcess, &creation, &exit, &kernel, &user))
+			return 0.0;
+		unsigned long long k{ ((unsigned long long)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime };
+		unsigned long long u{ ((unsigned long long)user.dwHighDateTime << 32) | user.dwLowDateTime };
+		return (k + u) / 1e7;
+	};
+
+	double startCpu{ cpuSeconds() };
+	while (running)
+	{
+		PROCESS_MEMORY_COUNTERS counters{};
+		if (GetProcessMemoryInfo(hProcess, &counters, sizeof(counters)))
+			usage.peakWorkingSet = (std::max)(usage.peakWorkingSet, (unsigned long long)counters.WorkingSetSize);
+		std::this_thread::sleep_for(std::chrono::milliseconds{ SAMPLE_INTERVAL_MS });
+	}
+	usage.cpuSeconds = cpuSeconds() - startCpu;
+	usage.valid = true;
+
+	CloseHandle(hProcess);
+	return usage;
+}
+
+/***********************************************
+	Results
+***********************************************/
+void LoadGen::printRun(const RunResults& run)
+{
+	char line[160];
+	std::cout << '\n' << run.clients << " clients, ";
+	if (run.streams > 0)
+		std::cout << run.streams << " streams per PGET, ";
+	std::cout << run.seconds << " s\n";
+
+	std::snprintf(line, sizeof(line), "%-7s %9s %7s %10s %10s %9s %9s %9s\n",
+		"Op", "Count", "Errors", "Ops/s", "MB/s", "p50 ms", "p99 ms", "p999 ms");
+	std::cout << line;
+
+	unsigned long long totalCount{ 0 }, totalErrors{ 0 }, totalBytes{ 0 };
+	for (std::size_t op = 0; op < OP_COUNT; ++op)
+	{
+		const OpResults& result{ run.ops[op] };
+		if (result.latencies.empty() && result.errors == 0)
+			continue;
+
+		std::snprintf(line, sizeof(line), "%-7s %9zu %7llu %10.1f %10.2f %9.3f %9.3f %9.3f\n",
+			opName((OP)op), result.latencies.size(), result.errors,
+			result.latencies.size() / run.seconds, result.bytes / 1e6 / run.seconds,
+			percentileMs(result.latencies, 0.5), percentileMs(result.latencies, 0.99), percentileMs(result.latencies, 0.999));
+		std::cout << line;
+
+		totalCount += result.latencies.size();
+		totalErrors += result.errors;
+		totalBytes += result.bytes;
+	}
+
+	std::snprintf(line, sizeof(line), "%-7s %9llu %7llu %10.1f %10.2f\n",
+		"Total", totalCount, totalErrors, totalCount / run.seconds, totalBytes / 1e6 / run.seconds);
+	std::cout << line;
+
+	if (run.server.valid)
+		std::cout << "Server: " << 100.0 * run.server.cpuSeconds / run.seconds << "% of a core, peak working set "
+			<< run.server.peakWorkingSet / (1024 * 1024) << " MiB\n";
+}
+
+int LoadGen::writeJson()
+{
+	std::ofstream ofs{ m_config.jsonPath, std::ios_base::trunc };
+	if (!ofs)
+	{
+		std::cerr << "LOADGEN: Unable to write " << m_config.jsonPath << '\n';
+		return FAILURE;
+	}
+
+	ofs << "{\n  \"label\": " << jsonString(m_config.label)
+		<< ",\n  \"host\": " << jsonString(m_config.host + ':' + m_config.port)
+		<< ",\n  \"duration\": " << m_config.duration
+		<< ",\n  \"delay_ms\": " << m_config.delay
+		<< ",\n  \"idle\": { \"connections\": " << m_idle.size() << ", \"accept_per_s\": " << m_idleAcceptRate << " }"
+		<< ",\n  \"files\": [";
+	for (std::size_t i = 0; i < m_config.files.size(); ++i)
+	{
+		const FileClass& fileClass{ m_config.files[i] };
+		ofs << (i ? ", " : "") << "{ \"name\": " << jsonString(fileClass.name) << ", \"count\": " << fileClass.count
+			<< ", \"size\": " << fileClass.size << ", \"weight\": " << fileClass.weight << " }";
+	}
+	ofs << "],\n  \"runs\": [";
+
+	for (std::size_t r = 0; r < m_runs.size(); ++r)
+	{
+		const RunResults& run{ m_runs[r] };
+		ofs << (r ? "," : "") << "\n    { \"clients\": " << run.clients << ", \"streams\": " << run.streams << ", \"seconds\": " << run.seconds;
+		if (run.server.valid)
+			ofs << ", \"server\": { \"cpu_percent\": " << 100.0 * run.server.cpuSeconds / run.seconds
+				<< ", \"peak_rss_bytes\": " << run.server.peakWorkingSet << " }";
+		ofs << ", \"ops\": {";
+
+		bool first{ true };
+		for (std::size_t op = 0; op < OP_COUNT; ++op)
+		{
+			const OpResults& result{ run.ops[op] };
+			if (result.latencies.empty() && result.errors == 0)
+				continue;
+
+			ofs << (first ? "" : ",") << "\n      \"" << opName((OP)op) << "\": { \"count\": " << result.latencies.size()
+				<< ", \"errors\": " << result.errors
+				<< ", \"ops_per_s\": " << result.latencies.size() / run.seconds
+				<< ", \"mb_per_s\": " << result.bytes / 1e6 / run.seconds
+				<< ", \"p50_ms\": " << percentileMs(result.latencies, 0.5)
+				<< ", \"p99_ms\": " << percentileMs(result.latencies, 0.99)
+				<< ", \"p999_ms\": " << percentileMs(result.latencies, 0.999) << " }";
+			first = false;
+		}
+		ofs << " } }";
+	}
+	ofs << "\n  ]\n}\n";
+
+	std::cout << "\nLOADGEN: Results written to " << m_config.jsonPath << '\n';
+	return ofs ? SUCCESS : FAILURE;
+}
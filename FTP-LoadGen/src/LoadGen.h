@@ -0,0 +1,261 @@
+#pragma once
+
+#include "../../Common/src/FTP_Common.h"
+#include "../../Common/src/FileTransfer.h"
+#include "../../Common/src/LineBuffer.h"
+#include "../../Common/src/Replies.h"
+#include "Relay.h"
+
+#include <ws2tcpip.h>
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+// Need to tell the compiler to link Ws2_32.lib and Psapi.lib
+#pragma comment(lib, "Ws2_32.lib")
+#pragma comment(lib, "Psapi.lib")
+
+// Use Winsock version 2.2
+constexpr WORD WINSOCK_VER{ MAKEWORD(2, 2) };
+
+// Defaults
+constexpr const char* DEFAULT_HOST{ "127.0.0.1" };
+constexpr const char* CONTROL_PORT{ "21" };
+constexpr unsigned int DEFAULT_CLIENTS{ 16 };
+constexpr double DEFAULT_DURATION{ 30.0 };	// Seconds per run
+
+// Server directory holding the file set, created by the first run
+constexpr const char* LOADGEN_DIRECTORY{ "/loadgen" };
+constexpr const char* LOADGEN_SUBDIRECTORY{ "/loadgen/sub" };
+
+// Data connection buffer of each simulated client
+constexpr std::size_t LOADGEN_BUFLEN{ 256 * 1024 };
+
+// Ranges read by RANG operations
+constexpr long long MIN_RANGE_SIZE{ 64 * 1024 };
+constexpr long long MAX_RANGE_SIZE{ 8 * 1024 * 1024 };
+
+// How often the server's memory is sampled
+constexpr int SAMPLE_INTERVAL_MS{ 100 };
+
+// Reply codes
+constexpr int CONNECTION_OPEN{ 125 };
+constexpr int FILE_OKAY{ 150 };
+constexpr int COMMAND_OKAY{ 200 };
+constexpr int FILE_STATUS{ 213 };
+constexpr int SERVICE_READY{ 220 };
+constexpr int CLOSING_DATA_CONNECTION{ 226 };
+constexpr int EXTENDED_PASSIVE_MODE{ 229 };
+constexpr int FILE_ACTION_OKAY{ 250 };
+constexpr int PATHNAME_CREATED{ 257 };
+constexpr int PENDING_FURTHER_INFORMATION{ 350 };
+
+// What a simulated client does, RESUME is the fault-injection test:
+// the data connection is cut halfway and the file finished with REST.
+// PGET downloads one file in ranges over several connections at once.
+enum class OP
+{
+	RETR, STOR, LIST, CWD, RANG, RESUME, PGET, COUNT
+};
+
+constexpr std::size_t OP_COUNT{ (std::size_t)OP::COUNT };
+
+constexpr const char* opName(OP op)
+{
+	switch (op)
+	{
+	case OP::RETR: return "RETR";
+	case OP::STOR: return "STOR";
+	case OP::LIST: return "LIST";
+	case OP::CWD: return "CWD";
+	case OP::RANG: return "RANG";
+	case OP::RESUME: return "RESUME";
+	default: return "PGET";
+	}
+}
+
+// Files of one size in the synthetic set, named <name>-<index>
+struct FileClass
+{
+	std::string name;
+	unsigned int count;
+	long long size;
+	unsigned int weight;	// Share of the downloads that pick this class
+};
+
+struct LoadConfig
+{
+	std::string host{ DEFAULT_HOST };
+	std::string port{ CONTROL_PORT };
+
+	// Each level is one run, a list measures scaling against client count
+	std::vector<unsigned int> clients{ DEFAULT_CLIENTS };
+	double duration{ DEFAULT_DURATION };
+
+	// Relative frequency of each operation
+	std::array<unsigned int, OP_COUNT> mix{ 60, 20, 10, 10, 0, 0, 0 };
+
+	// Connections of each PGET, a list measures scaling against stream count
+	std::vector<unsigned int> streams{ 1 };
+
+	// Many tiny files and a few huge ones
+	std::vector<FileClass> files{ { "tiny", 1000, 4 * 1024, 9 }, { "huge", 2, 1024LL * 1024 * 1024, 1 } };
+
+	unsigned int idle{ 0 };		// Control connections held open during the runs
+	unsigned int delay{ 0 };	// Milliseconds each way added by a relay, 0 for none
+	bool verify{ false };		// Compare every downloaded byte with the pattern
+	DWORD serverPid{ 0 };		// Process sampled for CPU and memory, 0 if none
+	unsigned int seed{ 1 };
+
+	std::string jsonPath{};		// Machine-readable results, empty if not wanted
+	std::string label{};		// Names the build in the results
+};
+
+// One file of the set
+struct FileRef
+{
+	std::string path;
+	unsigned int id;	// Seed of the file's contents
+	long long size;
+};
+
+// Outcome of one kind of operation on one client
+struct OpResults
+{
+	std::vector<long long> latencies;	// Microseconds, successful operations only
+	unsigned long long errors{ 0 };
+	unsigned long long bytes{ 0 };
+};
+
+using ClientResults = std::array<OpResults, OP_COUNT>;
+
+// CPU and memory of the server process during a run
+struct ServerUsage
+{
+	bool valid{ false };
+	double cpuSeconds{ 0.0 };
+	unsigned long long peakWorkingSet{ 0 };
+};
+
+struct RunResults
+{
+	unsigned int clients{ 0 };
+	unsigned int streams{ 0 };	// Of each PGET, 0 if the mix has none
+	double seconds{ 0.0 };
+	ClientResults ops{};
+	ServerUsage server{};
+};
+
+// Fills data with the contents of file id from offset on, every byte
+// depends on both so a misplaced range is caught by a verify
+void fillPattern(char* data, std::size_t length, unsigned int id, long long offset);
+bool checkPattern(const char* data, std::size_t length, unsigned int id, long long offset);
+
+/*
+	One simulated client: a control connection in passive mode. The
+	server keeps a session's passive listener open, so EPSV is only
+	sent once.
+*/
+class Connection
+{
+private: // Variables
+	SOCKET ControlSocket;
+	LineBuffer m_controlBuffer;
+	sockaddr_in m_serverAddr;
+	unsigned short m_dataPort;
+	std::string m_reply;
+	Relay* const m_relay;	// Connections go through it, if set
+
+private: // Functions
+	SOCKET connectTo(const sockaddr_in& addr);
+
+public:
+	explicit Connection(Relay* relay = nullptr);
+	virtual ~Connection();
+
+	Connection(const Connection&) = delete;
+	Connection& operator=(const Connection&) = delete;
+
+	int open(const sockaddr_in& serverAddr);
+	void close();
+
+	// Sends a command, SUCCESS if the reply has the expected code
+	int command(const std::string& request, int expectedCode);
+	int expect(int expectedCode);
+	int receive();	// Whatever the reply is
+
+	// Connects a new data connection to the session's passive port
+	int openData(SOCKET& dataSocket);
+
+	const std::string& reply() const { return m_reply; }
+	bool isOpen() const { return ControlSocket != INVALID_SOCKET; }
+};
+
+class LoadGen
+{
+private: // Variables
+	const LoadConfig m_config;
+
+	/*The WSADATA structure contains information
+	about the Windows Sockets implementation.*/
+	WSADATA wsaData;
+	sockaddr_in serverAddr;
+
+	// The file set, in the order of the classes
+	std::vector<FileRef> m_files;
+	std::vector<std::size_t> m_classFirst;	// Index of each class's first file
+	unsigned int m_totalWeight;
+
+	std::atomic<bool> m_stop;
+
+	// Idle connections and how fast the server accepted them
+	std::vector<std::unique_ptr<Connection>> m_idle;
+	double m_idleAcceptRate;
+
+	// Delays the runs' connections, null without a delay
+	std::unique_ptr<Relay> m_relay;
+
+	std::vector<RunResults> m_runs;
+
+private: // Functions
+	// Setup
+	int InitializeWinsock();
+	int ResolveServer();
+	int PrepareFiles();
+	int OpenIdleConnections();
+
+	// Runs
+	RunResults run(unsigned int clients, unsigned int streams);
+	void runClient(unsigned int id, unsigned int streams, ClientResults& results);
+	OP pickOp(std::mt19937& rng);
+	const FileRef& pickFile(std::mt19937& rng);
+	const FileRef& pickLargest(std::mt19937& rng);
+
+	// Operations, each returns SUCCESS or FAILURE and adds its bytes
+	int openSession(Connection& connection);
+	int retr(Connection& connection, const FileRef& file, long long offset, long long end,
+		long long cutAfter, bool verify, std::vector<char>& buffer, unsigned long long& bytes);
+	int stor(Connection& connection, const FileRef& file, std::vector<char>& buffer, unsigned long long& bytes);
+	int list(Connection& connection, std::vector<char>& buffer, unsigned long long& bytes);
+	int rang(Connection& connection, const FileRef& file, std::mt19937& rng, std::vector<char>& buffer, unsigned long long& bytes);
+	int resume(Connection& connection, const FileRef& file, std::mt19937& rng, std::vector<char>& buffer, unsigned long long& bytes);
+	int pget(Connection& connection, const FileRef& file, unsigned int streams, std::vector<char>& buffer, unsigned long long& bytes);
+
+	// Server process
+	ServerUsage sampleServer(const std::atomic<bool>& running);
+
+	// Results
+	void printRun(const RunResults& run);
+	int writeJson();
+
+public:
+	explicit LoadGen(const LoadConfig& config);
+	virtual ~LoadGen();
+
+	int init();
+	int runAll();
+};
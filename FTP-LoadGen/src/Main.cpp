@@ -0,0 +1,176 @@
+// FTP load generator main driver program
+
+#include "LoadGen.h"
+
+#include <iostream>
+#include <sstream>
+#include <string>
+
+// Bytes with an optional K, M or G suffix
+long long parseSize(const std::string& value)
+{
+	std::size_t end{ 0 };
+	long long size{ std::stoll(value, &end) };
+	std::string suffix{ value.substr(end) };
+	if (suffix == "K" || suffix == "k") size *= 1024;
+	else if (suffix == "M" || suffix == "m") size *= 1024 * 1024;
+	else if (suffix == "G" || suffix == "g") size *= 1024 * 1024 * 1024;
+	else if (!suffix.empty())
+		throw std::runtime_error("Unknown size suffix in " + value);
+
+	if (size < 0)
+		throw std::runtime_error("Negative size " + value);
+	return size;
+}
+
+std::vector<std::string> split(const std::string& text, char separator)
+{
+	std::vector<std::string> parts{};
+	std::stringstream ss{ text };
+	for (std::string part{}; std::getline(ss, part, separator); )
+	{
+		if (!part.empty())
+			parts.push_back(part);
+	}
+	return parts;
+}
+
+// Reads the command line settings:
+//	--host <address>		server address, 127.0.0.1 by default
+//	--port <port>			control port, 21 by default
+//	--clients <n[,n...]>	simulated clients, one run per count
+//	--duration <seconds>	length of each run
+//	--mix <op=weight,...>	retr, stor, list, cwd, rang, resume and pget weights
+//	--streams <n[,n...]>	connections of each PGET, one run per count
+//	--files <name:count:size[:weight],...>	synthetic file set, sizes take K, M or G
+//	--idle <count>			control connections held open and idle during the runs
+//	--delay <ms>			relay the runs through loopback, delayed this much each way
+//	--verify				check every downloaded byte
+//	--pid <process-id>		server process to sample for CPU and memory
+//	--seed <number>			seed of the random choices
+//	--json <file>			machine-readable results
+//	--label <name>			names the build in the results
+LoadConfig parseArguments(int argc, char** argv)
+{
+	LoadConfig config{};
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string option{ argv[i] };
+		if (option == "--verify")
+		{
+			config.verify = true;
+			continue;
+		}
+		if (i + 1 >= argc)
+			throw std::runtime_error("Missing value for " + option);
+
+		std::string value{ argv[++i] };
+		if (option == "--host")
+			config.host = value;
+		else if (option == "--port")
+			config.port = value;
+		else if (option == "--clients")
+		{
+			config.clients.clear();
+			for (const std::string& count : split(value, ','))
+				config.clients.push_back((unsigned int)std::stoul(count));
+		}
+		else if (option == "--streams")
+		{
+			config.streams.clear();
+			for (const std::string& count : split(value, ','))
+			{
+				config.streams.push_back((unsigned int)std::stoul(count));
+				if (config.streams.back() == 0)
+					throw std::runtime_error("A PGET needs at least one stream");
+			}
+		}
+		else if (option == "--duration")
+			config.duration = std::stod(value);
+		else if (option == "--mix")
+		{
+			config.mix.fill(0);
+			for (const std::string& entry : split(value, ','))
+			{
+				std::size_t equals{ entry.find('=') };
+				if (equals == std::string::npos)
+					throw std::runtime_error("Expected --mix <op=weight,...>");
+
+				std::string name{ entry.substr(0, equals) };
+				for (auto& c : name)
+					c = (char)std::toupper(c);
+
+				std::size_t op{ 0 };
+				while (op < OP_COUNT && name != opName((OP)op))
+					++op;
+				if (op == OP_COUNT)
+					throw std::runtime_error("Unknown operation " + entry);
+
+				config.mix[op] = (unsigned int)std::stoul(entry.substr(equals + 1));
+			}
+		}
+		else if (option == "--files")
+		{
+			config.files.clear();
+			for (const std::string& entry : split(value, ','))
+			{
+				std::vector<std::string> fields{ split(entry, ':') };
+				if (fields.size() < 3 || fields.size() > 4)
+					throw std::runtime_error("Expected --files <name:count:size[:weight],...>");
+
+				FileClass fileClass{ fields[0], (unsigned int)std::stoul(fields[1]), parseSize(fields[2]), 1 };
+				if (fields.size() == 4)
+					fileClass.weight = (unsigned int)std::stoul(fields[3]);
+				if (fileClass.count == 0)
+					throw std::runtime_error("Empty file class " + entry);
+				config.files.push_back(fileClass);
+			}
+		}
+		else if (option == "--idle")
+			config.idle = (unsigned int)std::stoul(value);
+		else if (option == "--delay")
+			config.delay = (unsigned int)std::stoul(value);
+		else if (option == "--pid")
+			config.serverPid = (DWORD)std::stoul(value);
+		else if (option == "--seed")
+			config.seed = (unsigned int)std::stoul(value);
+		else if (option == "--json")
+			config.jsonPath = value;
+		else if (option == "--label")
+			config.label = value;
+		else
+			throw std::runtime_error("Unknown option " + option);
+	}
+
+	unsigned int totalMix{ 0 };
+	for (unsigned int weight : config.mix)
+		totalMix += weight;
+	if (totalMix == 0)
+		throw std::runtime_error("The operation mix is empty");
+	if (config.clients.empty() || config.streams.empty() || config.files.empty())
+		throw std::runtime_error("Nothing to run");
+
+	return config;
+}
+
+int main(int argc, char** argv)
+try
+{
+	LoadGen loadGen{ parseArguments(argc, argv) };
+
+	if (loadGen.init() != SUCCESS)
+		return FAILURE;
+
+	return loadGen.runAll();
+}
+catch (std::exception& e)
+{
+	std::cerr << "ERROR: " << e.what() << '\n';
+	return FAILURE;
+}
+catch (...)
+{
+	std::cerr << "Unknown error.\n";
+	return FAILURE + 1;
+}
@@ -0,0 +1,277 @@
+#include "Relay.h"
+#include "../../Common/src/FTP_Common.h"
+
+#include <iostream>
+#include <thread>
+
+/***********************************************
+	Constructor
+***********************************************/
+Relay::Relay(unsigned int delayMs) :
+	m_delay{ delayMs },
+	m_listenSocket{ INVALID_SOCKET },
+	m_listenAddr{}
+{
+}
+
+/***********************************************
+	Destructor
+***********************************************/
+Relay::~Relay()
+{
+	// Whatever is still relayed is cut, the threads close their sockets
+	std::unique_lock<std::mutex> lock{ m_linksMutex };
+	for (const auto& link : m_links)
+		abort(*link);
+	m_linksChanged.wait(lock, [this] { return m_links.empty(); });
+	lock.unlock();
+
+	if (m_listenSocket != INVALID_SOCKET)
+		closesocket(m_listenSocket);
+}
+
+/***********************************************
+	Setup
+***********************************************/
+int Relay::init()
+{
+	m_listenSocket = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (m_listenSocket == INVALID_SOCKET)
+	{
+		std::cerr << "WINSOCK: socket() failed with error: " << WSAGetLastError() << '\n';
+		return FAILURE;
+	}
+
+	// Accepted sockets take the buffer size over
+	int bufferSize{ RELAY_CHUNK };
+	setsockopt(m_listenSocket, SOL_SOCKET, SO_RCVBUF, (const char*)&bufferSize, sizeof(bufferSize));
+
+	// Any free port on loopback
+	m_listenAddr.sin_family = AF_INET;
+	m_listenAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	m_listenAddr.sin_port = 0;
+
+	int addrLen{ sizeof(m_listenAddr) };
+	if (bind(m_listenSocket, (sockaddr*)&m_listenAddr, sizeof(m_listenAddr)) == SOCKET_ERROR ||
+		listen(m_listenSocket, SOMAXCONN) == SOCKET_ERROR ||
+		getsockname(m_listenSocket, (sockaddr*)&m_listenAddr, &addrLen) == SOCKET_ERROR)
+	{
+		std::cerr << "WINSOCK: Relay listener failed with error: " << WSAGetLastError() << '\n';
+		closesocket(m_listenSocket);
+		m_listenSocket = INVALID_SOCKET;
+		return FAILURE;
+	}
+
+	std::cout << "LOADGEN: Relaying through 127.0.0.1:" << ntohs(m_listenAddr.sin_port) << ", "
+		<< m_delay.count() << " ms each way, " << RELAY_WINDOW / 1024 << " KiB window.\n";
+	return SUCCESS;
+}
+
+/***********************************************
+	Connections
+***********************************************/
+SOCKET Relay::open(const sockaddr_in& target)
+{
+	auto link{ std::make_shared<RelayLink>() };
+	int bufferSize{ RELAY_CHUNK };
+	BOOL noDelay{ TRUE };
+
+	link->targetSocket = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (link->targetSocket == INVALID_SOCKET)
+	{
+		std::cerr << "WINSOCK: socket() failed with error: " << WSAGetLastError() << '\n';
+		return INVALID_SOCKET;
+	}
+	setsockopt(link->targetSocket, SOL_SOCKET, SO_RCVBUF, (const char*)&bufferSize, sizeof(bufferSize));
+
+	if (::connect(link->targetSocket, (const sockaddr*)&target, sizeof(target)) == SOCKET_ERROR)
+	{
+		std::cerr << "WINSOCK: connect() failed with error: " << WSAGetLastError() << '\n';
+		closesocket(link->targetSocket);
+		return INVALID_SOCKET;
+	}
+
+	SOCKET callerSocket = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (callerSocket == INVALID_SOCKET)
+	{
+		std::cerr << "WINSOCK: socket() failed with error: " << WSAGetLastError() << '\n';
+		closesocket(link->targetSocket);
+		return INVALID_SOCKET;
+	}
+
+	// Nobody else connects to the listener, the next accept is this connect
+	{
+		std::lock_guard<std::mutex> lock{ m_acceptMutex };
+		if (::connect(callerSocket, (sockaddr*)&m_listenAddr, sizeof(m_listenAddr)) != SOCKET_ERROR)
+			link->callerSocket = accept(m_listenSocket, NULL, NULL);
+	}
+	if (link->callerSocket == INVALID_SOCKET)
+	{
+		std::cerr << "WINSOCK: Relay connection failed with error: " << WSAGetLastError() << '\n';
+		closesocket(callerSocket);
+		closesocket(link->targetSocket);
+		return INVALID_SOCKET;
+	}
+
+	// The relay passes on what it has, the caller decides about Nagle
+	setsockopt(link->callerSocket, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+	setsockopt(link->targetSocket, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+
+	link->out.from = link->callerSocket;
+	link->out.to = link->targetSocket;
+	link->in.from = link->targetSocket;
+	link->in.to = link->callerSocket;
+	link->running = 4;
+	{
+		std::lock_guard<std::mutex> lock{ m_linksMutex };
+		m_links.insert(link);
+	}
+
+	std::thread{ &Relay::receive, this, link, std::ref(link->out) }.detach();
+	std::thread{ &Relay::forward, this, link, std::ref(link->out) }.detach();
+	std::thread{ &Relay::receive, this, link, std::ref(link->in) }.detach();
+	std::thread{ &Relay::forward, this, link, std::ref(link->in) }.detach();
+
+	// The handshake of a real link takes a round trip
+	std::this_thread::sleep_for(2 * m_delay);
+
+	return callerSocket;
+}
+
+// Queues what arrives with the time it may leave, while the window has room
+void Relay::receive(std::shared_ptr<RelayLink> link, RelayPipe& pipe)
+{
+	std::vector<char> buffer(RELAY_CHUNK);
+	while (!link->aborted)
+	{
+		{
+			std::unique_lock<std::mutex> lock{ pipe.mutex };
+			pipe.changed.wait(lock, [&] { return pipe.queued < RELAY_WINDOW || link->aborted; });
+		}
+		if (!wait(pipe.from, false, *link))
+		{
+			abort(*link);
+			break;
+		}
+
+		int iRecv = recv(pipe.from, buffer.data(), RELAY_CHUNK, 0);
+		if (iRecv == SOCKET_ERROR)
+		{
+			// A reset is passed on as one
+			abort(*link);
+			break;
+		}
+
+		std::lock_guard<std::mutex> lock{ pipe.mutex };
+		if (iRecv == 0)
+			pipe.ended = true;
+		else
+		{
+			pipe.chunks.push_back({ RelayClock::now() + m_delay, std::vector<char>(buffer.data(), buffer.data() + iRecv) });
+			pipe.queued += (std::size_t)iRecv;
+		}
+		pipe.changed.notify_all();
+
+		if (pipe.ended)
+			break;
+	}
+	release(link);
+}
+
+// Sends each queued chunk once it is due, then passes the close on
+void Relay::forward(std::shared_ptr<RelayLink> link, RelayPipe& pipe)
+{
+	for (;;)
+	{
+		RelayChunk chunk{};
+		{
+			std::unique_lock<std::mutex> lock{ pipe.mutex };
+			pipe.changed.wait(lock, [&] { return !pipe.chunks.empty() || pipe.ended || link->aborted; });
+			if (link->aborted)
+				break;
+			if (pipe.chunks.empty())
+			{
+				shutdown(pipe.to, SD_SEND);
+				break;
+			}
+
+			RelayClock::time_point due{ pipe.chunks.front().due };
+			if (pipe.changed.wait_until(lock, due, [&] { return link->aborted.load(); }))
+				break;
+
+			chunk = std::move(pipe.chunks.front());
+			pipe.chunks.pop_front();
+		}
+
+		int sent{ 0 };
+		while (sent < (int)chunk.data.size() && wait(pipe.to, true, *link))
+		{
+			int iSend = send(pipe.to, chunk.data.data() + sent, (int)chunk.data.size() - sent, 0);
+			if (iSend == SOCKET_ERROR)
+				break;
+			sent += iSend;
+		}
+		if (sent < (int)chunk.data.size())
+		{
+			abort(*link);
+			break;
+		}
+
+		// Room for the receiving side again
+		std::lock_guard<std::mutex> lock{ pipe.mutex };
+		pipe.queued -= chunk.data.size();
+		pipe.changed.notify_all();
+	}
+	release(link);
+}
+
+// Waits until s can be read or written, false on an error or once the link is cut
+bool Relay::wait(SOCKET s, bool write, const RelayLink& link)
+{
+	while (!link.aborted)
+	{
+		fd_set set{};
+		FD_ZERO(&set);
+		FD_SET(s, &set);
+		timeval timeout{ 0, RELAY_POLL_US };
+
+		int iResult = select(0, write ? NULL : &set, write ? &set : NULL, NULL, &timeout);
+		if (iResult == SOCKET_ERROR)
+			return false;
+		if (iResult > 0)
+			return true;
+	}
+	return false;
+}
+
+void Relay::abort(RelayLink& link)
+{
+	if (link.aborted.exchange(true))
+		return;
+
+	for (RelayPipe* pipe : { &link.out, &link.in })
+	{
+		std::lock_guard<std::mutex> lock{ pipe->mutex };
+		pipe->changed.notify_all();
+	}
+}
+
+// The last thread out closes the sockets, a cut link resets both sides
+void Relay::release(const std::shared_ptr<RelayLink>& link)
+{
+	if (--link->running > 0)
+		return;
+
+	if (link->aborted)
+	{
+		linger reset{ 1, 0 };
+		setsockopt(link->callerSocket, SOL_SOCKET, SO_LINGER, (const char*)&reset, sizeof(reset));
+		setsockopt(link->targetSocket, SOL_SOCKET, SO_LINGER, (const char*)&reset, sizeof(reset));
+	}
+	closesocket(link->callerSocket);
+	closesocket(link->targetSocket);
+
+	std::lock_guard<std::mutex> lock{ m_linksMutex };
+	m_links.erase(link);
+	m_linksChanged.notify_all();
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <ws2tcpip.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+
+// Bytes a relayed connection holds back in each direction, the window
+// of the emulated link. One stream moves at most this much per delay.
+constexpr std::size_t RELAY_WINDOW{ 256 * 1024 };
+
+// Largest piece read off a socket at once, also the relay's receive
+// buffer so the window is not widened by bytes waiting in the sockets
+constexpr int RELAY_CHUNK{ 64 * 1024 };
+
+// How often a waiting thread looks whether its link was cut
+constexpr long RELAY_POLL_US{ 100 * 1000 };
+
+using RelayClock = std::chrono::steady_clock;
+
+// Bytes that arrived on one side and when they may leave on the other
+struct RelayChunk
+{
+	RelayClock::time_point due;
+	std::vector<char> data;
+};
+
+// One direction of a relayed connection
+struct RelayPipe
+{
+	SOCKET from{ INVALID_SOCKET };
+	SOCKET to{ INVALID_SOCKET };
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::deque<RelayChunk> chunks;
+	std::size_t queued{ 0 };	// Bytes held, not sent yet
+	bool ended{ false };		// from was closed, nothing more comes
+};
+
+// A relayed connection, each pipe has a thread receiving and one sending
+struct RelayLink
+{
+	SOCKET callerSocket{ INVALID_SOCKET };	// Accepted from the caller's side
+	SOCKET targetSocket{ INVALID_SOCKET };	// Connected to the target
+	RelayPipe out;	// Caller to target
+	RelayPipe in;	// Target to caller
+
+	std::atomic<bool> aborted{ false };
+	std::atomic<int> running{ 0 };	// Threads still using the sockets
+};
+
+/*
+	Emulates a long link on loopback. A connection opened through the
+	relay goes to the relay's own listener, and the relay connects on to
+	the real target. Bytes are held for the delay in each direction
+	before they are passed on, and no more than RELAY_WINDOW at once, so
+	a single stream is bound by window over delay like on a real link
+	and parallel streams add up. A connect costs a round trip.
+*/
+class Relay
+{
+private: // Variables
+	const std::chrono::milliseconds m_delay;	// Each way
+
+	SOCKET m_listenSocket;
+	sockaddr_in m_listenAddr;
+	std::mutex m_acceptMutex;	// Pairs each connect with its accept
+
+	std::mutex m_linksMutex;
+	std::condition_variable m_linksChanged;
+	std::set<std::shared_ptr<RelayLink>> m_links;
+
+private: // Functions
+	void receive(std::shared_ptr<RelayLink> link, RelayPipe& pipe);
+	void forward(std::shared_ptr<RelayLink> link, RelayPipe& pipe);
+
+	bool wait(SOCKET s, bool write, const RelayLink& link);
+	void abort(RelayLink& link);
+	void release(const std::shared_ptr<RelayLink>& link);
+
+public:
+	explicit Relay(unsigned int delayMs);
+	virtual ~Relay();
+
+	Relay(const Relay&) = delete;
+	Relay& operator=(const Relay&) = delete;
+
+	// Opens the listener, WinSock must be started
+	int init();
+
+	// A socket connected to target through the relay, INVALID_SOCKET on failure
+	SOCKET open(const sockaddr_in& target);
+};
@@ -0,0 +1,171 @@
+#include "BlobStore.h"
+#include "../../Common/src/FTP_Common.h"
+#include "../../Common/src/Logger.h"
+
+#include <cctype>
+
+/***********************************************
+	Constructor
+***********************************************/
+BlobStore::BlobStore(const std::filesystem::path& root, bool enabled) :
+	m_directory{ root / BLOB_DIRECTORY },
+	m_ready{ false },
+	m_linked{ 0 },
+	m_stored{ 0 },
+	m_copies{ 0 }
+{
+	if (!enabled)
+		return;
+
+	std::error_code ec{};
+	std::filesystem::create_directory(m_directory, ec);
+	if (ec || !std::filesystem::is_directory(m_directory, ec))
+	{
+		Log{ LOG_LEVEL::WARN } << "SERVER: Unable to create " << m_directory.string() << ", uploads are not deduplicated.";
+		return;
+	}
+	SetFileAttributesW(m_directory.wstring().c_str(), FILE_ATTRIBUTE_HIDDEN);
+
+	collect();
+	m_ready = true;
+}
+
+// Removes blobs whose every name was deleted or overwritten,
+// and copies left behind by an unshare that did not finish
+void BlobStore::collect()
+{
+	std::error_code ec{};
+	std::size_t removed{ 0 }, kept{ 0 };
+	for (const auto& entry : std::filesystem::directory_iterator{ m_directory, ec })
+	{
+		HANDLE hFile = CreateFileW(entry.path().wstring().c_str(), FILE_READ_ATTRIBUTES,
+			FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+		if (hFile == INVALID_HANDLE_VALUE)
+			continue;
+
+		BY_HANDLE_FILE_INFORMATION information{};
+		bool orphan{ GetFileInformationByHandle(hFile, &information) && information.nNumberOfLinks <= 1 };
+		CloseHandle(hFile);
+
+		if (orphan && DeleteFileW(entry.path().wstring().c_str()))
+			++removed;
+		else
+			++kept;
+	}
+
+	Log{ LOG_LEVEL::INFO } << "SERVER: Content store holds " << kept << " blobs, removed " << removed << " unused.";
+}
+
+/***********************************************
+	Digests
+***********************************************/
+bool BlobStore::normalizeDigest(std::string& digest)
+{
+	if (digest.length() != BLOB_DIGEST_LENGTH)
+		return false;
+
+	for (char& c : digest)
+	{
+		if (!std::isxdigit((unsigned char)c))
+			return false;
+		c = (char)std::tolower((unsigned char)c);
+	}
+	return true;
+}
+
+std::filesystem::path BlobStore::blobPath(const std::string& digest) const
+{
+	return m_directory / digest;
+}
+
+/***********************************************
+	Content
+***********************************************/
+int BlobStore::link(const std::string& digest, long long size, const std::filesystem::path& filename)
+{
+	if (!m_ready)
+		return FAILURE;
+
+	// A digest match with another size is not the same content
+	std::wstring blob{ blobPath(digest).wstring() };
+	WIN32_FILE_ATTRIBUTE_DATA attributes{};
+	if (!GetFileAttributesExW(blob.c_str(), GetFileExInfoStandard, &attributes) ||
+		(long long)(((unsigned long long)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow) != size)
+		return FAILURE;
+
+	// Replaces the name like STOR would, a file in use can not be replaced
+	std::wstring name{ filename.wstring() };
+	if (!DeleteFileW(name.c_str()) && GetLastError() != ERROR_FILE_NOT_FOUND)
+	{
+		Log{ LOG_LEVEL::INFO } << "SERVER: DeleteFileW() failed with error: " << GetLastError();
+		return FAILURE;
+	}
+
+	// A link shares the blob's data, a copy is the fallback on another
+	// volume or past the file system's link limit. Either way nothing crosses the network.
+	if (!CreateHardLinkW(name.c_str(), blob.c_str(), NULL))
+	{
+		Log{ LOG_LEVEL::INFO } << "SERVER: CreateHardLinkW() failed with error: " << GetLastError() << ", copying instead.";
+		if (!CopyFileW(blob.c_str(), name.c_str(), FALSE))
+		{
+			Log{ LOG_LEVEL::ERR } << "SERVER: CopyFileW() failed with error: " << GetLastError();
+			return FAILURE;
+		}
+	}
+
+	++m_linked;
+	return SUCCESS;
+}
+
+void BlobStore::store(const std::string& digest, const std::filesystem::path& filename)
+{
+	if (!m_ready)
+		return;
+
+	// Another upload of the same content may have stored it first
+	if (!CreateHardLinkW(blobPath(digest).wstring().c_str(), filename.wstring().c_str(), NULL))
+	{
+		DWORD error{ GetLastError() };
+		if (error != ERROR_ALREADY_EXISTS)
+			Log{ LOG_LEVEL::WARN } << "SERVER: CreateHardLinkW() failed with error: " << error << ", content not stored.";
+		return;
+	}
+
+	++m_stored;
+}
+
+int BlobStore::unshare(const std::filesystem::path& filename, bool keepContents)
+{
+	if (!m_ready)
+		return SUCCESS;
+
+	std::wstring name{ filename.wstring() };
+	HANDLE hFile = CreateFileW(name.c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, 0, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return SUCCESS; // Nothing to share
+
+	BY_HANDLE_FILE_INFORMATION information{};
+	bool shared{ GetFileInformationByHandle(hFile, &information) && information.nNumberOfLinks > 1 };
+	CloseHandle(hFile);
+	if (!shared)
+		return SUCCESS;
+
+	// Dropping the name leaves the blob and the other names as they are
+	if (!keepContents)
+		return DeleteFileW(name.c_str()) ? SUCCESS : FAILURE;
+
+	// A restarted upload appends, so the name needs the old bytes in a file of its own.
+	// The copy is made in the blob directory, out of sight, then moved over the name.
+	std::wstring copy{ (m_directory / (L"copy-" + std::to_wstring(GetCurrentProcessId()) + L'-' +
+		std::to_wstring(++m_copies))).wstring() };
+	if (!CopyFileW(name.c_str(), copy.c_str(), FALSE) ||
+		!MoveFileExW(copy.c_str(), name.c_str(), MOVEFILE_REPLACE_EXISTING))
+	{
+		Log{ LOG_LEVEL::ERR } << "SERVER: Unable to copy " << filename.string() << ", error: " << GetLastError();
+		DeleteFileW(copy.c_str());
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
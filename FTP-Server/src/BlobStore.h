@@ -0,0 +1,75 @@
+#pragma once
+
+#include <ws2tcpip.h>
+
+#include <atomic>
+#include <string>
+#include <filesystem>
+
+// Names the server keeps for itself, hidden from listings and refused as paths
+constexpr const wchar_t* RESERVED_PREFIX{ L".ftp-" };
+
+// Stored content, one file per SHA-256 in the server's starting directory
+constexpr const wchar_t* BLOB_DIRECTORY{ L".ftp-blobs" };
+
+// Hex digits of a SHA-256
+constexpr std::size_t BLOB_DIGEST_LENGTH{ 64 };
+
+inline bool isReservedName(const std::wstring& name)
+{
+	return name.compare(0, std::char_traits<wchar_t>::length(RESERVED_PREFIX), RESERVED_PREFIX) == 0;
+}
+
+/*
+	Content-addressed store behind XDUP. Every upload announced with its
+	SHA-256, and found to match once it arrived, gets a hard link in the
+	blob directory named by the digest. A later XDUP of the same content
+	under any name is a hard link to the blob instead of a transfer, or
+	a local copy where a link is not possible.
+
+	The blob directory is the index: a digest is stored if its file
+	exists, which survives restarts without a separate journal. Names
+	that share a blob must never be written in place, so every write
+	first gives the name a file of its own. Blobs no name links to any
+	more are removed at startup.
+*/
+class BlobStore
+{
+private: // Variables
+	const std::filesystem::path m_directory;
+	bool m_ready;
+
+	std::atomic<unsigned long long> m_linked;
+	std::atomic<unsigned long long> m_stored;
+	std::atomic<unsigned long long> m_copies;	// Names of temporary copies
+
+private: // Functions
+	std::filesystem::path blobPath(const std::string& digest) const;
+	void collect();
+
+public:
+	// Creates the directory under root if enabled
+	BlobStore(const std::filesystem::path& root, bool enabled);
+	virtual ~BlobStore() = default;
+
+	BlobStore(const BlobStore&) = delete;
+	BlobStore& operator=(const BlobStore&) = delete;
+
+	// Lower-case hex SHA-256, false if digest is not one
+	static bool normalizeDigest(std::string& digest);
+
+	// Gives filename the stored content with this digest and size,
+	// replacing what it held. FAILURE if the content is not stored.
+	int link(const std::string& digest, long long size, const std::filesystem::path& filename);
+
+	// Keeps filename's content as the blob of digest
+	void store(const std::string& digest, const std::filesystem::path& filename);
+
+	// Called before filename is written: a name sharing a blob gets a file
+	// of its own, a copy if keepContents is set and otherwise an empty one
+	int unshare(const std::filesystem::path& filename, bool keepContents);
+
+	bool enabled() const { return m_ready; }
+	unsigned long long linked() const { return m_linked; }
+	unsigned long long stored() const { return m_stored; }
+};
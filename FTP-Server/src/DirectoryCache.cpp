@@ -0,0 +1,303 @@
+#include "DirectoryCache.h"
+#include "BlobStore.h"
+#include "../../Common/src/FTP_Common.h"
+#include "../../Common/src/Logger.h"
+
+#include <cstdio>
+#include <vector>
+
+// Older entries of an ls listing show the year instead of the time
+constexpr unsigned long long LIST_RECENT_TICKS{ 183ULL * 24 * 3600 * 10000000 };
+
+/***********************************************
+	Constructor
+***********************************************/
+DirectoryCache::DirectoryCache(std::size_t capacity, StatCache& stats) :
+	m_capacity{ capacity },
+	m_stats{ stats },
+	m_nextWatch{ 0 },
+	m_stopping{ false },
+	m_hPort{ NULL },
+	m_hits{ 0 },
+	m_misses{ 0 }
+{
+	if (m_capacity == 0)
+		return;
+
+	// Without the port nothing could tell a listing is stale, so nothing is cached
+	m_hPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	if (m_hPort == NULL)
+	{
+		Log{ LOG_LEVEL::WARN } << "SERVER: CreateIoCompletionPort() failed with error: " << GetLastError()
+			<< ", listings are not cached.";
+		return;
+	}
+
+	m_thread = std::thread{ &DirectoryCache::run, this };
+}
+
+/***********************************************
+	Destructor
+***********************************************/
+DirectoryCache::~DirectoryCache()
+{
+	if (!enabled())
+		return;
+
+	// The thread leaves once every cancelled watch has completed
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		m_stopping = true;
+		for (auto& watch : m_watches)
+			CancelIoEx(watch.second->hDirectory, watch.second.get());
+	}
+	PostQueuedCompletionStatus(m_hPort, 0, 0, NULL);
+
+	m_thread.join();
+	CloseHandle(m_hPort);
+}
+
+/***********************************************
+	Lookup
+***********************************************/
+int DirectoryCache::listing(const std::filesystem::path& directory, HANDLE hDirectory, LISTING_FORMAT format, std::shared_ptr<const Text>& text)
+{
+	Key key{ directory.wstring(), format };
+
+	if (enabled())
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+
+		auto it = m_entries.find(key);
+		if (it != m_entries.end())
+		{
+			// Move to the front of the LRU list
+			m_lru.splice(m_lru.begin(), m_lru, it->second);
+			++m_hits;
+
+			text = it->second->second.text;
+			return SUCCESS;
+		}
+	}
+	++m_misses;
+
+	// Watch first, a change while the directory is read then still drops the listing
+	unsigned long long id{ enabled() ? watch(key, hDirectory) : 0 };
+
+	// Read outside the lock, a large directory takes a while
+	auto built = std::make_shared<Text>();
+	int iResult = read(directory, hDirectory, format, *built);
+
+	std::lock_guard<std::mutex> lock{ m_mutex };
+
+	auto watch = m_watches.find(id);
+	if (iResult != SUCCESS)
+	{
+		if (watch != m_watches.end())
+			CancelIoEx(watch->second->hDirectory, watch->second.get());
+		return FAILURE;
+	}
+	text = built;
+
+	// A watch that already completed saw a change, the listing is served but not kept
+	if (watch == m_watches.end())
+		return SUCCESS;
+
+	// Another session may have listed the directory in the meantime
+	auto it = m_entries.find(key);
+	if (it != m_entries.end())
+		erase(it);
+
+	m_lru.emplace_front(key, Entry{ built, id });
+	m_entries[key] = m_lru.begin();
+
+	// Evict the least recently used listings
+	while (m_entries.size() > m_capacity)
+		erase(m_entries.find(m_lru.back().first));
+
+	return SUCCESS;
+}
+
+void DirectoryCache::invalidate(const std::filesystem::path& directory)
+{
+	if (!enabled())
+		return;
+
+	std::lock_guard<std::mutex> lock{ m_mutex };
+	for (LISTING_FORMAT format : { LISTING_FORMAT::LIST, LISTING_FORMAT::NLST, LISTING_FORMAT::MLSD })
+	{
+		auto it = m_entries.find(Key{ directory.wstring(), format });
+		if (it != m_entries.end())
+			erase(it);
+	}
+}
+
+// Caller holds the lock. The watch is cancelled, its completion frees it.
+void DirectoryCache::erase(EntryMap::iterator it)
+{
+	auto watch = m_watches.find(it->second->second.watch);
+	if (watch != m_watches.end())
+		CancelIoEx(watch->second->hDirectory, watch->second.get());
+
+	m_lru.erase(it->second);
+	m_entries.erase(it);
+}
+
+/***********************************************
+	Change Notifications
+***********************************************/
+// Starts watching the directory of key, returns the watch's id or 0 if it can not be watched.
+// The watch needs an overlapped handle of its own, opened again from the caller's.
+unsigned long long DirectoryCache::watch(const Key& key, HANDLE hListed)
+{
+	HANDLE hDirectory = ReOpenFile(hListed, FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED);
+	if (hDirectory == INVALID_HANDLE_VALUE)
+		return 0;
+
+	// Held while issuing, so the completion can not be handled before the watch is registered
+	std::lock_guard<std::mutex> lock{ m_mutex };
+	if (m_stopping)
+	{
+		CloseHandle(hDirectory);
+		return 0;
+	}
+
+	unsigned long long id{ ++m_nextWatch };
+	auto watch = std::make_unique<Watch>();
+	watch->key = key;
+	watch->hDirectory = hDirectory;
+
+	if (CreateIoCompletionPort(hDirectory, m_hPort, (ULONG_PTR)id, 0) == NULL ||
+		!ReadDirectoryChangesW(hDirectory, watch->buffer, sizeof(watch->buffer), FALSE, DIRECTORY_NOTIFY_FILTER,
+			NULL, watch.get(), NULL))
+	{
+		Log{ LOG_LEVEL::WARN } << "SERVER: ReadDirectoryChangesW() failed with error: " << GetLastError();
+		CloseHandle(hDirectory);
+		return 0;
+	}
+
+	m_watches.emplace(id, std::move(watch));
+	return id;
+}
+
+void DirectoryCache::run()
+{
+	while (true)
+	{
+		DWORD bytes{ 0 };
+		ULONG_PTR id{ 0 };
+		OVERLAPPED* overlapped{ NULL };
+		if (!GetQueuedCompletionStatus(m_hPort, &bytes, &id, &overlapped, INFINITE) && overlapped == NULL)
+			return;
+
+		std::lock_guard<std::mutex> lock{ m_mutex };
+
+		// A change, a cancel or an error, the listing can not be trusted after any of them
+		auto watch = m_watches.find(id);
+		if (overlapped != NULL && watch != m_watches.end())
+		{
+			auto it = m_entries.find(watch->second->key);
+			if (it != m_entries.end() && it->second->second.watch == id)
+			{
+				m_lru.erase(it->second);
+				m_entries.erase(it);
+			}
+
+			CloseHandle(watch->second->hDirectory);
+			m_watches.erase(watch);
+		}
+
+		if (m_stopping && m_watches.empty())
+			return;
+	}
+}
+
+/***********************************************
+	Listing
+***********************************************/
+// One line per entry. Names are in the code page the server resolves
+// paths with, so a listed name can be passed back to RETR or CWD.
+int DirectoryCache::read(const std::filesystem::path& directory, HANDLE hDirectory, LISTING_FORMAT format, Text& text)
+{
+	static const char* months[]{ "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+	// Many entries per call, the first one starts over in case the handle was read before
+	std::vector<LONGLONG> buffer(DIRECTORY_READ_BUFLEN / sizeof(LONGLONG));
+	FILE_INFO_BY_HANDLE_CLASS level{ FileFullDirectoryRestartInfo };
+
+	FILETIME now{};
+	GetSystemTimeAsFileTime(&now);
+	unsigned long long nowTicks{ ((unsigned long long)now.dwHighDateTime << 32) | now.dwLowDateTime };
+
+	while (GetFileInformationByHandleEx(hDirectory, level, buffer.data(), DIRECTORY_READ_BUFLEN))
+	{
+		level = FileFullDirectoryInfo;
+
+		const char* entry{ reinterpret_cast<const char*>(buffer.data()) };
+		while (entry != nullptr)
+		{
+			const FILE_FULL_DIR_INFO* data{ reinterpret_cast<const FILE_FULL_DIR_INFO*>(entry) };
+			entry = (data->NextEntryOffset != 0) ? entry + data->NextEntryOffset : nullptr;
+
+			// The server's own files are not listed
+			std::wstring fileName{ data->FileName, data->FileNameLength / sizeof(wchar_t) };
+			if (fileName == L"." || fileName == L".." || isReservedName(fileName))
+				continue;
+
+			char name[MAX_PATH * 4];
+			int nameLength = WideCharToMultiByte(CP_ACP, 0, fileName.c_str(), (int)fileName.length(), name, sizeof(name), NULL, NULL);
+			if (nameLength <= 0)
+				continue;
+
+			bool isDirectory{ (data->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0 };
+			long long size{ data->EndOfFile.QuadPart };
+			FILETIME lastWrite{ data->LastWriteTime.LowPart, (DWORD)data->LastWriteTime.HighPart };
+			unsigned long long written{ (unsigned long long)data->LastWriteTime.QuadPart };
+
+			// SIZE and MDTM of a listed file need no lookup of their own
+			if (m_stats.enabled())
+				m_stats.store(directory / fileName, FileStat{ size, lastWrite, isDirectory,
+					(data->FileAttributes & PARTIAL_ATTRIBUTE) != 0 });
+
+			// Times are UTC in every format
+			SYSTEMTIME modified{};
+			FileTimeToSystemTime(&lastWrite, &modified);
+
+			char facts[128]{};
+			switch (format)
+			{
+			case LISTING_FORMAT::LIST:
+			{
+				const char* mode{ isDirectory ? "drwxr-xr-x" : "-rw-r--r--" };
+				const char* month{ months[(modified.wMonth + 11) % 12] };
+				if (written + LIST_RECENT_TICKS > nowTicks)
+					std::snprintf(facts, sizeof(facts), "%s 1 ftp ftp %15lld %s %2u %02u:%02u ",
+						mode, size, month, modified.wDay, modified.wHour, modified.wMinute);
+				else
+					std::snprintf(facts, sizeof(facts), "%s 1 ftp ftp %15lld %s %2u  %4u ",
+						mode, size, month, modified.wDay, modified.wYear);
+			} break;
+			case LISTING_FORMAT::MLSD:
+			{
+				if (isDirectory)
+					std::snprintf(facts, sizeof(facts), "type=dir;modify=%04u%02u%02u%02u%02u%02u; ",
+						modified.wYear, modified.wMonth, modified.wDay, modified.wHour, modified.wMinute, modified.wSecond);
+				else
+					std::snprintf(facts, sizeof(facts), "type=file;size=%lld;modify=%04u%02u%02u%02u%02u%02u; ", size,
+						modified.wYear, modified.wMonth, modified.wDay, modified.wHour, modified.wMinute, modified.wSecond);
+			} break;
+			default:
+				break;
+			}
+
+			text += facts;
+			text.append(name, nameLength);
+			text += "\r\n";
+		}
+	}
+
+	// An empty volume root has no entries at all
+	DWORD error{ GetLastError() };
+	return (error == ERROR_NO_MORE_FILES || error == ERROR_FILE_NOT_FOUND) ? SUCCESS : FAILURE;
+}
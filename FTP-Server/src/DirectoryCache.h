@@ -0,0 +1,120 @@
+#pragma once
+
+#include "StatCache.h"
+
+#include <ws2tcpip.h>
+
+#include <map>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <filesystem>
+
+// Listings kept by default, one per directory and format
+constexpr std::size_t DEFAULT_DIRECTORY_CACHE{ 256 };
+
+// Change records are only a signal, an overflowing buffer still completes
+constexpr DWORD DIRECTORY_NOTIFY_BUFLEN{ 1024 };
+
+// Entries are read from the directory's handle this many bytes at a time
+constexpr DWORD DIRECTORY_READ_BUFLEN{ 64 * 1024 };
+
+// Changes that make a listing stale
+constexpr DWORD DIRECTORY_NOTIFY_FILTER{ FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME |
+	FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE };
+
+// How the entries of a listing are written, one line each
+enum class LISTING_FORMAT
+{
+	LIST,	// ls -l style
+	NLST,	// Names only
+	MLSD	// RFC 3659 facts: type, size and modify
+};
+
+/*
+	Keeps the text of recent directory listings, so a repeated listing
+	of a large directory is one lookup instead of a walk. Every cached
+	listing has a ReadDirectoryChangesW pending on its directory, all of
+	them on one completion port drained by one thread; the first change
+	drops the listing and the next request reads the directory again.
+	The watch is started before the directory is read, so a change in
+	between is not missed. Listings are shared, dropping one never pulls
+	the text out from under a transfer that is still sending it.
+*/
+class DirectoryCache
+{
+public:
+	using Text = std::string;
+
+private: // Variables
+	using Key = std::pair<std::wstring, LISTING_FORMAT>;
+
+	struct Entry
+	{
+		std::shared_ptr<const Text> text;
+		unsigned long long watch;	// Id of the watch that drops it
+	};
+
+	// Most recently used first
+	using LruList = std::list<std::pair<Key, Entry>>;
+	using EntryMap = std::map<Key, LruList::iterator>;
+
+	// One pending ReadDirectoryChangesW, OVERLAPPED must stay the first base
+	struct Watch : OVERLAPPED
+	{
+		Key key;
+		HANDLE hDirectory;
+		DWORD buffer[DIRECTORY_NOTIFY_BUFLEN / sizeof(DWORD)];
+	};
+
+	const std::size_t m_capacity;
+
+	// Filled with the size and time of every entry read
+	StatCache& m_stats;
+
+	std::mutex m_mutex;
+	LruList m_lru;
+	EntryMap m_entries;
+
+	// Watches live until their completion is dequeued, also after a cancel
+	std::unordered_map<unsigned long long, std::unique_ptr<Watch>> m_watches;
+	unsigned long long m_nextWatch;
+	bool m_stopping;
+
+	HANDLE m_hPort;
+	std::thread m_thread;
+
+	std::atomic<unsigned long long> m_hits;
+	std::atomic<unsigned long long> m_misses;
+
+private: // Functions
+	void run();
+	unsigned long long watch(const Key& key, HANDLE hDirectory);
+	void erase(EntryMap::iterator it);
+
+	int read(const std::filesystem::path& directory, HANDLE hDirectory, LISTING_FORMAT format, Text& text);
+
+public:
+	// A capacity of 0 disables the cache, every listing is read
+	DirectoryCache(std::size_t capacity, StatCache& stats);
+	virtual ~DirectoryCache();
+
+	DirectoryCache(const DirectoryCache&) = delete;
+	DirectoryCache& operator=(const DirectoryCache&) = delete;
+
+	// The listing of directory, from the cache if it has not changed. It is
+	// read and watched through hDirectory, a synchronous handle the caller
+	// opened with FILE_LIST_DIRECTORY; directory names it for the cache.
+	int listing(const std::filesystem::path& directory, HANDLE hDirectory, LISTING_FORMAT format, std::shared_ptr<const Text>& text);
+
+	// Drops the directory's listings, called after this server changed it
+	void invalidate(const std::filesystem::path& directory);
+
+	bool enabled() const { return m_hPort != NULL; }
+	unsigned long long hits() const { return m_hits; }
+	unsigned long long misses() const { return m_misses; }
+};
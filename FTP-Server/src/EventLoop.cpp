@@ -0,0 +1,158 @@
+#include "EventLoop.h"
+#include "FTP_Server.h"
+
+/***********************************************
+	Constructor
+***********************************************/
+EventLoop::EventLoop(ReadHandler handler) :
+	m_handler{ std::move(handler) },
+	m_hPort{ NULL },
+	m_running{ false },
+	m_watching{ 0 }
+{
+}
+
+/***********************************************
+	Destructor
+***********************************************/
+EventLoop::~EventLoop()
+{
+	stop();
+}
+
+/***********************************************
+	Loop control
+***********************************************/
+int EventLoop::start()
+{
+	// One thread takes the completions
+	m_hPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	if (m_hPort == NULL)
+	{
+		Log{ LOG_LEVEL::ERR } << "SERVER: CreateIoCompletionPort() failed with error: " << GetLastError();
+		return FAILURE;
+	}
+
+	m_running = true;
+	m_thread = std::thread{ &EventLoop::run, this };
+
+	return SUCCESS;
+}
+
+void EventLoop::stop()
+{
+	if (!m_thread.joinable()) return;
+
+	// Pending receives complete as cancelled, the loop ends once none is left.
+	// Under the lock so no add() posts a receive after the cancels.
+	{
+		std::lock_guard<std::mutex> lock{ m_watchMutex };
+		m_running = false;
+		for (const auto& watch : m_watches)
+		{
+			if (watch->session)
+				CancelIoEx((HANDLE)watch->session->ControlSocket, watch.get());
+		}
+	}
+	PostQueuedCompletionStatus(m_hPort, 0, 0, NULL);
+	m_thread.join();
+
+	CloseHandle(m_hPort);
+	m_hPort = NULL;
+}
+
+void EventLoop::add(std::shared_ptr<Session> session)
+{
+	std::lock_guard<std::mutex> lock{ m_watchMutex };
+
+	// A stopped loop closes the session by letting go of it
+	if (!m_running)
+		return;
+
+	// The control socket stays attached to the port for the session's life
+	if (!session->attached)
+	{
+		if (CreateIoCompletionPort((HANDLE)session->ControlSocket, m_hPort, 0, 0) == NULL)
+		{
+			Log{ LOG_LEVEL::ERR } << "SERVER: CreateIoCompletionPort() failed with error: " << GetLastError();
+			return;
+		}
+		session->attached = true;
+	}
+
+	Watch* watch{ nullptr };
+	if (!m_freeWatches.empty())
+	{
+		watch = m_freeWatches.back();
+		m_freeWatches.pop_back();
+	}
+	else
+	{
+		m_watches.push_back(std::make_unique<Watch>());
+		watch = m_watches.back().get();
+	}
+
+	// Zero bytes asked for, the receive completes once there is something to read
+	static_cast<OVERLAPPED&>(*watch) = OVERLAPPED{};
+	watch->session = std::move(session);
+	++m_watching;
+
+	WSABUF wsaBuf{ 0, NULL };
+	DWORD flags{ 0 };
+	int iResult = WSARecv(watch->session->ControlSocket, &wsaBuf, 1, NULL, &flags, watch, NULL);
+	int error{ WSAGetLastError() };
+	if (iResult == SOCKET_ERROR && error != WSA_IO_PENDING)
+	{
+		// A connection that is already broken is closed with the session
+		Log{ LOG_LEVEL::ERR } << "WINSOCK: WSARecv() failed with error: " << error;
+		watch->session.reset();
+		m_freeWatches.push_back(watch);
+		--m_watching;
+	}
+}
+
+// Frees a completed watch and hands back its session
+std::shared_ptr<Session> EventLoop::release(Watch* watch)
+{
+	std::lock_guard<std::mutex> lock{ m_watchMutex };
+	std::shared_ptr<Session> session{ std::move(watch->session) };
+	m_freeWatches.push_back(watch);
+	--m_watching;
+	return session;
+}
+
+/***********************************************
+	Main Loop
+***********************************************/
+void EventLoop::run()
+{
+	OVERLAPPED_ENTRY entries[EVENT_LOOP_BATCH];
+	while (m_running || m_watching > 0)
+	{
+		ULONG count{ 0 };
+		if (!GetQueuedCompletionStatusEx(m_hPort, entries, EVENT_LOOP_BATCH, &count, INFINITE, FALSE))
+		{
+			Log{ LOG_LEVEL::ERR } << "SERVER: GetQueuedCompletionStatusEx() failed with error: " << GetLastError();
+			break;
+		}
+
+		for (ULONG i = 0; i < count; ++i)
+		{
+			// The stop packet has no receive
+			if (entries[i].lpOverlapped == NULL)
+				continue;
+
+			std::shared_ptr<Session> session{ release(static_cast<Watch*>(entries[i].lpOverlapped)) };
+
+			// Readable, hung up or errored all end up in recv() inside the handler.
+			// Once stopped the session is let go of, which closes it.
+			if (m_running)
+				m_handler(std::move(session), *this);
+		}
+	}
+
+	// Releasing the sessions closes everything that is still connected
+	std::lock_guard<std::mutex> lock{ m_watchMutex };
+	for (const auto& watch : m_watches)
+		watch->session.reset();
+}
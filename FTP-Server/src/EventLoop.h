@@ -0,0 +1,68 @@
+#pragma once
+
+#include <ws2tcpip.h>
+
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <functional>
+
+struct Session;
+
+// Completions taken off the port with one call
+constexpr ULONG EVENT_LOOP_BATCH{ 64 };
+
+/*
+	Watches the non-blocking control sockets of many sessions from a
+	single thread. Each watched session has a zero-byte overlapped
+	WSARecv pending on the loop's completion port, which completes once
+	the client sent something. A wakeup only costs the sessions that are
+	ready, however many idle ones are held, and an idle session costs
+	its pending receive.
+	Sessions are watched one-shot: when one becomes readable it is no
+	longer watched and the handler owns it until it is add()ed again.
+*/
+class EventLoop
+{
+public:
+	// Runs on the loop thread, must not block
+	using ReadHandler = std::function<void(std::shared_ptr<Session>, EventLoop&)>;
+
+private: // Variables
+	// A pending zero-byte receive, OVERLAPPED must stay the first base
+	struct Watch : OVERLAPPED
+	{
+		std::shared_ptr<Session> session;	// Null while the watch is free
+	};
+
+	ReadHandler m_handler;
+	HANDLE m_hPort;
+
+	// Watches are reused, the loop allocates only when more sessions wait than ever before
+	std::mutex m_watchMutex;
+	std::vector<std::unique_ptr<Watch>> m_watches;
+	std::vector<Watch*> m_freeWatches;
+
+	std::thread m_thread;
+	std::atomic<bool> m_running;
+	std::atomic<std::size_t> m_watching;
+
+private: // Functions
+	void run();
+	std::shared_ptr<Session> release(Watch* watch);
+
+public:
+	explicit EventLoop(ReadHandler handler);
+	virtual ~EventLoop();
+
+	int start();
+	void stop();
+
+	// Thread safe, the loop takes ownership of the session
+	void add(std::shared_ptr<Session> session);
+
+	// Sessions currently waiting for input
+	std::size_t watching() const { return m_watching; }
+};
@@ -1,27 +1,70 @@
 #include "FTP_Server.h"
 
-#include <iostream>
 #include <string>
 #include <sstream>
 #include <fstream>
 #include <thread>
+#include <algorithm>
+#include <cstdio>
 
 /***********************************************
 	Constructor
 ***********************************************/
-FTP_Server::FTP_Server() :
+FTP_Server::FTP_Server(const ServerConfig& config) :
+	m_config{ config },
 	m_wsaData{ NULL },
 	m_iResult{ FAILURE },
-	m_iSendResult{ FAILURE },
 	ControlListenSocket{ INVALID_SOCKET },
 	ControlSocket{ INVALID_SOCKET },
-	DataTransferSocket{ INVALID_SOCKET },
 	clientAddr{ NULL },
 	clientAddrSize{ sizeof(clientAddr) },
+	m_nextLoop{ 0 },
+	m_bufferPool{ config.transferChunkSize },
+	m_fileCache{ config.fileCacheBytes },
+	m_statCache{ config.statCacheTtlMs },
+	m_hashIndex{ DEFAULT_HASH_INDEX_ENTRIES },
+	m_directoryCache{ config.directoryCacheEntries, m_statCache },
+	m_portPool{ config.passivePortFirst, config.passivePortLast },
+	m_metricsEndpoint{ m_metrics },
+	m_hRoot{ INVALID_HANDLE_VALUE },
+	m_blobStore{ STARTING_PATH, config.dedup },
+	m_deltaFiles{ 0 }
+{
+	for (const auto& name : commandNames)
+		m_metrics.nameCommand((std::size_t)name.command, name.verb);
+
+	m_hRoot = CreateFileW(STARTING_PATH.wstring().c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if (m_hRoot == INVALID_HANDLE_VALUE)
+		Log{ LOG_LEVEL::ERR } << "SERVER: CreateFileW() failed with error: " << GetLastError() << ", paths above the working directory are refused.";
+}
+
+Session::Session(SOCKET controlSocket, const std::filesystem::path& startingPath) :
+	ControlSocket{ controlSocket },
+	attached{ false },
+	DataTransferSocket{ INVALID_SOCKET },
+	PassiveListenSocket{ INVALID_SOCKET },
+	passivePort{},
+	iResult{ FAILURE },
+	iSendResult{ FAILURE },
+	hints{},
+	mode{ TRANSFER_MODE::STREAM },
+	compressionLevel{ COMPRESS_LEVEL_DEFAULT },
+	rangeStart{ 0 },
+	rangeEnd{ -1 },
+	transferred{ 0 },
+	hashAlgorithm{ HASH_ALGORITHM::SHA256 },
+	hasher{ nullptr },
+	expectedDigest{},
+	counted{},
 	cCommand{ COMMAND::INVALID },
 	sCommand{ "" },
-	sArgument{ "" }
+	sArgument{ "" },
+	sLine{ "" },
+	hCwd{ INVALID_HANDLE_VALUE }
 {
+	// Every session starts in the server's starting directory
+	changeDirectory(startingPath);
 }
 
 /***********************************************
@@ -31,6 +74,18 @@ FTP_Server::~FTP_Server()
 {
 	// Cleanup
 	Disconnect();
+
+	if (m_hRoot != INVALID_HANDLE_VALUE) CloseHandle(m_hRoot);
+}
+
+Session::~Session()
+{
+	// The last owner closes the connections
+	if (DataTransferSocket != INVALID_SOCKET) closesocket(DataTransferSocket);
+	if (PassiveListenSocket != INVALID_SOCKET) closesocket(PassiveListenSocket);
+	closesocket(ControlSocket);
+
+	if (hCwd != INVALID_HANDLE_VALUE) CloseHandle(hCwd);
 }
 
 /***********************************************
@@ -38,14 +93,28 @@ FTP_Server::~FTP_Server()
 ***********************************************/
 void FTP_Server::init()
 {
-	std::cout << "Initializing Winsock... ";
+	// From here on the console is written by the log writer only
+	if (!Logger::get().start(m_config.logFile, m_config.logLevel))
+	{
+		Logger::get().start("", m_config.logLevel);
+		Log{ LOG_LEVEL::WARN } << "LOG: Unable to open " << m_config.logFile << ", logging to the console.";
+	}
+
 	if (InitializeWinsock() != SUCCESS) return;
-	std::cout << "Done.\n";
+	Log{ LOG_LEVEL::INFO } << "WINSOCK: Initialized.";
+
+	// The server runs without the endpoint if it can not be opened, SITE STATS still works
+	if (!m_config.metricsSocket.empty())
+		m_metricsEndpoint.start(m_config.metricsSocket);
 
 	// Attempt to prepare server socket and start listening
 	if (EstablishControlConnection() != SUCCESS) return;
+
+	// Start one event loop per core to watch the control connections
+	if (StartEventLoops() != SUCCESS) return;
+	StartTransferBackend();
 	
-	std::cout << "\nSERVER: 220 System is ready.\n";
+	Log{ LOG_LEVEL::INFO } << "SERVER: 220 System is ready.";
 	if (AcceptControlConnection() != SUCCESS) return;
 }
 
@@ -61,8 +130,7 @@ int FTP_Server::InitializeWinsock()
 	m_iResult = WSAStartup(WINSOCK_VER, &m_wsaData);
 	if (m_iResult != SUCCESS) // Ensure system supports Winsock
 	{
-		std::cerr << "WINSOCK: WSAStartup() failed with error: "
-				  << m_iResult << '\n';
+		Log{ LOG_LEVEL::ERR } << "WINSOCK: WSAStartup() failed with error: " << m_iResult;
 		return FAILURE;
 	}
 	
@@ -71,6 +139,8 @@ int FTP_Server::InitializeWinsock()
 
 int FTP_Server::EstablishControlConnection()
 {
+	struct addrinfo* result = NULL, hints;
+
 	// After initialization, a SOCKET object must
 	// be instantiated for use by the server.
 	ZeroMemory(&hints, sizeof(hints));	// ZeroMemory fills the hints with zeros, prepares the memory to be used
@@ -84,7 +154,7 @@ int FTP_Server::EstablishControlConnection()
 	m_iResult = getaddrinfo(NULL, CONTROL_PORT, &hints, &result);
 	if (m_iResult != SUCCESS) // Error checking: ensure an address was received
 	{
-		std::cerr << "WINSOCK: getaddrinfo() failed with error: " << m_iResult << '\n';
+		Log{ LOG_LEVEL::ERR } << "WINSOCK: getaddrinfo() failed with error: " << m_iResult;
 		WSACleanup();
 		return FAILURE;
 	}
@@ -93,7 +163,7 @@ int FTP_Server::EstablishControlConnection()
 	ControlListenSocket = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
 	if (ControlListenSocket == INVALID_SOCKET) // Error checking: ensure the socket is valid.
 	{
-		std::cerr << "WINSOCK: socket() failed with error: " << WSAGetLastError() << '\n';
+		Log{ LOG_LEVEL::ERR } << "WINSOCK: socket() failed with error: " << WSAGetLastError();
 		freeaddrinfo(result);
 		WSACleanup();
 		return FAILURE;
@@ -106,7 +176,7 @@ int FTP_Server::EstablishControlConnection()
 	m_iResult = bind(ControlListenSocket, result->ai_addr, (int)result->ai_addrlen);
 	if (m_iResult == SOCKET_ERROR) // Error checking
 	{
-		std::cerr << "WINSOCK: bind() failed with error: " << WSAGetLastError() << '\n';
+		Log{ LOG_LEVEL::ERR } << "WINSOCK: bind() failed with error: " << WSAGetLastError();
 		freeaddrinfo(result); // Called to free the memory allocated by the getaddrinfo function for this address information
 		closesocket(ControlListenSocket);
 		WSACleanup();
@@ -121,7 +191,7 @@ int FTP_Server::EstablishControlConnection()
 	// must then listen on that IP address and port for incoming connection requests.
 	if (listen(ControlListenSocket, SOMAXCONN) == SOCKET_ERROR)
 	{
-		std::cerr << "WINSOCK: listen() failed with error: " << WSAGetLastError() << '\n';
+		Log{ LOG_LEVEL::ERR } << "WINSOCK: listen() failed with error: " << WSAGetLastError();
 		closesocket(ControlListenSocket);
 		WSACleanup();
 		return FAILURE;
@@ -139,7 +209,7 @@ int FTP_Server::AcceptControlConnection()
 		ControlSocket = accept(ControlListenSocket, (sockaddr*)&clientAddr, &clientAddrSize);
 		if (ControlSocket == INVALID_SOCKET)
 		{
-			std::cerr << "WINSOCK: accept() failed with code: " << WSAGetLastError() << '\n';
+			Log{ LOG_LEVEL::ERR } << "WINSOCK: accept() failed with code: " << WSAGetLastError();
 			closesocket(ControlListenSocket);
 			WSACleanup();
 			return FAILURE;
@@ -148,437 +218,1776 @@ int FTP_Server::AcceptControlConnection()
 		// DNS Lookup
 		// Attempt to get the client's name
 		if (getnameinfo((sockaddr*)&clientAddr, clientAddrSize, clientName, NI_MAXHOST, clientPort, NI_MAXSERV, 0) == 0)
-			std::cout << "SERVER: " << clientName << " connected on port " << clientPort << '\n';
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << clientName << " connected on port " << clientPort;
 		else // if unable to get name then show IP
 		{
-			inet_ntop(result->ai_family, &clientAddr.sin_addr, clientName, NI_MAXHOST);
-			std::cout << "SERVER: " << clientName << " connected on port " << ntohs(clientAddr.sin_port) << '\n';
+			inet_ntop(AF_INET, &clientAddr.sin_addr, clientName, NI_MAXHOST);
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << clientName << " connected on port " << ntohs(clientAddr.sin_port);
+		}
+
+		// Admission control, refuse the client while every worker is busy and the queue is full
+		if (m_workerPool->full())
+		{
+			RejectSession(ControlSocket);
+			closesocket(ControlSocket);
+			continue;
+		}
+
+		// Event loops need non-blocking sockets
+		u_long nonBlocking{ 1 };
+		if (ioctlsocket(ControlSocket, FIONBIO, &nonBlocking) == SOCKET_ERROR)
+		{
+			Log{ LOG_LEVEL::ERR } << "WINSOCK: ioctlsocket() failed with error: " << WSAGetLastError();
+			closesocket(ControlSocket);
+			continue;
 		}
 
-		// Save server object and socket in struct to send to new threads
-		threadex_info info{};
-		info.f = this;
-		info.s = ControlSocket;
-		
-		// Create new thread for client.
-		unsigned threadID{};
-		HANDLE hThread = (HANDLE)_beginthreadex(NULL, 0, &FTP_Server::ClientSession, (void*)&info, 0, &threadID);
+		// Send 220 welcome reply
+		auto session{ std::make_shared<Session>(ControlSocket, STARTING_PATH) };
+		session->counted = m_metrics.sessionStarted();
+		sendReply(*session, REPLY_220, (int)strlen(REPLY_220));
+		flushReplies(*session);
+
+		// Hand the new session over to the next event loop
+		m_eventLoops[m_nextLoop++ % m_eventLoops.size()]->add(std::move(session));
 	}
 
 	return 0;
 }
+
+/***********************************************
+	Event Loops and Workers
+***********************************************/
+int FTP_Server::StartEventLoops()
+{
+	// Workers are created once, the accept path never starts a thread
+	m_workerPool = std::make_unique<WorkerPool>((std::max)(1u, m_config.workerThreads), m_config.maxPendingSessions);
+
+	unsigned int loopCount{ (std::max)(1u, std::thread::hardware_concurrency()) };
+
+	for (unsigned int i = 0; i < loopCount; ++i)
+	{
+		// Queue a session for the workers whenever its control socket becomes readable
+		auto loop = std::make_unique<EventLoop>([this](std::shared_ptr<Session> session, EventLoop& loop)
+			{
+				SessionReadable(std::move(session), loop);
+			});
+
+		if (loop->start() != SUCCESS)
+		{
+			closesocket(ControlListenSocket);
+			WSACleanup();
+			return FAILURE;
+		}
+
+		m_eventLoops.push_back(std::move(loop));
+	}
+
+	Log{ LOG_LEVEL::INFO } << "SERVER: Started " << loopCount << " event loops and "
+		<< m_workerPool->workers() << " workers.";
+
+	return SUCCESS;
+}
+
+// Transfers fall back to TransmitFile when the port can not be created
+void FTP_Server::StartTransferBackend()
+{
+	if (m_config.transferBackend != TRANSFER_BACKEND::IOCP)
+		return;
+
+	m_iocp = std::make_unique<IocpTransfer>(m_bufferPool);
+	if (m_iocp->start() != SUCCESS)
+	{
+		Log{ LOG_LEVEL::WARN } << "SERVER: I/O completion ports unavailable, using TransmitFile.";
+		m_iocp.reset();
+		return;
+	}
+
+	Log{ LOG_LEVEL::INFO } << "SERVER: Data transfers use I/O completion ports.";
+}
+
+void FTP_Server::SessionReadable(std::shared_ptr<Session> session, EventLoop& loop)
+{
+	// The worker hands the session back to its loop once the command is done,
+	// a session that is not handed back is closed when the job releases it
+	bool queued = m_workerPool->trySubmit([this, session, &loop]
+		{
+			if (ControlProcess(*session) == SUCCESS)
+				loop.add(session);
+		});
+
+	if (!queued)
+		RejectSession(session->ControlSocket);
+}
+
+void FTP_Server::RejectSession(const SOCKET& hControlSocket)
+{
+	// Overloaded, tell the client instead of letting it hang
+	std::string m{ REPLY_421 + std::string{ CRLF } };
+	send(hControlSocket, m.c_str(), (int)m.length(), 0);
+	Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_421;
+}
  
 /***********************************************
 	Main Program Loop
 ***********************************************/
-int FTP_Server::ControlProcess(const SOCKET& hControlSocket)
+int FTP_Server::ControlProcess(Session& session)
 {
-	// Prepare buffer
-	char msgBuf[DEFAULT_BUFLEN]{};
-	int msgBufLen{ sizeof(msgBuf) };
-	ZeroMemory(msgBuf, msgBufLen);
-	
-	// Receive a command and handle it
-	m_iResult = recv(hControlSocket, msgBuf, msgBufLen, 0);
-	if (m_iResult > 0) // if something is received
+	const SOCKET& hControlSocket{ session.ControlSocket };
+
+	// Receive what the client sent, one read may carry several commands
+	// or only part of one
+	session.iResult = session.input.receive(hControlSocket);
+	if (session.iResult == 0) // Client closed the connection
 	{
-		// Separate input by whitespace
-		std::stringstream ss{ msgBuf };
-		ss >> sCommand;
-		ss >> sArgument;
+		Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_221 << " Client disconnected.";
+		return FAILURE;
+	}
+	else if (session.iResult == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK) // Nothing to read is not an error
+	{
+		Log{ LOG_LEVEL::ERR } << "SERVER: " << REPLY_221 << " Client disconnected. WSA Code: " << WSAGetLastError();
+		return FAILURE;
+	}
 
-		cCommand = getCommand(sCommand);
-		switch (cCommand)
-		{
-		case COMMAND::RETR:
+	// Handle every complete command in order, an unfinished one waits for the rest
+	int iResult{ SUCCESS };
+	while (iResult == SUCCESS && session.input.nextLine(session.sLine))
+	{
+		if (session.sLine.empty())
+			continue;
+
+		long long started{ m_metrics.now() };
+		iResult = executeCommand(session, session.sLine);
+		m_metrics.recordCommand((std::size_t)session.cCommand, started);
+	}
+
+	if (session.input.overflow())
+	{
+		session.input.clear();
+		sendReply(session, REPLY_500, (int)strlen(REPLY_500));
+		Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_500 << " Line too long.";
+	}
+
+	// The replies of the whole batch go out in one write
+	if (flushReplies(session) != SUCCESS)
+		return FAILURE;
+
+	return iResult;
+}
+
+int FTP_Server::executeCommand(Session& session, const std::string& line)
+{
+	// Split and look up without allocating, the session's strings keep their capacity
+	CommandLine command{ splitCommand(line) };
+	session.sCommand.assign(command.verb);
+	session.sArgument.assign(command.argument);
+
+	session.cCommand = getCommand(command.verb);
+	switch (session.cCommand)
+	{
+	case COMMAND::RETR:
+	{
+		if (!session.sArgument.empty())
 		{
-			if (!sArgument.empty())
+			std::filesystem::path filename{};
+			
+			// Hot files are served from memory without opening them,
+			// otherwise attempt to open file
+			std::shared_ptr<const FileCache::Content> cached{};
+			HANDLE hFile{ INVALID_HANDLE_VALUE };
+			ResolvedPath at{};
+			if (resolvePath(session, session.sArgument, filename, at) == SUCCESS)
 			{
-				std::string filename{ sArgument };
-				
-				// Attempt to open file
-				std::ifstream ifs{ filename, std::ios_base::binary };
-				if (!ifs)
-				{
-					// Reply with file not found
-					std::cout << "SERVER: " << REPLY_550 << '\n';
-					send(hControlSocket, REPLY_550, (int)strlen(REPLY_550), 0);
-				}
-				else
+				cached = m_fileCache.lookup(filename);
+				if (!cached)
 				{
-					// Reply with file found, attempting data connection
-					send(hControlSocket, REPLY_150, (int)strlen(REPLY_150), 0);
-					std::cout << "SERVER: " << REPLY_150 << '\n';
-					if (EstablishDataConnection() == SUCCESS)
+					hFile = at.open(FILE_GENERIC_READ, FILE_SHARE_READ, FILE_OPEN,
+						FILE_NON_DIRECTORY_FILE | FILE_SEQUENTIAL_ONLY | FILE_SYNCHRONOUS_IO_NONALERT);
+					if (hFile != INVALID_HANDLE_VALUE)
 					{
-						// Reply connection established, starting transfer
-						send(hControlSocket, REPLY_125, (int)strlen(REPLY_125), 0);
-						std::cout << "SERVER: " << REPLY_125;
-						if (retrFile(ifs) == SUCCESS)
-						{
-							// send sucess message
-							send(hControlSocket, REPLY_226, (int)strlen(REPLY_226), 0);
-							std::cout << "SERVER: " << REPLY_226 << '\n';							
-						}
-						else
-						{
-							// send failure message
-							send(hControlSocket, REPLY_450, (int)strlen(REPLY_450), 0);
-							std::cout << "SERVER: " << REPLY_450 << '\n';
-						}
-						closesocket(DataTransferSocket);
+						// A later SIZE or MDTM of the file is a lookup
+						m_statCache.store(filename, hFile);
+						cached = m_fileCache.load(filename, hFile);
 					}
 				}
 			}
-			else
+			if (!cached && hFile == INVALID_HANDLE_VALUE)
 			{
-				// reply syntax error in argument
-				send(hControlSocket, REPLY_501, (int)strlen(REPLY_501), 0);
-				std::cout << "SERVER: " << REPLY_501 << '\n';
+				// Reply with file not found
+				Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_550;
+				sendReply(session, REPLY_550, (int)strlen(REPLY_550));
 			}
-		} break;
-		case COMMAND::STOR:
-		{
-			if (!sArgument.empty())
+			else
 			{
-				// Attempt data connection with Client
-				send(hControlSocket, REPLY_150, (int)strlen(REPLY_150), 0);
-				std::cout << "SERVER: " << REPLY_150 << '\n';
-				if (EstablishDataConnection() == SUCCESS)
+				// Reply with file found, attempting data connection
+				sendReply(session, REPLY_150, (int)strlen(REPLY_150));
+				Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_150;
+				flushReplies(session);
+				if (EstablishDataConnection(session) == SUCCESS)
 				{
 					// Reply connection established, starting transfer
-					send(hControlSocket, REPLY_125, (int)strlen(REPLY_125), 0);
-					std::cout << "SERVER: " << REPLY_125;
+					sendReply(session, REPLY_125, (int)strlen(REPLY_125));
+					Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_125;
+					flushReplies(session);
 
-					// Receive file
-					if (storFile() == SUCCESS)
-					{
-						// send sucess message
-						send(hControlSocket, REPLY_226, (int)strlen(REPLY_226), 0);
-						std::cout << "SERVER: " << REPLY_226 << '\n';
-					}
-					else
+					// A whole file the index has no digest of is hashed on its way out
+					FileStat stat{};
+					std::string digest{};
+					std::unique_ptr<ContentHasher> hasher{};
+					if (session.rangeStart == 0 && session.rangeEnd < 0 &&
+						!m_hashIndex.lookup(filename, session.hashAlgorithm, stat, digest))
 					{
-						// send failure message
-						send(hControlSocket, REPLY_450, (int)strlen(REPLY_450), 0);
-						std::cout << "SERVER: " << REPLY_450 << '\n';
+						hasher = std::make_unique<ContentHasher>(hashBit(HASH_ALGORITHM::CRC32C) | hashBit(session.hashAlgorithm));
+						session.hasher = hasher.get();
 					}
-					closesocket(DataTransferSocket);
+
+					long long started{ m_metrics.now() };
+					session.transferred = 0;
+					session.iResult = cached ? retrCached(session, *cached) : retrFile(session, hFile);
+					m_metrics.recordTransfer(true, session.iResult == SUCCESS, session.transferred, started);
+					endTransfer(session, session.iResult);
+
+					session.hasher = nullptr;
+					if (hasher && session.iResult == SUCCESS)
+						m_hashIndex.record(filename, stat, *hasher);
 				}
+				else
+				{
+					// Reply unable to open the data connection
+					sendReply(session, REPLY_425, (int)strlen(REPLY_425));
+					Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_425;
+				}
+				if (hFile != INVALID_HANDLE_VALUE)
+					CloseHandle(hFile);
 			}
-			else
-			{
-				// reply syntax error in argument
-				send(hControlSocket, REPLY_501, (int)strlen(REPLY_501), 0);
-				std::cout << "SERVER: " << REPLY_501 << '\n';
-			}
-		} break;
-		case COMMAND::HELP:
-		{
-			// Call help command
-			std::string argument{ sArgument };
-			if (argument.empty())
-				showCommands(hControlSocket);
-			else if (!isCommand(argument))
-			{
-				// Send invalid argument
-				send(hControlSocket, REPLY_501, (int)strlen(REPLY_501), 0);
-				std::cout << "SERVER: " << REPLY_501 << '\n';
-				break;
-			}
-			else
-				explainCommands(hControlSocket, argument);
+		}
+		else
+		{
+			// reply syntax error in argument
+			sendReply(session, REPLY_501, (int)strlen(REPLY_501));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_501;
+		}
 
-			std::cout << "SERVER: " << REPLY_214 << '\n';
-		} break;
-		case COMMAND::MKD:
+		// A range only applies to the RETR right after it
+		session.clearRange();
+	} break;
+	case COMMAND::STOR:
+	{
+		std::filesystem::path filename{};
+		ResolvedPath at{};
+		if (!session.sArgument.empty() && resolvePath(session, session.sArgument, filename, at) != SUCCESS)
+		{
+			// Reply with not authorized
+			sendReply(session, REPLY_550, (int)strlen(REPLY_550));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_550;
+		}
+		else if (!session.sArgument.empty())
 		{
-			if (!sArgument.empty())
+			// Attempt data connection with Client
+			sendReply(session, REPLY_150, (int)strlen(REPLY_150));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_150;
+			flushReplies(session);
+			if (EstablishDataConnection(session) == SUCCESS)
 			{
-				// Attempt to create dir
-				if (std::filesystem::create_directory(sArgument))
+				// Reply connection established, starting transfer
+				sendReply(session, REPLY_125, (int)strlen(REPLY_125));
+				Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_125;
+				flushReplies(session);
+
+				// Receive file, a cached copy of the old one must not be served again
+				m_fileCache.invalidate(filename);
+				m_directoryCache.invalidate(filename.parent_path());
+				long long started{ m_metrics.now() };
+				session.transferred = 0;
+				// A new file is hashed as it arrives, a restarted one is not whole.
+				// After XDUP the SHA-256 decides whether the content is stored.
+				std::unique_ptr<ContentHasher> hasher{};
+				if (session.rangeStart == 0)
 				{
-					// Reply with directory created
-					std::string msg{ REPLY_257 + '<' + sArgument + '>' + " directory created."};
-					send(hControlSocket, msg.c_str(), msg.length(), 0);
-					std::cout << "SERVER: " << msg << '\n';
+					unsigned int algorithms{ hashBit(HASH_ALGORITHM::CRC32C) | hashBit(session.hashAlgorithm) };
+					if (!session.expectedDigest.empty())
+						algorithms |= hashBit(HASH_ALGORITHM::SHA256);
+					hasher = std::make_unique<ContentHasher>(algorithms);
+					session.hasher = hasher.get();
 				}
-				else
+
+				session.iResult = storFile(session, filename, at);
+				m_statCache.invalidate(filename);
+
+				// Stamped with the file as it is after the close
+				session.hasher = nullptr;
+				FileStat stat{};
+				if (hasher && session.iResult == SUCCESS && m_statCache.stat(filename, stat) == SUCCESS)
+					m_hashIndex.record(filename, stat, *hasher);
+
+				// Only content that really has the announced digest is stored,
+				// and only if the upload went through the hasher
+				if (hasher && session.iResult == SUCCESS && !session.expectedDigest.empty() &&
+					hasher->hashed() == (unsigned long long)session.transferred)
 				{
-					// Reply with error
-					std::string msg{ REPLY_521 + '<' + sArgument + '>' + ". Unable to create directory."};
-					send(hControlSocket, msg.c_str(), msg.length(), 0);
-					std::cout << "SERVER: " << msg << '\n';
+					if (hasher->digest(HASH_ALGORITHM::SHA256) == session.expectedDigest)
+						m_blobStore.store(session.expectedDigest, filename);
+					else
+						Log{ LOG_LEVEL::WARN } << "SERVER: " << filename.string() << " does not match the digest announced by XDUP.";
 				}
+				m_metrics.recordTransfer(false, session.iResult == SUCCESS, session.transferred, started);
+				endTransfer(session, session.iResult);
 			}
-			else // argument is empty
+			else
 			{
-				// Reply invalid argument
-				send(hControlSocket, REPLY_501, (int)strlen(REPLY_501), 0);
-				std::cout << "SERVER: " << REPLY_501 << '\n';
+				// Reply unable to open the data connection
+				sendReply(session, REPLY_425, (int)strlen(REPLY_425));
+				Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_425;
 			}
-		} break;
-		case COMMAND::CWD:
+		}
+		else
+		{
+			// reply syntax error in argument
+			sendReply(session, REPLY_501, (int)strlen(REPLY_501));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_501;
+		}
+
+		// A restart offset and an XDUP digest only apply to the STOR right after them
+		session.clearRange();
+		session.expectedDigest.clear();
+	} break;
+	case COMMAND::HELP:
+	{
+		// Call help command
+		std::string argument{ session.sArgument };
+		if (argument.empty())
+			showCommands(session);
+		else if (!isCommand(argument))
+		{
+			// Send invalid argument
+			sendReply(session, REPLY_501, (int)strlen(REPLY_501));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_501;
+			break;
+		}
+		else
+			explainCommands(session, argument);
+
+		Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_214;
+	} break;
+	case COMMAND::MKD:
+	{
+		if (!session.sArgument.empty())
 		{
-			if (!sArgument.empty())
+			// Attempt to create dir inside the session's directory, in the one the path was walked to
+			std::filesystem::path directory{};
+			ResolvedPath at{};
+			HANDLE hDirectory{ INVALID_HANDLE_VALUE };
+			if (resolvePath(session, session.sArgument, directory, at) == SUCCESS)
+				hDirectory = at.open(FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+					FILE_CREATE, FILE_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT);
+			if (hDirectory != INVALID_HANDLE_VALUE)
 			{
-				if (std::filesystem::exists(sArgument)) // directory exists
-				{
-					if ((sArgument == "..") && (std::filesystem::equivalent(std::filesystem::current_path(), STARTING_PATH)))
-					{
-						std::string msg{ "521 Directory is not authorized."};
-						send(hControlSocket, msg.c_str(), msg.length(), 0);
-						std::cout << "SERVER: " << msg << '\n';
-					}
-					else
-					{
-						std::filesystem::current_path(sArgument); // change directory
-						std::string d{ " Directory changed to: " };
-						std::string msg{ REPLY_200 + d + std::filesystem::current_path().string() };
-						send(hControlSocket, msg.c_str(), msg.length(), 0);
-						std::cout << "SERVER: " << msg << '\n';
-					}
-				}
-				else // directory doesn't exist
-				{
-					std::string msg{ "521 The system cannot find the path specified." };
-					send(hControlSocket, msg.c_str(), msg.length(), 0);
-					std::cout << "SERVER: " << msg << '\n';
-				}
+				CloseHandle(hDirectory);
+
+				// Listed right after, before the change notification may have arrived
+				m_directoryCache.invalidate(directory.parent_path());
 
+				// Reply with directory created
+				std::string msg{ std::string{ REPLY_257 } + '<' + session.sArgument + '>' + " directory created."};
+				sendReply(session, msg.c_str(), (int)msg.length());
+				Log{ LOG_LEVEL::INFO } << "SERVER: " << msg;
 			}
-			else // argument is empty
+			else
 			{
-				// Reply invalid argument
-				send(hControlSocket, REPLY_501, (int)strlen(REPLY_501), 0);
-				std::cout << "SERVER: " << REPLY_501 << '\n';
+				// Reply with error
+				std::string msg{ std::string{ REPLY_521 } + '<' + session.sArgument + '>' + ". Unable to create directory."};
+				sendReply(session, msg.c_str(), (int)msg.length());
+				Log{ LOG_LEVEL::INFO } << "SERVER: " << msg;
 			}
-		} break;
-		case COMMAND::PWD:
-		{
-			std::string m{ "The current working directory is " + std::filesystem::current_path().string() };
-			send(hControlSocket, m.c_str(), m.length(), 0);
-			std::cout << "SERVER: " << REPLY_257 << "Printed Working Directory.\n";
-		} break;
-		case COMMAND::QUIT:
+		}
+		else // argument is empty
 		{
-			send(hControlSocket, REPLY_221, (int)strlen(REPLY_221), 0);
-			std::cout << "SERVER: 221 Client requested QUIT command.\n";
-
-			closesocket(hControlSocket);
-		} break;
-		case COMMAND::LIST:
+			// Reply invalid argument
+			sendReply(session, REPLY_501, (int)strlen(REPLY_501));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_501;
+		}
+	} break;
+	case COMMAND::CWD:
+	{
+		if (!session.sArgument.empty())
 		{
-			std::string entries{ "Files and/or folders in directory:\n\n" };
-			// Loop to append every item in the current path to the string
-			for (auto const& directory_entry : std::filesystem::directory_iterator{ std::filesystem::current_path() })
+			std::filesystem::path directory{};
+			ResolvedPath at{};
+			HANDLE hDirectory{ INVALID_HANDLE_VALUE };
+			if (resolvePath(session, session.sArgument, directory, at) != SUCCESS) // outside of the starting path
+			{
+				std::string msg{ "521 Directory is not authorized."};
+				sendReply(session, msg.c_str(), (int)msg.length());
+				Log{ LOG_LEVEL::INFO } << "SERVER: " << msg;
+			}
+			else if ((hDirectory = at.open(FILE_LIST_DIRECTORY | FILE_TRAVERSE, FILE_SHARE_READ | FILE_SHARE_WRITE, FILE_OPEN,
+				FILE_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT)) != INVALID_HANDLE_VALUE &&
+				session.changeDirectory(hDirectory, directory) == SUCCESS)
 			{
-				// Clean the absolute path to only show the item's name
-				std::size_t found{ directory_entry.path().string().find_last_of("/\\") };
-				entries += ('\t' + directory_entry.path().string().substr(found + 1) + '\n');
+				// Only this session moves, the process keeps its working directory
+				std::string d{ " Directory changed to: " };
+				std::string msg{ REPLY_200 + d + session.cwd.string() };
+				sendReply(session, msg.c_str(), (int)msg.length());
+				Log{ LOG_LEVEL::INFO } << "SERVER: " << msg;
+			}
+			else // directory doesn't exist
+			{
+				std::string msg{ "521 The system cannot find the path specified." };
+				sendReply(session, msg.c_str(), (int)msg.length());
+				Log{ LOG_LEVEL::INFO } << "SERVER: " << msg;
 			}
 
-			send(hControlSocket, entries.c_str(), entries.length(), 0);
-			std::cout << "SERVER: " << REPLY_257 << "Printed files and/or folders in directory.\n";
-		} break;
-		case COMMAND::INVALID:
+		}
+		else // argument is empty
 		{
-			// Reply with invalid command
-			send(hControlSocket, REPLY_500, (int)strlen(REPLY_500), 0);
-			std::cout << "SERVER: " << REPLY_500 << '\n';
-		} break;
-		default:
-			throw std::runtime_error("Unknown error!");
+			// Reply invalid argument
+			sendReply(session, REPLY_501, (int)strlen(REPLY_501));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_501;
 		}
-	}
-	else if (m_iResult == SOCKET_ERROR)
+	} break;
+	case COMMAND::PWD:
 	{
-		std::cerr << "SERVER: " << REPLY_221 << " Client disconnected. WSA Code: " << WSAGetLastError() << '\n';
-		return FAILURE;
-	}
-
-	// Clear for next loop
-	sCommand.clear();
-	sArgument.clear();
-
-	return SUCCESS;
-}
+		// Quoted as RFC 959 asks, so clients can take the name out of the reply.
+		// Windows names can not hold a quote, none has to be doubled.
+		std::string m{ REPLY_257 + ('"' + session.cwd.string() + "\" is the current working directory.") };
+		sendReply(session, m.c_str(), (int)m.length());
+		Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_257 << "Printed Working Directory.";
+	} break;
+	case COMMAND::QUIT:
+	{
+		sendReply(session, REPLY_221, (int)strlen(REPLY_221));
+		Log{ LOG_LEVEL::INFO } << "SERVER: 221 Client requested QUIT command.";
 
-void FTP_Server::Disconnect()
-{
-	// Close all sockets
-	closesocket(ControlSocket);
-	closesocket(ControlListenSocket);
-	closesocket(DataTransferSocket);
+		// Let the event loop close the connection
+		session.sCommand.clear();
+		session.sArgument.clear();
+		return FAILURE;
+	} break;
+	case COMMAND::LIST:
+	case COMMAND::NLST:
+	case COMMAND::MLSD:
+	{
+		LISTING_FORMAT format{ (session.cCommand == COMMAND::MLSD) ? LISTING_FORMAT::MLSD :
+			(session.cCommand == COMMAND::NLST) ? LISTING_FORMAT::NLST : LISTING_FORMAT::LIST };
 
-	// Shut down the socket DLL
-	WSACleanup();
-}
+		// ls options like LIST -la are accepted and ignored
+		std::string argument{ (session.sArgument.empty() || session.sArgument.front() == '-') ? "" : session.sArgument };
 
-/***********************************************
-	FTP
-***********************************************/
+		// The session's directory unless one is given, read through the handle it was opened with
+		std::filesystem::path directory{ session.cwd };
+		HANDLE hDirectory{ session.hCwd };
+		if (!argument.empty())
+		{
+			ResolvedPath at{};
+			hDirectory = (resolvePath(session, argument, directory, at) == SUCCESS) ?
+				at.open(FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, FILE_OPEN,
+					FILE_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT) : INVALID_HANDLE_VALUE;
+		}
 
-int FTP_Server::EstablishDataConnection()
-{
-	ZeroMemory(&hints, sizeof(hints));	// ZeroMemory fills the hints with zeros
-	hints.ai_family = AF_INET;			// AF_NET for IPv4. AF_NET6 for IPv6. AF_UNSPEC for either (might cause error).
-	hints.ai_socktype = SOCK_STREAM;	// Used to specify a stream socket.
-	hints.ai_protocol = IPPROTO_TCP;	// Used to specify the TCP protocol.
+		std::shared_ptr<const DirectoryCache::Text> listing{};
+		int iListed = (hDirectory != INVALID_HANDLE_VALUE) ? m_directoryCache.listing(directory, hDirectory, format, listing) : FAILURE;
+		if (hDirectory != INVALID_HANDLE_VALUE && hDirectory != session.hCwd)
+			CloseHandle(hDirectory);
+		if (iListed != SUCCESS)
+		{
+			// Reply with directory not found
+			sendReply(session, REPLY_550, (int)strlen(REPLY_550));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_550;
+			break;
+		}
 
-	// Resolve the client address and port
-	m_iResult = getaddrinfo(/*Must be the Client's IP*//*"198.245.107.186"*/IP_ADDRESS, DATA_PORT, &hints, &result);
-	if (m_iResult != SUCCESS) // Error checking
-	{
-		std::cerr << "getaddrinfo() failed: " << m_iResult << '\n';
-		WSACleanup();
-		return FAILURE;
-	}
+		// Reply with listing ready, attempting data connection
+		sendReply(session, REPLY_150, (int)strlen(REPLY_150));
+		Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_150;
+		flushReplies(session);
+		if (EstablishDataConnection(session) == SUCCESS)
+		{
+			// Reply connection established, starting transfer
+			sendReply(session, REPLY_125, (int)strlen(REPLY_125));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_125;
+			flushReplies(session);
 
-	// Attempt to connect to an address until one succeeds
-	for (ptr = result; ptr != NULL; ptr = ptr->ai_next)
+			// Framed like a file, so every mode works for listings too
+			Log{ LOG_LEVEL::INFO } << "SERVER: Sending listing of " << listing->size() << " bytes (cached: "
+				<< m_directoryCache.hits() << " hits, " << m_directoryCache.misses() << " misses)";
+			long long started{ m_metrics.now() };
+			session.transferred = (long long)listing->size();
+			session.iResult = sendBuffer(session, listing->data(), (long long)listing->size());
+			m_metrics.recordTransfer(true, session.iResult == SUCCESS, session.transferred, started);
+			endTransfer(session, session.iResult);
+		}
+		else
+		{
+			// Reply unable to open the data connection
+			sendReply(session, REPLY_425, (int)strlen(REPLY_425));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_425;
+		}
+	} break;
+	case COMMAND::SIZE:
+	case COMMAND::MDTM:
 	{
-		// Create a SOCKET for connecting to client
-		DataTransferSocket = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
-		if (DataTransferSocket == INVALID_SOCKET) // Ensure that the socket is a valid socket.
+		// Size or last write time of a file, without opening it
+		std::filesystem::path filename{};
+		FileStat stat{};
+		if (session.sArgument.empty())
 		{
-			std::cerr << "socket() failed with error: " << WSAGetLastError() << '\n';
-			freeaddrinfo(result);
-			WSACleanup();
-			return FAILURE;
+			// reply syntax error in argument
+			sendReply(session, REPLY_501, (int)strlen(REPLY_501));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_501;
 		}
-
-		// Connect to client.
-		m_iResult = connect(DataTransferSocket, ptr->ai_addr, (int)ptr->ai_addrlen);
-		if (m_iResult == SOCKET_ERROR) // Check for general errors.
+		else if (resolvePath(session, session.sArgument, filename) != SUCCESS ||
+			m_statCache.stat(filename, stat) != SUCCESS || stat.directory)
 		{
-			closesocket(DataTransferSocket);
-			DataTransferSocket = INVALID_SOCKET;
-			continue;
+			// Reply with file not found
+			sendReply(session, REPLY_550, (int)strlen(REPLY_550));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_550;
 		}
-		break;
-	}
-
-	// Not needed anymore, free the memory
-	freeaddrinfo(result);
+		else if (session.cCommand == COMMAND::SIZE)
+		{
+			// An upload that did not finish only has what arrived, not what the file was grown to
+			long long committed{ stat.partial ? PartialUpload::committed(filename) : -1 };
+			std::string m{ REPLY_213 + std::to_string((committed >= 0) ? (std::min)(committed, stat.size) : stat.size) };
+			sendReply(session, m.c_str(), (int)m.length());
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << m;
+		}
+		else
+		{
+			// RFC 3659 time-val, always UTC
+			SYSTEMTIME modified{};
+			FileTimeToSystemTime(&stat.lastWrite, &modified);
+			char timeVal[16]{};
+			std::snprintf(timeVal, sizeof(timeVal), "%04u%02u%02u%02u%02u%02u", modified.wYear, modified.wMonth,
+				modified.wDay, modified.wHour, modified.wMinute, modified.wSecond);
 
-	if (DataTransferSocket == INVALID_SOCKET)
+			std::string m{ REPLY_213 + std::string{ timeVal } };
+			sendReply(session, m.c_str(), (int)m.length());
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << m;
+		}
+	} break;
+	case COMMAND::RANG:
 	{
-		std::cerr << "SERVER: Unable to connect to Client-DTP!\n";
-		WSACleanup();
-		return FAILURE;
-	}
-
-	return SUCCESS;
-}
+		// RANG <start> <end>, both inclusive byte positions
+		std::string_view args{ command.rest };
+		long long start{ -1 }, end{ -1 };
+		bool parsed{ parseNumber(splitWord(args), start) && parseNumber(splitWord(args), end) };
 
-int FTP_Server::retrFile(std::ifstream& ifs)
-{
-	// Prepare transfer buffer
-	char xferBuf[TRANSFER_BYTE_SYZE];
-	int xferBufLen{ sizeof(xferBuf) };
-	ZeroMemory(xferBuf, xferBufLen);
-
-	// Get file size
-	long file_size = (long)std::filesystem::file_size(sArgument);
-	std::cout << " (" << file_size << " bytes)\n";
-
-	// Send file size
-	m_iSendResult = send(DataTransferSocket, reinterpret_cast<char*>(&file_size), sizeof(file_size), 0);
-	
-	// Send file
-	// Loop while there's still data to send
-	for (int remainingData = file_size; remainingData > 0; remainingData -= m_iSendResult)
-	{
-		ifs.read(xferBuf, xferBufLen);
-		m_iSendResult = send(DataTransferSocket, xferBuf, xferBufLen, 0);
-		if (m_iSendResult == SOCKET_ERROR)
+		if (!parsed || start < 0 || end < start)
 		{
-			std::cerr << "WINSOCK: send() failed with error: " << WSAGetLastError() << '\n';
-			return FAILURE;
+			// reply syntax error in argument
+			sendReply(session, REPLY_501, (int)strlen(REPLY_501));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_501;
 		}
-	}
-
-	ifs.close();
-
-	return SUCCESS;
-}
-
-int FTP_Server::storFile()
-{
-	// Prepare transfer buffer
-	char xferBuf[TRANSFER_BYTE_SYZE];
-	int xferBufLen{ sizeof(xferBuf) };
-	ZeroMemory(xferBuf, xferBufLen);
-
-	// Receive file size
-	long file_size{ 0 };
-	m_iResult = recv(DataTransferSocket, reinterpret_cast<char*>(&file_size), sizeof(file_size), 0);
-	std::cout << " (" << file_size << " bytes)\n";
-
-	// Create file in binary mode
-	std::ofstream ofs{ sArgument, std::ios_base::binary };
-	if (!ofs) std::cout << "SERVER: Error opening file: " << sArgument << "\n";
+		else
+		{
+			session.rangeStart = start;
+			session.rangeEnd = end;
 
-	// Receive file
-	// Loop while there's still data to receive
-	for (int remainingData = file_size; remainingData > 0; remainingData -= m_iResult)
+			std::string m{ REPLY_350 + std::string{ "Restarting at " } + std::to_string(start) +
+				". End-point at " + std::to_string(end) + "." };
+			sendReply(session, m.c_str(), (int)m.length());
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << m;
+		}
+	} break;
+	case COMMAND::REST:
 	{
-		m_iResult = recv(DataTransferSocket, xferBuf, xferBufLen, 0);
-		if (m_iResult == SOCKET_ERROR)
+		// REST <offset>, the next RETR or STOR starts at that byte
+		long long offset{ -1 };
+		if (!parseNumber(command.argument, offset) || offset < 0)
 		{
-			std::cerr << "WINSOCK: recv() failed with error: " << WSAGetLastError() << '\n';
-			return FAILURE;
+			// reply syntax error in argument
+			sendReply(session, REPLY_501, (int)strlen(REPLY_501));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_501;
 		}
-		ofs.write(xferBuf, xferBufLen);
-	}
+		else
+		{
+			session.rangeStart = offset;
+			session.rangeEnd = -1;
 
-	ofs.close();
+			std::string m{ REPLY_350 + std::string{ "Restarting at " } + std::to_string(offset) +
+				". Send STORE or RETRIEVE to initiate transfer." };
+			sendReply(session, m.c_str(), (int)m.length());
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << m;
+		}
+	} break;
+	case COMMAND::MODE:
+	{
+		// Switching modes starts over with a fresh data connection
+		std::string mode{ session.sArgument };
+		for (auto& c : mode)
+			c = std::toupper(c);
+
+		if (mode.empty())
+		{
+			// reply syntax error in argument
+			sendReply(session, REPLY_501, (int)strlen(REPLY_501));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_501;
+		}
+		else if (mode == "S" || mode == "B")
+		{
+			session.closeDataConnection();
+			session.mode = (mode == "B") ? TRANSFER_MODE::BLOCK : TRANSFER_MODE::STREAM;
+			sendReply(session, REPLY_200, (int)strlen(REPLY_200));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_200 << " Mode " << mode << ".";
+		}
+		else if (mode == "Z")
+		{
+			// MODE Z [level], the level is optional
+			std::string_view args{ command.rest };
+			splitWord(args);
+			int level{ COMPRESS_LEVEL_DEFAULT };
+			if (!parseNumber(splitWord(args), level))
+				level = COMPRESS_LEVEL_DEFAULT;
+
+			if (level < COMPRESS_LEVEL_MIN || level > COMPRESS_LEVEL_MAX)
+			{
+				// Reply with unsupported level
+				sendReply(session, REPLY_504, (int)strlen(REPLY_504));
+				Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_504;
+			}
+			else
+			{
+				session.closeDataConnection();
+				session.mode = TRANSFER_MODE::COMPRESSED;
+				session.compressionLevel = level;
+				sendReply(session, REPLY_200, (int)strlen(REPLY_200));
+				Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_200 << " Mode Z, level " << level << ".";
+			}
+		}
+		else
+		{
+			// Reply with unsupported mode
+			sendReply(session, REPLY_504, (int)strlen(REPLY_504));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_504;
+		}
+	} break;
+	case COMMAND::PASV:
+	{
+		sockaddr_in listenAddr{};
+		int listenAddrSize{ sizeof(listenAddr) };
+		if (OpenPassiveListener(session) != SUCCESS ||
+			getsockname(session.PassiveListenSocket, (sockaddr*)&listenAddr, &listenAddrSize) == SOCKET_ERROR)
+		{
+			// Reply with no data connection
+			sendReply(session, REPLY_425, (int)strlen(REPLY_425));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_425;
+		}
+		else
+		{
+			// Reply with h1,h2,h3,h4,p1,p2
+			const unsigned char* ip{ reinterpret_cast<const unsigned char*>(&listenAddr.sin_addr) };
+			unsigned short port{ session.passivePort.port() };
+			std::string m{ std::string{ REPLY_227 } + '(' +
+				std::to_string(ip[0]) + ',' + std::to_string(ip[1]) + ',' +
+				std::to_string(ip[2]) + ',' + std::to_string(ip[3]) + ',' +
+				std::to_string(port >> 8) + ',' + std::to_string(port & 0xFF) + ")." };
+			sendReply(session, m.c_str(), (int)m.length());
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << m;
+		}
+	} break;
+	case COMMAND::EPSV:
+	{
+		if (OpenPassiveListener(session) != SUCCESS)
+		{
+			// Reply with no data connection
+			sendReply(session, REPLY_425, (int)strlen(REPLY_425));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_425;
+		}
+		else
+		{
+			// Only the port, the client reuses the control connection's address
+			std::string m{ std::string{ REPLY_229 } + "(|||" + std::to_string(session.passivePort.port()) + "|)" };
+			sendReply(session, m.c_str(), (int)m.length());
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << m;
+		}
+	} break;
+	case COMMAND::HASH:
+	case COMMAND::XCRC:
+	{
+		// XCRC is always the CRC-32C, HASH uses the session's algorithm
+		HASH_ALGORITHM algorithm{ (session.cCommand == COMMAND::XCRC) ? HASH_ALGORITHM::CRC32C : session.hashAlgorithm };
+
+		std::filesystem::path filename{};
+		ResolvedPath at{};
+		FileStat stat{};
+		std::string digest{};
+		if (session.sArgument.empty())
+		{
+			// reply syntax error in argument
+			sendReply(session, REPLY_501, (int)strlen(REPLY_501));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_501;
+		}
+		else if (resolvePath(session, session.sArgument, filename, at) != SUCCESS ||
+			hashFile(filename, at, algorithm, stat, digest) != SUCCESS)
+		{
+			// Reply with file not found
+			sendReply(session, REPLY_550, (int)strlen(REPLY_550));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_550;
+		}
+		else
+		{
+			// HASH replies like draft-bryan-ftp-hash: algorithm, byte range, digest, name
+			std::string m{};
+			if (session.cCommand == COMMAND::XCRC)
+				m = std::string{ REPLY_250_CRC } + digest;
+			else
+				m = REPLY_213 + std::string{ hashName(algorithm) } + " 0-" + std::to_string(stat.size > 0 ? stat.size - 1 : 0) +
+					' ' + digest + ' ' + session.sArgument;
+			sendReply(session, m.c_str(), (int)m.length());
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << m << " (index: " << m_hashIndex.hits() << " hits, "
+				<< m_hashIndex.misses() << " misses)";
+		}
+
+		// Whole files only, a pending range is dropped
+		session.clearRange();
+	} break;
+	case COMMAND::XDUP:
+	{
+		// XDUP <sha256> <size> <file-name>, asked before a STOR of the same file
+		std::string_view args{ command.rest };
+		std::string digest{ splitWord(args) };
+		long long size{ -1 };
+		bool parsed{ parseNumber(splitWord(args), size) };
+		std::string name{ splitWord(args) };
+
+		std::filesystem::path filename{};
+		std::error_code ec{};
+		if (!m_blobStore.enabled())
+		{
+			// Reply with not implemented, the client sends the file
+			sendReply(session, REPLY_502, (int)strlen(REPLY_502));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_502;
+		}
+		else if (!parsed || name.empty() || size < 0 || !BlobStore::normalizeDigest(digest))
+		{
+			// reply syntax error in argument
+			sendReply(session, REPLY_501, (int)strlen(REPLY_501));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_501;
+		}
+		else if (resolvePath(session, name, filename) != SUCCESS || std::filesystem::is_directory(filename, ec))
+		{
+			// Reply with not authorized
+			sendReply(session, REPLY_550, (int)strlen(REPLY_550));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_550;
+		}
+		else if (m_blobStore.link(digest, size, filename) == SUCCESS)
+		{
+			// The name changed without a STOR, nothing cached about it holds
+			m_fileCache.invalidate(filename);
+			m_statCache.invalidate(filename);
+			m_directoryCache.invalidate(filename.parent_path());
+
+			std::string m{ "250 " + name + " linked to stored content, no transfer needed." };
+			sendReply(session, m.c_str(), (int)m.length());
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << m << " (" << m_blobStore.linked() << " linked, "
+				<< m_blobStore.stored() << " stored)";
+		}
+		else
+		{
+			// Remembered for the STOR that follows
+			session.expectedDigest = digest;
+
+			std::string m{ REPLY_350 + std::string{ "Content not stored, send it with STOR." } };
+			sendReply(session, m.c_str(), (int)m.length());
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << m;
+		}
+	} break;
+	case COMMAND::XDLT:
+	{
+		// XDLT <file-name>, a STOR that only sends what changed against the copy here
+		std::filesystem::path filename{};
+		ResolvedPath at{};
+		HANDLE hBasis{ INVALID_HANDLE_VALUE };
+		if (!session.sArgument.empty() && resolvePath(session, session.sArgument, filename, at) == SUCCESS)
+			hBasis = at.open(0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, FILE_OPEN,
+				FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT);
+
+		// Only a file to build on is looked for here, the transfer opens it again from the same directory
+		if (hBasis != INVALID_HANDLE_VALUE)
+			CloseHandle(hBasis);
+
+		if (session.sArgument.empty())
+		{
+			// reply syntax error in argument
+			sendReply(session, REPLY_501, (int)strlen(REPLY_501));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_501;
+		}
+		else if (hBasis == INVALID_HANDLE_VALUE)
+		{
+			// Nothing to build on, the client sends the file with STOR
+			sendReply(session, REPLY_550, (int)strlen(REPLY_550));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_550;
+		}
+		else
+		{
+			// Attempt data connection with Client
+			sendReply(session, REPLY_150, (int)strlen(REPLY_150));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_150;
+			flushReplies(session);
+			if (EstablishDataConnection(session) == SUCCESS)
+			{
+				// Reply connection established, starting transfer
+				sendReply(session, REPLY_125, (int)strlen(REPLY_125));
+				Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_125;
+				flushReplies(session);
+
+				// The rebuilt file is hashed as it is written
+				m_fileCache.invalidate(filename);
+				long long started{ m_metrics.now() };
+				session.transferred = 0;
+				ContentHasher hasher{ hashBit(HASH_ALGORITHM::CRC32C) | hashBit(session.hashAlgorithm) };
+				session.hasher = &hasher;
+				session.iResult = storDelta(session, at);
+				session.hasher = nullptr;
+
+				m_statCache.invalidate(filename);
+				m_directoryCache.invalidate(filename.parent_path());
+				FileStat stat{};
+				if (session.iResult == SUCCESS && m_statCache.stat(filename, stat) == SUCCESS)
+					m_hashIndex.record(filename, stat, hasher);
+
+				m_metrics.recordTransfer(false, session.iResult == SUCCESS, session.transferred, started);
+				endTransfer(session, session.iResult);
+			}
+			else
+			{
+				// Reply unable to open the data connection
+				sendReply(session, REPLY_425, (int)strlen(REPLY_425));
+				Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_425;
+			}
+		}
+
+		// A restart offset does not apply to a delta
+		session.clearRange();
+	} break;
+	case COMMAND::XDGT:
+	{
+		// XDGT <file-name>, a RETR that only sends what the client's copy lacks
+		std::filesystem::path filename{};
+		HANDLE hFile{ INVALID_HANDLE_VALUE };
+		ResolvedPath at{};
+		if (!session.sArgument.empty() && resolvePath(session, session.sArgument, filename, at) == SUCCESS)
+			hFile = at.open(FILE_GENERIC_READ, FILE_SHARE_READ, FILE_OPEN,
+				FILE_NON_DIRECTORY_FILE | FILE_SEQUENTIAL_ONLY | FILE_SYNCHRONOUS_IO_NONALERT);
+
+		if (session.sArgument.empty())
+		{
+			// reply syntax error in argument
+			sendReply(session, REPLY_501, (int)strlen(REPLY_501));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_501;
+		}
+		else if (hFile == INVALID_HANDLE_VALUE)
+		{
+			// Reply with file not found
+			sendReply(session, REPLY_550, (int)strlen(REPLY_550));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_550;
+		}
+		else
+		{
+			// Reply with file found, attempting data connection
+			m_statCache.store(filename, hFile);
+			sendReply(session, REPLY_150, (int)strlen(REPLY_150));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_150;
+			flushReplies(session);
+			if (EstablishDataConnection(session) == SUCCESS)
+			{
+				// Reply connection established, starting transfer
+				sendReply(session, REPLY_125, (int)strlen(REPLY_125));
+				Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_125;
+				flushReplies(session);
+
+				// The whole file is read, so one the index has no digest of is hashed on the way
+				FileStat stat{};
+				std::string digest{};
+				std::unique_ptr<ContentHasher> hasher{};
+				if (!m_hashIndex.lookup(filename, session.hashAlgorithm, stat, digest))
+				{
+					hasher = std::make_unique<ContentHasher>(hashBit(HASH_ALGORITHM::CRC32C) | hashBit(session.hashAlgorithm));
+					session.hasher = hasher.get();
+				}
+
+				long long started{ m_metrics.now() };
+				session.transferred = 0;
+				session.iResult = retrDelta(session, hFile);
+				m_metrics.recordTransfer(true, session.iResult == SUCCESS, session.transferred, started);
+				endTransfer(session, session.iResult);
+
+				session.hasher = nullptr;
+				if (hasher && session.iResult == SUCCESS)
+					m_hashIndex.record(filename, stat, *hasher);
+			}
+			else
+			{
+				// Reply unable to open the data connection
+				sendReply(session, REPLY_425, (int)strlen(REPLY_425));
+				Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_425;
+			}
+		}
+		if (hFile != INVALID_HANDLE_VALUE)
+			CloseHandle(hFile);
+
+		// A range does not apply to a delta
+		session.clearRange();
+	} break;
+	case COMMAND::OPTS:
+	{
+		// OPTS HASH [algorithm], the only option so far
+		std::string_view args{ command.rest };
+		std::string_view option{ splitWord(args) };
+		std::string_view value{ splitWord(args) };
+
+		HASH_ALGORITHM algorithm{};
+		if (verbKey(option) != verbKey("HASH"))
+		{
+			// reply syntax error in argument
+			sendReply(session, REPLY_501, (int)strlen(REPLY_501));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_501;
+		}
+		else if (!value.empty() && !parseHashName(value, algorithm))
+		{
+			// Reply with unsupported algorithm
+			sendReply(session, REPLY_504, (int)strlen(REPLY_504));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_504;
+		}
+		else
+		{
+			// Without a value the reply names the current algorithm
+			if (!value.empty())
+				session.hashAlgorithm = algorithm;
+
+			std::string m{ "200 " + std::string{ hashName(session.hashAlgorithm) } };
+			sendReply(session, m.c_str(), (int)m.length());
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << m;
+		}
+	} break;
+	case COMMAND::SITE:
+	{
+		// SITE STATS, the only site command so far
+		std::string argument{ session.sArgument };
+		for (auto& c : argument)
+			c = std::toupper(c);
+
+		if (argument.empty())
+		{
+			// reply syntax error in argument
+			sendReply(session, REPLY_501, (int)strlen(REPLY_501));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_501;
+		}
+		else if (argument == "STATS")
+		{
+			sendMultilineReply(session, REPLY_211, m_metrics.formatStats());
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_211 << " Sent statistics.";
+		}
+		else
+		{
+			// Reply with unsupported site command
+			sendReply(session, REPLY_504, (int)strlen(REPLY_504));
+			Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_504;
+		}
+	} break;
+	case COMMAND::INVALID:
+	{
+		// Reply with invalid command
+		sendReply(session, REPLY_500, (int)strlen(REPLY_500));
+		Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_500;
+	} break;
+	default:
+		throw std::runtime_error("Unknown error!");
+	}
+
+	// Clear for next loop
+	session.sCommand.clear();
+	session.sArgument.clear();
 
 	return SUCCESS;
 }
 
+// Queues a reply, it is sent with the others of the batch by flushReplies()
+int FTP_Server::sendReply(Session& session, const char* msg, int msgLen)
+{
+	session.replies.append(msg, msgLen);
+	session.replies += CRLF;
+	return SUCCESS;
+}
+
+// Queues a multi-line reply: "214-Help message.", the lines of text, "214 End."
+int FTP_Server::sendMultilineReply(Session& session, const char* reply, const std::string& text)
+{
+	std::string code{ reply, 3 };
+	session.replies += code + '-' + (reply + 4) + CRLF;
+
+	// A line starting with a digit could be taken for the last line
+	std::stringstream lines{ text };
+	for (std::string line{}; std::getline(lines, line); )
+	{
+		if (!line.empty() && std::isdigit((unsigned char)line[0]))
+			session.replies += ' ';
+		session.replies += line + CRLF;
+	}
+
+	session.replies += code + " End." + CRLF;
+	return SUCCESS;
+}
+
+// Sends every queued reply in one write
+int FTP_Server::flushReplies(Session& session)
+{
+	if (session.replies.empty())
+		return SUCCESS;
+
+	// Control sockets are non-blocking, sendAll waits for room in the send buffer
+	int iResult = sendAll(session.ControlSocket, session.replies.c_str(), (int)session.replies.length());
+	session.replies.clear();
+	return iResult;
+}
+
+void FTP_Server::Disconnect()
+{
+	// Stop the workers before the loops they hand sockets back to,
+	// the loops close their own sockets
+	if (m_workerPool) m_workerPool->stop();
+	m_eventLoops.clear();
+	m_workerPool.reset();
+	m_iocp.reset();
+	m_metricsEndpoint.stop();
+
+	// Close all sockets
+	closesocket(ControlListenSocket);
+
+	// Shut down the socket DLL
+	WSACleanup();
+
+	// Write out what is still queued
+	Logger::get().stop();
+}
+
 /***********************************************
-	COMMANDS
+	FTP
 ***********************************************/
 
-COMMAND FTP_Server::getCommand(std::string& sCommand)
+int FTP_Server::EstablishDataConnection(Session& session)
 {
-	// Make all characters in sCommand uppercase
-	for (auto& c : sCommand)
-		c = std::toupper(c);
+	// Block mode reuses the connection of the previous transfer
+	if (session.DataTransferSocket != INVALID_SOCKET)
+		return SUCCESS;
 
-	// Search hash map for the command
-	auto x = stringToCommand.find(sCommand);
-	if (x != std::end(stringToCommand))
-		return x->second;
+	// Only new connections count towards the setup time
+	long long started{ m_metrics.now() };
+
+	// Passive mode, the client connects to the session's listener
+	if (session.PassiveListenSocket != INVALID_SOCKET)
+	{
+		// Only the client on the control connection may use the port
+		sockaddr_in controlAddr{};
+		int controlAddrSize{ sizeof(controlAddr) };
+		if (getpeername(session.ControlSocket, (sockaddr*)&controlAddr, &controlAddrSize) == SOCKET_ERROR)
+		{
+			Log{ LOG_LEVEL::ERR } << "WINSOCK: getpeername() failed with error: " << WSAGetLastError();
+			return FAILURE;
+		}
+
+		// A connection from anyone else is dropped and the wait goes on,
+		// so a stranger who finds the port can not fail the transfer
+		while (true)
+		{
+			long long waited{ (m_metrics.now() - started) / 1000 };
+			WSAPOLLFD pollFd{ session.PassiveListenSocket, POLLRDNORM, 0 };
+			if (waited >= DATA_ACCEPT_TIMEOUT_MS ||
+				WSAPoll(&pollFd, 1, (int)(DATA_ACCEPT_TIMEOUT_MS - waited)) <= 0)
+			{
+				Log{ LOG_LEVEL::ERR } << "SERVER: Client-DTP did not connect!";
+				return FAILURE;
+			}
+
+			sockaddr_in dataAddr{};
+			int dataAddrSize{ sizeof(dataAddr) };
+			SOCKET dataSocket = accept(session.PassiveListenSocket, (sockaddr*)&dataAddr, &dataAddrSize);
+			if (dataSocket == INVALID_SOCKET)
+			{
+				Log{ LOG_LEVEL::ERR } << "WINSOCK: accept() failed with error: " << WSAGetLastError();
+				return FAILURE;
+			}
+
+			if (dataAddr.sin_addr.s_addr == controlAddr.sin_addr.s_addr)
+			{
+				session.DataTransferSocket = dataSocket;
+				break;
+			}
+
+			Log{ LOG_LEVEL::WARN } << "SERVER: Data connection from a foreign address refused.";
+			closesocket(dataSocket);
+		}
+
+		m_metrics.recordDataConnect(started);
+		return SUCCESS;
+	}
+
+	// Active mode, connect back to the address of the control connection
+	sockaddr_in peerAddr{};
+	int peerAddrSize{ sizeof(peerAddr) };
+	char peerName[INET_ADDRSTRLEN]{};
+	if (getpeername(session.ControlSocket, (sockaddr*)&peerAddr, &peerAddrSize) == SOCKET_ERROR ||
+		inet_ntop(AF_INET, &peerAddr.sin_addr, peerName, sizeof(peerName)) == NULL)
+	{
+		Log{ LOG_LEVEL::ERR } << "WINSOCK: getpeername() failed with error: " << WSAGetLastError();
+		return FAILURE;
+	}
+
+	ZeroMemory(&session.hints, sizeof(session.hints));	// ZeroMemory fills the hints with zeros
+	session.hints.ai_family = AF_INET;			// AF_NET for IPv4. AF_NET6 for IPv6. AF_UNSPEC for either (might cause error).
+	session.hints.ai_socktype = SOCK_STREAM;	// Used to specify a stream socket.
+	session.hints.ai_protocol = IPPROTO_TCP;	// Used to specify the TCP protocol.
+
+	// Resolve the client address and port
+	session.iResult = getaddrinfo(peerName, DATA_PORT, &session.hints, &session.result);
+	if (session.iResult != SUCCESS) // Error checking
+	{
+		Log{ LOG_LEVEL::ERR } << "getaddrinfo() failed: " << session.iResult;
+		return FAILURE;
+	}
+
+	// Attempt to connect to an address until one succeeds
+	for (session.ptr = session.result; session.ptr != NULL; session.ptr = session.ptr->ai_next)
+	{
+		// Create a SOCKET for connecting to client
+		session.DataTransferSocket = socket(session.ptr->ai_family, session.ptr->ai_socktype, session.ptr->ai_protocol);
+		if (session.DataTransferSocket == INVALID_SOCKET) // Ensure that the socket is a valid socket.
+		{
+			Log{ LOG_LEVEL::ERR } << "socket() failed with error: " << WSAGetLastError();
+			freeaddrinfo(session.result);
+			return FAILURE;
+		}
+
+		// Connect to client.
+		session.iResult = connect(session.DataTransferSocket, session.ptr->ai_addr, (int)session.ptr->ai_addrlen);
+		if (session.iResult == SOCKET_ERROR) // Check for general errors.
+		{
+			closesocket(session.DataTransferSocket);
+			session.DataTransferSocket = INVALID_SOCKET;
+			continue;
+		}
+		break;
+	}
+
+	// Not needed anymore, free the memory
+	freeaddrinfo(session.result);
+
+	if (session.DataTransferSocket == INVALID_SOCKET)
+	{
+		Log{ LOG_LEVEL::ERR } << "SERVER: Unable to connect to Client-DTP!";
+		return FAILURE;
+	}
+
+	m_metrics.recordDataConnect(started);
+	return SUCCESS;
+}
+
+// Sends the final reply of a transfer. Block mode keeps a healthy
+// data connection open for the next one, stream mode always closes it.
+void FTP_Server::endTransfer(Session& session, int result)
+{
+	if (result != SUCCESS)
+	{
+		// send failure message
+		sendReply(session, REPLY_450, (int)strlen(REPLY_450));
+		Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_450;
+		session.closeDataConnection();
+	}
+	else if (session.mode == TRANSFER_MODE::BLOCK)
+	{
+		// send sucess message, the connection stays open
+		sendReply(session, REPLY_250, (int)strlen(REPLY_250));
+		Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_250;
+	}
 	else
-		return COMMAND::INVALID;
+	{
+		// send sucess message
+		sendReply(session, REPLY_226, (int)strlen(REPLY_226));
+		Log{ LOG_LEVEL::INFO } << "SERVER: " << REPLY_226;
+		session.closeDataConnection();
+	}
+}
+
+// Opens the session's passive listener on a port from the pool
+int FTP_Server::OpenPassiveListener(Session& session)
+{
+	// A session keeps its listener, a repeated PASV/EPSV gets the same port
+	if (session.PassiveListenSocket != INVALID_SOCKET)
+		return SUCCESS;
+
+	// Listen on the address the client already reaches us on
+	sockaddr_in localAddr{};
+	int localAddrSize{ sizeof(localAddr) };
+	if (getsockname(session.ControlSocket, (sockaddr*)&localAddr, &localAddrSize) == SOCKET_ERROR)
+	{
+		Log{ LOG_LEVEL::ERR } << "WINSOCK: getsockname() failed with error: " << WSAGetLastError();
+		return FAILURE;
+	}
+
+	// Ports taken by other programs go back to the pool, try the next one
+	for (std::size_t attempts = m_portPool.available(); attempts > 0; --attempts)
+	{
+		PortPool::Lease lease{ m_portPool.acquire() };
+		if (!lease)
+			break;
+
+		SOCKET listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (listenSocket == INVALID_SOCKET)
+		{
+			Log{ LOG_LEVEL::ERR } << "WINSOCK: socket() failed with error: " << WSAGetLastError();
+			return FAILURE;
+		}
+
+		localAddr.sin_port = htons(lease.port());
+		if (bind(listenSocket, (sockaddr*)&localAddr, sizeof(localAddr)) == SOCKET_ERROR ||
+			listen(listenSocket, 1) == SOCKET_ERROR)
+		{
+			closesocket(listenSocket);
+			continue;
+		}
+
+		session.PassiveListenSocket = listenSocket;
+		session.passivePort = std::move(lease);
+		return SUCCESS;
+	}
+
+	Log{ LOG_LEVEL::ERR } << "SERVER: No passive port available!";
+	return FAILURE;
+}
+
+int FTP_Server::retrFile(Session& session, HANDLE hFile)
+{
+	// Get file size from the open handle
+	LARGE_INTEGER fileSize{};
+	if (!GetFileSizeEx(hFile, &fileSize))
+	{
+		Log{ LOG_LEVEL::ERR } << "SERVER: GetFileSizeEx() failed with error: " << GetLastError();
+		return FAILURE;
+	}
+	// Only the requested range is sent, its length goes in the size header
+	long long start{ 0 }, file_size{ 0 };
+	session.takeRange(fileSize.QuadPart, start, file_size);
+	long long end{ start + file_size };
+	session.transferred = file_size;
+	Log{ LOG_LEVEL::INFO } << "SERVER: Sending " << file_size << " bytes.";
+
+	// Block mode marks the end of the file in the stream
+	if (session.mode == TRANSFER_MODE::BLOCK)
+		return sendFileBlocks(session.DataTransferSocket, hFile, start, file_size, m_bufferPool, session.hasher);
+
+	// Send file size
+	if (sendAll(session.DataTransferSocket, reinterpret_cast<char*>(&file_size), sizeof(file_size)) != SUCCESS)
+	{
+		Log{ LOG_LEVEL::ERR } << "WINSOCK: send() failed with error: " << WSAGetLastError();
+		return FAILURE;
+	}
+
+	// Compressed chunks are read and sent by this thread
+	if (session.mode == TRANSFER_MODE::COMPRESSED)
+	{
+		ChunkCompressor compressor{ session.compressionLevel };
+		int iResult = sendFileCompressed(session.DataTransferSocket, hFile, start, file_size, compressor, session.hasher);
+		reportCompression(compressor);
+		return iResult;
+	}
+
+	// Send file
+	// Through the completion port when it is enabled.
+	// Neither it nor TransmitFile hand the bytes to a hasher, HASH reads the file later.
+	if (m_iocp)
+	{
+		bool started{ false };
+		int iResult = m_iocp->sendFile(session.DataTransferSocket, hFile, start, file_size, started);
+		if (started)
+			return iResult;
+	}
+
+	// TransmitFile moves the data from the system file cache to the
+	// socket inside the kernel, no copy through this process
+	OVERLAPPED overlapped{};
+	overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+	if (overlapped.hEvent == NULL)
+		return copyFile(session, hFile, start, file_size);
+
+	for (long long offset = start; offset < end; )
+	{
+		DWORD chunk{ (DWORD)(std::min)(end - offset, TRANSMIT_CHUNK_SIZE) };
+		overlapped.Offset = (DWORD)(offset & 0xFFFFFFFF);
+		overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+		ResetEvent(overlapped.hEvent);
+
+		DWORD sent{ 0 }, flags{ 0 };
+		if ((!TransmitFile(session.DataTransferSocket, hFile, chunk, 0, &overlapped, NULL, 0) &&
+			WSAGetLastError() != WSA_IO_PENDING) ||
+			!WSAGetOverlappedResult(session.DataTransferSocket, &overlapped, &sent, TRUE, &flags))
+		{
+			int error{ WSAGetLastError() };
+			CloseHandle(overlapped.hEvent);
+
+			// Nothing went out yet, the copy loop can still do the whole range
+			if (offset == start)
+			{
+				Log{ LOG_LEVEL::WARN } << "WINSOCK: TransmitFile() failed with error: " << error << ", copying instead.";
+				return copyFile(session, hFile, start, file_size);
+			}
+
+			Log{ LOG_LEVEL::ERR } << "WINSOCK: TransmitFile() failed with error: " << error;
+			return FAILURE;
+		}
+
+		offset += sent;
+	}
+
+	CloseHandle(overlapped.hEvent);
+
+	return SUCCESS;
+}
+
+// Sends a file from the hot-file cache, no file open or disk read
+int FTP_Server::retrCached(Session& session, const FileCache::Content& content)
+{
+	long long start{ 0 }, file_size{ 0 };
+	session.takeRange((long long)content.size(), start, file_size);
+	const char* data{ content.data() + start };
+	session.transferred = file_size;
+	Log{ LOG_LEVEL::INFO } << "SERVER: Sending " << file_size << " bytes (cached: " << m_fileCache.hits() << " hits, "
+		<< m_fileCache.misses() << " misses)";
+
+	return sendBuffer(session, data, file_size);
+}
+
+// Sends data from memory in the session's transfer mode
+int FTP_Server::sendBuffer(Session& session, const char* data, long long file_size)
+{
+	if (session.hasher)
+		session.hasher->update(data, (std::size_t)file_size);
+
+	// Block mode marks the end of the file in the stream
+	if (session.mode == TRANSFER_MODE::BLOCK)
+		return sendBlocks(session.DataTransferSocket, data, file_size, true);
+
+	// Send file size
+	if (sendAll(session.DataTransferSocket, reinterpret_cast<char*>(&file_size), sizeof(file_size)) != SUCCESS)
+	{
+		Log{ LOG_LEVEL::ERR } << "WINSOCK: send() failed with error: " << WSAGetLastError();
+		return FAILURE;
+	}
+
+	if (session.mode == TRANSFER_MODE::COMPRESSED)
+	{
+		ChunkCompressor compressor{ session.compressionLevel };
+		int iResult = sendCompressed(session.DataTransferSocket, data, file_size, compressor);
+		reportCompression(compressor);
+		return iResult;
+	}
+
+	// Send file
+	for (long long offset = 0; offset < file_size; )
+	{
+		int chunk{ (int)(std::min)(file_size - offset, TRANSMIT_CHUNK_SIZE) };
+		if (sendAll(session.DataTransferSocket, data + offset, chunk) != SUCCESS)
+		{
+			Log{ LOG_LEVEL::ERR } << "WINSOCK: send() failed with error: " << WSAGetLastError();
+			return FAILURE;
+		}
+		offset += chunk;
+	}
+
+	return SUCCESS;
+}
+
+// Digest of a file from the hash index, or read and hashed now. The
+// CRC-32C is taken along so a later XCRC needs no second read.
+int FTP_Server::hashFile(const std::filesystem::path& filename, const ResolvedPath& at, HASH_ALGORITHM algorithm, FileStat& stat, std::string& digest)
+{
+	if (m_hashIndex.lookup(filename, algorithm, stat, digest))
+		return SUCCESS;
+
+	// Directories fail here
+	HANDLE hFile = at.open(FILE_GENERIC_READ, FILE_SHARE_READ, FILE_OPEN,
+		FILE_NON_DIRECTORY_FILE | FILE_SEQUENTIAL_ONLY | FILE_SYNCHRONOUS_IO_NONALERT);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return FAILURE;
+
+	// Stamped with the state of the file that is read, writers are shut out until it is closed
+	BY_HANDLE_FILE_INFORMATION information{};
+	ContentHasher hasher{ hashBit(HASH_ALGORITHM::CRC32C) | hashBit(algorithm) };
+	int iResult = GetFileInformationByHandle(hFile, &information) ? ::hashFile(hFile, hasher, m_bufferPool) : FAILURE;
+	CloseHandle(hFile);
+	if (iResult != SUCCESS)
+		return FAILURE;
+
+	stat.size = (long long)(((unsigned long long)information.nFileSizeHigh << 32) | information.nFileSizeLow);
+	stat.lastWrite = information.ftLastWriteTime;
+	stat.directory = false;
+	m_hashIndex.record(filename, stat, hasher);
+
+	digest = hasher.digest(algorithm);
+	return digest.empty() ? FAILURE : SUCCESS;
+}
+
+// Prints how much compressed mode saved on a transfer
+void FTP_Server::reportCompression(const ChunkCompressor& compressor)
+{
+	if (compressor.rawBytes == 0)
+		return;
+
+	Log{ LOG_LEVEL::INFO } << "SERVER: Compressed " << compressor.rawBytes << " bytes to " << compressor.sentBytes << " ("
+		<< 100.0 * compressor.sentBytes / compressor.rawBytes << "%) in " << compressor.compressSeconds << " s of CPU.";
+}
+
+// Fallback for sockets TransmitFile can not handle,
+// sends the file through a pooled buffer instead.
+int FTP_Server::copyFile(Session& session, HANDLE hFile, long long offset, long long length)
+{
+	// Lease a transfer buffer
+	TransferBufferPool::Buffer xferBuf{ m_bufferPool.acquire() };
+	if (!xferBuf)
+	{
+		Log{ LOG_LEVEL::ERR } << "SERVER: Out of transfer buffers.";
+		return FAILURE;
+	}
+
+	LARGE_INTEGER position{};
+	position.QuadPart = offset;
+	if (!SetFilePointerEx(hFile, position, NULL, FILE_BEGIN))
+	{
+		Log{ LOG_LEVEL::ERR } << "SERVER: SetFilePointerEx() failed with error: " << GetLastError();
+		return FAILURE;
+	}
+
+	// Loop while there's still data to send
+	for (long long remainingData = length; remainingData > 0; )
+	{
+		DWORD bytesRead{ 0 };
+		DWORD toRead{ (DWORD)(std::min)(remainingData, (long long)xferBuf.size()) };
+		if (!ReadFile(hFile, xferBuf.data(), toRead, &bytesRead, NULL) || bytesRead == 0)
+		{
+			Log{ LOG_LEVEL::ERR } << "SERVER: ReadFile() failed with error: " << GetLastError();
+			return FAILURE;
+		}
+		if (session.hasher)
+			session.hasher->update(xferBuf.data(), bytesRead);
+
+		if (sendAll(session.DataTransferSocket, xferBuf.data(), (int)bytesRead) != SUCCESS)
+		{
+			Log{ LOG_LEVEL::ERR } << "WINSOCK: send() failed with error: " << WSAGetLastError();
+			return FAILURE;
+		}
+		remainingData -= bytesRead;
+	}
+
+	return SUCCESS;
 }
 
-bool FTP_Server::isCommand(std::string& argument)
+int FTP_Server::storFile(Session& session, const std::filesystem::path& filename, const ResolvedPath& at)
 {
-	// Make all characters in sArgument uppercase
-	for (auto& c : argument)
-		c = std::toupper(c);
+	// Receive file size, block mode has none and marks the end in the stream
+	long long file_size{ 0 };
+	if (session.mode != TRANSFER_MODE::BLOCK)
+	{
+		session.iResult = recv(session.DataTransferSocket, reinterpret_cast<char*>(&file_size), sizeof(file_size), MSG_WAITALL);
+		if (session.iResult != sizeof(file_size))
+		{
+			Log{ LOG_LEVEL::ERR } << "WINSOCK: recv() failed with error: " << WSAGetLastError();
+			return FAILURE;
+		}
+		session.transferred = file_size;
+		Log{ LOG_LEVEL::INFO } << "SERVER: Receiving " << file_size << " bytes.";
+	}
+
+	// After REST the file is continued from the offset instead of replaced,
+	// the size header then holds only the bytes that follow it
+	long long offset{ session.rangeStart };
+	session.clearRange();
 
-	// Search hash map for the argument
-	auto x = stringToCommand.find(argument);
-	if (x != std::end(stringToCommand))
-		return true;
+	// A name sharing stored content gets a file of its own, or the upload would change every copy
+	if (m_blobStore.unshare(filename, offset > 0) != SUCCESS)
+		return FAILURE;
+
+	// Create file, it is opened for reading too so it can be mapped.
+	// The completion port path writes through a second, overlapped
+	// handle, which needs write sharing.
+	DWORD shareMode{ m_iocp ? (DWORD)(FILE_SHARE_READ | FILE_SHARE_WRITE) : (DWORD)0 };
+	HANDLE hFile = at.open(FILE_GENERIC_READ | FILE_GENERIC_WRITE, shareMode, (offset > 0) ? FILE_OPEN : FILE_OVERWRITE_IF,
+		FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		Log{ LOG_LEVEL::INFO } << "SERVER: Error opening file: " << filename.string();
+		return FAILURE;
+	}
+
+	// Resuming past the end would leave a hole
+	LARGE_INTEGER currentSize{};
+	if (!GetFileSizeEx(hFile, &currentSize) || currentSize.QuadPart < offset)
+	{
+		Log{ LOG_LEVEL::INFO } << "SERVER: Restart offset " << offset << " is past the end of " << filename.string();
+		CloseHandle(hFile);
+		return FAILURE;
+	}
+
+	// Until the upload is whole the file's length may run ahead of the data:
+	// stream mode grows it first, and a restart can write into a longer file.
+	// The marker then keeps what really arrived for SIZE.
+	PartialUpload partial{ hFile };
+	if (session.mode == TRANSFER_MODE::STREAM || currentSize.QuadPart > offset)
+		partial.mark(offset);
+
+	// Receive file
+	if (session.mode == TRANSFER_MODE::BLOCK)
+	{
+		long long received{ 0 };
+		session.iResult = recvFileBlocks(session.DataTransferSocket, hFile, offset, m_bufferPool, received, session.hasher);
+		session.transferred = received;
+		Log{ LOG_LEVEL::INFO } << "SERVER: Received " << received << " bytes.";
+	}
+	else if (session.mode == TRANSFER_MODE::COMPRESSED)
+	{
+		ChunkDecompressor decompressor{};
+		session.iResult = recvFileCompressed(session.DataTransferSocket, hFile, offset, file_size, decompressor, session.hasher);
+	}
 	else
-		return false;
+	{
+		// The file is grown one part ahead of the data, the marker follows each part
+		session.iResult = SUCCESS;
+		for (long long position = 0; position < file_size && session.iResult == SUCCESS; )
+		{
+			long long length{ (std::min)(PARTIAL_COMMIT_INTERVAL, file_size - position) };
+			bool started{ false };
+			if (m_iocp)
+				session.iResult = m_iocp->recvFile(session.DataTransferSocket, hFile, offset + position, length, started);
+			if (!started)
+				session.iResult = recvToFile(session.DataTransferSocket, hFile, offset + position, length, m_bufferPool, session.hasher);
+
+			position += length;
+			if (session.iResult == SUCCESS)
+				partial.commit(offset + position);
+		}
+	}
+
+	// Drop whatever an earlier, longer upload left after the new end
+	long long end{ (session.mode == TRANSFER_MODE::BLOCK) ? offset + session.transferred : offset + file_size };
+	if (session.iResult == SUCCESS && currentSize.QuadPart > offset && !setFileSize(hFile, end))
+		session.iResult = FAILURE;
+
+	// A failed receive cut a file it grew back to what arrived, so a file
+	// that was not longer before has a true length again
+	if (session.iResult == SUCCESS || currentSize.QuadPart <= offset)
+		partial.finish();
+	CloseHandle(hFile);
+
+	return session.iResult;
 }
 
-void FTP_Server::showCommands(const SOCKET& hControlSocket) {
+// Rebuilds a file from the client's instructions against the copy here.
+// The new file is written beside it under a reserved name and replaces
+// it only once it is whole, the old copy is read until then. Both are
+// opened from the directory the path was walked to.
+int FTP_Server::storDelta(Session& session, const ResolvedPath& at)
+{
+	HANDLE hBasis = at.open(FILE_GENERIC_READ, FILE_SHARE_READ, FILE_OPEN,
+		FILE_NON_DIRECTORY_FILE | FILE_SEQUENTIAL_ONLY | FILE_SYNCHRONOUS_IO_NONALERT);
+	if (hBasis == INVALID_HANDLE_VALUE)
+	{
+		Log{ LOG_LEVEL::INFO } << "SERVER: Error opening file: " << std::filesystem::path{ at.leaf() }.string();
+		return FAILURE;
+	}
+
+	// The signature of the copy here goes first, the instructions come back on the same connection
+	unsigned int threads{ (m_config.deltaThreads > 0) ? m_config.deltaThreads : std::thread::hardware_concurrency() };
+	Signature basis{};
+	if (computeSignature(hBasis, basis, threads) != SUCCESS || sendSignature(session.DataTransferSocket, basis) != SUCCESS)
+	{
+		CloseHandle(hBasis);
+		return FAILURE;
+	}
+	Log{ LOG_LEVEL::INFO } << "SERVER: Sent signature of " << basis.blocks.size() << " blocks of " << basis.blockSize << " bytes.";
+
+	// Opened for delete too, the name is moved and a failed rebuild removed through the handle
+	std::wstring rebuilt{ std::wstring{ RESERVED_PREFIX } + L"delta-" +
+		std::to_wstring(GetCurrentProcessId()) + L'-' + std::to_wstring(++m_deltaFiles) };
+	HANDLE hTarget = openAt(at.parent(), rebuilt, FILE_GENERIC_WRITE | DELETE, 0, FILE_OVERWRITE_IF,
+		FILE_NON_DIRECTORY_FILE | FILE_SEQUENTIAL_ONLY | FILE_SYNCHRONOUS_IO_NONALERT);
+	if (hTarget == INVALID_HANDLE_VALUE)
+	{
+		Log{ LOG_LEVEL::ERR } << "SERVER: Error creating file: " << std::filesystem::path{ rebuilt }.string();
+		CloseHandle(hBasis);
+		return FAILURE;
+	}
+
+	DeltaStats stats{};
+	session.iResult = recvDelta(session.DataTransferSocket, hBasis, basis, hTarget, stats, session.hasher);
+	session.transferred = stats.sent;
+	CloseHandle(hBasis);
+	reportDelta(stats);
+
+	// Only the name moves to the new file, other names linked to the old one keep it
+	if (session.iResult == SUCCESS && at.replace(hTarget) != SUCCESS)
+	{
+		Log{ LOG_LEVEL::ERR } << "SERVER: SetFileInformationByHandle() failed with error: " << GetLastError();
+		session.iResult = FAILURE;
+	}
+	if (session.iResult != SUCCESS)
+	{
+		FILE_DISPOSITION_INFO disposition{ TRUE };
+		SetFileInformationByHandle(hTarget, FileDispositionInfo, &disposition, sizeof(disposition));
+	}
+	CloseHandle(hTarget);
+
+	return session.iResult;
+}
+
+// Sends a file as instructions against the client's copy, whose signature comes first
+int FTP_Server::retrDelta(Session& session, HANDLE hFile)
+{
+	Signature basis{};
+	if (recvSignature(session.DataTransferSocket, basis) != SUCCESS)
+		return FAILURE;
+
+	DeltaStats stats{};
+	session.iResult = sendDelta(session.DataTransferSocket, hFile, basis, stats, session.hasher);
+	session.transferred = stats.sent;
+	reportDelta(stats);
+
+	return session.iResult;
+}
+
+// Prints how much of a delta transfer came from the old copy
+void FTP_Server::reportDelta(const DeltaStats& stats)
+{
+	long long total{ stats.matched + stats.literal };
+	if (total == 0)
+		return;
+
+	Log{ LOG_LEVEL::INFO } << "SERVER: Delta of " << total << " bytes, " << stats.matched << " matched ("
+		<< 100.0 * stats.matched / total << "%), " << stats.sent << " bytes sent.";
+}
+
+/***********************************************
+	Virtual Working Directory
+***********************************************/
+
+int Session::changeDirectory(const std::filesystem::path& directory)
+{
+	HANDLE hDirectory = CreateFileW(directory.wstring().c_str(), FILE_LIST_DIRECTORY | FILE_TRAVERSE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if (hDirectory == INVALID_HANDLE_VALUE)
+		return FAILURE;
+
+	return changeDirectory(hDirectory, directory);
+}
+
+// Takes over hDirectory. It is kept open without delete sharing so the
+// directory can not be renamed or removed while the session still
+// resolves paths from it.
+int Session::changeDirectory(HANDLE hDirectory, const std::filesystem::path& directory)
+{
+	if (hCwd != INVALID_HANDLE_VALUE) CloseHandle(hCwd);
+	hCwd = hDirectory;
+	cwd = directory;
+
+	return SUCCESS;
+}
+
+// Clamps the pending range to the file and clears it
+void Session::takeRange(long long fileSize, long long& offset, long long& length)
+{
+	// Compared before adding, RANG takes an end up to the largest long long
+	long long end{ (rangeEnd < 0 || rangeEnd >= fileSize - 1) ? fileSize : rangeEnd + 1 };
+	offset = (std::min)(rangeStart, fileSize);
+	length = (std::max)(end - offset, 0LL);
+
+	clearRange();
+}
+
+void Session::clearRange()
+{
+	rangeStart = 0;
+	rangeEnd = -1;
+}
+
+void Session::closeDataConnection()
+{
+	if (DataTransferSocket != INVALID_SOCKET)
+		closesocket(DataTransferSocket);
+	DataTransferSocket = INVALID_SOCKET;
+}
+
+// Resolves a client path against the session's working directory and walks
+// it, at then opens the target. Fails if the result would leave the starting path.
+int FTP_Server::resolvePath(const Session& session, const std::string& argument, std::filesystem::path& resolved, ResolvedPath& at)
+{
+	std::filesystem::path requested{ argument };
+
+	// A leading slash means the top of the server's tree
+	if (requested.has_root_directory() && !requested.has_root_name())
+		resolved = STARTING_PATH / requested.relative_path();
+	else if (requested.is_absolute())
+		resolved = requested;
+	else // Resolved from the cached directory, not from the process
+		resolved = session.cwd / requested;
+
+	resolved = resolved.lexically_normal();
+	if (!resolved.has_filename() && resolved.has_parent_path())
+		resolved = resolved.parent_path(); // Drop a trailing separator
+
+	// Jail check, nothing above the starting path is reachable by name
+	std::filesystem::path relative{ resolved.lexically_relative(STARTING_PATH) };
+	if (relative.empty() || *relative.begin() == "..")
+		return FAILURE;
+
+	// The server's own files are out of reach
+	for (const auto& part : relative)
+	{
+		if (isReservedName(part.wstring()))
+			return FAILURE;
+	}
+
+	// Nor by link: the path is walked from the working directory's handle
+	// when it stays below it, and from the top of the tree otherwise
+	std::filesystem::path below{ resolved.lexically_relative(session.cwd) };
+	if (!below.empty() && *below.begin() != ".." && session.hCwd != INVALID_HANDLE_VALUE)
+		return at.walk(session.hCwd, below);
+
+	if (m_hRoot == INVALID_HANDLE_VALUE)
+		return FAILURE;
+	return at.walk(m_hRoot, relative);
+}
+
+// For commands that go on by name, the last part is refused if it is a link
+int FTP_Server::resolvePath(const Session& session, const std::string& argument, std::filesystem::path& resolved)
+{
+	ResolvedPath at{};
+	if (resolvePath(session, argument, resolved, at) != SUCCESS)
+		return FAILURE;
+	return at.check();
+}
+
+/***********************************************
+	COMMANDS
+***********************************************/
+
+COMMAND FTP_Server::getCommand(std::string_view command)
+{
+	// Case-insensitive, no copy of the verb is made
+	return commandTable.find(command);
+}
+
+bool FTP_Server::isCommand(std::string_view argument)
+{
+	return commandTable.contains(argument);
+}
+
+void FTP_Server::showCommands(Session& session) {
 	// menu
-	std::string m{ "\t\tCOMMANDS\n\tRETR, STOR, HELP, LIST, QUIT, MKD, PWD, CWD\n"
+	std::string m{ "\t\tCOMMANDS\n\tRETR, STOR, HELP, LIST, QUIT, MKD, PWD, CWD, PASV, EPSV, MODE, SIZE, RANG, REST, SITE,\n"
+					"\tNLST, MLSD, MDTM, HASH, XCRC, OPTS, XDUP, XDLT, XDGT\n"
 					"\tType HELP <command-name> to see a description of the command.\n" };
 
-	send(hControlSocket, m.c_str(), m.length(), 0);
+	sendMultilineReply(session, REPLY_214, m);
 }
 
-void FTP_Server::explainCommands(const SOCKET & hControlSocket, std::string argument)
+void FTP_Server::explainCommands(Session& session, std::string argument)
 {
 	COMMAND command = getCommand(argument);
 
@@ -588,76 +1997,151 @@ void FTP_Server::explainCommands(const SOCKET & hControlSocket, std::string argu
 	{
 		std::string m{ "Retrieve\n"
 						"\tUse RETR <file-name> to download the specified file from the server.\n" };
-		send(hControlSocket, m.c_str(), m.length(), 0);
+		sendMultilineReply(session, REPLY_214, m);
 	} break;
 	case COMMAND::STOR:
 	{
 		std::string m{ "Store\n"
 					   "\tUse STOR <file-name> to upload the specified file to the server.\n" };
-		send(hControlSocket, m.c_str(), m.length(), 0);
+		sendMultilineReply(session, REPLY_214, m);
 	} break;
 	case COMMAND::HELP:
 	{
 		std::string m{ "Use HELP to view all commands. Use HELP <command-name> to see an explanation of the specified command.\n" };
-		send(hControlSocket, m.c_str(), m.length(), 0);
+		sendMultilineReply(session, REPLY_214, m);
 	} break;
 	case COMMAND::QUIT:
 	{
 		std::string m{ "Use QUIT to exit and close the program.\n" };
 
-		send(hControlSocket, m.c_str(), m.length(), 0);
+		sendMultilineReply(session, REPLY_214, m);
 	} break;
 	case COMMAND::MKD:
 	{
 		std::string m{ "Make New Directory\n"
 					   "\tUse MKD <path\\directory-name> to create a new directory.\n" };
-		send(hControlSocket, m.c_str(), m.length(), 0);
+		sendMultilineReply(session, REPLY_214, m);
 	} break;
 	case COMMAND::PWD:
 	{
 		std::string m{ "Print Working Directory\n"
 					   "\tUse PWD to view the current working directory.\n" };
-		send(hControlSocket, m.c_str(), m.length(), 0);
+		sendMultilineReply(session, REPLY_214, m);
 	} break;
 	case COMMAND::CWD:
 	{
 		std::string m{ "Change Working Directory\n"
 					   "\tUse CWD <folder-name> to change to that directory or <..> to go back one level.\n" };
-		send(hControlSocket, m.c_str(), m.length(), 0);
+		sendMultilineReply(session, REPLY_214, m);
 	} break;
 	case COMMAND::LIST:
 	{
-		std::string m {"Use LIST to view the entire current working directory, including all files and folders.\n"};
-		send(hControlSocket, m.c_str(), m.length(), 0);
+		std::string m{ "List\n"
+					   "\tUse LIST [directory] to download an ls style listing of the current or the given directory.\n" };
+		sendMultilineReply(session, REPLY_214, m);
+	} break;
+	case COMMAND::NLST:
+	{
+		std::string m{ "Name List\n"
+					   "\tUse NLST [directory] to download only the names in the current or the given directory.\n" };
+		sendMultilineReply(session, REPLY_214, m);
+	} break;
+	case COMMAND::MLSD:
+	{
+		std::string m{ "Machine List\n"
+					   "\tUse MLSD [directory] to download the type, size and modification time of every entry.\n" };
+		sendMultilineReply(session, REPLY_214, m);
+	} break;
+	case COMMAND::PASV:
+	{
+		std::string m{ "Passive Mode\n"
+					   "\tUse PASV to have the server listen for the data connection. The reply holds its address and port.\n" };
+		sendMultilineReply(session, REPLY_214, m);
+	} break;
+	case COMMAND::MODE:
+	{
+		std::string m{ "Transfer Mode\n"
+					   "\tUse MODE S for stream mode, one data connection per file.\n"
+					   "\tUse MODE B for block mode, the data connection stays open between files.\n"
+					   "\tUse MODE Z [level] to compress data, level 1 (fastest) to 4 (smallest).\n" };
+		sendMultilineReply(session, REPLY_214, m);
+	} break;
+	case COMMAND::SIZE:
+	{
+		std::string m{ "File Size\n"
+					   "\tUse SIZE <file-name> to get the size of the file in bytes.\n" };
+		sendMultilineReply(session, REPLY_214, m);
+	} break;
+	case COMMAND::MDTM:
+	{
+		std::string m{ "Modification Time\n"
+					   "\tUse MDTM <file-name> to get the last modification time of the file as YYYYMMDDHHMMSS in UTC.\n" };
+		sendMultilineReply(session, REPLY_214, m);
+	} break;
+	case COMMAND::RANG:
+	{
+		std::string m{ "Byte Range\n"
+					   "\tUse RANG <start> <end> before RETR to download only bytes start to end, both included.\n" };
+		sendMultilineReply(session, REPLY_214, m);
+	} break;
+	case COMMAND::REST:
+	{
+		std::string m{ "Restart\n"
+					   "\tUse REST <offset> before RETR or STOR to continue an interrupted transfer from that byte.\n" };
+		sendMultilineReply(session, REPLY_214, m);
+	} break;
+	case COMMAND::EPSV:
+	{
+		std::string m{ "Extended Passive Mode\n"
+					   "\tUse EPSV to have the server listen for the data connection. The reply holds only its port.\n" };
+		sendMultilineReply(session, REPLY_214, m);
+	} break;
+	case COMMAND::HASH:
+	{
+		std::string m{ "Hash\n"
+					   "\tUse HASH <file-name> to get a digest of the file, SHA-256 unless OPTS HASH chose another.\n" };
+		sendMultilineReply(session, REPLY_214, m);
+	} break;
+	case COMMAND::XCRC:
+	{
+		std::string m{ "CRC\n"
+					   "\tUse XCRC <file-name> to get the CRC-32C of the file.\n" };
+		sendMultilineReply(session, REPLY_214, m);
+	} break;
+	case COMMAND::XDUP:
+	{
+		std::string m{ "Deduplicate\n"
+					   "\tUse XDUP <sha256> <size> <file-name> before STOR. If the server already stores that content\n"
+					   "\tthe file is created from it (250) and no STOR is needed, otherwise send the file (350).\n" };
+		sendMultilineReply(session, REPLY_214, m);
+	} break;
+	case COMMAND::XDLT:
+	{
+		std::string m{ "Delta Store\n"
+					   "\tUse XDLT <file-name> to upload a changed file. The server sends the block signatures of its copy\n"
+					   "\tand only the blocks it does not have are sent. Without a copy on the server use STOR.\n" };
+		sendMultilineReply(session, REPLY_214, m);
+	} break;
+	case COMMAND::XDGT:
+	{
+		std::string m{ "Delta Retrieve\n"
+					   "\tUse XDGT <file-name> to download a changed file. The client sends the block signatures of its copy\n"
+					   "\tand the server only sends the blocks it does not have.\n" };
+		sendMultilineReply(session, REPLY_214, m);
+	} break;
+	case COMMAND::OPTS:
+	{
+		std::string m{ "Options\n"
+					   "\tUse OPTS HASH to see the algorithm of HASH, OPTS HASH <name> to choose CRC32C, XXH64 or SHA-256.\n" };
+		sendMultilineReply(session, REPLY_214, m);
+	} break;
+	case COMMAND::SITE:
+	{
+		std::string m{ "Site Commands\n"
+					   "\tUse SITE STATS to view command latencies, transfer totals and active sessions.\n" };
+		sendMultilineReply(session, REPLY_214, m);
 	} break;
 	default:
 		throw std::runtime_error("Unknown error!");
 	} // End Switch-case
-}
-
-/***********************************************
-	Multithreading
-***********************************************/
-
-unsigned int __stdcall FTP_Server::ClientSession(void* data)
-{
-	// Assign data to each unique client
-	threadex_info* newdata = (threadex_info*)data;
-	FTP_Server* ftp = static_cast<FTP_Server*>(newdata->f);
-	SOCKET hControlSocket = (SOCKET)newdata->s;
-
-	// Send 220 welcome reply
-	send(hControlSocket, REPLY_220, (int)strlen(REPLY_220), 0);
-
-	// Process the client.
-	while (true)
-	{
-		if (ftp->ControlProcess(hControlSocket) != SUCCESS)
-		{
-			closesocket(hControlSocket);
-			return FAILURE;
-		}
-	}
-
-	return SUCCESS;
 }
\ No newline at end of file
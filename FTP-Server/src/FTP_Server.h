@@ -1,59 +1,213 @@
 #pragma once
 
+#include "../../Common/src/FTP_Common.h"
+#include "../../Common/src/Commands.h"
+#include "../../Common/src/FileTransfer.h"
+#include "../../Common/src/BufferPool.h"
+#include "../../Common/src/BlockMode.h"
+#include "../../Common/src/Compression.h"
+#include "../../Common/src/Delta.h"
+#include "../../Common/src/LineBuffer.h"
+#include "../../Common/src/Logger.h"
+#include "EventLoop.h"
+#include "WorkerPool.h"
+#include "FileCache.h"
+#include "DirectoryCache.h"
+#include "StatCache.h"
+#include "HashIndex.h"
+#include "BlobStore.h"
+#include "PartialUpload.h"
+#include "ResolvedPath.h"
+#include "IocpTransfer.h"
+#include "PortPool.h"
+#include "Metrics.h"
+
 #include <ws2tcpip.h>
+#include <mswsock.h>
+#include <winternl.h>
 
-#include <map>
+#include <memory>
+#include <atomic>
+#include <vector>
 #include <filesystem>
 
-// Need to tell the compiler to link Ws2_32.lib
+// Need to tell the compiler to link Ws2_32.lib, Mswsock.lib and ntdll.lib
 #pragma comment(lib, "Ws2_32.lib")
-
-// Return constants
-constexpr int SUCCESS{ 0 };
-constexpr int FAILURE{ 1 };
+#pragma comment(lib, "Mswsock.lib")
+#pragma comment(lib, "ntdll.lib")
 
 // Buffer constants
-constexpr int TRANSFER_BYTE_SYZE{ 8 };
+constexpr long long TRANSMIT_CHUNK_SIZE{ 1LL << 30 };	// TransmitFile sends at most 2 GB per call
 constexpr int DEFAULT_BUFLEN{ 512 };
 
-// IP Address and Port constants
-constexpr const char* IP_ADDRESS{ "192.168.0.2" };
+// Session scheduling constants
+constexpr unsigned int DEFAULT_WORKER_THREADS{ 32 };
+constexpr std::size_t DEFAULT_PENDING_SESSIONS{ 256 };
+
+// Port constants
 constexpr const char* DATA_PORT{ "20" };
 constexpr const char* CONTROL_PORT{ "21" };
 
+// How long a passive listener waits for the client to connect
+constexpr int DATA_ACCEPT_TIMEOUT_MS{ 10000 };
+
 // Use Winsock version 2.2
 constexpr WORD WINSOCK_VER{ MAKEWORD(2, 2) };
 
 enum class COMMAND
 {
-	INVALID, RETR, STOR, HELP, QUIT, MKD, PWD, CWD, LIST
+	INVALID, RETR, STOR, HELP, QUIT, MKD, PWD, CWD, LIST, PASV, EPSV, MODE, SIZE, RANG, REST, SITE, NLST, MLSD, MDTM,
+	HASH, XCRC, OPTS, XDUP, XDLT, XDGT
+};
+
+// Verbs, also the names of the commands in the metrics
+inline constexpr CommandName<COMMAND> commandNames[]
+{
+	{ "RETR", COMMAND::RETR },
+	{ "STOR", COMMAND::STOR },
+	{ "HELP", COMMAND::HELP },
+	{ "QUIT", COMMAND::QUIT },
+	{ "MKD", COMMAND::MKD },
+	{ "PWD", COMMAND::PWD },
+	{ "CWD", COMMAND::CWD },
+	{ "LIST", COMMAND::LIST },
+	{ "PASV", COMMAND::PASV },
+	{ "EPSV", COMMAND::EPSV },
+	{ "MODE", COMMAND::MODE },
+	{ "SIZE", COMMAND::SIZE },
+	{ "RANG", COMMAND::RANG },
+	{ "REST", COMMAND::REST },
+	{ "SITE", COMMAND::SITE },
+	{ "NLST", COMMAND::NLST },
+	{ "MLSD", COMMAND::MLSD },
+	{ "MDTM", COMMAND::MDTM },
+	{ "HASH", COMMAND::HASH },
+	{ "XCRC", COMMAND::XCRC },
+	{ "OPTS", COMMAND::OPTS },
+	{ "XDUP", COMMAND::XDUP },
+	{ "XDLT", COMMAND::XDLT },
+	{ "XDGT", COMMAND::XDGT }
+};
+
+// Looked up through a perfect hash built at compile time
+inline constexpr CommandTable<COMMAND> commandTable{ commandNames };
+
+// How files are framed on the data connection
+enum class TRANSFER_MODE
+{
+	STREAM,		// Size header and data, one connection per file
+	BLOCK,		// MODE B blocks, the connection stays open
+	COMPRESSED	// MODE Z, size header and compressed chunks, one connection per file
+};
+
+// How the data connection moves file contents
+enum class TRANSFER_BACKEND
+{
+	TRANSMIT,	// TransmitFile and blocking recv, one transfer per worker thread
+	IOCP		// Overlapped I/O on a completion port shared by all transfers
 };
 
-static std::map<std::string, COMMAND> stringToCommand
+// Server settings that can be changed from the command line
+struct ServerConfig
 {
-		{"RETR", COMMAND::RETR },
-		{"STOR", COMMAND::STOR },
-		{"HELP", COMMAND::HELP },
-		{"QUIT", COMMAND::QUIT },
-		{"MKD", COMMAND::MKD },
-		{"PWD", COMMAND::PWD },
-		{"CWD", COMMAND::CWD },
-		{"LIST", COMMAND::LIST }
+	unsigned int workerThreads{ DEFAULT_WORKER_THREADS };		// Threads executing commands
+	std::size_t maxPendingSessions{ DEFAULT_PENDING_SESSIONS };	// Sessions waiting for a worker before 421
+	std::size_t transferChunkSize{ DEFAULT_TRANSFER_CHUNK };		// Copy path buffer size
+	std::size_t fileCacheBytes{ 0 };								// Hot-file cache budget, 0 disables it
+	std::size_t directoryCacheEntries{ DEFAULT_DIRECTORY_CACHE };	// Cached listings, 0 disables the cache
+	unsigned int statCacheTtlMs{ DEFAULT_STAT_TTL_MS };			// How long SIZE/MDTM trust a cached stat, 0 disables it
+	bool dedup{ true };												// Content store behind XDUP
+	unsigned int deltaThreads{ 0 };									// Threads signing the old copy for XDLT, 0 for one per core
+	TRANSFER_BACKEND transferBackend{ TRANSFER_BACKEND::TRANSMIT };
+	unsigned short passivePortFirst{ DEFAULT_PASSIVE_PORT_FIRST };	// Ports PASV/EPSV may hand out
+	unsigned short passivePortLast{ DEFAULT_PASSIVE_PORT_LAST };
+	std::string logFile{};											// Empty logs to the console
+	LOG_LEVEL logLevel{ LOG_LEVEL::INFO };
+	std::string metricsSocket{};										// AF_UNIX path of the Prometheus endpoint, empty disables it
+};
+
+/*
+	Everything that belongs to one client connection. A session is
+	only ever used by one thread at a time (its event loop or the
+	worker running its command), so none of this needs locking.
+*/
+struct Session
+{
+	SOCKET ControlSocket;		// Control connection with the client
+	bool attached;				// ControlSocket is attached to its event loop's completion port
+	SOCKET DataTransferSocket;	// SOCKET for data connection
+
+	// Passive mode listener, kept open for every transfer of the session
+	SOCKET PassiveListenSocket;
+	PortPool::Lease passivePort;
+
+	int iResult;
+	int iSendResult;
+
+	// Used to resolve the data connection address
+	struct addrinfo* result = NULL, * ptr = NULL, hints;
+
+	TRANSFER_MODE mode;
+	int compressionLevel;	// Level of MODE Z
+
+	// Byte range of the next RETR, rangeEnd is inclusive and -1 means to the end of the file.
+	// A REST offset is kept in rangeStart and also applies to the next STOR.
+	long long rangeStart;
+	long long rangeEnd;
+
+	// Command stuff
+	COMMAND cCommand;
+	std::string sCommand, sArgument;
+	std::string sLine;	// The line being handled, keeps its capacity like the others
+
+	// Bytes moved by the last transfer, for the metrics
+	long long transferred;
+
+	// Algorithm of HASH, chosen with OPTS HASH
+	HASH_ALGORITHM hashAlgorithm;
+
+	// Sees the bytes of the current transfer on their way, null if the file is not hashed
+	ContentHasher* hasher;
+
+	// SHA-256 announced by XDUP, the next STOR is stored as that content if it matches
+	std::string expectedDigest;
+
+	// Counted as active until the session is destroyed
+	Metrics::SessionCount counted;
+
+	// Control connection buffers, commands not handled yet and replies not sent yet
+	LineBuffer input;
+	std::string replies;
+
+	// Virtual working directory, held open while it is the session's cwd
+	std::filesystem::path cwd;
+	HANDLE hCwd;
+
+	Session(SOCKET controlSocket, const std::filesystem::path& startingPath);
+	~Session();
+
+	int changeDirectory(const std::filesystem::path& directory);
+	int changeDirectory(HANDLE hDirectory, const std::filesystem::path& directory);
+	void closeDataConnection();
+	void takeRange(long long fileSize, long long& offset, long long& length);
+	void clearRange();
+
+	Session(const Session&) = delete;
+	Session& operator=(const Session&) = delete;
 };
 
 class FTP_Server
 {
 private: // Variables
+	const ServerConfig m_config;
 	
 	/*The WSADATA structure contains information
 	about the Windows Sockets implementation.*/
 	WSADATA m_wsaData;
 	int m_iResult;
-	int m_iSendResult;
 
 	SOCKET ControlSocket;		// Temporary SOCKET for accepting connections from clients
 	SOCKET ControlListenSocket;	// SOCKET for Server to listen for Client control connections
-	SOCKET DataTransferSocket;	// SOCKET for data connection
 
 	// Used for DNS Lookup
 	sockaddr_in clientAddr;		// Client's socket address
@@ -61,24 +215,50 @@ private: // Variables
 	char clientName[NI_MAXHOST];
 	char clientPort[NI_MAXHOST];
 
-	// Declare an addrinfo object that contains a
-	// sockaddr structure and initialize these values
-	struct addrinfo* result = NULL, * ptr = NULL, hints;
+	// Event loops watching the control connections, one per core
+	std::vector<std::unique_ptr<EventLoop>> m_eventLoops;
+	std::size_t m_nextLoop;
 
-	// Command stuff
-	COMMAND cCommand;
-	std::string sCommand, sArgument;
+	// Workers executing the commands of ready sessions
+	std::unique_ptr<WorkerPool> m_workerPool;
+
+	// Buffers for the copy paths, shared by all transfers
+	TransferBufferPool m_bufferPool;
+
+	// Contents of frequently downloaded files
+	FileCache m_fileCache;
+
+	// Sizes and times of recently seen files, for SIZE and MDTM
+	StatCache m_statCache;
+
+	// Digests computed by transfers, HASH and XCRC
+	HashIndex m_hashIndex;
+
+	// Listings of recently listed directories
+	DirectoryCache m_directoryCache;
+
+	// Completion port transfers, null when the TransmitFile path is used
+	std::unique_ptr<IocpTransfer> m_iocp;
 
-	// Multithread
-	struct threadex_info
-	{
-		FTP_Server* f;
-		SOCKET s;
-	};
+	// Ports for passive data connections
+	PortPool m_portPool;
+
+	// Latencies and transfer counters, read by SITE STATS and the endpoint
+	Metrics m_metrics;
+	MetricsEndpoint m_metricsEndpoint;
 
 	// Constant to store the executable's absolute path
 	const std::filesystem::path STARTING_PATH{ std::filesystem::absolute(std::filesystem::current_path()) };
 
+	// Held open for paths that are walked from the top of the tree
+	HANDLE m_hRoot;
+
+	// Uploaded content by SHA-256, in the starting path so links stay on its volume
+	BlobStore m_blobStore;
+
+	// Names of files rebuilt by XDLT
+	std::atomic<unsigned long long> m_deltaFiles;
+
 private: // Functions
 	// Winsock and User-PI
 	int InitializeWinsock();
@@ -86,27 +266,48 @@ private: // Functions
 	int AcceptControlConnection();
 	void Disconnect();
 
+	// Event loops and workers
+	int StartEventLoops();
+	void SessionReadable(std::shared_ptr<Session> session, EventLoop& loop);
+	void RejectSession(const SOCKET& hControlSocket);
+	void StartTransferBackend();
+
 	// Main loop
-	int ControlProcess(const SOCKET& hControlSocket);
+	int ControlProcess(Session& session);
+	int executeCommand(Session& session, const std::string& line);
+	int sendReply(Session& session, const char* msg, int msgLen);
+	int sendMultilineReply(Session& session, const char* reply, const std::string& text);
+	int flushReplies(Session& session);
 
 	// Server-DTP
-	int EstablishDataConnection(); // TCP Connection
+	int EstablishDataConnection(Session& session); // TCP Connection
+	int OpenPassiveListener(Session& session);
+	void endTransfer(Session& session, int result);
 
 	// FTP Commands
-	int retrFile(std::ifstream& ifs);
-	int storFile();
+	int retrFile(Session& session, HANDLE hFile);
+	int retrCached(Session& session, const FileCache::Content& content);
+	int sendBuffer(Session& session, const char* data, long long file_size);
+	int copyFile(Session& session, HANDLE hFile, long long offset, long long length);
+	void reportCompression(const ChunkCompressor& compressor);
+	int hashFile(const std::filesystem::path& filename, const ResolvedPath& at, HASH_ALGORITHM algorithm, FileStat& stat, std::string& digest);
+	int storFile(Session& session, const std::filesystem::path& filename, const ResolvedPath& at);
+	int storDelta(Session& session, const ResolvedPath& at);
+	int retrDelta(Session& session, HANDLE hFile);
+	void reportDelta(const DeltaStats& stats);
 
-	// Commands and input
-	COMMAND getCommand(std::string& command);
-	bool isCommand(std::string& command);
-	void showCommands(const SOCKET& hControlSocket); // menu
-	void explainCommands(const SOCKET& hControlSocket, std::string argument);
+	// Paths
+	int resolvePath(const Session& session, const std::string& argument, std::filesystem::path& resolved, ResolvedPath& at);
+	int resolvePath(const Session& session, const std::string& argument, std::filesystem::path& resolved);
 
-	// Multithread
-	static unsigned int __stdcall ClientSession(void* data);
+	// Commands and input
+	COMMAND getCommand(std::string_view command);
+	bool isCommand(std::string_view command);
+	void showCommands(Session& session); // menu
+	void explainCommands(Session& session, std::string argument);
 
 public:
-	FTP_Server();
+	explicit FTP_Server(const ServerConfig& config = ServerConfig{});
 	virtual ~FTP_Server();
 
 	void init();
@@ -116,13 +317,24 @@ public:
 constexpr const char* REPLY_125{ "125 Connection open. Starting file transfer." };
 constexpr const char* REPLY_150{ "150 File status okay; about to open data connection." };
 constexpr const char* REPLY_200{ "200 Command okay." };
+constexpr const char* REPLY_211{ "211 System status." };
+constexpr const char* REPLY_213{ "213 " }; // File status
 constexpr const char* REPLY_214{ "214 Help message." };
 constexpr const char* REPLY_220{ "220 Service ready for new user." };
 constexpr const char* REPLY_221{ "221 Service closing control connection." };
 constexpr const char* REPLY_226{ "226 Requested file action successful. Closing data connection." };
+constexpr const char* REPLY_227{ "227 Entering Passive Mode " }; // (h1,h2,h3,h4,p1,p2)
+constexpr const char* REPLY_229{ "229 Entering Extended Passive Mode " }; // (|||port|)
+constexpr const char* REPLY_250{ "250 Requested file action okay, completed." };
+constexpr const char* REPLY_250_CRC{ "250 " }; // CRC of a file
 constexpr const char* REPLY_257{ "257 " }; // Pathname created
+constexpr const char* REPLY_350{ "350 " }; // Pending further information
+constexpr const char* REPLY_421{ "421 Service not available, closing control connection." };
+constexpr const char* REPLY_425{ "425 Can't open data connection." };
 constexpr const char* REPLY_450{ "450 Requested file action not taken. Transfer failed." };
 constexpr const char* REPLY_500{ "500 Syntax error, command unrecognized." };
 constexpr const char* REPLY_501{ "501 Syntax error in parameters or arguments." };
+constexpr const char* REPLY_502{ "502 Command not implemented." };
+constexpr const char* REPLY_504{ "504 Command not implemented for that parameter." };
 constexpr const char* REPLY_521{ "521 " }; // Directory already exists
 constexpr const char* REPLY_550{ "550 Requested action not taken. File not found." };
\ No newline at end of file
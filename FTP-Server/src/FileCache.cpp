@@ -0,0 +1,130 @@
+#include "FileCache.h"
+#include "../../Common/src/Logger.h"
+
+/***********************************************
+	Constructor
+***********************************************/
+FileCache::FileCache(std::size_t budget) :
+	m_budget{ budget },
+	m_used{ 0 },
+	m_hits{ 0 },
+	m_misses{ 0 }
+{
+}
+
+/***********************************************
+	Lookup
+***********************************************/
+std::shared_ptr<const FileCache::Content> FileCache::lookup(const std::filesystem::path& filename)
+{
+	if (!enabled())
+		return nullptr;
+
+	// Size and last write time come from the directory, no open needed
+	WIN32_FILE_ATTRIBUTE_DATA attributes{};
+	if (!GetFileAttributesExW(filename.wstring().c_str(), GetFileExInfoStandard, &attributes))
+	{
+		++m_misses;
+		return nullptr;
+	}
+	long long size{ (long long)(((unsigned long long)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow) };
+
+	std::lock_guard<std::mutex> lock{ m_mutex };
+
+	auto it = m_entries.find(filename.wstring());
+	if (it == m_entries.end())
+	{
+		++m_misses;
+		return nullptr;
+	}
+
+	// The file changed since it was cached
+	const Entry& entry{ it->second->second };
+	if (entry.size != size || CompareFileTime(&entry.lastWrite, &attributes.ftLastWriteTime) != 0)
+	{
+		erase(it);
+		++m_misses;
+		return nullptr;
+	}
+
+	// Move to the front of the LRU list
+	m_lru.splice(m_lru.begin(), m_lru, it->second);
+	++m_hits;
+
+	return entry.content;
+}
+
+std::shared_ptr<const FileCache::Content> FileCache::load(const std::filesystem::path& filename, HANDLE hFile)
+{
+	if (!enabled())
+		return nullptr;
+
+	// Stamp the entry with the state of the file that was actually read
+	LARGE_INTEGER fileSize{};
+	FILETIME lastWrite{};
+	if (!GetFileSizeEx(hFile, &fileSize) || !GetFileTime(hFile, NULL, NULL, &lastWrite))
+		return nullptr;
+
+	if (fileSize.QuadPart > (long long)(m_budget / FILE_CACHE_ENTRY_DIVISOR))
+		return nullptr;
+
+	// Read the whole file outside the lock
+	auto content = std::make_shared<Content>((std::size_t)fileSize.QuadPart);
+	LARGE_INTEGER position{};
+	if (!SetFilePointerEx(hFile, position, NULL, FILE_BEGIN))
+		return nullptr;
+
+	for (std::size_t offset = 0; offset < content->size(); )
+	{
+		DWORD bytesRead{ 0 };
+		if (!ReadFile(hFile, content->data() + offset, (DWORD)(content->size() - offset), &bytesRead, NULL) || bytesRead == 0)
+		{
+			Log{ LOG_LEVEL::ERR } << "SERVER: ReadFile() failed with error: " << GetLastError();
+			return nullptr;
+		}
+		offset += bytesRead;
+	}
+
+	std::lock_guard<std::mutex> lock{ m_mutex };
+
+	// Another session may have loaded it meanwhile
+	std::wstring key{ filename.wstring() };
+	auto it = m_entries.find(key);
+	if (it != m_entries.end())
+		erase(it);
+
+	// Evict from the back until the new entry fits
+	while (!m_lru.empty() && m_used + content->size() > m_budget)
+		erase(m_entries.find(m_lru.back().first));
+
+	m_lru.emplace_front(key, Entry{ content, fileSize.QuadPart, lastWrite });
+	m_entries[key] = m_lru.begin();
+	m_used += content->size();
+
+	return content;
+}
+
+void FileCache::invalidate(const std::filesystem::path& filename)
+{
+	if (!enabled())
+		return;
+
+	std::lock_guard<std::mutex> lock{ m_mutex };
+	auto it = m_entries.find(filename.wstring());
+	if (it != m_entries.end())
+		erase(it);
+}
+
+std::size_t FileCache::used()
+{
+	std::lock_guard<std::mutex> lock{ m_mutex };
+	return m_used;
+}
+
+// Caller holds m_mutex
+void FileCache::erase(EntryMap::iterator it)
+{
+	m_used -= it->second->second.content->size();
+	m_lru.erase(it->second);
+	m_entries.erase(it);
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <ws2tcpip.h>
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <filesystem>
+
+// Files larger than this share of the budget are never cached,
+// so one big download can not flush every hot file
+constexpr std::size_t FILE_CACHE_ENTRY_DIVISOR{ 8 };
+
+/*
+	Keeps the contents of recently downloaded files in memory, up to
+	a byte budget, evicting the least recently used file first. An
+	entry is only served while the file's size and last write time
+	still match, which is checked without opening the file. Entries
+	are shared, so evicting one never pulls data out from under a
+	transfer that is still sending it.
+*/
+class FileCache
+{
+public:
+	using Content = std::vector<char>;
+
+private: // Variables
+	struct Entry
+	{
+		std::shared_ptr<const Content> content;
+		long long size;
+		FILETIME lastWrite;
+	};
+
+	// Most recently used first
+	using LruList = std::list<std::pair<std::wstring, Entry>>;
+	using EntryMap = std::unordered_map<std::wstring, LruList::iterator>;
+
+	const std::size_t m_budget;
+	std::size_t m_used;
+
+	std::mutex m_mutex;
+	LruList m_lru;
+	EntryMap m_entries;
+
+	std::atomic<unsigned long long> m_hits;
+	std::atomic<unsigned long long> m_misses;
+
+private: // Functions
+	void erase(EntryMap::iterator it);
+
+public:
+	// A budget of 0 disables the cache
+	explicit FileCache(std::size_t budget);
+	virtual ~FileCache() = default;
+
+	FileCache(const FileCache&) = delete;
+	FileCache& operator=(const FileCache&) = delete;
+
+	// Returns the cached contents if they are still current, nullptr otherwise
+	std::shared_ptr<const Content> lookup(const std::filesystem::path& filename);
+
+	// Reads hFile into the cache if it fits, nullptr if it was not cached
+	std::shared_ptr<const Content> load(const std::filesystem::path& filename, HANDLE hFile);
+
+	// Drops the file, called before it is overwritten
+	void invalidate(const std::filesystem::path& filename);
+
+	bool enabled() const { return m_budget > 0; }
+	std::size_t used();
+	unsigned long long hits() const { return m_hits; }
+	unsigned long long misses() const { return m_misses; }
+};
@@ -0,0 +1,81 @@
+#include "HashIndex.h"
+
+/***********************************************
+	Constructor
+***********************************************/
+HashIndex::HashIndex(std::size_t capacity) :
+	m_capacity{ capacity },
+	m_hits{ 0 },
+	m_misses{ 0 }
+{
+}
+
+/***********************************************
+	Lookup
+***********************************************/
+bool HashIndex::lookup(const std::filesystem::path& filename, HASH_ALGORITHM algorithm, FileStat& stat, std::string& digest)
+{
+	// Always from the file system, a stale size or time would hand out a wrong digest
+	WIN32_FILE_ATTRIBUTE_DATA attributes{};
+	if (!GetFileAttributesExW(filename.wstring().c_str(), GetFileExInfoStandard, &attributes))
+	{
+		++m_misses;
+		return false;
+	}
+	stat.size = (long long)(((unsigned long long)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow);
+	stat.lastWrite = attributes.ftLastWriteTime;
+	stat.directory = (attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+
+	std::lock_guard<std::mutex> lock{ m_mutex };
+
+	auto it = m_entries.find(filename.wstring());
+	if (it == m_entries.end() || it->second.size != stat.size ||
+		CompareFileTime(&it->second.lastWrite, &stat.lastWrite) != 0 ||
+		it->second.digests[(int)algorithm].empty())
+	{
+		++m_misses;
+		return false;
+	}
+
+	++m_hits;
+	digest = it->second.digests[(int)algorithm];
+	return true;
+}
+
+/***********************************************
+	Updates
+***********************************************/
+void HashIndex::record(const std::filesystem::path& filename, const FileStat& stat, ContentHasher& hasher)
+{
+	// A range, a restarted upload or a transfer the kernel did on its own
+	if (m_capacity == 0 || hasher.hashed() != (unsigned long long)stat.size)
+		return;
+
+	// Digests are finished outside the lock
+	std::string digests[HASH_ALGORITHMS]{};
+	for (int i = 0; i < HASH_ALGORITHMS; ++i)
+	{
+		if (hasher.has((HASH_ALGORITHM)i))
+			digests[i] = hasher.digest((HASH_ALGORITHM)i);
+	}
+
+	std::wstring key{ filename.wstring() };
+	std::lock_guard<std::mutex> lock{ m_mutex };
+
+	// Full, any entry makes room
+	if (m_entries.size() >= m_capacity && m_entries.find(key) == m_entries.end())
+		m_entries.erase(m_entries.begin());
+
+	// Digests of the same state of the file are merged, anything else is replaced
+	Entry& entry{ m_entries[key] };
+	bool same{ entry.size == stat.size && CompareFileTime(&entry.lastWrite, &stat.lastWrite) == 0 };
+	entry.size = stat.size;
+	entry.lastWrite = stat.lastWrite;
+	for (int i = 0; i < HASH_ALGORITHMS; ++i)
+	{
+		if (!digests[i].empty())
+			entry.digests[i] = digests[i];
+		else if (!same)
+			entry.digests[i].clear();
+	}
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "../../Common/src/Hash.h"
+#include "StatCache.h"
+
+#include <ws2tcpip.h>
+
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <filesystem>
+
+// Files whose digests are kept
+constexpr std::size_t DEFAULT_HASH_INDEX_ENTRIES{ 65536 };
+
+/*
+	Digests of files, recorded by the transfers that hashed the bytes
+	on their way and by HASH and XCRC when they had to read a file.
+	An entry is stamped with the size and last write time of the file
+	it was computed from and only answers while both still match, so a
+	file changed by anything, this server or not, is hashed again.
+*/
+class HashIndex
+{
+private: // Variables
+	struct Entry
+	{
+		long long size{ 0 };
+		FILETIME lastWrite{};
+		std::string digests[HASH_ALGORITHMS];	// Empty if not computed
+	};
+
+	const std::size_t m_capacity;
+
+	std::mutex m_mutex;
+	std::unordered_map<std::wstring, Entry> m_entries;
+
+	std::atomic<unsigned long long> m_hits;
+	std::atomic<unsigned long long> m_misses;
+
+public:
+	explicit HashIndex(std::size_t capacity);
+	virtual ~HashIndex() = default;
+
+	HashIndex(const HashIndex&) = delete;
+	HashIndex& operator=(const HashIndex&) = delete;
+
+	// Reads the file's current size and time into stat. Returns true
+	// and the digest if one was recorded for exactly that state.
+	bool lookup(const std::filesystem::path& filename, HASH_ALGORITHM algorithm, FileStat& stat, std::string& digest);
+
+	// Records the hasher's digests for the file as stat describes it,
+	// only if the hasher saw the whole file
+	void record(const std::filesystem::path& filename, const FileStat& stat, ContentHasher& hasher);
+
+	unsigned long long hits() const { return m_hits; }
+	unsigned long long misses() const { return m_misses; }
+};
@@ -0,0 +1,422 @@
+#include "IocpTransfer.h"
+
+#include <algorithm>
+
+/***********************************************
+	Constructor
+***********************************************/
+IocpTransfer::IocpTransfer(TransferBufferPool& bufferPool, unsigned int depth) :
+	m_bufferPool{ bufferPool },
+	m_depth{ (std::max)(depth, 1u) },
+	m_hPort{ NULL }
+{
+}
+
+IocpTransfer::Operation::Operation(Transfer* owner, TransferBufferPool::Buffer&& leased) :
+	OVERLAPPED{},
+	transfer{ owner },
+	type{ OPERATION::READ },
+	buffer{ std::move(leased) },
+	offset{ 0 },
+	length{ 0 },
+	sequence{ 0 }
+{
+}
+
+/***********************************************
+	Destructor
+***********************************************/
+IocpTransfer::~IocpTransfer()
+{
+	stop();
+}
+
+/***********************************************
+	Completion Port
+***********************************************/
+int IocpTransfer::start()
+{
+	m_hPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+	if (m_hPort == NULL)
+	{
+		Log{ LOG_LEVEL::ERR } << "SERVER: CreateIoCompletionPort() failed with error: " << GetLastError();
+		return FAILURE;
+	}
+
+	unsigned int threadCount{ (std::max)(std::thread::hardware_concurrency(), 1u) };
+	for (unsigned int i = 0; i < threadCount; ++i)
+		m_threads.emplace_back(&IocpTransfer::run, this);
+
+	return SUCCESS;
+}
+
+void IocpTransfer::stop()
+{
+	if (m_hPort == NULL) return;
+
+	// An empty packet tells one thread to leave
+	for (std::size_t i = 0; i < m_threads.size(); ++i)
+		PostQueuedCompletionStatus(m_hPort, 0, 0, NULL);
+
+	for (auto& thread : m_threads)
+		thread.join();
+	m_threads.clear();
+
+	CloseHandle(m_hPort);
+	m_hPort = NULL;
+}
+
+void IocpTransfer::run()
+{
+	OVERLAPPED_ENTRY entries[IOCP_BATCH_SIZE];
+
+	while (true)
+	{
+		ULONG removed{ 0 };
+		COUNT_SYSCALL();
+		if (!GetQueuedCompletionStatusEx(m_hPort, entries, IOCP_BATCH_SIZE, &removed, INFINITE, FALSE))
+			return;
+
+		ULONG stops{ 0 };
+		for (ULONG i = 0; i < removed; ++i)
+		{
+			if (entries[i].lpOverlapped == NULL)
+			{
+				++stops;
+				continue;
+			}
+
+			// Internal holds the status of the finished request
+			Operation* op{ static_cast<Operation*>(entries[i].lpOverlapped) };
+			complete(op, op->Internal == 0, entries[i].dwNumberOfBytesTransferred);
+		}
+
+		// One batch can hold the stop packets of several threads,
+		// this thread takes one and hands the others back
+		if (stops > 0)
+		{
+			for (ULONG i = 1; i < stops; ++i)
+				PostQueuedCompletionStatus(m_hPort, 0, 0, NULL);
+			return;
+		}
+	}
+}
+
+/***********************************************
+	Transfers
+***********************************************/
+int IocpTransfer::sendFile(SOCKET s, HANDLE hFile, long long offset, long long length, bool& started)
+{
+	started = false;
+
+	Transfer transfer{};
+	std::vector<Operation> operations{};
+	acquireBuffers(transfer, operations);
+	if (operations.empty() || begin(transfer, s, hFile, GENERIC_READ, offset, length) != SUCCESS)
+		return FAILURE;
+	started = true;
+
+	// Read ahead with every buffer, the sends follow in file order
+	{
+		std::lock_guard<std::mutex> lock{ transfer.mutex };
+		for (Operation& op : operations)
+		{
+			if (transfer.failed || transfer.position >= transfer.end)
+				break;
+			issueRead(transfer, &op);
+		}
+	}
+
+	return wait(transfer, length);
+}
+
+int IocpTransfer::recvFile(SOCKET s, HANDLE hFile, long long offset, long long length, bool& started)
+{
+	started = false;
+
+	LARGE_INTEGER currentSize{};
+	if (!GetFileSizeEx(hFile, &currentSize))
+		return FAILURE;
+
+	Transfer transfer{};
+	std::vector<Operation> operations{};
+	acquireBuffers(transfer, operations);
+	if (operations.empty() || begin(transfer, s, hFile, GENERIC_WRITE, offset, length) != SUCCESS)
+		return FAILURE;
+	started = true;
+
+	// Reserve the whole range up front like the blocking path
+	bool grown{ (long long)currentSize.QuadPart < offset + length };
+	if (grown && !setFileSize(hFile, offset + length))
+		fail(transfer);
+
+	// One recv at a time keeps the stream in order, the
+	// other buffers carry writes that are still running
+	{
+		std::lock_guard<std::mutex> lock{ transfer.mutex };
+		for (Operation& op : operations)
+			transfer.idle.push_back(&op);
+
+		if (!transfer.failed && transfer.position < transfer.end)
+		{
+			Operation* op{ transfer.idle.back() };
+			transfer.idle.pop_back();
+			issueRecv(transfer, op);
+		}
+	}
+
+	int iResult = wait(transfer, length);
+
+	// Do not leave preallocated zeros behind a failed transfer
+	if (iResult != SUCCESS && grown)
+		setFileSize(hFile, (std::max)((long long)currentSize.QuadPart, transfer.intact));
+
+	return iResult;
+}
+
+void IocpTransfer::acquireBuffers(Transfer& transfer, std::vector<Operation>& operations)
+{
+	// Operations are referenced by address once issued, never reallocate
+	operations.reserve(m_depth);
+	for (unsigned int i = 0; i < m_depth; ++i)
+	{
+		TransferBufferPool::Buffer buffer{ m_bufferPool.acquire() };
+		if (!buffer)
+			break;
+		operations.emplace_back(&transfer, std::move(buffer));
+	}
+}
+
+// Attaches an overlapped handle of the file and the socket to the port
+int IocpTransfer::begin(Transfer& transfer, SOCKET s, HANDLE hFile, DWORD access, long long offset, long long length)
+{
+	if (m_hPort == NULL)
+		return FAILURE;
+
+	transfer.hFile = ReOpenFile(hFile, access, FILE_SHARE_READ | FILE_SHARE_WRITE, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN);
+	if (transfer.hFile == INVALID_HANDLE_VALUE)
+		return FAILURE;
+
+	// A socket stays attached for its life, one that carried an earlier
+	// transfer or part of one is refused a second time and is ready as it is
+	if (CreateIoCompletionPort(transfer.hFile, m_hPort, 0, 0) == NULL ||
+		(CreateIoCompletionPort((HANDLE)s, m_hPort, 0, 0) == NULL && GetLastError() != ERROR_INVALID_PARAMETER))
+	{
+		Log{ LOG_LEVEL::ERR } << "SERVER: CreateIoCompletionPort() failed with error: " << GetLastError();
+		CloseHandle(transfer.hFile);
+		return FAILURE;
+	}
+
+	transfer.s = s;
+	transfer.position = offset;
+	transfer.end = offset + length;
+	transfer.intact = transfer.end;
+
+	return SUCCESS;
+}
+
+int IocpTransfer::wait(Transfer& transfer, long long length)
+{
+	{
+		std::unique_lock<std::mutex> lock{ transfer.mutex };
+		transfer.finished.wait(lock, [&transfer] { return transfer.inFlight == 0; });
+	}
+
+	CloseHandle(transfer.hFile);
+
+	return (transfer.failed || transfer.done != length) ? FAILURE : SUCCESS;
+}
+
+/***********************************************
+	Completions
+***********************************************/
+void IocpTransfer::complete(Operation* op, bool ok, DWORD bytes)
+{
+	Transfer& transfer{ *op->transfer };
+	std::lock_guard<std::mutex> lock{ transfer.mutex };
+	--transfer.inFlight;
+
+	switch (op->type)
+	{
+	case OPERATION::READ:
+	{
+		if (!ok || bytes != op->length)
+		{
+			fail(transfer);
+			break;
+		}
+
+		// Reads finish in any order, sends have to go out in file order
+		transfer.ready[op->sequence] = op;
+		if (!transfer.failed)
+			sendReady(transfer);
+	} break;
+	case OPERATION::SEND:
+	{
+		if (!ok || bytes != op->length)
+		{
+			fail(transfer);
+			break;
+		}
+		transfer.done += bytes;
+
+		// The buffer is free again, read the next block into it
+		if (!transfer.failed && transfer.position < transfer.end)
+			issueRead(transfer, op);
+	} break;
+	case OPERATION::RECV:
+	{
+		transfer.receiving = false;
+		if (!ok || bytes == 0)
+		{
+			if (ok)
+				Log{ LOG_LEVEL::ERR } << "WINSOCK: Connection closed " << transfer.end - transfer.position << " bytes early.";
+			transfer.intact = (std::min)(transfer.intact, transfer.position);
+			fail(transfer);
+			break;
+		}
+
+		op->offset = transfer.position;
+		op->length = bytes;
+		transfer.position += bytes;
+		if (transfer.failed)
+			break;
+
+		issueWrite(transfer, op);
+
+		// Keep receiving while the write runs, unless every buffer is busy
+		if (!transfer.failed && transfer.position < transfer.end && !transfer.idle.empty())
+		{
+			Operation* next{ transfer.idle.back() };
+			transfer.idle.pop_back();
+			issueRecv(transfer, next);
+		}
+	} break;
+	case OPERATION::WRITE:
+	{
+		if (!ok || bytes != op->length)
+		{
+			transfer.intact = (std::min)(transfer.intact, op->offset);
+			fail(transfer);
+			break;
+		}
+		transfer.done += bytes;
+
+		// Continue a receive that was waiting for a buffer
+		if (!transfer.failed && transfer.position < transfer.end && !transfer.receiving)
+			issueRecv(transfer, op);
+		else
+			transfer.idle.push_back(op);
+	} break;
+	}
+
+	// Notify under the lock, the waiter owns the transfer and
+	// destroys it as soon as it gets the lock back
+	if (transfer.inFlight == 0)
+		transfer.finished.notify_all();
+}
+
+void IocpTransfer::issueRead(Transfer& transfer, Operation* op)
+{
+	op->type = OPERATION::READ;
+	op->offset = transfer.position;
+	op->length = (DWORD)(std::min)(transfer.end - transfer.position, (long long)op->buffer.size());
+	op->sequence = transfer.nextRead++;
+	transfer.position += op->length;
+
+	op->Internal = op->InternalHigh = 0;
+	op->Offset = (DWORD)(op->offset & 0xFFFFFFFF);
+	op->OffsetHigh = (DWORD)(op->offset >> 32);
+	op->hEvent = NULL;
+
+	++transfer.inFlight;
+	COUNT_SYSCALL();
+	if (!ReadFile(transfer.hFile, op->buffer.data(), op->length, NULL, op) && GetLastError() != ERROR_IO_PENDING)
+	{
+		Log{ LOG_LEVEL::ERR } << "SERVER: ReadFile() failed with error: " << GetLastError();
+		--transfer.inFlight;
+		fail(transfer);
+	}
+}
+
+void IocpTransfer::issueSend(Transfer& transfer, Operation* op)
+{
+	op->type = OPERATION::SEND;
+	op->Internal = op->InternalHigh = 0;
+	op->hEvent = NULL;
+
+	// Sends on one socket are queued in the order they are issued
+	WSABUF wsaBuf{ op->length, op->buffer.data() };
+	++transfer.inFlight;
+	COUNT_SYSCALL();
+	if (WSASend(transfer.s, &wsaBuf, 1, NULL, 0, op, NULL) == SOCKET_ERROR && WSAGetLastError() != WSA_IO_PENDING)
+	{
+		Log{ LOG_LEVEL::ERR } << "WINSOCK: WSASend() failed with error: " << WSAGetLastError();
+		--transfer.inFlight;
+		fail(transfer);
+	}
+}
+
+void IocpTransfer::issueRecv(Transfer& transfer, Operation* op)
+{
+	op->type = OPERATION::RECV;
+	op->Internal = op->InternalHigh = 0;
+	op->hEvent = NULL;
+
+	WSABUF wsaBuf{ (ULONG)(std::min)(transfer.end - transfer.position, (long long)op->buffer.size()), op->buffer.data() };
+	DWORD flags{ 0 };
+	transfer.receiving = true;
+	++transfer.inFlight;
+	COUNT_SYSCALL();
+	if (WSARecv(transfer.s, &wsaBuf, 1, NULL, &flags, op, NULL) == SOCKET_ERROR && WSAGetLastError() != WSA_IO_PENDING)
+	{
+		Log{ LOG_LEVEL::ERR } << "WINSOCK: WSARecv() failed with error: " << WSAGetLastError();
+		transfer.receiving = false;
+		--transfer.inFlight;
+		transfer.intact = (std::min)(transfer.intact, transfer.position);
+		transfer.idle.push_back(op);
+		fail(transfer);
+	}
+}
+
+void IocpTransfer::issueWrite(Transfer& transfer, Operation* op)
+{
+	op->type = OPERATION::WRITE;
+	op->Internal = op->InternalHigh = 0;
+	op->Offset = (DWORD)(op->offset & 0xFFFFFFFF);
+	op->OffsetHigh = (DWORD)(op->offset >> 32);
+	op->hEvent = NULL;
+
+	++transfer.inFlight;
+	COUNT_SYSCALL();
+	if (!WriteFile(transfer.hFile, op->buffer.data(), op->length, NULL, op) && GetLastError() != ERROR_IO_PENDING)
+	{
+		Log{ LOG_LEVEL::ERR } << "SERVER: WriteFile() failed with error: " << GetLastError();
+		--transfer.inFlight;
+		transfer.intact = (std::min)(transfer.intact, op->offset);
+		transfer.idle.push_back(op);
+		fail(transfer);
+	}
+}
+
+void IocpTransfer::sendReady(Transfer& transfer)
+{
+	for (auto it = transfer.ready.begin(); it != transfer.ready.end() && it->first == transfer.nextSend; )
+	{
+		Operation* op{ it->second };
+		it = transfer.ready.erase(it);
+		++transfer.nextSend;
+		issueSend(transfer, op);
+	}
+}
+
+// Stops issuing and cancels what is still running so the
+// waiter is released as soon as the port drains
+void IocpTransfer::fail(Transfer& transfer)
+{
+	if (transfer.failed) return;
+	transfer.failed = true;
+
+	CancelIoEx(transfer.hFile, NULL);
+	CancelIoEx((HANDLE)transfer.s, NULL);
+}
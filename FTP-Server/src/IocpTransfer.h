@@ -0,0 +1,116 @@
+#pragma once
+
+#include "../../Common/src/FileTransfer.h"
+
+#include <ws2tcpip.h>
+
+#include <map>
+#include <mutex>
+#include <vector>
+#include <thread>
+#include <condition_variable>
+
+// Buffers kept in flight by one transfer
+constexpr unsigned int DEFAULT_IOCP_DEPTH{ 4 };
+
+// Completions dequeued per GetQueuedCompletionStatusEx call
+constexpr unsigned long IOCP_BATCH_SIZE{ 64 };
+
+/*
+	Data transfer backend built on one I/O completion port shared by
+	every active transfer. Each transfer keeps several pooled buffers
+	in flight: a RETR reads ahead from the file while earlier blocks
+	are still being sent, a STOR keeps receiving while earlier blocks
+	are still being written. A few threads drain the port in batches,
+	so hundreds of concurrent transfers cost a handful of threads and
+	one dequeue call per batch of completions.
+
+	The calling thread blocks until its transfer is finished, which
+	keeps the command flow of a session unchanged.
+*/
+class IocpTransfer
+{
+private: // Variables
+	struct Transfer;
+
+	enum class OPERATION
+	{
+		READ, SEND, RECV, WRITE
+	};
+
+	// One buffer of a transfer, OVERLAPPED must stay the first base
+	struct Operation : OVERLAPPED
+	{
+		Transfer* transfer;
+		OPERATION type;
+		TransferBufferPool::Buffer buffer;
+		long long offset;				// File position of the block
+		DWORD length;					// Bytes in the block
+		unsigned long long sequence;	// Send order of a read block
+
+		Operation(Transfer* owner, TransferBufferPool::Buffer&& leased);
+	};
+
+	// State of one file moving over one data connection
+	struct Transfer
+	{
+		SOCKET s{ INVALID_SOCKET };
+		HANDLE hFile{ INVALID_HANDLE_VALUE };	// Overlapped handle attached to the port
+
+		long long position{ 0 };	// Next file offset to read or receive into
+		long long end{ 0 };
+		long long done{ 0 };		// Bytes sent or written
+		long long intact{ 0 };		// A failed STOR kept every byte before this offset
+
+		unsigned long long nextRead{ 0 };	// Sequence given to the next read
+		unsigned long long nextSend{ 0 };	// Sequence that has to be sent next
+		std::map<unsigned long long, Operation*> ready;	// Read blocks waiting for their turn
+
+		std::vector<Operation*> idle;	// Buffers with nothing to do
+		bool receiving{ false };		// A recv is outstanding
+		unsigned int inFlight{ 0 };
+		bool failed{ false };
+
+		std::mutex mutex;
+		std::condition_variable finished;
+	};
+
+	TransferBufferPool& m_bufferPool;
+	const unsigned int m_depth;
+
+	HANDLE m_hPort;
+	std::vector<std::thread> m_threads;
+
+private: // Functions
+	void run();
+	void complete(Operation* op, bool ok, DWORD bytes);
+
+	// Caller holds the transfer's mutex
+	void issueRead(Transfer& transfer, Operation* op);
+	void issueSend(Transfer& transfer, Operation* op);
+	void issueRecv(Transfer& transfer, Operation* op);
+	void issueWrite(Transfer& transfer, Operation* op);
+	void sendReady(Transfer& transfer);
+	void fail(Transfer& transfer);
+
+	int begin(Transfer& transfer, SOCKET s, HANDLE hFile, DWORD access, long long offset, long long length);
+	void acquireBuffers(Transfer& transfer, std::vector<Operation>& operations);
+	int wait(Transfer& transfer, long long length);
+
+public:
+	IocpTransfer(TransferBufferPool& bufferPool, unsigned int depth = DEFAULT_IOCP_DEPTH);
+	virtual ~IocpTransfer();
+
+	IocpTransfer(const IocpTransfer&) = delete;
+	IocpTransfer& operator=(const IocpTransfer&) = delete;
+
+	// Fails if completion ports are not available
+	int start();
+	void stop();
+
+	// Send or receive length bytes of hFile starting at offset. If the
+	// file or socket can not be attached to the port nothing is moved,
+	// started is false and the caller should use the blocking path.
+	int sendFile(SOCKET s, HANDLE hFile, long long offset, long long length, bool& started);
+	int recvFile(SOCKET s, HANDLE hFile, long long offset, long long length, bool& started);
+};
@@ -3,11 +3,107 @@
 #include "FTP_Server.h"
 
 #include <iostream>
+#include <string>
+
+// Reads the optional command line settings:
+//	--workers <count>	threads executing commands
+//	--queue <count>		sessions allowed to wait for a worker
+//	--chunk <bytes>		transfer buffer size, 64 KiB to 8 MiB
+//	--cache <bytes>		hot-file cache budget, off by default
+//	--dir-cache <count>	directory listings kept, 0 disables the cache
+//	--stat-ttl <ms>		how long SIZE and MDTM trust a cached stat, 0 disables it
+//	--dedup <on|off>	content store behind XDUP, on by default
+//	--delta-threads <n>	threads signing the old copy for XDLT, one per core by default
+//	--xfer <backend>	transmit (default) or iocp
+//	--pasv <first-last>	ports handed out by PASV/EPSV
+//	--log <file>		log file, the console by default
+//	--log-level <level>	debug, info (default), warn or error
+//	--metrics <path>	AF_UNIX socket serving Prometheus metrics, off by default
+ServerConfig parseArguments(int argc, char** argv)
+{
+	ServerConfig config{};
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string option{ argv[i] };
+		if (i + 1 >= argc)
+			throw std::runtime_error("Missing value for " + option);
+
+		std::string value{ argv[++i] };
+		if (option == "--workers")
+			config.workerThreads = std::stoul(value);
+		else if (option == "--queue")
+			config.maxPendingSessions = std::stoul(value);
+		else if (option == "--chunk")
+			config.transferChunkSize = std::stoul(value);
+		else if (option == "--cache")
+			config.fileCacheBytes = (std::size_t)std::stoull(value);
+		else if (option == "--dir-cache")
+			config.directoryCacheEntries = (std::size_t)std::stoull(value);
+		else if (option == "--stat-ttl")
+			config.statCacheTtlMs = (unsigned int)std::stoul(value);
+		else if (option == "--dedup")
+		{
+			if (value == "on")
+				config.dedup = true;
+			else if (value == "off")
+				config.dedup = false;
+			else
+				throw std::runtime_error("Unknown dedup setting " + value);
+		}
+		else if (option == "--delta-threads")
+			config.deltaThreads = (unsigned int)std::stoul(value);
+		else if (option == "--xfer")
+		{
+			if (value == "transmit")
+				config.transferBackend = TRANSFER_BACKEND::TRANSMIT;
+			else if (value == "iocp")
+				config.transferBackend = TRANSFER_BACKEND::IOCP;
+			else
+				throw std::runtime_error("Unknown transfer backend " + value);
+		}
+		else if (option == "--pasv")
+		{
+			std::size_t dash{ value.find('-') };
+			if (dash == std::string::npos)
+				throw std::runtime_error("Expected --pasv <first-last>");
+
+			unsigned long first{ std::stoul(value.substr(0, dash)) };
+			unsigned long last{ std::stoul(value.substr(dash + 1)) };
+			if (first == 0 || first > last || last > 65535)
+				throw std::runtime_error("Invalid passive port range " + value);
+
+			config.passivePortFirst = (unsigned short)first;
+			config.passivePortLast = (unsigned short)last;
+		}
+		else if (option == "--metrics")
+			config.metricsSocket = value;
+		else if (option == "--log")
+			config.logFile = value;
+		else if (option == "--log-level")
+		{
+			if (value == "debug")
+				config.logLevel = LOG_LEVEL::DEBUG;
+			else if (value == "info")
+				config.logLevel = LOG_LEVEL::INFO;
+			else if (value == "warn")
+				config.logLevel = LOG_LEVEL::WARN;
+			else if (value == "error")
+				config.logLevel = LOG_LEVEL::ERR;
+			else
+				throw std::runtime_error("Unknown log level " + value);
+		}
+		else
+			throw std::runtime_error("Unknown option " + option);
+	}
+
+	return config;
+}
 
 int main(int argc, char** argv)
 try
 {
-	FTP_Server* server = new FTP_Server();
+	FTP_Server* server = new FTP_Server(parseArguments(argc, argv));
 
 	server->init();
 
@@ -0,0 +1,361 @@
+#include "Metrics.h"
+#include "../../Common/src/FTP_Common.h"
+#include "../../Common/src/FileTransfer.h"
+#include "../../Common/src/Logger.h"
+
+#include <afunix.h>
+
+#include <cmath>
+#include <cstdio>
+
+/***********************************************
+	Histograms
+***********************************************/
+double Metrics::Histogram::quantile(double q) const
+{
+	if (count == 0)
+		return 0.0;
+
+	// The last bucket has no upper bound, its lower one is reported
+	unsigned long long target{ (unsigned long long)std::ceil(q * count) };
+	unsigned long long seen{ 0 };
+	for (std::size_t i = 0; i < LATENCY_BUCKETS; ++i)
+	{
+		seen += buckets[i];
+		if (seen >= target && seen > 0)
+			return (double)(1ULL << (std::min)(i, LATENCY_BUCKETS - 2)) / 1e6;
+	}
+	return (double)(1ULL << (LATENCY_BUCKETS - 2)) / 1e6;
+}
+
+void Metrics::record(ThreadHistogram& histogram, long long micros)
+{
+	micros = (std::max)(micros, 0LL);
+
+	std::size_t bucket{ 0 };
+	while (bucket < LATENCY_BUCKETS - 1 && (1LL << bucket) < micros)
+		++bucket;
+
+	add(histogram.buckets[bucket], 1);
+	add(histogram.count, 1);
+	add(histogram.sumMicros, (unsigned long long)micros);
+}
+
+void Metrics::collect(Histogram& total, const ThreadHistogram& histogram)
+{
+	for (std::size_t i = 0; i < LATENCY_BUCKETS; ++i)
+		total.buckets[i] += histogram.buckets[i].load(std::memory_order_relaxed);
+	total.count += histogram.count.load(std::memory_order_relaxed);
+	total.sumMicros += histogram.sumMicros.load(std::memory_order_relaxed);
+}
+
+/***********************************************
+	Constructor
+***********************************************/
+Metrics::Metrics() :
+	m_id{ []
+		{
+			static std::atomic<unsigned long long> instances{ 0 };
+			return ++instances;
+		}() },
+	m_sessionsActive{ 0 },
+	m_sessionsTotal{ 0 },
+	m_commandNames{},
+	m_epoch{ std::chrono::steady_clock::now() }
+{
+}
+
+/***********************************************
+	Recording
+***********************************************/
+Metrics::Shard& Metrics::threadShard()
+{
+	thread_local unsigned long long owner{ 0 };
+	thread_local Shard* shard{ nullptr };
+	if (owner != m_id)
+	{
+		auto created{ std::make_unique<Shard>() };
+
+		std::lock_guard<std::mutex> lock{ m_shardsMutex };
+		shard = created.get();
+		owner = m_id;
+		m_shards.push_back(std::move(created));
+	}
+	return *shard;
+}
+
+void Metrics::nameCommand(std::size_t command, std::string_view name)
+{
+	if (command < METRIC_COMMANDS)
+		m_commandNames[command] = name;
+}
+
+long long Metrics::now() const
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_epoch).count();
+}
+
+void Metrics::recordCommand(std::size_t command, long long started)
+{
+	if (command < METRIC_COMMANDS)
+		record(threadShard().commands[command], now() - started);
+}
+
+void Metrics::recordDataConnect(long long started)
+{
+	record(threadShard().dataConnect, now() - started);
+}
+
+void Metrics::recordTransfer(bool sent, bool succeeded, long long bytes, long long started)
+{
+	Shard& shard{ threadShard() };
+	add(succeeded ? shard.transfers : shard.transfersFailed, 1);
+	add(sent ? shard.bytesSent : shard.bytesReceived, (unsigned long long)(std::max)(bytes, 0LL));
+	add(shard.transferMicros, (unsigned long long)(std::max)(now() - started, 0LL));
+}
+
+Metrics::SessionCount Metrics::sessionStarted()
+{
+	m_sessionsActive.fetch_add(1, std::memory_order_relaxed);
+	m_sessionsTotal.fetch_add(1, std::memory_order_relaxed);
+	return SessionCount{ this };
+}
+
+/***********************************************
+	Reports
+***********************************************/
+Metrics::Snapshot Metrics::snapshot()
+{
+	Snapshot snapshot{};
+
+	std::lock_guard<std::mutex> lock{ m_shardsMutex };
+	for (const auto& shard : m_shards)
+	{
+		for (std::size_t i = 0; i < METRIC_COMMANDS; ++i)
+			collect(snapshot.commands[i], shard->commands[i]);
+		collect(snapshot.dataConnect, shard->dataConnect);
+
+		snapshot.bytesSent += shard->bytesSent.load(std::memory_order_relaxed);
+		snapshot.bytesReceived += shard->bytesReceived.load(std::memory_order_relaxed);
+		snapshot.transfers += shard->transfers.load(std::memory_order_relaxed);
+		snapshot.transfersFailed += shard->transfersFailed.load(std::memory_order_relaxed);
+		snapshot.transferMicros += shard->transferMicros.load(std::memory_order_relaxed);
+	}
+	snapshot.sessionsActive = m_sessionsActive.load(std::memory_order_relaxed);
+	snapshot.sessionsTotal = m_sessionsTotal.load(std::memory_order_relaxed);
+
+	return snapshot;
+}
+
+std::string Metrics::formatStats()
+{
+	Snapshot s{ snapshot() };
+	std::string text{};
+	char line[160];
+
+	std::snprintf(line, sizeof(line), "Sessions: %lld active, %llu since start.\n", s.sessionsActive, s.sessionsTotal);
+	text += line;
+
+	// Throughput while a transfer was running, idle time does not count
+	double transferSeconds{ s.transferMicros / 1e6 };
+	double gigabytes{ (s.bytesSent + s.bytesReceived) / 1e9 };
+	std::snprintf(line, sizeof(line), "Transfers: %llu completed, %llu failed, %llu bytes sent, %llu bytes received, %.3f GB/s.\n",
+		s.transfers, s.transfersFailed, s.bytesSent, s.bytesReceived, transferSeconds > 0 ? gigabytes / transferSeconds : 0.0);
+	text += line;
+
+	std::snprintf(line, sizeof(line), "Data connections: %llu opened, mean %.3f ms, p99 <= %.3f ms.\n",
+		s.dataConnect.count, s.dataConnect.meanSeconds() * 1e3, s.dataConnect.quantile(0.99) * 1e3);
+	text += line;
+
+	std::snprintf(line, sizeof(line), "%-6s %10s %10s %10s %10s\n", "Verb", "Count", "Mean ms", "p50 ms", "p99 ms");
+	text += line;
+	for (std::size_t i = 0; i < METRIC_COMMANDS; ++i)
+	{
+		const Histogram& h{ s.commands[i] };
+		if (m_commandNames[i].empty() || h.count == 0)
+			continue;
+
+		std::string name{ m_commandNames[i] };
+		std::snprintf(line, sizeof(line), "%-6s %10llu %10.3f %10.3f %10.3f\n", name.c_str(), h.count,
+			h.meanSeconds() * 1e3, h.quantile(0.5) * 1e3, h.quantile(0.99) * 1e3);
+		text += line;
+	}
+
+	return text;
+}
+
+void Metrics::formatHistogram(std::string& text, const char* name, const std::string& labels, const Histogram& histogram)
+{
+	char line[256];
+	std::string separator{ labels.empty() ? "" : "," };
+
+	// Prometheus buckets are cumulative
+	unsigned long long cumulative{ 0 };
+	for (std::size_t i = 0; i < LATENCY_BUCKETS - 1; ++i)
+	{
+		cumulative += histogram.buckets[i];
+		std::snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"%g\"} %llu\n",
+			name, labels.c_str(), separator.c_str(), (double)(1ULL << i) / 1e6, cumulative);
+		text += line;
+	}
+	std::snprintf(line, sizeof(line), "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels.c_str(), separator.c_str(), histogram.count);
+	text += line;
+
+	std::string braces{ labels.empty() ? "" : "{" + labels + "}" };
+	std::snprintf(line, sizeof(line), "%s_sum%s %g\n%s_count%s %llu\n",
+		name, braces.c_str(), histogram.sumMicros / 1e6, name, braces.c_str(), histogram.count);
+	text += line;
+}
+
+std::string Metrics::formatPrometheus()
+{
+	Snapshot s{ snapshot() };
+	std::string text{};
+
+	text += "# HELP ftp_command_duration_seconds Time from reading a command to queuing its final reply.\n"
+			"# TYPE ftp_command_duration_seconds histogram\n";
+	for (std::size_t i = 0; i < METRIC_COMMANDS; ++i)
+	{
+		if (!m_commandNames[i].empty())
+			formatHistogram(text, "ftp_command_duration_seconds", "command=\"" + std::string{ m_commandNames[i] } + "\"", s.commands[i]);
+	}
+
+	text += "# HELP ftp_data_connect_duration_seconds Time to open a data connection.\n"
+			"# TYPE ftp_data_connect_duration_seconds histogram\n";
+	formatHistogram(text, "ftp_data_connect_duration_seconds", "", s.dataConnect);
+
+	text += "# HELP ftp_bytes_sent_total File bytes sent on data connections.\n"
+			"# TYPE ftp_bytes_sent_total counter\n"
+			"ftp_bytes_sent_total " + std::to_string(s.bytesSent) + "\n"
+			"# HELP ftp_bytes_received_total File bytes received on data connections.\n"
+			"# TYPE ftp_bytes_received_total counter\n"
+			"ftp_bytes_received_total " + std::to_string(s.bytesReceived) + "\n"
+			"# HELP ftp_transfers_total Transfers by result.\n"
+			"# TYPE ftp_transfers_total counter\n"
+			"ftp_transfers_total{result=\"ok\"} " + std::to_string(s.transfers) + "\n"
+			"ftp_transfers_total{result=\"failed\"} " + std::to_string(s.transfersFailed) + "\n"
+			"# HELP ftp_transfer_seconds_total Time spent transferring, bytes over this is the throughput.\n"
+			"# TYPE ftp_transfer_seconds_total counter\n"
+			"ftp_transfer_seconds_total " + std::to_string(s.transferMicros / 1e6) + "\n"
+			"# HELP ftp_sessions_active Control connections open now.\n"
+			"# TYPE ftp_sessions_active gauge\n"
+			"ftp_sessions_active " + std::to_string(s.sessionsActive) + "\n"
+			"# HELP ftp_sessions_total Control connections accepted.\n"
+			"# TYPE ftp_sessions_total counter\n"
+			"ftp_sessions_total " + std::to_string(s.sessionsTotal) + "\n";
+
+	return text;
+}
+
+/***********************************************
+	Endpoint
+***********************************************/
+MetricsEndpoint::MetricsEndpoint(Metrics& metrics) :
+	m_metrics{ metrics },
+	m_path{},
+	ListenSocket{ INVALID_SOCKET },
+	m_running{ false }
+{
+}
+
+MetricsEndpoint::~MetricsEndpoint()
+{
+	stop();
+}
+
+int MetricsEndpoint::start(const std::string& path)
+{
+	sockaddr_un endpointAddr{};
+	if (path.size() >= sizeof(endpointAddr.sun_path))
+	{
+		Log{ LOG_LEVEL::ERR } << "SERVER: Metrics socket path is too long: " << path;
+		return FAILURE;
+	}
+	endpointAddr.sun_family = AF_UNIX;
+	path.copy(endpointAddr.sun_path, path.size());
+
+	ListenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (ListenSocket == INVALID_SOCKET)
+	{
+		Log{ LOG_LEVEL::ERR } << "WINSOCK: socket() failed with error: " << WSAGetLastError();
+		return FAILURE;
+	}
+
+	// A socket file left behind by an earlier run blocks the bind
+	DeleteFileA(path.c_str());
+	if (bind(ListenSocket, (sockaddr*)&endpointAddr, sizeof(endpointAddr)) == SOCKET_ERROR ||
+		listen(ListenSocket, SOMAXCONN) == SOCKET_ERROR)
+	{
+		Log{ LOG_LEVEL::ERR } << "WINSOCK: Unable to listen on " << path << ", error: " << WSAGetLastError();
+		closesocket(ListenSocket);
+		ListenSocket = INVALID_SOCKET;
+		return FAILURE;
+	}
+
+	m_path = path;
+	m_running = true;
+	m_thread = std::thread{ &MetricsEndpoint::run, this };
+
+	Log{ LOG_LEVEL::INFO } << "SERVER: Metrics served on " << path;
+	return SUCCESS;
+}
+
+void MetricsEndpoint::stop()
+{
+	if (!m_thread.joinable()) return;
+
+	// Closing the listener makes the blocked accept() return
+	m_running = false;
+	closesocket(ListenSocket);
+	ListenSocket = INVALID_SOCKET;
+	m_thread.join();
+
+	DeleteFileA(m_path.c_str());
+}
+
+void MetricsEndpoint::run()
+{
+	while (m_running)
+	{
+		SOCKET scrapeSocket = accept(ListenSocket, NULL, NULL);
+		if (scrapeSocket == INVALID_SOCKET)
+		{
+			int error{ WSAGetLastError() };
+			if (!m_running || error == WSAEINTR || error == WSAECONNRESET)
+				continue;
+
+			// Out of buffers or the socket file is gone, try again later
+			Log{ LOG_LEVEL::ERR } << "WINSOCK: accept() failed with error: " << error;
+			std::this_thread::sleep_for(std::chrono::milliseconds{ METRICS_ACCEPT_RETRY_MS });
+			continue;
+		}
+
+		respond(scrapeSocket);
+		closesocket(scrapeSocket);
+	}
+}
+
+// Every request gets the metrics, whatever path it asks for
+void MetricsEndpoint::respond(SOCKET s)
+{
+	// A scraper that never finishes its request must not stall the endpoint
+	DWORD timeout{ METRICS_REQUEST_TIMEOUT_MS };
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+
+	std::string request{};
+	char recvBuf[1024];
+	while (request.find("\r\n\r\n") == std::string::npos && request.size() < METRICS_MAX_REQUEST)
+	{
+		int iResult = recv(s, recvBuf, sizeof(recvBuf), 0);
+		if (iResult <= 0)
+			break;
+		request.append(recvBuf, iResult);
+	}
+
+	std::string body{ m_metrics.formatPrometheus() };
+	std::string response{ "HTTP/1.0 200 OK\r\n"
+						  "Content-Type: text/plain; version=0.0.4\r\n"
+						  "Content-Length: " + std::to_string(body.size()) + "\r\n"
+						  "\r\n" + body };
+	sendAll(s, response.c_str(), (int)response.size());
+}
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <ws2tcpip.h>
+
+#include <array>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <string>
+#include <thread>
+#include <string_view>
+
+// Command slots, indexed by the value of the program's command enum
+constexpr std::size_t METRIC_COMMANDS{ 32 };
+
+// Bucket i counts latencies up to 2^i microseconds, the last one everything above
+constexpr std::size_t LATENCY_BUCKETS{ 26 };
+
+// Limits on a scrape request, which is read and ignored
+constexpr DWORD METRICS_REQUEST_TIMEOUT_MS{ 1000 };
+constexpr std::size_t METRICS_MAX_REQUEST{ 8192 };
+
+// Wait after a failed accept, a lasting failure must not spin the thread
+constexpr int METRICS_ACCEPT_RETRY_MS{ 1000 };
+
+/*
+	Server instrumentation. Every thread records into counters of its
+	own, so recording is a few relaxed loads and stores with no lock and
+	no shared cache line; a report adds up the threads. Latencies go in
+	power of two histograms, from which the report estimates quantiles.
+	Session counts are shared, they change once per connection.
+*/
+class Metrics
+{
+public:
+	// Totals of one histogram, as read by a report
+	struct Histogram
+	{
+		std::array<unsigned long long, LATENCY_BUCKETS> buckets{};
+		unsigned long long count{ 0 };
+		unsigned long long sumMicros{ 0 };
+
+		// Upper bound of the bucket holding quantile q, in seconds
+		double quantile(double q) const;
+		double meanSeconds() const { return count ? sumMicros / 1e6 / count : 0.0; }
+	};
+
+	struct Snapshot
+	{
+		std::array<Histogram, METRIC_COMMANDS> commands{};
+		Histogram dataConnect{};
+		unsigned long long bytesSent{ 0 };
+		unsigned long long bytesReceived{ 0 };
+		unsigned long long transfers{ 0 };
+		unsigned long long transfersFailed{ 0 };
+		unsigned long long transferMicros{ 0 };
+		long long sessionsActive{ 0 };
+		unsigned long long sessionsTotal{ 0 };
+	};
+
+	// Counts a session as active for as long as it is held
+	class SessionCount
+	{
+	private:
+		Metrics* m_metrics;
+
+	public:
+		SessionCount() : m_metrics{ nullptr } {}
+		explicit SessionCount(Metrics* metrics) : m_metrics{ metrics } {}
+		~SessionCount() { if (m_metrics) m_metrics->m_sessionsActive.fetch_sub(1, std::memory_order_relaxed); }
+
+		SessionCount(SessionCount&& other) noexcept : m_metrics{ other.m_metrics } { other.m_metrics = nullptr; }
+		SessionCount& operator=(SessionCount&& other) noexcept
+		{
+			std::swap(m_metrics, other.m_metrics);
+			return *this;
+		}
+		SessionCount(const SessionCount&) = delete;
+		SessionCount& operator=(const SessionCount&) = delete;
+	};
+
+private: // Variables
+	// Only its own thread writes a counter, a plain load and store is enough
+	using Counter = std::atomic<unsigned long long>;
+
+	struct ThreadHistogram
+	{
+		std::array<Counter, LATENCY_BUCKETS> buckets{};
+		Counter count{ 0 };
+		Counter sumMicros{ 0 };
+	};
+
+	struct Shard
+	{
+		std::array<ThreadHistogram, METRIC_COMMANDS> commands;
+		ThreadHistogram dataConnect;
+		Counter bytesSent{ 0 };
+		Counter bytesReceived{ 0 };
+		Counter transfers{ 0 };
+		Counter transfersFailed{ 0 };
+		Counter transferMicros{ 0 };
+	};
+
+	// Tells the shards of this instance apart from those of an earlier one
+	const unsigned long long m_id;
+
+	// Registration happens once per thread, only it takes the lock
+	std::mutex m_shardsMutex;
+	std::vector<std::unique_ptr<Shard>> m_shards;
+
+	std::atomic<long long> m_sessionsActive;
+	std::atomic<unsigned long long> m_sessionsTotal;
+
+	std::array<std::string_view, METRIC_COMMANDS> m_commandNames;
+
+	const std::chrono::steady_clock::time_point m_epoch;
+
+private: // Functions
+	Shard& threadShard();
+
+	static void add(Counter& counter, unsigned long long value)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+	}
+	static void record(ThreadHistogram& histogram, long long micros);
+	static void collect(Histogram& total, const ThreadHistogram& histogram);
+
+	static void formatHistogram(std::string& text, const char* name, const std::string& labels, const Histogram& histogram);
+
+public:
+	Metrics();
+	virtual ~Metrics() = default;
+
+	Metrics(const Metrics&) = delete;
+	Metrics& operator=(const Metrics&) = delete;
+
+	// Names the command slot in reports, unnamed slots are left out
+	void nameCommand(std::size_t command, std::string_view name);
+
+	// Microseconds on a monotonic clock, the start of a measurement
+	long long now() const;
+
+	void recordCommand(std::size_t command, long long started);
+	void recordDataConnect(long long started);
+	void recordTransfer(bool sent, bool succeeded, long long bytes, long long started);
+	SessionCount sessionStarted();
+
+	Snapshot snapshot();
+
+	// Report for SITE STATS, one line per item
+	std::string formatStats();
+
+	// Prometheus text exposition format
+	std::string formatPrometheus();
+};
+
+/*
+	Serves the Prometheus text of the metrics on a local AF_UNIX
+	socket. Every connection gets one HTTP/1.0 response and is closed,
+	so curl --unix-socket or a scraper through a socket proxy can read
+	it. Only processes that can open the socket file can connect.
+*/
+class MetricsEndpoint
+{
+private: // Variables
+	Metrics& m_metrics;
+	std::string m_path;
+
+	SOCKET ListenSocket;
+	std::thread m_thread;
+	std::atomic<bool> m_running;
+
+private: // Functions
+	void run();
+	void respond(SOCKET s);
+
+public:
+	explicit MetricsEndpoint(Metrics& metrics);
+	virtual ~MetricsEndpoint();
+
+	MetricsEndpoint(const MetricsEndpoint&) = delete;
+	MetricsEndpoint& operator=(const MetricsEndpoint&) = delete;
+
+	int start(const std::string& path);
+	void stop();
+};
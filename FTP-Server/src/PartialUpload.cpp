@@ -0,0 +1,105 @@
+#include "PartialUpload.h"
+#include "ResolvedPath.h"
+#include "../../Common/src/Logger.h"
+
+/***********************************************
+	Constructor
+***********************************************/
+PartialUpload::PartialUpload(HANDLE hFile) :
+	m_hFile{ hFile },
+	m_attributes{ 0 },
+	m_marked{ false }
+{
+	// A marker left by an upload that did not finish is taken over,
+	// the attribute alone may also have been set by someone else
+	BY_HANDLE_FILE_INFORMATION information{};
+	if (GetFileInformationByHandle(m_hFile, &information))
+	{
+		m_attributes = information.dwFileAttributes;
+		if ((m_attributes & PARTIAL_ATTRIBUTE) && readCommitted(openStream(FILE_GENERIC_READ, FILE_OPEN, 0)) >= 0)
+		{
+			m_attributes &= ~PARTIAL_ATTRIBUTE;
+			m_marked = true;
+		}
+	}
+}
+
+bool PartialUpload::setAttributes(DWORD attributes)
+{
+	// Zero would leave them as they are
+	FILE_BASIC_INFO basic{};
+	basic.FileAttributes = (attributes != 0) ? attributes : FILE_ATTRIBUTE_NORMAL;
+	return SetFileInformationByHandle(m_hFile, FileBasicInfo, &basic, sizeof(basic)) != FALSE;
+}
+
+HANDLE PartialUpload::openStream(ACCESS_MASK access, ULONG disposition, ULONG options) const
+{
+	return openAt(m_hFile, PARTIAL_STREAM, access, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, disposition,
+		options | FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT);
+}
+
+/***********************************************
+	Marker
+***********************************************/
+void PartialUpload::mark(long long committed)
+{
+	m_marked = true;
+	commit(committed);
+
+	if (!(m_attributes & PARTIAL_ATTRIBUTE) && !setAttributes(m_attributes | PARTIAL_ATTRIBUTE))
+		Log{ LOG_LEVEL::WARN } << "SERVER: SetFileInformationByHandle() failed with error: " << GetLastError();
+}
+
+void PartialUpload::commit(long long committed)
+{
+	if (!m_marked)
+		return;
+
+	HANDLE hStream = openStream(FILE_GENERIC_WRITE, FILE_OVERWRITE_IF, 0);
+	if (hStream == INVALID_HANDLE_VALUE)
+	{
+		// Without streams the file system can not keep the marker, the length is all there is
+		Log{ LOG_LEVEL::WARN } << "SERVER: NtCreateFile() failed with error: " << GetLastError() << ", upload progress not recorded.";
+		return;
+	}
+
+	DWORD written{ 0 };
+	if (!WriteFile(hStream, &committed, sizeof(committed), &written, NULL) || written != sizeof(committed))
+		Log{ LOG_LEVEL::WARN } << "SERVER: WriteFile() failed with error: " << GetLastError();
+	CloseHandle(hStream);
+}
+
+void PartialUpload::finish()
+{
+	if (!m_marked)
+		return;
+
+	// Removed as the handle closes
+	HANDLE hStream = openStream(DELETE, FILE_OPEN, FILE_DELETE_ON_CLOSE);
+	if (hStream != INVALID_HANDLE_VALUE)
+		CloseHandle(hStream);
+	setAttributes(m_attributes);
+	m_marked = false;
+}
+
+long long PartialUpload::committed(const std::filesystem::path& filename)
+{
+	HANDLE hStream = CreateFileW((filename.wstring() + PARTIAL_STREAM).c_str(), GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	return readCommitted(hStream);
+}
+
+// Takes over hStream, which may be INVALID_HANDLE_VALUE
+long long PartialUpload::readCommitted(HANDLE hStream)
+{
+	if (hStream == INVALID_HANDLE_VALUE)
+		return -1;
+
+	long long committed{ -1 };
+	DWORD bytesRead{ 0 };
+	if (!ReadFile(hStream, &committed, sizeof(committed), &bytesRead, NULL) || bytesRead != sizeof(committed))
+		committed = -1;
+	CloseHandle(hStream);
+
+	return committed;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <ws2tcpip.h>
+
+#include <string>
+#include <filesystem>
+
+// Stream of an unfinished upload's file holding the bytes that arrived
+constexpr const wchar_t* PARTIAL_STREAM{ L":ftp-partial" };
+
+// Set on the file while the stream exists, SIZE reads it with the size for free
+constexpr DWORD PARTIAL_ATTRIBUTE{ FILE_ATTRIBUTE_NOT_CONTENT_INDEXED };
+
+// Bytes a stream mode STOR grows the file by and receives before the stream moves on
+constexpr long long PARTIAL_COMMIT_INTERVAL{ 64LL * 1024 * 1024 };
+
+/*
+	Marks a file an upload is still writing. A stream mode STOR grows
+	the file ahead of the data so it can be mapped, and a restarted one
+	may write into a file that is already longer, so after a crash the
+	length of the file says nothing about what arrived. The marker is a
+	stream of the file itself holding the length that did, moved on as
+	the upload goes. SIZE reports that length while the stream exists,
+	so a client resuming after a crash sends the rest again instead of
+	trusting zeros. The stream is removed once the upload is whole.
+
+	Opening the stream would cost every SIZE an open, so marked files
+	also carry an attribute. Only files with it are looked at.
+*/
+class PartialUpload
+{
+private: // Variables
+	const HANDLE m_hFile;
+	DWORD m_attributes;		// Of the file before it was marked
+	bool m_marked;
+
+private: // Functions
+	bool setAttributes(DWORD attributes);
+
+	// The stream is opened from the file's handle, never by name
+	HANDLE openStream(ACCESS_MASK access, ULONG disposition, ULONG options) const;
+	static long long readCommitted(HANDLE hStream);
+
+public:
+	// hFile is the upload's handle, with write access
+	explicit PartialUpload(HANDLE hFile);
+	virtual ~PartialUpload() = default;
+
+	PartialUpload(const PartialUpload&) = delete;
+	PartialUpload& operator=(const PartialUpload&) = delete;
+
+	// Marks the file with the bytes that are in it so far
+	void mark(long long committed);
+
+	// Moves the marker on, if the file is marked
+	void commit(long long committed);
+
+	// Removes the marker, the file's length is true again
+	void finish();
+
+	// Bytes that arrived of a marked file, -1 if filename is not marked
+	static long long committed(const std::filesystem::path& filename);
+};
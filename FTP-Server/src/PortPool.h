@@ -0,0 +1,95 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+
+// Default range handed out for passive data connections
+constexpr unsigned short DEFAULT_PASSIVE_PORT_FIRST{ 50000 };
+constexpr unsigned short DEFAULT_PASSIVE_PORT_LAST{ 50999 };
+
+/*
+	Free list of the ports passive data connections may listen on.
+	A session leases a port with its first PASV/EPSV and keeps
+	listening on it for every later transfer, the port goes back to
+	the pool when the lease ends with the session.
+*/
+class PortPool
+{
+public:
+	// Lease on one port, returns it to the pool when destroyed
+	class Lease
+	{
+	private:
+		PortPool* m_pool;
+		unsigned short m_port;
+
+	public:
+		Lease() : m_pool{ nullptr }, m_port{ 0 } {}
+		Lease(PortPool* pool, unsigned short port) : m_pool{ pool }, m_port{ port } {}
+		~Lease() { reset(); }
+
+		Lease(Lease&& other) noexcept : m_pool{ other.m_pool }, m_port{ other.m_port } { other.m_port = 0; }
+		Lease& operator=(Lease&& other) noexcept
+		{
+			if (this != &other)
+			{
+				reset();
+				m_pool = other.m_pool;
+				m_port = other.m_port;
+				other.m_port = 0;
+			}
+			return *this;
+		}
+		Lease(const Lease&) = delete;
+		Lease& operator=(const Lease&) = delete;
+
+		void reset()
+		{
+			if (m_port != 0) m_pool->release(m_port);
+			m_port = 0;
+		}
+
+		unsigned short port() const { return m_port; }
+		explicit operator bool() const { return m_port != 0; }
+	};
+
+private: // Variables
+	std::mutex m_mutex;
+	std::deque<unsigned short> m_free;
+
+private: // Functions
+	void release(unsigned short port)
+	{
+		// Released ports go to the back so a port in TIME_WAIT is not reused at once
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		m_free.push_back(port);
+	}
+
+public:
+	PortPool(unsigned short first, unsigned short last)
+	{
+		for (unsigned int port = first; port <= last && port != 0; ++port)
+			m_free.push_back((unsigned short)port);
+	}
+
+	PortPool(const PortPool&) = delete;
+	PortPool& operator=(const PortPool&) = delete;
+
+	// An empty Lease means every port is in use
+	Lease acquire()
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		if (m_free.empty())
+			return Lease{};
+
+		unsigned short port{ m_free.front() };
+		m_free.pop_front();
+		return Lease{ this, port };
+	}
+
+	std::size_t available()
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		return m_free.size();
+	}
+};
@@ -0,0 +1,143 @@
+#include "ResolvedPath.h"
+#include "../../Common/src/FTP_Common.h"
+
+#include <vector>
+#include <cstring>
+
+HANDLE openAt(HANDLE hParent, std::wstring_view name, ACCESS_MASK access, ULONG share, ULONG disposition, ULONG options)
+{
+	USHORT length{ (USHORT)(name.length() * sizeof(wchar_t)) };
+	UNICODE_STRING objectName{ length, length, const_cast<wchar_t*>(name.data()) };
+	OBJECT_ATTRIBUTES attributes{};
+	InitializeObjectAttributes(&attributes, &objectName, OBJ_CASE_INSENSITIVE, hParent, NULL);
+
+	// Attributes are read below, synchronous handles need to wait on themselves
+	HANDLE hFile{ NULL };
+	IO_STATUS_BLOCK ioStatus{};
+	NTSTATUS status = NtCreateFile(&hFile, access | FILE_READ_ATTRIBUTES | SYNCHRONIZE, &attributes, &ioStatus, NULL,
+		FILE_ATTRIBUTE_NORMAL, share, disposition, options | FILE_OPEN_REPARSE_POINT, NULL, 0);
+	if (status < 0)
+	{
+		SetLastError(RtlNtStatusToDosError(status));
+		return INVALID_HANDLE_VALUE;
+	}
+
+	FILE_BASIC_INFO basic{};
+	if (!GetFileInformationByHandleEx(hFile, FileBasicInfo, &basic, sizeof(basic)) ||
+		(basic.FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+	{
+		CloseHandle(hFile);
+		SetLastError(ERROR_ACCESS_DENIED);
+		return INVALID_HANDLE_VALUE;
+	}
+
+	return hFile;
+}
+
+/***********************************************
+	Constructor
+***********************************************/
+ResolvedPath::ResolvedPath() :
+	m_hParent{ INVALID_HANDLE_VALUE },
+	m_owned{ false },
+	m_leaf{},
+	m_error{ ERROR_PATH_NOT_FOUND }
+{
+}
+
+/***********************************************
+	Destructor
+***********************************************/
+ResolvedPath::~ResolvedPath()
+{
+	close();
+}
+
+void ResolvedPath::close()
+{
+	if (m_owned) CloseHandle(m_hParent);
+	m_hParent = INVALID_HANDLE_VALUE;
+	m_owned = false;
+	m_leaf.clear();
+}
+
+/***********************************************
+	Walk
+***********************************************/
+// Each directory is opened from the handle of the one before, so the
+// depth of hBase costs nothing and only traversal is asked for
+int ResolvedPath::walk(HANDLE hBase, const std::filesystem::path& relative)
+{
+	close();
+
+	std::vector<std::wstring> parts{};
+	for (const auto& part : relative)
+	{
+		if (part != ".")
+			parts.push_back(part.wstring());
+	}
+
+	m_hParent = hBase;
+	for (std::size_t i = 0; i + 1 < parts.size(); ++i)
+	{
+		HANDLE hPart = openAt(m_hParent, parts[i], FILE_TRAVERSE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			FILE_OPEN, FILE_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT);
+		DWORD error{ GetLastError() };
+
+		if (m_owned) CloseHandle(m_hParent);
+		m_hParent = hPart;
+		m_owned = (hPart != INVALID_HANDLE_VALUE);
+		if (hPart == INVALID_HANDLE_VALUE)
+		{
+			// A link or a file on the way is refused, a missing directory is left to the command
+			m_error = error;
+			return (error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND) ? SUCCESS : FAILURE;
+		}
+	}
+
+	m_leaf = parts.empty() ? std::wstring{} : parts.back();
+	return SUCCESS;
+}
+
+HANDLE ResolvedPath::open(ACCESS_MASK access, ULONG share, ULONG disposition, ULONG options) const
+{
+	if (m_hParent == INVALID_HANDLE_VALUE)
+	{
+		SetLastError(m_error);
+		return INVALID_HANDLE_VALUE;
+	}
+
+	return openAt(m_hParent, m_leaf, access, share, disposition, options);
+}
+
+int ResolvedPath::check() const
+{
+	HANDLE hFile = open(0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, FILE_OPEN, FILE_SYNCHRONOUS_IO_NONALERT);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		DWORD error{ GetLastError() };
+		return (error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND) ? SUCCESS : FAILURE;
+	}
+
+	CloseHandle(hFile);
+	return SUCCESS;
+}
+
+int ResolvedPath::replace(HANDLE hFile) const
+{
+	if (m_hParent == INVALID_HANDLE_VALUE)
+	{
+		SetLastError(m_error);
+		return FAILURE;
+	}
+
+	// The new name is stored after the structure, relative to the walked directory
+	std::vector<char> buffer(sizeof(FILE_RENAME_INFO) + m_leaf.length() * sizeof(wchar_t));
+	FILE_RENAME_INFO* information{ reinterpret_cast<FILE_RENAME_INFO*>(buffer.data()) };
+	information->ReplaceIfExists = TRUE;
+	information->RootDirectory = m_hParent;
+	information->FileNameLength = (DWORD)(m_leaf.length() * sizeof(wchar_t));
+	std::memcpy(information->FileName, m_leaf.data(), information->FileNameLength);
+
+	return SetFileInformationByHandle(hFile, FileRenameInfo, information, (DWORD)buffer.size()) ? SUCCESS : FAILURE;
+}
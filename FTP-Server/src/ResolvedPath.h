@@ -0,0 +1,58 @@
+#pragma once
+
+#include <ws2tcpip.h>
+#include <winternl.h>
+
+#include <string>
+#include <string_view>
+#include <filesystem>
+
+// Opens name relative to the directory hParent, an empty name opens hParent
+// again. A junction or symbolic link is opened as itself and refused, it
+// could point anywhere. INVALID_HANDLE_VALUE on failure, with the Win32
+// error set.
+HANDLE openAt(HANDLE hParent, std::wstring_view name, ACCESS_MASK access, ULONG share, ULONG disposition, ULONG options);
+
+/*
+	A client path after the walk: the handle of the directory it ends
+	in and the name of its last part. Every directory on the way was
+	opened from the one before it and checked, and the target is opened
+	from the handle the walk ended with, so nothing renamed or linked
+	in between the check and the use can move the target out of the
+	tree. The name is never looked up from the top again.
+*/
+class ResolvedPath
+{
+private: // Variables
+	HANDLE m_hParent;		// INVALID_HANDLE_VALUE if a directory on the way is missing
+	bool m_owned;			// Opened by the walk, not the base it started from
+	std::wstring m_leaf;	// Empty if the path names the base itself
+	DWORD m_error;			// Why the walk stopped early
+
+private: // Functions
+	void close();
+
+public:
+	ResolvedPath();
+	virtual ~ResolvedPath();
+
+	ResolvedPath(const ResolvedPath&) = delete;
+	ResolvedPath& operator=(const ResolvedPath&) = delete;
+
+	// Opens every part of relative but the last, starting from hBase.
+	// A missing directory is not an error here, opening the target reports it.
+	int walk(HANDLE hBase, const std::filesystem::path& relative);
+
+	// Opens or creates the target, takes the arguments of NtCreateFile
+	HANDLE open(ACCESS_MASK access, ULONG share, ULONG disposition, ULONG options) const;
+
+	// Refuses a target that is a link, for commands that go on by name
+	int check() const;
+
+	// Gives the target's name to hFile, which was opened with DELETE access.
+	// A file that had the name before loses it.
+	int replace(HANDLE hFile) const;
+
+	HANDLE parent() const { return m_hParent; }
+	const std::wstring& leaf() const { return m_leaf; }
+};
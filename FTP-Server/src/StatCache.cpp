@@ -0,0 +1,109 @@
+#include "StatCache.h"
+#include "../../Common/src/FTP_Common.h"
+
+/***********************************************
+	Constructor
+***********************************************/
+StatCache::StatCache(unsigned int ttlMs) :
+	m_ttl{ std::chrono::milliseconds{ ttlMs } },
+	m_hits{ 0 },
+	m_misses{ 0 }
+{
+}
+
+StatCache::Shard& StatCache::shard(const std::wstring& key)
+{
+	return m_shards[std::hash<std::wstring>{}(key) % STAT_CACHE_SHARDS];
+}
+
+/***********************************************
+	Lookup
+***********************************************/
+int StatCache::stat(const std::filesystem::path& filename, FileStat& result)
+{
+	std::wstring key{ filename.wstring() };
+
+	if (enabled())
+	{
+		Shard& cached{ shard(key) };
+		std::lock_guard<std::mutex> lock{ cached.mutex };
+
+		auto it = cached.entries.find(key);
+		if (it != cached.entries.end() && it->second.expires > Clock::now())
+		{
+			++m_hits;
+			result = it->second.stat;
+			return SUCCESS;
+		}
+	}
+	++m_misses;
+
+	// Read from the directory entry, the file is not opened
+	WIN32_FILE_ATTRIBUTE_DATA attributes{};
+	if (!GetFileAttributesExW(key.c_str(), GetFileExInfoStandard, &attributes))
+		return FAILURE;
+
+	result.size = (long long)(((unsigned long long)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow);
+	result.lastWrite = attributes.ftLastWriteTime;
+	result.directory = (attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+	result.partial = (attributes.dwFileAttributes & PARTIAL_ATTRIBUTE) != 0;
+	store(filename, result);
+
+	return SUCCESS;
+}
+
+/***********************************************
+	Updates
+***********************************************/
+void StatCache::store(const std::filesystem::path& filename, const FileStat& stat)
+{
+	if (!enabled())
+		return;
+
+	std::wstring key{ filename.wstring() };
+	Shard& cached{ shard(key) };
+	Clock::time_point now{ Clock::now() };
+
+	std::lock_guard<std::mutex> lock{ cached.mutex };
+
+	// A full shard drops its expired entries, then whatever comes first
+	if (cached.entries.size() >= STAT_CACHE_SHARD_ENTRIES && cached.entries.find(key) == cached.entries.end())
+	{
+		for (auto it = cached.entries.begin(); it != cached.entries.end(); )
+			it = (it->second.expires <= now) ? cached.entries.erase(it) : std::next(it);
+
+		if (cached.entries.size() >= STAT_CACHE_SHARD_ENTRIES)
+			cached.entries.erase(cached.entries.begin());
+	}
+
+	cached.entries[key] = Entry{ stat, now + m_ttl };
+}
+
+void StatCache::store(const std::filesystem::path& filename, HANDLE hFile)
+{
+	if (!enabled())
+		return;
+
+	BY_HANDLE_FILE_INFORMATION information{};
+	if (!GetFileInformationByHandle(hFile, &information))
+		return;
+
+	FileStat stat{};
+	stat.size = (long long)(((unsigned long long)information.nFileSizeHigh << 32) | information.nFileSizeLow);
+	stat.lastWrite = information.ftLastWriteTime;
+	stat.directory = (information.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+	stat.partial = (information.dwFileAttributes & PARTIAL_ATTRIBUTE) != 0;
+	store(filename, stat);
+}
+
+void StatCache::invalidate(const std::filesystem::path& filename)
+{
+	if (!enabled())
+		return;
+
+	std::wstring key{ filename.wstring() };
+	Shard& cached{ shard(key) };
+
+	std::lock_guard<std::mutex> lock{ cached.mutex };
+	cached.entries.erase(key);
+}
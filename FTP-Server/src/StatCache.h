@@ -0,0 +1,88 @@
+#pragma once
+
+#include "PartialUpload.h"
+
+#include <ws2tcpip.h>
+
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <chrono>
+#include <unordered_map>
+#include <filesystem>
+
+// Shards of the cache, each with its own lock
+constexpr std::size_t STAT_CACHE_SHARDS{ 16 };
+
+// Entries per shard, expired ones go first when a shard is full
+constexpr std::size_t STAT_CACHE_SHARD_ENTRIES{ 4096 };
+
+// How long an entry is trusted, changes made by other programs show after this
+constexpr unsigned int DEFAULT_STAT_TTL_MS{ 2000 };
+
+// What SIZE and MDTM report about a file
+struct FileStat
+{
+	long long size;
+	FILETIME lastWrite;
+	bool directory;
+	bool partial{ false };	// May be an upload that did not finish
+};
+
+/*
+	Keeps the size and last write time of recently seen paths, so SIZE
+	and MDTM are answered without touching the file system. Listings,
+	downloads and uploads fill it with what they learn anyway, uploads
+	and changes made through this server drop the entry right away.
+	Changes made by other programs are only seen once an entry is older
+	than the TTL. Paths are spread over shards by hash, so concurrent
+	sessions rarely wait on the same lock.
+*/
+class StatCache
+{
+private: // Variables
+	using Clock = std::chrono::steady_clock;
+
+	struct Entry
+	{
+		FileStat stat;
+		Clock::time_point expires;
+	};
+
+	struct Shard
+	{
+		std::mutex mutex;
+		std::unordered_map<std::wstring, Entry> entries;
+	};
+
+	const Clock::duration m_ttl;
+	Shard m_shards[STAT_CACHE_SHARDS];
+
+	std::atomic<unsigned long long> m_hits;
+	std::atomic<unsigned long long> m_misses;
+
+private: // Functions
+	Shard& shard(const std::wstring& key);
+
+public:
+	// A TTL of 0 disables the cache, every lookup goes to the file system
+	explicit StatCache(unsigned int ttlMs);
+	virtual ~StatCache() = default;
+
+	StatCache(const StatCache&) = delete;
+	StatCache& operator=(const StatCache&) = delete;
+
+	// Size and last write time of filename, FAILURE if it does not exist
+	int stat(const std::filesystem::path& filename, FileStat& result);
+
+	// Records what a listing or an open file showed
+	void store(const std::filesystem::path& filename, const FileStat& stat);
+	void store(const std::filesystem::path& filename, HANDLE hFile);
+
+	// Drops the path, called after this server changed it
+	void invalidate(const std::filesystem::path& filename);
+
+	bool enabled() const { return m_ttl.count() > 0; }
+	unsigned long long hits() const { return m_hits; }
+	unsigned long long misses() const { return m_misses; }
+};
@@ -0,0 +1,85 @@
+#include "WorkerPool.h"
+
+/***********************************************
+	Constructor
+***********************************************/
+WorkerPool::WorkerPool(unsigned int workerCount, std::size_t maxPending) :
+	m_maxPending{ maxPending },
+	m_stopping{ false }
+{
+	// All threads are created up front, never on the accept path
+	for (unsigned int i = 0; i < workerCount; ++i)
+		m_workers.emplace_back(&WorkerPool::run, this);
+}
+
+/***********************************************
+	Destructor
+***********************************************/
+WorkerPool::~WorkerPool()
+{
+	stop();
+}
+
+/***********************************************
+	Jobs
+***********************************************/
+bool WorkerPool::trySubmit(Job job)
+{
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		if (m_stopping || m_jobs.size() >= m_maxPending)
+			return false;
+
+		m_jobs.push_back(std::move(job));
+	}
+	m_jobReady.notify_one();
+
+	return true;
+}
+
+void WorkerPool::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		if (m_stopping) return;
+		m_stopping = true;
+	}
+	m_jobReady.notify_all();
+
+	for (auto& worker : m_workers)
+		worker.join();
+}
+
+std::size_t WorkerPool::pending() const
+{
+	std::lock_guard<std::mutex> lock{ m_mutex };
+	return m_jobs.size();
+}
+
+bool WorkerPool::full() const
+{
+	return pending() >= m_maxPending;
+}
+
+/***********************************************
+	Worker Loop
+***********************************************/
+void WorkerPool::run()
+{
+	while (true)
+	{
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock{ m_mutex };
+			m_jobReady.wait(lock, [this] { return m_stopping || !m_jobs.empty(); });
+
+			// Jobs still queued at shutdown are dropped
+			if (m_stopping) return;
+
+			job = std::move(m_jobs.front());
+			m_jobs.pop_front();
+		}
+
+		job();
+	}
+}
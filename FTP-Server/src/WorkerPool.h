@@ -0,0 +1,44 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+/*
+	Fixed number of worker threads fed from a bounded queue.
+	Submitting never blocks: when the queue is full the job is
+	refused and the caller decides how to shed the load.
+*/
+class WorkerPool
+{
+public:
+	using Job = std::function<void()>;
+
+private: // Variables
+	std::vector<std::thread> m_workers;
+
+	std::deque<Job> m_jobs;
+	const std::size_t m_maxPending;
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_jobReady;
+	bool m_stopping;
+
+private: // Functions
+	void run();
+
+public:
+	WorkerPool(unsigned int workerCount, std::size_t maxPending);
+	virtual ~WorkerPool();
+
+	// Returns false if the pending queue is full
+	bool trySubmit(Job job);
+	void stop();
+
+	std::size_t pending() const;
+	bool full() const;
+	std::size_t workers() const { return m_workers.size(); }
+};